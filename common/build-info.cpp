@@ -0,0 +1,4 @@
+int LLAMA_BUILD_NUMBER = 40;
+char const *LLAMA_COMMIT = "906b0f2";
+char const *LLAMA_COMPILER = "cc (Debian 12.2.0-14+deb12u1) 12.2.0";
+char const *LLAMA_BUILD_TARGET = "x86_64-linux-gnu";
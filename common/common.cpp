@@ -568,6 +568,11 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.defrag_thold = std::stof(argv[i]);
         return true;
     }
+    if (arg == "--kv-block-size" || arg == "-kvb") {
+        CHECK_ARG
+        params.kv_block_size = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "--samplers") {
         CHECK_ARG
         const auto sampler_names = string_split(argv[i], ';');
@@ -771,6 +776,15 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.p_split = std::stof(argv[i]);
         return true;
     }
+    if (arg == "--lookup-decoding") {
+        params.lookup_decoding = true;
+        return true;
+    }
+    if (arg == "--draft-p-min") {
+        CHECK_ARG
+        params.p_draft_min = std::stof(argv[i]);
+        return true;
+    }
     if (arg == "-m" || arg == "--model") {
         CHECK_ARG
         params.model = argv[i];
@@ -945,10 +959,42 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.attn_max_batch = std::stoi(argv[i]);
         return true;
     }
+    if (arg == "-mlab" || arg == "--mla-pp-batch") {
+        CHECK_ARG
+        params.mla_pp_batch = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "-fmoe" || arg == "--fused-moe") {
         params.fused_moe_up_gate = true;
         return true;
     }
+    if (arg == "-gls" || arg == "--graph-lockstep") {
+        params.graph_lockstep = true;
+        return true;
+    }
+    if (arg == "-swac" || arg == "--swa-cache") {
+        params.swa_kv_cache = true;
+        return true;
+    }
+    if (arg == "--expert-stats") {
+        CHECK_ARG
+        params.expert_stats_file = argv[i];
+        return true;
+    }
+    if (arg == "-emp" || arg == "--expert-prefetch") {
+        params.expert_prefetch = true;
+        return true;
+    }
+    if (arg == "--hot-experts") {
+        CHECK_ARG
+        params.hot_experts_file = argv[i];
+        return true;
+    }
+    if (arg == "--n-hot-experts") {
+        CHECK_ARG
+        params.n_hot_experts = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "-ser" || arg == "--smart-expert-reduction") {
         CHECK_ARG
         auto values = string_split_pairs<int,float>(argv[i], ',');
@@ -1086,7 +1132,6 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
     }
     if (arg == "-rtr" || arg == "--run-time-repack") {
         params.repack_tensors = true;
-        params.use_mmap = false;
         return true;
     }
     if (arg == "-thp" || arg == "--transparent-huge-pages") {
@@ -1099,6 +1144,7 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         /**/ if (value == "distribute" || value == "") { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
         else if (value == "isolate") { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
         else if (value == "numactl") { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
+        else if (value == "shard") { params.numa = GGML_NUMA_STRATEGY_SHARD; }
         else { invalid_param = true; }
         return true;
     }
@@ -1359,6 +1405,11 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.n_threads_http = std::stoi(argv[i]);
         return true;
     }
+    if (arg == "--threads-sampling") {
+        CHECK_ARG
+        params.n_threads_sampling = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "-spf" || arg == "--system-prompt-file") {
         CHECK_ARG
         std::ifstream file(argv[i]);
@@ -1416,6 +1467,45 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.chat_template = argv[i];
         return true;
     }
+    if (arg == "--prefix-cache") {
+        CHECK_ARG
+        params.n_prefix_cache = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--prefill-budget") {
+        CHECK_ARG
+        params.n_prefill_budget = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--tpot-target") {
+        CHECK_ARG
+        params.tpot_target = std::stof(argv[i]);
+        return true;
+    }
+    if (arg == "--ttft-target") {
+        CHECK_ARG
+        params.ttft_target = std::stof(argv[i]);
+        return true;
+    }
+    if (arg == "--slot-cache-ram") {
+        CHECK_ARG
+        params.slot_cache_ram = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--slot-cache-disk") {
+        CHECK_ARG
+        params.slot_cache_disk = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--slot-cache-path") {
+        CHECK_ARG
+        params.slot_cache_path = argv[i];
+        // if doesn't end with DIRECTORY_SEPARATOR, add it
+        if (!params.slot_cache_path.empty() && params.slot_cache_path[params.slot_cache_path.size() - 1] != DIRECTORY_SEPARATOR) {
+            params.slot_cache_path += DIRECTORY_SEPARATOR;
+        }
+        return true;
+    }
     if (arg == "--slot-prompt-similarity" || arg == "-sps") {
         CHECK_ARG
         params.slot_prompt_similarity = std::stof(argv[i]);
@@ -1642,6 +1732,7 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
                                                                         "number of threads to use during batch and prompt processing (default: same as --threads-draft)" });
     options.push_back({ "speculative", "       --draft N",              "number of tokens to draft for speculative decoding (default: %d)", params.n_draft });
     options.push_back({ "speculative", "-ps,   --p-split N",            "speculative decoding split probability (default: %.1f)", (double)params.p_split });
+    options.push_back({ "speculative", "       --draft-p-min P",        "minimum draft token probability to keep drafting (default: %.2f)", (double)params.p_draft_min });
     options.push_back({ "*",           "-lcs,  --lookup-cache-static FNAME",
                                                                         "path to static lookup cache to use for lookup decoding (not updated by generation)" });
     options.push_back({ "*",           "-lcd,  --lookup-cache-dynamic FNAME",
@@ -1656,8 +1747,19 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "*",           "-fa,   --flash-attn",           "enable Flash Attention (default: %s)", params.flash_attn ? "enabled" : "disabled" });
     options.push_back({ "*",           "-mla,  --mla-use",              "enable MLA (default: %d)", params.mla_attn });
     options.push_back({ "*",           "-amb,  --attention-max-batch",  "max batch size for attention computations (default: %d)", params.attn_max_batch});
+    options.push_back({ "*",           "-mlab, --mla-pp-batch N",       "with -mla 2,3 and -fa: compute the attention of ubatches of at least N tokens\n"
+                                                                        "with decompressed K/V instead of MLA (default: %d, -1 = auto, 0 = never)", params.mla_pp_batch });
     options.push_back({ "*",           "-fmoe, --fused-moe",            "enable fused MoE (default: %s)", params.fused_moe_up_gate ? "enabled" : "disabled" });
+    options.push_back({ "*",           "-gls,  --graph-lockstep",       "CPU: compute graph nodes one at a time on all threads (default: %s)", params.graph_lockstep ? "enabled" : "disabled" });
+    options.push_back({ "*",           "-swac, --swa-cache",            "sliding window attention layers (Gemma 2/3, Cohere2) only keep their window in the KV cache\n"
+                                                                        "(default: %s)", params.swa_kv_cache ? "enabled" : "disabled" });
     options.push_back({ "*",         "-ser,  --smart-expert-reduction,","experts reduction (default: %d,%g)", params.min_experts, params.thresh_experts});
+    options.push_back({ "*",           "       --expert-stats FNAME",   "record how often each MoE expert is selected and save the counts to FNAME on exit" });
+    options.push_back({ "*",           "-emp,  --expert-prefetch",      "MoE models with mmapped weights: ask the OS to read in the selected experts before they are used,\n"
+                                                                        "print prefetch and page fault counts with the timings (default: %s)", params.expert_prefetch ? "enabled" : "disabled" });
+    options.push_back({ "*",           "       --hot-experts FNAME",    "copy the most selected experts of each layer (counts from --expert-stats) to fast memory,\n"
+                                                                        "the others stay where --override-tensor / -ngl put them" });
+    options.push_back({ "*",           "       --n-hot-experts N",      "number of hot experts per layer (default: %d, 0 = a quarter of the experts)", params.n_hot_experts });
     options.push_back({ "*",           "-p,    --prompt PROMPT",        "prompt to start generation with\n"
                                                                         "in conversation mode, this will be used as system prompt\n"
                                                                         "(default: '%s')", params.prompt.c_str() });
@@ -1775,6 +1877,8 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
 
     options.push_back({ "parallel" });
     options.push_back({ "*",           "-dt,   --defrag-thold N",       "KV cache defragmentation threshold (default: %.1f, < 0 - disabled)", (double)params.defrag_thold });
+    options.push_back({ "*",           "-kvb,  --kv-block-size N",      "paged KV cache: allocate the cells of each sequence in blocks of N (requires -fa, CPU only)\n"
+                                                                        "(default: %d, 0 = contiguous)", params.kv_block_size });
     options.push_back({ "*",           "-np,   --parallel N",           "number of parallel sequences to decode (default: %d)", params.n_parallel });
     options.push_back({ "*",           "-ns,   --sequences N",          "number of sequences to decode (default: %d)", params.n_sequences });
     options.push_back({ "*",           "-cb,   --cont-batching",        "enable continuous batching (a.k.a dynamic batching) (default: %s)", params.cont_batching ? "enabled" : "disabled" });
@@ -1793,11 +1897,14 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     if (llama_supports_mmap()) {
         options.push_back({ "*",           "       --no-mmap",              "do not memory-map model (slower load but may reduce pageouts if not using mlock)" });
     }
-    options.push_back({ "*",           "       --run-time-repack",      "repack tensors if interleaved variant is available"});
+    options.push_back({ "*",           "       --run-time-repack",      "repack tensors if interleaved variant is available\n"
+                                                                        "with mmap the repacked tensors are cached in <model>.rtr and mmap'ed on later runs" });
     options.push_back({ "*",           "       --numa TYPE",            "attempt optimizations that help on some NUMA systems\n"
                                                                         "  - distribute: spread execution evenly over all nodes\n"
                                                                         "  - isolate: only spawn threads on CPUs on the node that execution started on\n"
                                                                         "  - numactl: use the CPU map provided by numactl\n"
+                                                                        "  - shard: distribute, and split the rows of the weights over the nodes so that\n"
+                                                                        "    each thread only reads weights from its own node (disables the use of mmap buffers)\n"
                                                                         "if run without this previously, it is recommended to drop the system page cache before using this\n"
                                                                         "see https://github.com/ggerganov/llama.cpp/issues/1437" });
 
@@ -1879,6 +1986,7 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "server",      "       --ssl-cert-file FNAME",  "path to file a PEM-encoded SSL certificate" });
     options.push_back({ "server",      "       --timeout N",            "server read/write timeout in seconds (default: %d)", params.timeout_read });
     options.push_back({ "server",      "       --threads-http N",       "number of threads used to process HTTP requests (default: %d)", params.n_threads_http });
+    options.push_back({ "server",      "       --threads-sampling N",   "number of threads sampling the slots after each decode (default: %d, -1 = n_parallel)", params.n_threads_sampling });
     options.push_back({ "server",      "       --system-prompt-file FNAME",
                                                                         "set a file to load a system prompt (initial prompt of all slots), this is useful for chat applications" });
     options.push_back({ "server",      "       --log-format {text,json}",
@@ -1892,7 +2000,18 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
                                                                         "https://github.com/ggerganov/llama.cpp/wiki/Templates-supported-by-llama_chat_apply_template" });
     options.push_back({ "server",      "-sps,  --slot-prompt-similarity SIMILARITY",
                                                                         "how much the prompt of a request must match the prompt of a slot in order to use that slot (default: %.2f, 0.0 = disabled)\n", params.slot_prompt_similarity });
+    options.push_back({ "server",      "       --prefix-cache N",       "number of token prefixes kept in the KV cache and shared by all slots (default: %d, 0 = disabled)", params.n_prefix_cache });
+    options.push_back({ "server",      "       --prefill-budget N",     "max prompt tokens per decode step while other slots are generating (default: %d, 0 = n_batch)", params.n_prefill_budget });
+    options.push_back({ "server",      "       --tpot-target MS",       "limit the prompt tokens per decode step so that generating slots get a token every MS ms\n"
+                                                                        "(default: %.0f, 0 = disabled)", (double) params.tpot_target });
+    options.push_back({ "server",      "       --ttft-target MS",       "prompts that have waited longer than MS ms are processed first and without the --tpot-target limit\n"
+                                                                        "(default: %.0f, 0 = disabled)", (double) params.ttft_target });
+    options.push_back({ "server",      "       --slot-cache-ram N",     "MiB of host RAM for KV snapshots of reassigned slots, restored when a matching prompt returns (default: %d, 0 = disabled)", params.slot_cache_ram });
+    options.push_back({ "server",      "       --slot-cache-disk N",    "MiB of disk for slot snapshots spilled from RAM (default: %d, 0 = disabled)", params.slot_cache_disk });
+    options.push_back({ "server",      "       --slot-cache-path PATH", "directory for slot snapshots spilled from RAM (default: disabled)" });
     options.push_back({ "server",      "       --lora-init-without-apply",     "load LoRA adapters without applying them (apply later via POST /lora-adapters) (default: %s)", params.lora_init_without_apply ? "enabled" : "disabled"});
+    options.push_back({ "server",      "       --lookup-decoding",      "draft tokens for speculative decoding by n-gram lookup in the prompt and generated text\n"
+                                                                        "when no draft model is given; -lcs/-lcd caches are used read-only (default: %s)", params.lookup_decoding ? "enabled" : "disabled" });
 
 #ifndef LOG_DISABLE_LOGS
     options.push_back({ "logging" });
@@ -2448,6 +2567,8 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     mparams.check_tensors   = params.check_tensors;
     mparams.repack_tensors  = params.repack_tensors;
     mparams.use_thp         = params.use_thp;
+    mparams.hot_experts     = params.hot_experts_file.empty() ? nullptr : params.hot_experts_file.c_str();
+    mparams.n_hot_experts   = params.n_hot_experts;
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
     } else {
@@ -2525,13 +2646,19 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.kv_block_size     = params.kv_block_size;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
     cparams.flash_attn        = params.flash_attn;
     cparams.mla_attn          = params.mla_attn;
     cparams.attn_max_batch    = params.attn_max_batch;
+    cparams.mla_pp_batch      = params.mla_pp_batch;
     cparams.fused_moe_up_gate = params.fused_moe_up_gate;
+    cparams.graph_lockstep    = params.graph_lockstep;
+    cparams.swa_kv_cache      = params.swa_kv_cache;
+    cparams.expert_stats      = !params.expert_stats_file.empty();
+    cparams.expert_prefetch   = params.expert_prefetch;
     cparams.min_experts       = params.min_experts;
     cparams.thresh_experts    = params.thresh_experts;
 
@@ -3543,7 +3670,12 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "flash_attn: %s # default: false\n", params.flash_attn ? "true" : "false");
     fprintf(stream, "mla_attn: %d # default: 0\n", params.mla_attn);
     fprintf(stream, "attn_max_batch: %d # default: 0\n", params.attn_max_batch);
+    fprintf(stream, "mla_pp_batch: %d # default: -1\n", params.mla_pp_batch);
     fprintf(stream, "fused_moe: %s # default: false\n", params.fused_moe_up_gate ? "true" : "false");
+    fprintf(stream, "graph_lockstep: %s # default: false\n", params.graph_lockstep ? "true" : "false");
+    fprintf(stream, "swa_kv_cache: %s # default: false\n", params.swa_kv_cache ? "true" : "false");
+    fprintf(stream, "expert_prefetch: %s # default: false\n", params.expert_prefetch ? "true" : "false");
+    fprintf(stream, "kv_block_size: %d # default: 0\n", params.kv_block_size);
     fprintf(stream, "ser: %d,%g # defaulr: -1,0\n", params.min_experts, params.thresh_experts);
     fprintf(stream, "temp: %f # default: 0.8\n", sparams.temp);
 
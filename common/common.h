@@ -91,6 +91,7 @@ struct gpt_params {
     int32_t n_parallel            =     1; // number of parallel sequences to decode
     int32_t n_sequences           =     1; // number of sequences to decode
     float   p_split               =  0.1f; // speculative decoding split probability
+    float   p_draft_min           = 0.75f; // minimum draft token probability to continue drafting (greedy)
     int32_t n_gpu_layers          =    -1; // number of layers to store in VRAM (-1 - use default)
     int32_t n_gpu_layers_draft    =    -1; // number of layers to store in VRAM for the draft model (-1 - use default)
     int32_t main_gpu              =     0; // the GPU that is used for scratch and small tensors
@@ -106,6 +107,7 @@ struct gpt_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          = -1.0f; // KV cache defragmentation threshold
+    int32_t kv_block_size         =     0; // paged KV cache block size (0 = contiguous)
 
     ggml_backend_sched_eval_callback cb_eval = nullptr;
     void * cb_eval_user_data                 = nullptr;
@@ -138,6 +140,8 @@ struct gpt_params {
     std::string lookup_cache_dynamic = ""; // path of dynamic ngram cache file for lookup decoding
     std::string logits_file          = ""; // file for saving *all* logits
     std::string rpc_servers          = ""; // comma separated list of RPC servers
+    std::string expert_stats_file    = ""; // file for saving the expert selection counts
+    std::string hot_experts_file     = ""; // expert selection counts that decide which experts are hot
 
     std::vector<std::string> in_files;   // all input files
     std::vector<std::string> antiprompt; // strings upon which more user input is prompted (a.k.a. reverse prompts)
@@ -182,10 +186,16 @@ struct gpt_params {
     bool multiline_input   = false; // reverse the usage of `\`
     bool simple_io         = false; // improves compatibility with subprocesses and limited consoles
     bool cont_batching     = true;  // insert new sequences for decoding on-the-fly
+    bool lookup_decoding   = false; // server: draft tokens from n-gram lookup when there is no draft model
     bool flash_attn        = false; // flash attention
     int  mla_attn          = 0;     // MLA 0: standard attention, 1: MLA with K and transposed V cache, 2: MLA with just K cache
     int  attn_max_batch    = 0;     // Max batch size to use when computing attention (only applicable if flash_attn = false)
+    int  mla_pp_batch      = -1;    // MLA = 2,3 with FA: min. ubatch size for attention with decompressed K/V (-1 = auto, 0 = never)
     bool fused_moe_up_gate = false; // fused up*unary(gate) op for MoE models
+    bool graph_lockstep    = false; // CPU: compute the graph one node at a time on all threads
+    bool swa_kv_cache      = false; // SWA layers keep only their attention window in the KV cache
+    bool expert_prefetch   = false; // read in the mmapped slices of the selected experts ahead of their use
+    int  n_hot_experts     = 0;     // number of experts per layer to copy to fast memory (0 = a quarter of them)
     int  min_experts       = -1;
     float thresh_experts   = 0;
 
@@ -223,6 +233,7 @@ struct gpt_params {
     int32_t timeout_read   = 600;          // http read timeout in seconds
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests
+    int32_t n_threads_sampling = -1;       // number of threads sampling the slots after each decode (-1 = n_parallel)
     bool    send_done      = false;        // send done message as required for OAI compatibility
 
     std::string hostname      = "127.0.0.1";
@@ -245,6 +256,16 @@ struct gpt_params {
 
     float slot_prompt_similarity = 0.5f;
 
+    int32_t n_prefix_cache = 0; // number of sequences reserved for the prefix cache shared by all slots (0 = disabled)
+
+    int32_t n_prefill_budget = 0;    // max prompt tokens per decode step while slots are generating (0 = n_batch)
+    float   tpot_target      = 0.0f; // ms per generated token that prompt processing should not exceed (0 = disabled)
+    float   ttft_target      = 0.0f; // ms after which a waiting prompt is processed first and without the TPOT cap (0 = disabled)
+
+    int32_t     slot_cache_ram  = 0; // MiB of host RAM for KV snapshots of overwritten slot prompts (0 = disabled)
+    int32_t     slot_cache_disk = 0; // MiB of disk for the snapshots spilled from RAM (needs slot_cache_path)
+    std::string slot_cache_path;     // directory of the spilled snapshots
+
     // batched-bench params
     bool is_pp_shared = false;
 
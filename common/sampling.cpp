@@ -269,7 +269,8 @@ static void sampler_queue(
     const llama_sampling_params& params,
     llama_sampling_context * ctx_sampling,
     llama_token_data_array& cur_p,
-    size_t   min_keep) {
+    size_t   min_keep,
+    size_t   n_skip = 0) {
     const float         temp = params.temp;
     const float         dynatemp_range = params.dynatemp_range;
     const float         dynatemp_exponent = params.dynatemp_exponent;
@@ -284,15 +285,15 @@ static void sampler_queue(
 
     const std::vector<llama_sampler_type> & samplers_sequence = params.samplers_sequence;
 
-    for (auto sampler_type : samplers_sequence) {
-        switch (sampler_type) {
+    for (size_t i = n_skip; i < samplers_sequence.size(); ++i) {
+        switch (samplers_sequence[i]) {
             case llama_sampler_type::DRY        : llama_sample_dry      (ctx_main, ctx_sampling->smpl, &cur_p); break;
             case llama_sampler_type::TOP_K      : llama_sample_top_k    (ctx_main, &cur_p, top_k,     min_keep); break;
             case llama_sampler_type::TFS_Z      : llama_sample_tail_free(ctx_main, &cur_p, tfs_z,     min_keep); break;
             case llama_sampler_type::TYPICAL_P  : llama_sample_typical  (ctx_main, &cur_p, typical_p, min_keep); break;
             case llama_sampler_type::TOP_P      : llama_sample_top_p    (ctx_main, &cur_p, top_p,     min_keep); break;
             case llama_sampler_type::MIN_P      : llama_sample_min_p    (ctx_main, &cur_p, min_p,     min_keep); break;
-            case llama_sampler_type::XTC        : llama_sample_xtc      (ctx_main, &cur_p, xtc_probability, xtc_threshold, min_keep); break;
+            case llama_sampler_type::XTC        : llama_sample_xtc_with_rng(ctx_main, &cur_p, xtc_probability, xtc_threshold, min_keep, ctx_sampling->rng); break;
             case llama_sampler_type::TOP_N_SIGMA: llama_sample_top_n_sigma(ctx_main, &cur_p, top_n_sigma); break;
             case llama_sampler_type::TEMPERATURE:
                 if (dynatemp_range > 0) {
@@ -308,6 +309,148 @@ static void sampler_queue(
     }
 }
 
+// Prune the vocabulary with the first sampler of the sequence directly on the logits, so that the candidates
+// array only holds the tokens that survive it. This is only possible when that sampler is top-k, top-p or min-p
+// and the samplers before it either are a fixed temperature or are disabled.
+// Returns the number of samplers of the sequence that were applied, 0 if the candidates have to be prepared as usual.
+static size_t llama_sampling_prepare_logits(
+                  struct llama_sampling_context * ctx_sampling,
+                  struct llama_context * ctx_main,
+                  const int idx,
+                  size_t min_keep,
+                  std::vector<float> * original_logits,
+                  llama_token_data_array & cur_p) {
+    const llama_sampling_params & params = ctx_sampling->params;
+
+    const std::vector<llama_sampler_type> & samplers_sequence = params.samplers_sequence;
+
+    float temp = 1.0f;
+
+    size_t i_prune = 0;
+    for (; i_prune < samplers_sequence.size(); ++i_prune) {
+        bool prunes = false;
+        switch (samplers_sequence[i_prune]) {
+            case llama_sampler_type::TOP_K:
+                prunes = params.top_k > 0;
+                break;
+            case llama_sampler_type::TOP_P:
+                prunes = params.top_p < 1.0f;
+                break;
+            case llama_sampler_type::MIN_P:
+                prunes = params.min_p > 0.0f;
+                break;
+            case llama_sampler_type::TEMPERATURE:
+                if (params.dynatemp_range > 0) {
+                    return 0;
+                }
+                temp *= params.temp;
+                break;
+            case llama_sampler_type::TFS_Z:
+                if (params.tfs_z < 1.0f) {
+                    return 0;
+                }
+                break;
+            case llama_sampler_type::TYPICAL_P:
+                if (params.typical_p < 1.0f) {
+                    return 0;
+                }
+                break;
+            case llama_sampler_type::XTC:
+                if (params.xtc_probability > 0.0f && params.xtc_threshold <= 0.5f) {
+                    return 0;
+                }
+                break;
+            case llama_sampler_type::TOP_N_SIGMA:
+                if (params.top_n_sigma > 0.0f) {
+                    return 0;
+                }
+                break;
+            case llama_sampler_type::DRY:
+                if (ctx_sampling->smpl != nullptr && params.dry_multiplier != 0.0f && params.dry_base >= 1.0f && params.dry_penalty_last_n != 0) {
+                    return 0;
+                }
+                break;
+            default:
+                return 0;
+        }
+        if (prunes) {
+            break;
+        }
+    }
+
+    if (i_prune == samplers_sequence.size()) {
+        // nothing prunes the vocabulary
+        return 0;
+    }
+
+    const llama_model * model = llama_get_model(ctx_main);
+
+    const int n_vocab = llama_n_vocab(model);
+
+    float * logits = llama_get_logits_ith(ctx_main, idx);
+
+    if (ctx_sampling->grammar != NULL) {
+        GGML_ASSERT(original_logits != NULL);
+        *original_logits = {logits, logits + n_vocab};
+    }
+
+    // apply params.logit_bias map
+    for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++) {
+        logits[it->first] += it->second;
+    }
+
+    // apply penalties to a copy of the logits, only the penalized tokens are put in a candidates array
+    const int32_t penalty_last_n = params.penalty_last_n < 0 ? params.n_prev : params.penalty_last_n;
+
+    const auto & penalty_tokens = params.use_penalty_prompt_tokens ? params.penalty_prompt_tokens : ctx_sampling->prev;
+    const int penalty_tokens_used_size = std::min((int) penalty_tokens.size(), penalty_last_n);
+    if (penalty_tokens_used_size && (params.penalty_repeat != 1.0f || params.penalty_freq != 0.0f || params.penalty_present != 0.0f)) {
+        const llama_token * last_tokens = penalty_tokens.data() + penalty_tokens.size() - penalty_tokens_used_size;
+
+        std::vector<llama_token> ids(last_tokens, last_tokens + penalty_tokens_used_size);
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+        auto & logits_penalized = ctx_sampling->logits_penalized;
+        logits_penalized.assign(logits, logits + n_vocab);
+
+        std::vector<llama_token_data> penalized;
+        for (const llama_token id : ids) {
+            if (id >= 0 && id < n_vocab) {
+                penalized.push_back(llama_token_data{id, logits[id], 0.0f});
+            }
+        }
+
+        llama_token_data_array penalized_p = { penalized.data(), penalized.size(), false };
+        llama_sample_repetition_penalties(ctx_main, &penalized_p,
+                last_tokens,
+                penalty_tokens_used_size, params.penalty_repeat, params.penalty_freq, params.penalty_present);
+
+        for (const auto & td : penalized) {
+            if (params.penalize_nl || td.id != llama_token_nl(model)) {
+                logits_penalized[td.id] = td.logit;
+            }
+        }
+
+        logits = logits_penalized.data();
+    }
+
+    auto & cur = ctx_sampling->cur;
+
+    cur.resize(n_vocab);
+
+    cur_p = { cur.data(), cur.size(), false };
+
+    switch (samplers_sequence[i_prune]) {
+        case llama_sampler_type::TOP_K: llama_sample_top_k_logits(ctx_main, &cur_p, logits, n_vocab, temp, params.top_k, min_keep); break;
+        case llama_sampler_type::TOP_P: llama_sample_top_p_logits(ctx_main, &cur_p, logits, n_vocab, temp, params.top_p, min_keep); break;
+        case llama_sampler_type::MIN_P: llama_sample_min_p_logits(ctx_main, &cur_p, logits, n_vocab, temp, params.min_p, min_keep); break;
+        default: GGML_ABORT("fatal error");
+    }
+
+    return i_prune + 1;
+}
+
 static llama_token llama_sampling_sample_impl(
                   struct llama_sampling_context * ctx_sampling,
                   struct llama_context * ctx_main,
@@ -322,7 +465,16 @@ static llama_token llama_sampling_sample_impl(
     const float   mirostat_eta    = params.mirostat_eta;
 
     std::vector<float> original_logits;
-    auto cur_p = llama_sampling_prepare(ctx_sampling, ctx_main, ctx_cfg, idx, /* apply_grammar= */ is_resampling, &original_logits);
+    llama_token_data_array cur_p;
+
+    // the candidates of the whole vocabulary are only needed when probabilities for them are requested
+    size_t n_applied = 0;
+    if (!is_resampling && ctx_cfg == nullptr && temp > 0.0f && mirostat == 0 && params.n_probs == 0) {
+        n_applied = llama_sampling_prepare_logits(ctx_sampling, ctx_main, idx, std::max(1, params.min_keep), &original_logits, cur_p);
+    }
+    if (n_applied == 0) {
+        cur_p = llama_sampling_prepare(ctx_sampling, ctx_main, ctx_cfg, idx, /* apply_grammar= */ is_resampling, &original_logits);
+    }
     if (ctx_sampling->grammar != NULL && !is_resampling) {
         GGML_ASSERT(!original_logits.empty());
     }
@@ -347,7 +499,7 @@ static llama_token llama_sampling_sample_impl(
             // temperature sampling
             size_t min_keep = std::max(1, params.min_keep);
 
-            sampler_queue(ctx_main, params,ctx_sampling, cur_p, min_keep);
+            sampler_queue(ctx_main, params,ctx_sampling, cur_p, min_keep, n_applied);
 
             id = llama_sample_token_with_rng(ctx_main, &cur_p, ctx_sampling->rng);
 
@@ -97,6 +97,7 @@ struct llama_sampling_context {
     // TODO: replace with ring-buffer
     std::vector<llama_token>      prev;
     std::vector<llama_token_data> cur;
+    std::vector<float>            logits_penalized; // copy of the logits when penalties are applied to them directly
     llama_sampler_dry* smpl;
 
     size_t n_valid; // Number of correct top tokens with correct probabilities.
@@ -3462,6 +3462,10 @@ class DeepseekV2Model(Model):
         else:
             raise ValueError(f"Unsupported scoring_func value: {hparams['scoring_func']}")
 
+        if hparams.get("topk_method") in ("group_limited_greedy", "noaux_tc") and hparams.get("n_group", 1) > 1:
+            self.gguf_writer.add_expert_group_count(hparams["n_group"])
+            self.gguf_writer.add_expert_group_used_count(hparams["topk_group"])
+
         self.gguf_writer.add_rope_dimension_count(hparams["qk_rope_head_dim"])
 
         if self.hparams.get("rope_scaling") is not None and "factor" in self.hparams["rope_scaling"]:
@@ -0,0 +1,306 @@
+#pragma once
+
+#include "llama.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//
+// Offload tier for the KV cache of slot prompts that are about to be overwritten
+//
+// When a slot is reused for a prompt that does not extend its history, the sequence state of the
+// slot (llama_state_seq_get_data) is snapshotted into a bounded host RAM pool. The least recently
+// used snapshots are spilled to files in an optional directory on disk, which is bounded as well.
+// A later prompt that shares a longer prefix with a snapshot than with anything in the KV cache
+// gets the snapshot restored into its slot (llama_state_seq_set_data) instead of being processed
+// again, e.g. a chat user returning after their slot was given to someone else.
+//
+// Snapshots are keyed by the hash of their tokens and matched by their longest common prefix with
+// the prompt. The tier only stores the serialized state - the llama calls are made by the caller.
+//
+
+struct server_kv_tier {
+    struct entry {
+        std::vector<llama_token> tokens;  // tokens of the snapshotted sequence
+        std::vector<uint8_t>     data;    // sequence state - empty if the entry is on disk
+        size_t                   size    = 0;
+        bool                     on_disk = false;
+        int64_t                  t_last  = 0; // logical time of the last save or lookup hit
+    };
+
+    size_t ram_max  = 0; // bytes
+    size_t disk_max = 0; // bytes
+    size_t ram_used  = 0;
+    size_t disk_used = 0;
+
+    std::string disk_path; // directory of the spilled snapshots, with a trailing separator
+
+    std::unordered_map<uint64_t, entry> entries;
+
+    int64_t t_now = 0;
+
+    // stats
+    uint64_t n_lookup          = 0;
+    uint64_t n_hit             = 0;
+    uint64_t n_tokens_restored = 0;
+    uint64_t n_saved           = 0;
+    uint64_t n_spilled         = 0;
+    uint64_t n_evicted         = 0;
+
+    ~server_kv_tier() {
+        clear();
+    }
+
+    void init(size_t ram_bytes, size_t disk_bytes, const std::string & path) {
+        clear();
+
+        ram_max   = ram_bytes;
+        disk_max  = path.empty() ? 0 : disk_bytes;
+        disk_path = path;
+    }
+
+    bool enabled() const {
+        return ram_max > 0 || disk_max > 0;
+    }
+
+    // drop all snapshots and remove their files
+    void clear() {
+        for (auto & it : entries) {
+            if (it.second.on_disk) {
+                std::remove(file_name(it.first).c_str());
+            }
+        }
+        entries.clear();
+
+        ram_used  = 0;
+        disk_used = 0;
+    }
+
+    // FNV-1a of the tokens
+    static uint64_t hash(const std::vector<llama_token> & tokens) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (const llama_token t : tokens) {
+            h ^= (uint32_t) t;
+            h *= 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    // key of the snapshot sharing the longest prefix with tokens, n is the length of the prefix
+    // returns false if no snapshot shares at least n_min tokens
+    bool find(const std::vector<llama_token> & tokens, int32_t n_min, uint64_t & key, int32_t & n) {
+        n_lookup++;
+
+        n = 0;
+        for (const auto & it : entries) {
+            const int32_t k = match(it.second.tokens, tokens);
+            if (k > n) {
+                n   = k;
+                key = it.first;
+            }
+        }
+
+        if (n < n_min || n == 0) {
+            n = 0;
+            return false;
+        }
+
+        entries.at(key).t_last = ++t_now;
+
+        return true;
+    }
+
+    // the serialized state of a snapshot - a pointer to its data in RAM or to buf, read from disk
+    const uint8_t * load(uint64_t key, std::vector<uint8_t> & buf) {
+        const entry & e = entries.at(key);
+        if (!e.on_disk) {
+            return e.data.data();
+        }
+
+        buf.resize(e.size);
+
+        FILE * f = std::fopen(file_name(key).c_str(), "rb");
+        if (f == nullptr) {
+            erase(key);
+            return nullptr;
+        }
+        const size_t n_read = std::fread(buf.data(), 1, buf.size(), f);
+        std::fclose(f);
+
+        if (n_read != buf.size()) {
+            erase(key);
+            return nullptr;
+        }
+
+        return buf.data();
+    }
+
+    // store a snapshot of the sequence holding tokens - returns false if it does not fit
+    bool save(const std::vector<llama_token> & tokens, std::vector<uint8_t> && data) {
+        if (tokens.empty() || data.empty()) {
+            return false;
+        }
+
+        const size_t size = data.size();
+        if (size > ram_max && size > disk_max) {
+            return false;
+        }
+
+        // a snapshot of a longer sequence with the same prefix makes the shorter one redundant
+        for (auto it = entries.begin(); it != entries.end(); ) {
+            const int32_t k = match(it->second.tokens, tokens);
+            if (k == (int32_t) tokens.size()) {
+                it->second.t_last = ++t_now;
+                return true;
+            }
+            if (k == (int32_t) it->second.tokens.size()) {
+                drop(it->first, it->second);
+                it = entries.erase(it);
+                continue;
+            }
+            ++it;
+        }
+
+        const uint64_t key = hash(tokens);
+        if (entries.find(key) != entries.end()) {
+            // hash collision - keep the newer snapshot
+            erase(key);
+        }
+
+        entry & e = entries[key];
+        e.tokens = tokens;
+        e.size   = size;
+        e.t_last = ++t_now;
+
+        n_saved++;
+
+        if (size > ram_max) {
+            // too large for RAM - straight to disk
+            if (!spill(key, e, data)) {
+                entries.erase(key);
+                return false;
+            }
+            return true;
+        }
+
+        while (ram_used + size > ram_max && evict_ram()) {}
+
+        e.data = std::move(data);
+        ram_used += size;
+
+        return true;
+    }
+
+    void erase(uint64_t key) {
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            drop(it->first, it->second);
+            entries.erase(it);
+        }
+    }
+
+    size_t n_ram() const {
+        return std::count_if(entries.begin(), entries.end(), [](const auto & it) { return !it.second.on_disk; });
+    }
+
+    size_t n_disk() const {
+        return entries.size() - n_ram();
+    }
+
+private:
+    static int32_t match(const std::vector<llama_token> & a, const std::vector<llama_token> & b) {
+        const size_t n = std::min(a.size(), b.size());
+
+        size_t k = 0;
+        while (k < n && a[k] == b[k]) {
+            k++;
+        }
+
+        return k;
+    }
+
+    std::string file_name(uint64_t key) const {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%016" PRIx64 ".kv", key);
+        return disk_path + buf;
+    }
+
+    // release the storage of an entry that is about to be removed from the map
+    void drop(uint64_t key, entry & e) {
+        if (e.on_disk) {
+            std::remove(file_name(key).c_str());
+            disk_used -= e.size;
+        } else {
+            ram_used -= e.size;
+        }
+    }
+
+    // least recently used entry in RAM (on_disk = false) or on disk (on_disk = true)
+    bool find_lru(bool on_disk, uint64_t & key) const {
+        int64_t t_min = INT64_MAX;
+        for (const auto & it : entries) {
+            if (it.second.on_disk == on_disk && it.second.t_last < t_min) {
+                t_min = it.second.t_last;
+                key   = it.first;
+            }
+        }
+        return t_min != INT64_MAX;
+    }
+
+    // write the data of an entry to disk, making room by evicting the least recently used files
+    bool spill(uint64_t key, entry & e, const std::vector<uint8_t> & data) {
+        if (e.size > disk_max) {
+            return false;
+        }
+
+        uint64_t key_lru;
+        while (disk_used + e.size > disk_max && find_lru(true, key_lru)) {
+            erase(key_lru);
+            n_evicted++;
+        }
+
+        FILE * f = std::fopen(file_name(key).c_str(), "wb");
+        if (f == nullptr) {
+            return false;
+        }
+        const size_t n_written = std::fwrite(data.data(), 1, data.size(), f);
+        const bool ok = std::fclose(f) == 0 && n_written == data.size();
+
+        if (!ok) {
+            std::remove(file_name(key).c_str());
+            return false;
+        }
+
+        e.on_disk = true;
+        disk_used += e.size;
+        n_spilled++;
+
+        return true;
+    }
+
+    // move the least recently used snapshot out of RAM - to disk if possible, otherwise it is dropped
+    bool evict_ram() {
+        uint64_t key;
+        if (!find_lru(false, key)) {
+            return false;
+        }
+
+        entry & e = entries.at(key);
+
+        std::vector<uint8_t> data = std::move(e.data);
+        e.data.clear();
+        ram_used -= e.size;
+
+        if (!spill(key, e, data)) {
+            entries.erase(key);
+            n_evicted++;
+        }
+
+        return true;
+    }
+};
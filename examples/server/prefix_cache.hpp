@@ -0,0 +1,344 @@
+#pragma once
+
+#include "llama.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+//
+// Radix tree of token prefixes shared by all server slots
+//
+// Every leaf owns a dedicated sequence of the llama context that keeps the KV cells of the full
+// prefix from the root to the leaf alive. Since cells are shared between sequences through
+// llama_kv_cell::seq_id, the common part of two prefixes is stored only once, and handing a
+// prefix to a slot with llama_kv_cache_seq_cp() does not copy any data.
+//
+// The tree itself only does the bookkeeping - the KV operations are delegated to the callbacks,
+// which receive token indices relative to the start of the cached sequences.
+//
+
+struct server_prefix_cache {
+    struct node {
+        std::vector<llama_token> tokens;      // edge label - tokens between the parent and this node
+        llama_seq_id             seq_id = -1; // a cache sequence holding the full prefix up to this node
+        int64_t                  t_last = 0;  // logical time of the last lookup or insert through this node
+
+        node * parent = nullptr;
+
+        std::unordered_map<llama_token, std::unique_ptr<node>> children;
+    };
+
+    // copy the KV cells of tokens [i0, i1) from sequence src to sequence dst
+    std::function<void(llama_seq_id src, llama_seq_id dst, int32_t i0, int32_t i1)> kv_copy;
+    // remove all KV cells of a sequence
+    std::function<void(llama_seq_id seq_id)> kv_drop;
+
+    node root;
+
+    std::vector<llama_seq_id> seq_free; // cache sequences not owned by any leaf
+
+    int64_t t_now = 0;
+
+    // stats
+    uint64_t n_lookup        = 0;
+    uint64_t n_hit           = 0;
+    uint64_t n_tokens_reused = 0;
+    uint64_t n_evicted       = 0;
+
+    // use sequences [seq_first, seq_first + n_seq) for the cached prefixes
+    void init(llama_seq_id seq_first, int32_t n_seq) {
+        seq_free.clear();
+        for (int32_t i = n_seq - 1; i >= 0; --i) {
+            seq_free.push_back(seq_first + i);
+        }
+    }
+
+    bool enabled() const {
+        return !seq_free.empty() || !root.children.empty();
+    }
+
+    // forget all prefixes - the caller is responsible for the KV cells (e.g. the KV cache was cleared)
+    void clear() {
+        std::vector<node *> stack = { &root };
+        while (!stack.empty()) {
+            node * cur = stack.back();
+            stack.pop_back();
+            for (auto & it : cur->children) {
+                if (it.second->children.empty()) {
+                    seq_free.push_back(it.second->seq_id);
+                } else {
+                    stack.push_back(it.second.get());
+                }
+            }
+        }
+        root.children.clear();
+    }
+
+    // length of the longest cached prefix of tokens and the sequence holding it
+    int32_t find(const std::vector<llama_token> & tokens, llama_seq_id & seq_id) {
+        n_lookup++;
+
+        const int64_t t = ++t_now;
+
+        node *  cur = &root;
+        int32_t n   = 0;
+
+        seq_id = -1;
+
+        while (n < (int32_t) tokens.size()) {
+            auto it = cur->children.find(tokens[n]);
+            if (it == cur->children.end()) {
+                break;
+            }
+
+            node * child = it->second.get();
+
+            const int32_t k = match(child->tokens, tokens, n);
+
+            child->t_last = t;
+            seq_id = child->seq_id;
+            n += k;
+
+            if (k < (int32_t) child->tokens.size()) {
+                break;
+            }
+
+            cur = child;
+        }
+
+        if (n > 0) {
+            n_hit++;
+        }
+
+        return n;
+    }
+
+    // cache tokens [0, n) whose KV cells are currently held by sequence seq_src
+    void insert(const std::vector<llama_token> & tokens, int32_t n, llama_seq_id seq_src) {
+        n = std::min(n, (int32_t) tokens.size());
+        if (n <= 0 || !enabled()) {
+            return;
+        }
+
+        // make sure a sequence is available in case a new leaf is needed
+        // note: evicting first keeps the walk below free of dangling nodes
+        if (seq_free.empty() && needs_leaf(tokens, n)) {
+            if (!evict_lru()) {
+                return;
+            }
+        }
+
+        const int64_t t = ++t_now;
+
+        node *  cur = &root;
+        int32_t m   = 0;
+
+        while (m < n) {
+            auto it = cur->children.find(tokens[m]);
+            if (it == cur->children.end()) {
+                add_leaf(cur, tokens, m, n, seq_src, t);
+                return;
+            }
+
+            node * child = it->second.get();
+
+            const int32_t k = match(child->tokens, tokens, m, n);
+
+            child->t_last = t;
+
+            if (k == (int32_t) child->tokens.size()) {
+                m += k;
+
+                if (m < n && child->children.empty()) {
+                    // extend the leaf in place - its sequence already holds the prefix
+                    kv_copy(seq_src, child->seq_id, m, n);
+                    child->tokens.insert(child->tokens.end(), tokens.begin() + m, tokens.begin() + n);
+                    return;
+                }
+
+                cur = child;
+                continue;
+            }
+
+            if (m + k == n) {
+                // already cached as part of a longer prefix
+                return;
+            }
+
+            // split the edge at the divergence point and branch off a new leaf
+            node * mid = split(child, k);
+            add_leaf(mid, tokens, m + k, n, seq_src, t);
+            return;
+        }
+    }
+
+    // drop the least recently used prefix - returns false if the cache is empty
+    bool evict_lru() {
+        node * lru = nullptr;
+
+        std::vector<node *> stack = { &root };
+        while (!stack.empty()) {
+            node * cur = stack.back();
+            stack.pop_back();
+            for (auto & it : cur->children) {
+                node * child = it.second.get();
+                if (child->children.empty()) {
+                    if (lru == nullptr || child->t_last < lru->t_last) {
+                        lru = child;
+                    }
+                } else {
+                    stack.push_back(child);
+                }
+            }
+        }
+
+        if (lru == nullptr) {
+            return false;
+        }
+
+        const llama_seq_id seq_id = lru->seq_id;
+
+        kv_drop(seq_id);
+        seq_free.push_back(seq_id);
+        n_evicted++;
+
+        node * parent = lru->parent;
+        parent->children.erase(lru->tokens[0]);
+
+        // the ancestors that referred to the dropped sequence take over the one of a remaining child
+        for (node * cur = parent; cur != &root && cur->seq_id == seq_id; cur = cur->parent) {
+            cur->seq_id = cur->children.begin()->second->seq_id;
+        }
+
+        // keep the tree compact - an inner node with a single child is merged into it
+        if (parent != &root && parent->children.size() == 1) {
+            merge(parent);
+        }
+
+        return true;
+    }
+
+    size_t n_prefixes() const {
+        size_t n = 0;
+
+        std::vector<const node *> stack = { &root };
+        while (!stack.empty()) {
+            const node * cur = stack.back();
+            stack.pop_back();
+            for (const auto & it : cur->children) {
+                if (it.second->children.empty()) {
+                    n++;
+                } else {
+                    stack.push_back(it.second.get());
+                }
+            }
+        }
+
+        return n;
+    }
+
+private:
+    // number of leading tokens of the edge that match tokens[i0, i1)
+    static int32_t match(const std::vector<llama_token> & edge, const std::vector<llama_token> & tokens, int32_t i0, int32_t i1 = -1) {
+        if (i1 < 0) {
+            i1 = tokens.size();
+        }
+
+        const int32_t n = std::min((int32_t) edge.size(), i1 - i0);
+
+        int32_t k = 0;
+        while (k < n && edge[k] == tokens[i0 + k]) {
+            k++;
+        }
+
+        return k;
+    }
+
+    bool needs_leaf(const std::vector<llama_token> & tokens, int32_t n) const {
+        const node * cur = &root;
+        int32_t      m   = 0;
+
+        while (m < n) {
+            auto it = cur->children.find(tokens[m]);
+            if (it == cur->children.end()) {
+                return true;
+            }
+
+            const node * child = it->second.get();
+
+            const int32_t k = match(child->tokens, tokens, m, n);
+            if (k < (int32_t) child->tokens.size()) {
+                return m + k < n;
+            }
+
+            m += k;
+            if (child->children.empty()) {
+                return false; // extended in place
+            }
+
+            cur = child;
+        }
+
+        return false;
+    }
+
+    void add_leaf(node * parent, const std::vector<llama_token> & tokens, int32_t m, int32_t n, llama_seq_id seq_src, int64_t t) {
+        GGML_ASSERT(!seq_free.empty());
+
+        auto leaf = std::make_unique<node>();
+
+        leaf->tokens.assign(tokens.begin() + m, tokens.begin() + n);
+        leaf->seq_id = seq_free.back();
+        leaf->t_last = t;
+        leaf->parent = parent;
+
+        seq_free.pop_back();
+
+        kv_copy(seq_src, leaf->seq_id, 0, n);
+
+        parent->children[tokens[m]] = std::move(leaf);
+    }
+
+    // split the edge into child at offset k - returns the new inner node
+    node * split(node * child, int32_t k) {
+        node * parent = child->parent;
+
+        auto mid = std::make_unique<node>();
+
+        mid->tokens.assign(child->tokens.begin(), child->tokens.begin() + k);
+        mid->seq_id = child->seq_id;
+        mid->t_last = child->t_last;
+        mid->parent = parent;
+
+        std::unique_ptr<node> owned = std::move(parent->children[child->tokens[0]]);
+
+        child->tokens.erase(child->tokens.begin(), child->tokens.begin() + k);
+        child->parent = mid.get();
+
+        node * res = mid.get();
+
+        mid->children[child->tokens[0]] = std::move(owned);
+        parent->children[res->tokens[0]] = std::move(mid);
+
+        return res;
+    }
+
+    // merge an inner node with its only child
+    void merge(node * cur) {
+        node * parent = cur->parent;
+
+        std::unique_ptr<node> child = std::move(cur->children.begin()->second);
+        cur->children.clear();
+
+        child->tokens.insert(child->tokens.begin(), cur->tokens.begin(), cur->tokens.end());
+        child->parent = parent;
+
+        const llama_token key = child->tokens[0];
+
+        parent->children[key] = std::move(child); // destroys cur
+    }
+};
@@ -2,6 +2,7 @@
 #include "utils.hpp"
 
 #include "common.h"
+#include "ngram-cache.h"
 #include "json-schema-to-grammar.h"
 #include "llama.h"
 #include "grammar-parser.h"
@@ -22,11 +23,16 @@
 #include "loading.html.hpp"
 #include "function_calls.hpp"
 #include "streaming_chat.hpp"
+#include "prefix_cache.hpp"
+#include "kv_tier.hpp"
 #include "../../common/chat-parser.h"
 
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <future>
 #include <cstddef>
 #include <set>
 #include <mutex>
@@ -42,6 +48,11 @@ using json = nlohmann::ordered_json;
 bool server_verbose = false;
 bool server_log_json = true;
 
+// max allowed difference in vocab size between the target and the draft model
+#define SPEC_VOCAB_MAX_SIZE_DIFFERENCE 100
+
+// min number of tokens a slot snapshot must save or restore to be worth the copy
+#define KV_TIER_MIN_TOKENS 64
 
 
 enum stop_type {
@@ -79,6 +90,8 @@ enum server_task_type {
 
 
 struct result_timings {
+    double queue_ms = 0;
+
     int32_t prompt_n = -1;
     double prompt_ms;
     double prompt_per_token_ms;
@@ -89,12 +102,18 @@ struct result_timings {
     double predicted_per_token_ms;
     double predicted_per_second;
 
+    // breakdown of the generation time: decode steps that produced the tokens vs. sampling them
+    double compute_ms  = 0;
+    double sampling_ms = 0;
+
     // Optional speculative metrics - only included when > 0
     int32_t draft_n = 0;
     int32_t draft_n_accepted = 0;
 
     json to_json() const {
         json base = {
+            {"queue_ms",               queue_ms},
+
             {"prompt_n",               prompt_n},
             {"prompt_ms",              prompt_ms},
             {"prompt_per_token_ms",    prompt_per_token_ms},
@@ -104,6 +123,9 @@ struct result_timings {
             {"predicted_ms",           predicted_ms},
             {"predicted_per_token_ms", predicted_per_token_ms},
             {"predicted_per_second",   predicted_per_second},
+
+            {"compute_ms",             compute_ms},
+            {"sampling_ms",            sampling_ms},
         };
 
         if (draft_n > 0) {
@@ -125,6 +147,13 @@ struct server_task {
 
     bool infill    = false;
     bool embedding = false;
+
+    // completion tasks: the prompt is tokenized by the HTTP thread that posts the task
+    std::vector<llama_token> prompt_tokens;
+    int32_t n_prompt_text = -1; // tokens of the leading text piece of the prompt, which gets the special tokens (-1: none)
+
+    int32_t priority = 0; // completion tasks: higher priorities get free slots and prompt processing first
+    int64_t t_queued = 0; // set by server_queue::post
 };
 
 struct server_task_result {
@@ -225,6 +254,11 @@ struct slot_params {
     int32_t  n_discard =  0; // number of tokens after n_keep that may be discarded when shifting context, 0 defaults to half
     int32_t  n_predict = -1; // new tokens to predict
 
+    int32_t  n_draft     = 0;     // max number of tokens to draft per decode (0 = speculative decoding disabled)
+    float    p_draft_min = 0.75f; // stop drafting when the draft token probability falls below this
+
+    int32_t  priority    = 0;     // prompts of higher priority are processed first
+
     std::vector<std::string> antiprompt;
 
     bool timings_per_token = false;
@@ -265,6 +299,13 @@ struct server_slot {
     std::vector<llama_token> cache_tokens;
     std::vector<completion_token_output> generated_token_probs;
 
+    // speculative decoding
+    std::vector<llama_token> cache_tokens_dft; // tokens of this slot's sequence in the draft context
+    std::vector<llama_token> drafted;          // draft tokens queued for verification in the current batch
+
+    llama_ngram_cache        ngram_cache;      // n-grams of the slot's history for lookup decoding
+    std::vector<llama_token> ngram_tokens;     // history that ngram_cache has been built from
+
     // Streaming tool call state
     ik_chat_msg previous_msg;
     ik_chat_msg current_msg;
@@ -272,6 +313,8 @@ struct server_slot {
 
     bool infill         = false;
     bool embedding      = false;
+    int32_t n_prompt_text = -1; // tokens of the leading text piece of the prompt, which gets the special tokens (-1: none)
+    bool prompt_ready   = false; // prompt_tokens has been truncated and matched against the cache
     bool has_next_token = true;
     bool truncated      = false;
     bool stopped_eos    = false;
@@ -299,11 +342,18 @@ struct server_slot {
     size_t n_sent_text = 0; // number of sent text character
     size_t n_sent_token_probs = 0;
 
+    int64_t t_queued = 0; // when the request was queued
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
 
+    double t_queue = 0; // ms from being queued to the first prompt token in a batch
     double t_prompt_processing; // ms
     double t_token_generation; // ms
+    double t_compute  = 0; // ms of the decode steps that produced generated tokens
+    double t_sampling = 0; // ms spent sampling and accepting tokens
+
+    int32_t n_draft_total    = 0; // number of draft tokens submitted for verification
+    int32_t n_draft_accepted = 0; // number of draft tokens accepted by the target model
 
     void reset() {
         n_prompt_tokens    = 0;
@@ -319,8 +369,13 @@ struct server_slot {
         infill             = false;
         ga_i               = 0;
         n_past_se          = 0;
+        n_draft_total      = 0;
+        n_draft_accepted   = 0;
+        t_compute          = 0;
+        t_sampling         = 0;
 
         generated_token_probs.clear();
+        drafted.clear();
         
         // Reset streaming tool call state
         previous_msg = ik_chat_msg();
@@ -378,6 +433,11 @@ struct server_slot {
         return (state == SLOT_STATE_IDLE && command == SLOT_COMMAND_LOAD_PROMPT) || state == SLOT_STATE_PROCESSING;
     }
 
+    // the token history is needed both for prompt caching and for keeping the draft context in sync
+    bool need_cache_tokens() const {
+        return params.cache_prompt || params.n_draft > 0;
+    }
+
     void add_token_string(const completion_token_output & token) {
         if (command == SLOT_COMMAND_RELEASE) {
             return;
@@ -393,7 +453,9 @@ struct server_slot {
     }
 
     json get_formated_timings() const {
-        return json {
+        json timings = {
+            {"queue_ms",               t_queue},
+
             {"prompt_n",               n_prompt_tokens_processed},
             {"prompt_ms",              t_prompt_processing},
             {"prompt_per_token_ms",    t_prompt_processing / n_prompt_tokens_processed},
@@ -403,11 +465,22 @@ struct server_slot {
             {"predicted_ms",           t_token_generation},
             {"predicted_per_token_ms", t_token_generation / n_decoded},
             {"predicted_per_second",   1e3 / t_token_generation * n_decoded},
+
+            {"compute_ms",             t_compute},
+            {"sampling_ms",            t_sampling},
         };
+
+        if (n_draft_total > 0) {
+            timings["draft_n"]          = n_draft_total;
+            timings["draft_n_accepted"] = n_draft_accepted;
+        }
+
+        return timings;
     }
 
     result_timings get_timings() const {
         result_timings timings;
+        timings.queue_ms = t_queue;
         timings.prompt_n = n_prompt_tokens_processed;
         timings.prompt_ms = t_prompt_processing;
         timings.prompt_per_token_ms = t_prompt_processing / n_prompt_tokens_processed;
@@ -419,11 +492,14 @@ struct server_slot {
         timings.predicted_per_token_ms = t_token_generation / n_decoded;
         timings.predicted_per_second = 1e3 / t_token_generation * n_decoded;
 
-        //// Add speculative metrics
-        //if (n_draft_total > 0) {
-        //    timings.draft_n = n_draft_total;
-        //    timings.draft_n_accepted = n_draft_accepted;
-        //}
+        timings.compute_ms  = t_compute;
+        timings.sampling_ms = t_sampling;
+
+        // Add speculative metrics
+        if (n_draft_total > 0) {
+            timings.draft_n = n_draft_total;
+            timings.draft_n_accepted = n_draft_accepted;
+        }
 
         return timings;
     }
@@ -458,6 +534,15 @@ struct server_slot {
     void print_timings() const {
         char buffer[512];
 
+        snprintf(buffer, 512, "queue time           = %10.2f ms", t_queue);
+
+        LOG_INFO(buffer, {
+            {"id_slot",  id},
+            {"id_task",  id_task},
+            {"t_queue",  t_queue},
+            {"priority", params.priority},
+        });
+
         double t_token = t_prompt_processing / n_prompt_tokens_processed;
         double n_tokens_second = 1e3 / t_prompt_processing * n_prompt_tokens_processed;
 
@@ -490,6 +575,31 @@ struct server_slot {
             {"n_tokens_second",    n_tokens_second},
         });
 
+        snprintf(buffer, 512, "generation breakdown = %10.2f ms compute, %10.2f ms sampling",
+                t_compute, t_sampling);
+
+        LOG_INFO(buffer, {
+            {"id_slot",    id},
+            {"id_task",    id_task},
+            {"t_compute",  t_compute},
+            {"t_sampling", t_sampling},
+        });
+
+        if (n_draft_total > 0) {
+            const float draft_ratio = (float) n_draft_accepted / n_draft_total;
+
+            snprintf(buffer, 512, "draft acceptance     = %10.5f (%5d accepted / %5d generated)",
+                    draft_ratio, n_draft_accepted, n_draft_total);
+
+            LOG_INFO(buffer, {
+                {"id_slot",          id},
+                {"id_task",          id_task},
+                {"draft_ratio",      draft_ratio},
+                {"n_draft_accepted", n_draft_accepted},
+                {"n_draft_total",    n_draft_total},
+            });
+        }
+
         snprintf(buffer, 512, "          total time = %10.2f ms", t_prompt_processing + t_token_generation);
 
         LOG_INFO(buffer, {
@@ -516,6 +626,9 @@ struct server_metrics {
     uint64_t n_tokens_predicted  = 0;
     uint64_t t_tokens_generation = 0;
 
+    uint64_t n_draft_total    = 0;
+    uint64_t n_draft_accepted = 0;
+
     void init() {
         t_start = ggml_time_us();
     }
@@ -532,6 +645,8 @@ struct server_metrics {
         n_tokens_predicted         += slot.n_decoded;
         t_tokens_generation        += slot.t_token_generation;
         t_tokens_generation_total  += slot.t_token_generation;
+        n_draft_total              += slot.n_draft_total;
+        n_draft_accepted           += slot.n_draft_accepted;
     }
 
     void reset_bucket() {
@@ -567,6 +682,9 @@ struct server_queue {
             task.id = id++;
             LOG_VERBOSE("new task id", {{"new_id", task.id}});
         }
+        if (task.t_queued == 0) {
+            task.t_queued = ggml_time_us();
+        }
         queue_tasks.push_back(std::move(task));
         condition_tasks.notify_one();
         return task.id;
@@ -603,8 +721,11 @@ struct server_queue {
 
     // Call when the state of one slot is changed
     void notify_slot_changed() {
-        // move deferred tasks back to main loop
+        // move deferred tasks back to main loop, the highest priority first so that it gets the free slot
         std::unique_lock<std::mutex> lock(mutex_tasks);
+        std::stable_sort(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), [](const server_task & a, const server_task & b) {
+            return a.priority > b.priority;
+        });
         for (auto & task : queue_tasks_deferred) {
             queue_tasks.push_back(std::move(task));
         }
@@ -785,18 +906,96 @@ struct server_response {
     }
 };
 
+// a fixed set of worker threads that sample independent slots after each decode
+struct server_sampling_pool {
+    std::vector<std::thread> workers;
+
+    std::deque<std::packaged_task<void()>> tasks;
+
+    std::mutex mutex_tasks;
+    std::condition_variable condition_tasks;
+    bool running = true;
+
+    ~server_sampling_pool() {
+        {
+            std::unique_lock<std::mutex> lock(mutex_tasks);
+            running = false;
+        }
+        condition_tasks.notify_all();
+
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    void init(int n_workers) {
+        for (int i = 0; i < n_workers; ++i) {
+            workers.emplace_back([this]() {
+                while (true) {
+                    std::packaged_task<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex_tasks);
+                        condition_tasks.wait(lock, [&]{
+                            return !running || !tasks.empty();
+                        });
+
+                        if (tasks.empty()) {
+                            return;
+                        }
+
+                        task = std::move(tasks.front());
+                        tasks.pop_front();
+                    }
+                    task();
+                }
+            });
+        }
+    }
+
+    std::future<void> submit(std::function<void()> func) {
+        std::packaged_task<void()> task(std::move(func));
+        std::future<void> res = task.get_future();
+        {
+            std::unique_lock<std::mutex> lock(mutex_tasks);
+            tasks.push_back(std::move(task));
+        }
+        condition_tasks.notify_one();
+
+        return res;
+    }
+};
+
 struct server_context {
     llama_model * model = nullptr;
     llama_context * ctx = nullptr;
     std::vector<llama_lora_adapter_container> lora_adapters;
 
+    // draft model for speculative decoding (optional)
+    llama_model   * model_dft = nullptr;
+    llama_context * ctx_dft   = nullptr;
+
+    // n-gram caches shared by all slots for lookup decoding (read-only)
+    llama_ngram_cache ngram_cache_static;
+    llama_ngram_cache ngram_cache_dynamic;
+
+    // token prefixes whose KV cells are kept alive for reuse by any slot
+    server_prefix_cache prefix_cache;
+
+    // snapshots of the KV cache of overwritten slot prompts, in host RAM and on disk
+    server_kv_tier kv_tier;
+
     gpt_params params;
 
     llama_batch batch;
+    llama_batch batch_dft = {};
 
     bool clean_kv_cache = true;
     bool add_bos_token  = true;
 
+    // tokens added by the tokenizer before and after a text when add_special is set
+    std::vector<llama_token> special_prefix;
+    std::vector<llama_token> special_suffix;
+
     int32_t n_ctx; // total context for all clients / slots
 
     // system prompt
@@ -812,11 +1011,18 @@ struct server_context {
     server_queue    queue_tasks;
     server_response queue_results;
 
+    server_sampling_pool sampling_pool;
+
     server_metrics metrics;
 
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
+    // prefill scheduling: running estimates of the time of a decode step without prompt tokens
+    // and of the time each prompt token adds to it
+    double t_step_base_ms   = 0.0;
+    double t_step_prompt_ms = 0.0;
+
     ~server_context() {
         if (ctx) {
             llama_free(ctx);
@@ -828,6 +1034,16 @@ struct server_context {
             model = nullptr;
         }
 
+        if (ctx_dft) {
+            llama_free(ctx_dft);
+            ctx_dft = nullptr;
+        }
+
+        if (model_dft) {
+            llama_free_model(model_dft);
+            model_dft = nullptr;
+        }
+
         // Clear any sampling context
         for (server_slot & slot : slots) {
             if (slot.ctx_sampling != nullptr) {
@@ -836,20 +1052,22 @@ struct server_context {
         }
 
         llama_batch_free(batch);
+        llama_batch_free(batch_dft);
     }
 
     bool load_model(const gpt_params & params_) {
         params = params_;
 
-        // dedicate one sequence to the system prompt
-        params.n_parallel += 1;
+        // dedicate one sequence to the system prompt and the rest to the prefix cache
+        params.n_prefix_cache = std::max(params.n_prefix_cache, 0);
+        params.n_parallel += 1 + params.n_prefix_cache;
 
         llama_init_result llama_init = llama_init_from_gpt_params(params);
 
         model = llama_init.model;
         ctx = llama_init.context;
         lora_adapters = llama_init.lora_adapters;
-        params.n_parallel -= 1; // but be sneaky about it
+        params.n_parallel -= 1 + params.n_prefix_cache; // but be sneaky about it
         if (model == nullptr) {
             LOG_ERROR("unable to load model", {{"model", params.model}});
             return false;
@@ -860,6 +1078,98 @@ struct server_context {
         add_bos_token = llama_should_add_bos_token(model);
         GGML_ASSERT(llama_add_eos_token(model) != 1);
 
+        {
+            const auto with_special = ::llama_tokenize(ctx, "a", true,  false);
+            const auto text         = ::llama_tokenize(ctx, "a", false, false);
+            const auto it = std::search(with_special.begin(), with_special.end(), text.begin(), text.end());
+            GGML_ASSERT(it != with_special.end());
+            special_prefix.assign(with_special.begin(), it);
+            special_suffix.assign(it + text.size(), with_special.end());
+        }
+
+        if (!params.model_draft.empty()) {
+            if (!load_model_draft()) {
+                return false;
+            }
+        } else if (params.lookup_decoding) {
+            if (!load_lookup_caches()) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool load_lookup_caches() {
+        if (!params.lookup_cache_static.empty()) {
+            try {
+                ngram_cache_static = llama_ngram_cache_load(params.lookup_cache_static);
+            } catch (std::ifstream::failure const &) {
+                LOG_ERROR("failed to open static lookup cache", {{"path", params.lookup_cache_static}});
+                return false;
+            }
+        }
+
+        if (!params.lookup_cache_dynamic.empty()) {
+            try {
+                ngram_cache_dynamic = llama_ngram_cache_load(params.lookup_cache_dynamic);
+            } catch (std::ifstream::failure const &) {
+                LOG_WARNING("failed to open dynamic lookup cache", {{"path", params.lookup_cache_dynamic}});
+            }
+        }
+
+        LOG_INFO("lookup decoding enabled", {
+            {"n_ngrams_static",  ngram_cache_static.size()},
+            {"n_ngrams_dynamic", ngram_cache_dynamic.size()},
+        });
+
+        return true;
+    }
+
+    bool load_model_draft() {
+        LOG_INFO("loading draft model", {{"model", params.model_draft}});
+
+        gpt_params params_dft = params;
+
+        params_dft.model           = params.model_draft;
+        params_dft.model_url       = "";
+        params_dft.hf_repo         = "";
+        params_dft.hf_file         = "";
+        params_dft.n_ctx           = n_ctx;
+        params_dft.n_parallel      = params.n_parallel + 1;
+        params_dft.n_gpu_layers    = params.n_gpu_layers_draft;
+        params_dft.n_threads       = params.n_threads_draft > 0 ? params.n_threads_draft : params.n_threads;
+        params_dft.n_threads_batch = params.n_threads_batch_draft > 0 ? params.n_threads_batch_draft : params_dft.n_threads;
+        params_dft.embedding       = false;
+        params_dft.lora_adapters.clear();
+        params_dft.control_vectors.clear();
+        params_dft.tensor_buft_overrides.clear();
+
+        llama_init_result llama_init_dft = llama_init_from_gpt_params(params_dft);
+
+        model_dft = llama_init_dft.model;
+        ctx_dft   = llama_init_dft.context;
+        if (model_dft == nullptr) {
+            LOG_ERROR("unable to load draft model", {{"model", params.model_draft}});
+            return false;
+        }
+
+        // the draft tokens are fed to the target model as-is, so both models must share the vocabulary
+        const int n_vocab_tgt = llama_n_vocab(model);
+        const int n_vocab_dft = llama_n_vocab(model_dft);
+
+        if (llama_vocab_type(model) != llama_vocab_type(model_dft) ||
+            std::abs(n_vocab_tgt - n_vocab_dft) > SPEC_VOCAB_MAX_SIZE_DIFFERENCE ||
+            llama_token_bos(model) != llama_token_bos(model_dft) ||
+            llama_token_eos(model) != llama_token_eos(model_dft)) {
+            LOG_ERROR("draft model vocab must match the target model to use speculative decoding", {
+                {"model",       params.model_draft},
+                {"n_vocab_tgt", n_vocab_tgt},
+                {"n_vocab_dft", n_vocab_dft},
+            });
+            return false;
+        }
+
         return true;
     }
 
@@ -874,6 +1184,16 @@ struct server_context {
     void init() {
         const int32_t n_ctx_slot = n_ctx / params.n_parallel;
 
+        {
+            // the main loop thread samples too
+            const int32_t n_threads_sampling = params.n_threads_sampling < 0 ? params.n_parallel : params.n_threads_sampling;
+            const int32_t n_workers = std::min(n_threads_sampling, params.n_parallel) - 1;
+            if (n_workers > 0) {
+                LOG_INFO("initializing sampling threads", {{"n_threads", n_workers + 1}});
+                sampling_pool.init(n_workers);
+            }
+        }
+
         LOG_INFO("initializing slots", {{"n_slots", params.n_parallel}});
 
         for (int i = 0; i < params.n_parallel; i++) {
@@ -927,6 +1247,38 @@ struct server_context {
             batch = llama_batch_init(n_batch, 0, 1);
         }
 
+        if (ctx_dft) {
+            batch_dft = llama_batch_init(llama_n_batch(ctx_dft), 0, 1);
+        }
+
+        if (params.n_prefix_cache > 0) {
+            LOG_INFO("initializing prefix cache", {{"n_prefixes", params.n_prefix_cache}});
+
+            // the cached sequences start right after the system prompt
+            prefix_cache.kv_copy = [this](llama_seq_id src, llama_seq_id dst, int32_t i0, int32_t i1) {
+                llama_kv_cache_seq_cp(ctx, src, dst, system_tokens.size() + i0, system_tokens.size() + i1);
+            };
+            prefix_cache.kv_drop = [this](llama_seq_id seq_id) {
+                llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            };
+            prefix_cache.init(params.n_parallel + 1, params.n_prefix_cache);
+        }
+
+        if (params.slot_cache_disk > 0 && params.slot_cache_path.empty()) {
+            LOG_WARNING("--slot-cache-disk requires --slot-cache-path, the disk tier is disabled", {});
+        }
+
+        if (params.slot_cache_ram > 0 || (params.slot_cache_disk > 0 && !params.slot_cache_path.empty())) {
+            LOG_INFO("initializing slot cache", {
+                {"ram_mib",  params.slot_cache_ram},
+                {"disk_mib", params.slot_cache_path.empty() ? 0 : params.slot_cache_disk},
+                {"path",     params.slot_cache_path},
+            });
+
+            kv_tier.init((size_t) params.slot_cache_ram  * 1024 * 1024,
+                         (size_t) params.slot_cache_disk * 1024 * 1024, params.slot_cache_path);
+        }
+
         metrics.init();
     }
 
@@ -971,6 +1323,79 @@ struct server_context {
         return prompt_tokens;
     }
 
+    std::vector<llama_token> format_infill(const json & input_prefix, json input_suffix) const {
+        const bool add_bos = llama_should_add_bos_token(model);
+        bool suff_rm_leading_spc = true;
+        if (input_suffix.is_string()) {
+            auto & suffix = input_suffix.get_ref<std::string &>();
+            if (suffix.find_first_of(' ') == 0 && suffix.size() > 1) {
+                suffix.erase(0, 1);
+                suff_rm_leading_spc = false;
+            }
+        }
+
+        auto prefix_tokens = tokenize(input_prefix, false);
+        auto suffix_tokens = tokenize(input_suffix, false);
+
+        const int space_token = 29871; // TODO: this should not be hardcoded
+        if (suff_rm_leading_spc && !suffix_tokens.empty() && suffix_tokens[0] == space_token) {
+            suffix_tokens.erase(suffix_tokens.begin());
+        }
+
+        prefix_tokens.insert(prefix_tokens.begin(), llama_token_prefix(model));
+        suffix_tokens.insert(suffix_tokens.begin(), llama_token_suffix(model));
+
+        auto embd_inp = params.spm_infill ? suffix_tokens : prefix_tokens;
+        auto embd_end = params.spm_infill ? prefix_tokens : suffix_tokens;
+        if (add_bos) {
+            embd_inp.insert(embd_inp.begin(), llama_token_bos(model));
+        }
+        embd_inp.insert(embd_inp.end(), embd_end.begin(), embd_end.end());
+
+        const llama_token middle_token = llama_token_middle(model);
+        if (middle_token >= 0) {
+            embd_inp.push_back(middle_token);
+        }
+
+        return embd_inp;
+    }
+
+    // tokenize the prompt of a completion task before it is posted, so that the HTTP thread
+    // handling the request pays for it instead of the main loop
+    // invalid prompts are left untokenized, launch_slot_with_task() reports them
+    void tokenize_task(server_task & task) const {
+        const json & data = task.data;
+
+        try {
+            if (task.infill) {
+                // the prefix and suffix are text or tokens, like the prompt
+                task.prompt_tokens = format_infill(
+                    json_value(data, "input_prefix", json(std::string())),
+                    json_value(data, "input_suffix", json(std::string())));
+                return;
+            }
+
+            const auto prompt = data.find("prompt");
+            if (prompt == data.end()) {
+                return;
+            }
+
+            const json & p = prompt->is_array() && prompt->size() == 1 && prompt->at(0).is_array() ? prompt->at(0) : *prompt;
+
+            // the special tokens depend on the system prompt, they are added around the leading text piece
+            // when the slot starts
+            task.prompt_tokens = tokenize(p, false);
+            if (p.is_string()) {
+                task.n_prompt_text = task.prompt_tokens.size();
+            } else if (p.is_array() && !p.empty() && p.at(0).is_string()) {
+                task.n_prompt_text = tokenize(p.at(0), false).size();
+            }
+        } catch (const std::exception &) {
+            task.prompt_tokens.clear();
+            task.n_prompt_text = -1;
+        }
+    }
+
     server_slot * get_slot_by_id(int id) {
         for (server_slot & slot : slots) {
             if (slot.id == id) {
@@ -1100,6 +1525,15 @@ struct server_context {
         slot.sparams.seed              = json_value(data, "seed",              default_sparams.seed);
         slot.sparams.n_probs           = json_value(data, "n_probs",           default_sparams.n_probs);
         slot.sparams.min_keep          = json_value(data, "min_keep",          default_sparams.min_keep);
+        slot.params.n_draft            = json_value(data, "n_draft",           can_draft() ? params.n_draft : 0);
+        slot.params.p_draft_min        = json_value(data, "draft_p_min",       params.p_draft_min);
+        slot.params.priority           = task.priority;
+        slot.t_queued                  = task.t_queued;
+
+        if (!can_draft()) {
+            slot.params.n_draft = 0;
+        }
+        slot.params.n_draft = std::max(slot.params.n_draft, 0);
 
         if (slot.sparams.penalty_last_n < -1) {
             throw std::runtime_error("Error: repeat_last_n must be >= -1");
@@ -1315,7 +1749,9 @@ struct server_context {
         }
 
         slot.command = SLOT_COMMAND_LOAD_PROMPT;
-        slot.prompt_tokens.clear();
+        slot.prompt_tokens = task.prompt_tokens;
+        slot.n_prompt_text = task.n_prompt_text;
+        slot.prompt_ready  = false;
 
         LOG_INFO("slot is processing task", {
             {"id_slot", slot.id},
@@ -1331,6 +1767,20 @@ struct server_context {
         // clear the entire KV cache
         llama_kv_cache_clear(ctx);
         clean_kv_cache = false;
+
+        prefix_cache.clear();
+
+        // the slots do not hold anything anymore
+        for (server_slot & slot : slots) {
+            slot.cache_tokens.clear();
+        }
+
+        if (ctx_dft) {
+            llama_kv_cache_clear(ctx_dft);
+            for (server_slot & slot : slots) {
+                slot.cache_tokens_dft.clear();
+            }
+        }
     }
 
     void system_prompt_update() {
@@ -1574,7 +2024,10 @@ struct server_context {
             {"n_probs",                   slot.sparams.n_probs},
             {"min_keep",                  slot.sparams.min_keep},
             {"grammar",                   slot.sparams.grammar},
-            {"samplers",                  samplers_sequence}
+            {"samplers",                  samplers_sequence},
+            {"n_draft",                   slot.params.n_draft},
+            {"draft_p_min",               slot.params.p_draft_min},
+            {"priority",                  slot.params.priority},
         };
     }
 
@@ -1779,6 +2232,7 @@ struct server_context {
         task.infill    = infill;
         task.embedding = embedding;
         task.type      = SERVER_TASK_TYPE_COMPLETION;
+        task.priority  = json_value(task.data, "priority", 0);
 
         // when a completion task's prompt array is not a singleton, we split it into multiple requests
         // otherwise, it's a single-prompt task, we actually queue it
@@ -1798,11 +2252,13 @@ struct server_context {
             // if there are numbers, it needs to be treated like a single prompt,
             // queue_tasks handles a mix of strings and numbers just fine.
             if (numbers) {
+                tokenize_task(task);
                 queue_tasks.post(task);
             } else {
                 split_multiprompt_task(id_task, task);
             }
         } else {
+            tokenize_task(task);
             queue_tasks.post(task);
         }
     }
@@ -1974,6 +2430,24 @@ struct server_context {
                         { "n_tokens_predicted",              metrics.n_tokens_predicted},
                         { "t_tokens_generation",             metrics.t_tokens_generation},
 
+                        { "n_draft_total",                   metrics.n_draft_total},
+                        { "n_draft_accepted",                metrics.n_draft_accepted},
+
+                        { "prefix_cache_lookups",            prefix_cache.n_lookup},
+                        { "prefix_cache_hits",               prefix_cache.n_hit},
+                        { "prefix_cache_tokens_reused",      prefix_cache.n_tokens_reused},
+                        { "prefix_cache_evictions",          prefix_cache.n_evicted},
+                        { "prefix_cache_entries",            prefix_cache.n_prefixes()},
+
+                        { "slot_cache_lookups",              kv_tier.n_lookup},
+                        { "slot_cache_hits",                 kv_tier.n_hit},
+                        { "slot_cache_tokens_restored",      kv_tier.n_tokens_restored},
+                        { "slot_cache_saves",                kv_tier.n_saved},
+                        { "slot_cache_spills",               kv_tier.n_spilled},
+                        { "slot_cache_evictions",            kv_tier.n_evicted},
+                        { "slot_cache_ram_bytes",            kv_tier.ram_used},
+                        { "slot_cache_disk_bytes",           kv_tier.disk_used},
+
                         { "kv_cache_tokens_count",           llama_get_kv_cache_token_count(ctx)},
                         { "kv_cache_used_cells",             llama_get_kv_cache_used_cells(ctx)},
 
@@ -2135,6 +2609,301 @@ struct server_context {
         queue_results.send(result);
     }
 
+    bool can_draft() const {
+        return ctx_dft != nullptr || params.lookup_decoding;
+    }
+
+    // Number of prompt tokens that may join the n_gen_tokens of the generating slots in this decode step.
+    // Without generating slots nobody waits and the whole batch is used. Otherwise the prompt tokens are capped
+    // by --prefill-budget and by what fits into --tpot-target after the generation itself, unless a prompt has
+    // waited longer than --ttft-target.
+    int32_t prefill_budget(int32_t n_gen_tokens, int32_t n_batch, bool any_overdue) const {
+        int32_t budget = n_batch - n_gen_tokens;
+        if (n_gen_tokens == 0) {
+            return budget;
+        }
+        if (params.n_prefill_budget > 0) {
+            budget = std::min(budget, params.n_prefill_budget);
+        }
+        if (params.tpot_target > 0 && !any_overdue && t_step_prompt_ms > 0) {
+            // always make some progress, however tight the target
+            const int32_t n_min = 32;
+            const double t_left = params.tpot_target - t_step_base_ms;
+            budget = std::min(budget, std::max(n_min, (int32_t) (t_left / t_step_prompt_ms)));
+        }
+        return std::max(budget, 0);
+    }
+
+    // update the prefill scheduling estimates with a decode of n_gen generation and n_prompt prompt tokens
+    void prefill_update_estimates(int32_t n_gen, int32_t n_prompt, double t_ms) {
+        const double alpha = 0.2;
+        if (n_prompt == 0) {
+            if (n_gen > 0) {
+                t_step_base_ms = t_step_base_ms > 0 ? (1 - alpha)*t_step_base_ms + alpha*t_ms : t_ms;
+            }
+            return;
+        }
+        const double t_prompt = std::max(0.0, t_ms - t_step_base_ms) / n_prompt;
+        t_step_prompt_ms = t_step_prompt_ms > 0 ? (1 - alpha)*t_step_prompt_ms + alpha*t_prompt : t_prompt;
+    }
+
+    void prefix_cache_insert(const server_slot & slot) {
+        if (!prefix_cache.enabled() || !slot.params.cache_prompt || slot.embedding || slot.truncated || slot.ga_n != 1) {
+            return;
+        }
+
+        prefix_cache.insert(slot.cache_tokens, slot.cache_tokens.size(), slot.id + 1);
+    }
+
+    // replace the slot's KV with the longest cached prefix of the prompt if it is longer than what the slot has
+    void prefix_cache_load(server_slot & slot, const std::vector<llama_token> & prompt_tokens) {
+        if (!prefix_cache.enabled()) {
+            return;
+        }
+
+        llama_seq_id seq_id = -1;
+
+        const int32_t n_cached = prefix_cache.find(prompt_tokens, seq_id);
+        if (n_cached <= slot.n_past) {
+            return;
+        }
+
+        const int32_t n_system = system_tokens.size();
+
+        llama_kv_cache_seq_rm(ctx, slot.id + 1, n_system, -1);
+        llama_kv_cache_seq_cp(ctx, seq_id, slot.id + 1, n_system, n_system + n_cached);
+
+        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_cached);
+        slot.n_past = n_cached;
+
+        prefix_cache.n_tokens_reused += n_cached;
+
+        LOG_VERBOSE("prefix cache hit", {
+            {"id_slot",  slot.id},
+            {"id_task",  slot.id_task},
+            {"n_cached", n_cached},
+            {"seq_id",   seq_id},
+        });
+    }
+
+    // snapshot the slot's sequence before the part of it not shared with the next prompt (from n_keep on) is dropped
+    void kv_tier_save(const server_slot & slot, int32_t n_keep) {
+        if (!kv_tier.enabled() || slot.ga_n != 1) {
+            return;
+        }
+
+        if ((int32_t) slot.cache_tokens.size() - n_keep < KV_TIER_MIN_TOKENS) {
+            return;
+        }
+
+        // the sequence includes the cells of the system prompt
+        std::vector<llama_token> tokens = system_tokens;
+        tokens.insert(tokens.end(), slot.cache_tokens.begin(), slot.cache_tokens.end());
+
+        const size_t size = llama_state_seq_get_size(ctx, slot.id + 1);
+
+        std::vector<uint8_t> data(size);
+        if (llama_state_seq_get_data(ctx, data.data(), size, slot.id + 1) != size) {
+            LOG_WARNING("failed to snapshot slot", {{"id_slot", slot.id}});
+            return;
+        }
+
+        const bool saved = kv_tier.save(tokens, std::move(data));
+
+        LOG_VERBOSE("slot cache save", {
+            {"id_slot",  slot.id},
+            {"n_tokens", tokens.size()},
+            {"size",     size},
+            {"saved",    saved},
+        });
+    }
+
+    // restore the snapshot sharing the longest prefix with the prompt if it is longer than what the slot has
+    void kv_tier_load(server_slot & slot, const std::vector<llama_token> & prompt_tokens) {
+        if (!kv_tier.enabled()) {
+            return;
+        }
+
+        const int32_t n_system = system_tokens.size();
+
+        std::vector<llama_token> tokens = system_tokens;
+        tokens.insert(tokens.end(), prompt_tokens.begin(), prompt_tokens.end());
+
+        uint64_t key;
+        int32_t  n;
+        if (!kv_tier.find(tokens, n_system + slot.n_past + KV_TIER_MIN_TOKENS, key, n)) {
+            return;
+        }
+
+        std::vector<uint8_t> buf;
+
+        const uint8_t * data = kv_tier.load(key, buf);
+        if (data == nullptr) {
+            LOG_WARNING("failed to read slot cache entry", {{"id_slot", slot.id}});
+            return;
+        }
+
+        const llama_seq_id seq_id = slot.id + 1;
+        const size_t       size   = kv_tier.entries.at(key).size;
+
+        if (llama_state_seq_set_data(ctx, data, size, seq_id) != size) {
+            // the sequence has been cleared - start over from the system prompt
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            if (n_system > 0) {
+                llama_kv_cache_seq_cp(ctx, 0, seq_id, -1, -1);
+            }
+
+            slot.cache_tokens.clear();
+            slot.n_past = 0;
+
+            LOG_WARNING("failed to restore slot cache entry", {{"id_slot", slot.id}});
+            return;
+        }
+
+        // share the cells of the system prompt with the other slots instead of keeping a copy
+        if (n_system > 0) {
+            llama_kv_cache_seq_rm(ctx, seq_id, 0, n_system);
+            llama_kv_cache_seq_cp(ctx, 0, seq_id, 0, n_system);
+        }
+
+        // the cells past the common part are dropped with the rest of the non-common part
+        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + (n - n_system));
+        slot.n_past = n - n_system;
+
+        kv_tier.n_hit++;
+        kv_tier.n_tokens_restored += slot.n_past;
+
+        LOG_VERBOSE("slot cache hit", {
+            {"id_slot",  slot.id},
+            {"id_task",  slot.id_task},
+            {"n_cached", slot.n_past},
+        });
+    }
+
+    // fill slot.drafted with up to n_max tokens predicted to follow the slot's sequence
+    void speculative_draft(server_slot & slot, int n_max) {
+        slot.drafted.clear();
+
+        if (n_max <= 0 || slot.cache_tokens.empty()) {
+            return;
+        }
+
+        if (ctx_dft) {
+            speculative_draft_model(slot, n_max);
+        } else if (params.lookup_decoding) {
+            speculative_draft_lookup(slot, n_max);
+        }
+    }
+
+    // draft by n-gram lookup in the slot's own prompt and generated text
+    void speculative_draft_lookup(server_slot & slot, int n_max) {
+        const std::vector<llama_token> & tokens = slot.cache_tokens;
+
+        // the n-gram cache can only be appended to - rebuild it when the history was rewritten
+        // (new prompt, context shift)
+        if (slot.ngram_tokens.size() > tokens.size() ||
+            !std::equal(slot.ngram_tokens.begin(), slot.ngram_tokens.end(), tokens.begin())) {
+            slot.ngram_cache.clear();
+            slot.ngram_tokens.clear();
+        }
+
+        const int n_new = tokens.size() - slot.ngram_tokens.size();
+        slot.ngram_tokens.insert(slot.ngram_tokens.end(), tokens.end() - n_new, tokens.end());
+
+        llama_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.ngram_tokens, n_new, false);
+
+        // the draft starts with the last sampled token
+        std::vector<llama_token> draft = { tokens.back() };
+
+        llama_ngram_cache_draft(slot.ngram_tokens, draft, n_max, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX,
+                                slot.ngram_cache, ngram_cache_dynamic, ngram_cache_static);
+
+        slot.drafted.assign(draft.begin() + 1, draft.end());
+    }
+
+    // greedily draft up to n_max tokens continuing the slot's sequence with the draft model
+    void speculative_draft_model(server_slot & slot, int n_max) {
+        const llama_seq_id seq_id = slot.id + 1;
+
+        std::vector<llama_token> tokens = system_tokens;
+        tokens.insert(tokens.end(), slot.cache_tokens.begin(), slot.cache_tokens.end());
+
+        // reuse the common prefix already in the draft KV cache, but always re-evaluate the
+        // last token so that its logits are available
+        size_t n_reuse = common_part(slot.cache_tokens_dft, tokens);
+        if (n_reuse >= tokens.size()) {
+            n_reuse = tokens.size() - 1;
+        }
+
+        llama_kv_cache_seq_rm(ctx_dft, seq_id, n_reuse, -1);
+        slot.cache_tokens_dft.resize(n_reuse);
+
+        const size_t n_batch_dft = llama_n_batch(ctx_dft);
+
+        for (size_t i = n_reuse; i < tokens.size(); i += n_batch_dft) {
+            const size_t n_tokens = std::min(n_batch_dft, tokens.size() - i);
+
+            llama_batch_clear(batch_dft);
+            for (size_t j = 0; j < n_tokens; ++j) {
+                llama_batch_add(batch_dft, tokens[i + j], i + j, { seq_id }, i + j == tokens.size() - 1);
+            }
+
+            if (llama_decode(ctx_dft, batch_dft) != 0) {
+                LOG_WARNING("failed to decode the draft batch - skipping draft", {
+                    {"id_slot",  slot.id},
+                    {"n_tokens", n_tokens},
+                });
+                llama_kv_cache_seq_rm(ctx_dft, seq_id, -1, -1);
+                slot.cache_tokens_dft.clear();
+                return;
+            }
+
+            slot.cache_tokens_dft.insert(slot.cache_tokens_dft.end(), tokens.begin() + i, tokens.begin() + i + n_tokens);
+        }
+
+        const int n_vocab_dft = llama_n_vocab(model_dft);
+        const int n_vocab_tgt = llama_n_vocab(model);
+
+        int32_t i_logits = batch_dft.n_tokens - 1;
+
+        for (int k = 0; k < n_max; ++k) {
+            const float * logits = llama_get_logits_ith(ctx_dft, i_logits);
+
+            llama_token id = 0;
+            for (llama_token t = 1; t < n_vocab_dft; ++t) {
+                if (logits[t] > logits[id]) {
+                    id = t;
+                }
+            }
+
+            // probability of the greedy token: 1 / sum(exp(l - l_max))
+            double sum = 0.0;
+            for (llama_token t = 0; t < n_vocab_dft; ++t) {
+                sum += std::exp(logits[t] - logits[id]);
+            }
+
+            if (1.0/sum < slot.params.p_draft_min || id >= n_vocab_tgt) {
+                break;
+            }
+
+            slot.drafted.push_back(id);
+
+            if (k + 1 == n_max || llama_token_is_eog(model_dft, id)) {
+                break;
+            }
+
+            llama_batch_clear(batch_dft);
+            llama_batch_add(batch_dft, id, tokens.size() + k, { seq_id }, true);
+
+            if (llama_decode(ctx_dft, batch_dft) != 0) {
+                break;
+            }
+
+            slot.cache_tokens_dft.push_back(id);
+            i_logits = 0;
+        }
+    }
+
     void update_slots() {
         if (system_need_update) {
             system_prompt_update();
@@ -2147,6 +2916,9 @@ struct server_context {
                 slot.command     = SLOT_COMMAND_NONE;
                 slot.t_last_used = ggml_time_us();
 
+                // keep the prompt + generation around for follow-up requests (e.g. the next chat turn)
+                prefix_cache_insert(slot);
+
                 LOG_INFO("slot released", {
                     {"id_slot",         slot.id},
                     {"id_task",         slot.id_task},
@@ -2217,7 +2989,7 @@ struct server_context {
                     llama_kv_cache_seq_rm (ctx, slot.id + 1, n_keep            , n_keep + n_discard);
                     llama_kv_cache_seq_add(ctx, slot.id + 1, n_keep + n_discard, system_tokens.size() + slot.n_past, -n_discard);
 
-                    if (slot.params.cache_prompt) {
+                    if (slot.need_cache_tokens()) {
                         for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++) {
                             slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
                         }
@@ -2247,14 +3019,48 @@ struct server_context {
 
             // TODO: we always have to take into account the "system_tokens"
             //       this is not great and needs to be improved somehow
+            if (slot.params.n_draft > 0 && slot.ga_n == 1) {
+                // drop the KV cells of draft tokens that were decoded but not verified, the sampled token takes the first one
+                if (!llama_kv_cache_seq_rm(ctx, slot.id + 1, system_tokens.size() + slot_npast, -1)) {
+                    // the sliding window cache no longer holds the window before the draft tokens
+                    LOG_ERROR("failed to remove the draft tokens from the KV cache", {
+                        {"id_slot", slot.id},
+                        {"n_past",  slot_npast},
+                    });
+                    slot.i_batch = -1;
+                    slot.release();
+                    send_error(slot, "failed to remove the draft tokens from the KV cache");
+                    continue;
+                }
+            }
+
             llama_batch_add(batch, slot.sampled, system_tokens.size() + slot_npast, { slot.id + 1 }, true);
 
             slot.n_past += 1;
 
-            if (slot.params.cache_prompt) {
+            if (slot.need_cache_tokens()) {
                 slot.cache_tokens.push_back(slot.sampled);
             }
 
+            // speculative decoding: queue draft tokens right after the sampled token so that
+            // the whole run is verified by the target model in this decode
+            slot.drafted.clear();
+            if (slot.params.n_draft > 0 && slot.ga_n == 1 && !slot.embedding) {
+                int n_draft_max = std::min(slot.params.n_draft, (int) llama_n_batch(ctx) - batch.n_tokens);
+                n_draft_max = std::min(n_draft_max, slot.n_ctx - 1 - (int) system_tokens.size() - slot.n_past);
+
+                const int32_t n_predict = slot.params.n_predict != -1 ? slot.params.n_predict : params.n_predict;
+                if (n_predict > 0) {
+                    n_draft_max = std::min(n_draft_max, n_predict - slot.n_decoded - 1);
+                }
+
+                speculative_draft(slot, n_draft_max);
+
+                for (size_t k = 0; k < slot.drafted.size(); ++k) {
+                    llama_batch_add(batch, slot.drafted[k], system_tokens.size() + slot.n_past + k, { slot.id + 1 }, true);
+                }
+            }
+
             LOG_VERBOSE("slot decode token", {
                 {"id_slot",         slot.id},
                 {"id_task",         slot.id_task},
@@ -2275,57 +3081,55 @@ struct server_context {
         // -1: none, 0: non-embedding, 1: embedding
         int32_t batch_type = batch.n_tokens > 0 ? 0 : -1;
 
+        // the tokens of the generating slots, which the prompt tokens must not delay too much
+        const int32_t n_gen_tokens = batch.n_tokens;
+
+        // prompts are batched in order of: past the TTFT target, priority, time queued
+        const int64_t t_now = ggml_time_us();
+        auto is_overdue = [&](const server_slot & slot) {
+            return params.ttft_target > 0 && slot.command == SLOT_COMMAND_LOAD_PROMPT && (t_now - slot.t_queued)/1e3 > params.ttft_target;
+        };
+        std::vector<server_slot *> prompt_order;
+        bool any_overdue = false;
+        for (auto & slot : slots) {
+            prompt_order.push_back(&slot);
+            any_overdue = any_overdue || is_overdue(slot);
+        }
+        std::stable_sort(prompt_order.begin(), prompt_order.end(), [&](const server_slot * a, const server_slot * b) {
+            const bool a_overdue = is_overdue(*a);
+            const bool b_overdue = is_overdue(*b);
+            if (a_overdue != b_overdue) {
+                return a_overdue;
+            }
+            if (a->params.priority != b->params.priority) {
+                return a->params.priority > b->params.priority;
+            }
+            return a->t_queued < b->t_queued;
+        });
+
+        // the batch ends after at most n_prompt_max prompt tokens
+        const int32_t n_prompt_max = n_gen_tokens + prefill_budget(n_gen_tokens, n_batch, any_overdue);
+
         // next, batch any pending prompts without exceeding n_batch
         if (params.cont_batching || batch.n_tokens == 0) {
-            for (auto & slot : slots) {
+            for (server_slot * pslot : prompt_order) {
+                auto & slot = *pslot;
+
                 // this slot still has a prompt to be processed
                 if (slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_LOAD_PROMPT) {
                     auto & prompt_tokens = slot.prompt_tokens;
 
-                    // we haven't tokenized the prompt yet - do it now:
-                    if (prompt_tokens.empty()) {
-                        LOG_VERBOSE("tokenizing prompt", {
-                            {"id_slot", slot.id},
-                            {"id_task", slot.id_task}
-                        });
+                    // the prompt was tokenized with the request, set up the slot for it now
+                    if (!slot.prompt_ready) {
+                        slot.prompt_ready = true;
 
                         slot.t_start_process_prompt = ggml_time_us();
                         slot.t_start_generation = 0;
 
-                        if (slot.infill) {
-                            const bool add_bos = llama_should_add_bos_token(model);
-                            bool suff_rm_leading_spc = true;
-                            if (params.input_suffix.find_first_of(' ') == 0 && params.input_suffix.size() > 1) {
-                                params.input_suffix.erase(0, 1);
-                                suff_rm_leading_spc = false;
-                            }
-
-                            auto prefix_tokens = tokenize(slot.params.input_prefix, false);
-                            auto suffix_tokens = tokenize(slot.params.input_suffix, false);
-
-                            const int space_token = 29871; // TODO: this should not be hardcoded
-                            if (suff_rm_leading_spc && !suffix_tokens.empty() && suffix_tokens[0] == space_token) {
-                                suffix_tokens.erase(suffix_tokens.begin());
-                            }
-
-                            prefix_tokens.insert(prefix_tokens.begin(), llama_token_prefix(model));
-                            suffix_tokens.insert(suffix_tokens.begin(), llama_token_suffix(model));
-
-                            auto embd_inp = params.spm_infill ? suffix_tokens : prefix_tokens;
-                            auto embd_end = params.spm_infill ? prefix_tokens : suffix_tokens;
-                            if (add_bos) {
-                                embd_inp.insert(embd_inp.begin(), llama_token_bos(model));
-                            }
-                            embd_inp.insert(embd_inp.end(), embd_end.begin(), embd_end.end());
-
-                            const llama_token middle_token = llama_token_middle(model);
-                            if (middle_token >= 0) {
-                                embd_inp.push_back(middle_token);
-                            }
-
-                            prompt_tokens = embd_inp;
-                        } else {
-                            prompt_tokens = tokenize(slot.prompt, system_prompt.empty()); // add BOS if there isn't system prompt
+                        // the special tokens are only added if there isn't a system prompt
+                        if (slot.n_prompt_text >= 0 && system_prompt.empty()) {
+                            prompt_tokens.insert(prompt_tokens.begin() + slot.n_prompt_text, special_suffix.begin(), special_suffix.end());
+                            prompt_tokens.insert(prompt_tokens.begin(), special_prefix.begin(), special_prefix.end());
                         }
 
                         slot.n_past = 0;
@@ -2406,6 +3210,9 @@ struct server_context {
 
                             llama_sampling_reset(slot.ctx_sampling);
 
+                            // the history of the slot that the new prompt does not share is about to be dropped
+                            kv_tier_save(slot, slot.params.cache_prompt ? common_part(slot.cache_tokens, prompt_tokens) : 0);
+
                             if (!slot.params.cache_prompt) {
                                 slot.n_past_se = 0;
                                 slot.ga_i      = 0;
@@ -2415,6 +3222,12 @@ struct server_context {
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_part(slot.cache_tokens, prompt_tokens);
 
+                                // a longer prefix may have been computed by another slot
+                                prefix_cache_load(slot, prompt_tokens);
+
+                                // or it may have been offloaded when its slot was reassigned
+                                kv_tier_load(slot, prompt_tokens);
+
                                 // push the prompt into the sampling context (do not apply grammar)
                                 for (int i = 0; i < slot.n_past; ++i) {
                                     llama_sampling_accept(slot.ctx_sampling, ctx, slot.cache_tokens[i], false);
@@ -2488,9 +3301,14 @@ struct server_context {
                     int32_t ga_n = slot.ga_n;
                     int32_t ga_w = slot.ga_w;
 
+                    if (slot.n_prompt_tokens_processed == 0 && batch.n_tokens < n_prompt_max) {
+                        slot.t_start_process_prompt = ggml_time_us();
+                        slot.t_queue = (slot.t_start_process_prompt - slot.t_queued) / 1e3;
+                    }
+
                     // add prompt tokens for processing in the current batch
                     // TODO: the self-extend stuff here is a mess - simplify and/or abstract it somehow
-                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch; ++slot.n_past) {
+                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_prompt_max; ++slot.n_past) {
                         if (slot.ga_n != 1) {
                             while (slot_npast >= ga_i + ga_w) {
                                 const int bd = (ga_w/ga_n)*(ga_n - 1);
@@ -2501,7 +3319,7 @@ struct server_context {
 
                         llama_batch_add(batch, prompt_tokens[slot.n_past], system_tokens.size() + slot_npast, { slot.id + 1 }, false);
 
-                        if (slot.params.cache_prompt) {
+                        if (slot.need_cache_tokens()) {
                             slot.cache_tokens.push_back(prompt_tokens[slot.n_past]);
                         }
 
@@ -2546,7 +3364,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_prompt_max) {
                     break;
                 }
             }
@@ -2564,6 +3382,11 @@ struct server_context {
         // make sure we're in the right embedding mode
         llama_set_embeddings(ctx, batch_type == 1);
 
+        // make room in the KV cache by dropping cached prefixes first
+        while (llama_get_kv_cache_used_cells(ctx) + batch.n_tokens > n_ctx && prefix_cache.evict_lru()) {
+            LOG_VERBOSE("prefix cache eviction", {{"n_prefixes", prefix_cache.n_prefixes()}});
+        }
+
         // process the created batch of tokens
         for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
             const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
@@ -2608,9 +3431,31 @@ struct server_context {
                 0, 0, 0, // unused
             };
 
+            const int64_t t_decode_start = ggml_time_us();
+
             const int ret = llama_decode(ctx, batch_view);
 
+            double t_compute_view = 0.0;
+
+            if (ret == 0) {
+                // the outputs of this view are read by the sampling threads below, they must be ready first
+                llama_synchronize(ctx);
+
+                t_compute_view = (ggml_time_us() - t_decode_start) / 1e3;
+
+                if (params.tpot_target > 0) {
+                    const int32_t n_gen_view = std::max(0, std::min(n_gen_tokens - i, n_tokens));
+                    prefill_update_estimates(n_gen_view, n_tokens - n_gen_view, t_compute_view);
+                }
+            }
+
             if (ret != 0) {
+                if (ret > 0 && prefix_cache.evict_lru()) {
+                    // retry the same view after freeing the cells of a cached prefix
+                    i -= n_batch;
+                    continue;
+                }
+
                 if (n_batch == 1 || ret < 0) {
                     // if you get here, it means the KV cache is full - try increasing it via the context size
                     LOG_ERROR("failed to decode the batch: KV cache is full - try increasing it via the context size", {
@@ -2640,6 +3485,48 @@ struct server_context {
                 continue; // continue loop of n_batch
             }
 
+            // sample the first token of the slots in this view in parallel, each slot only touches its own sampling context
+            // and rng, only mirostat draws from the rng of the llama_context
+            std::vector<completion_token_output> sampled(slots.size());
+            {
+                std::vector<server_slot *> to_sample;
+                for (auto & slot : slots) {
+                    if (slot.state != SLOT_STATE_PROCESSING || slot.embedding || slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
+                        continue;
+                    }
+
+                    if (slot.n_decoded > 0) {
+                        slot.t_compute += t_compute_view;
+                    }
+
+                    to_sample.push_back(&slot);
+                }
+
+                std::vector<std::future<void>> sampling_futures;
+                std::vector<server_slot *> sample_here;
+                for (size_t j = 0; j < to_sample.size(); ++j) {
+                    server_slot * slot = to_sample[j];
+
+                    // this thread samples too, and mirostat draws from the rng of the llama_context
+                    if (j == 0 || sampling_pool.workers.empty() || slot->sparams.mirostat != 0) {
+                        sample_here.push_back(slot);
+                        continue;
+                    }
+
+                    sampling_futures.push_back(sampling_pool.submit([this, slot, &sampled, i]() {
+                        sampled[slot->id] = sample_token(*slot, slot->i_batch - i);
+                    }));
+                }
+
+                for (server_slot * slot : sample_here) {
+                    sampled[slot->id] = sample_token(*slot, slot->i_batch - i);
+                }
+
+                for (auto & future : sampling_futures) {
+                    future.get();
+                }
+            }
+
             for (auto & slot : slots) {
                 if (slot.state != SLOT_STATE_PROCESSING || slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
@@ -2653,62 +3540,109 @@ struct server_context {
                     continue; // continue loop of slots
                 }
 
-                completion_token_output result;
-                const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch - i);
+                // only draft tokens that made it into this view can be verified
+                const int n_drafted = std::min((int) slot.drafted.size(), (int) (i + n_tokens) - slot.i_batch - 1);
+                slot.n_draft_total += n_drafted;
 
-                llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+                // the logits at i_batch + k predict the token following drafted[k - 1]
+                for (int k = 0; k <= n_drafted; ++k) {
+                    completion_token_output result = k == 0 ? std::move(sampled[slot.id]) : sample_token(slot, slot.i_batch - i + k);
+                    const llama_token id = result.tok;
 
-                slot.n_decoded += 1;
-                if (slot.n_decoded == 1) {
-                    slot.t_start_generation = ggml_time_us();
-                    slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
-                }
-
-                llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
-                result.tok = id;
+                    slot.n_decoded += 1;
+                    if (slot.n_decoded == 1) {
+                        slot.t_start_generation = ggml_time_us();
+                        slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
+                        metrics.on_prompt_eval(slot);
 
-                const size_t n_probs = std::min(cur_p.size, (size_t) slot.sparams.n_probs);
-                if (n_probs > 0) {
-                    const size_t n_valid = slot.ctx_sampling->n_valid;
+                        // the prompt is in the KV cache now - share it with other slots right away
+                        prefix_cache_insert(slot);
+                    }
 
-                    // Make sure at least n_probs top tokens are at the front of the vector:
-                    if (slot.sparams.temp == 0.0f && n_probs > n_valid) {
-                        llama_sample_top_k(ctx, &cur_p, n_probs, 0);
+                    if (!process_token(result, slot)) {
+                        slot.release();
+                        slot.print_timings();
+                        send_final_response(slot);
+                        metrics.on_prediction(slot);
+                        break;
                     }
 
-                    if (slot.sparams.temp == 0.0f) {
-                        // With greedy sampling the probabilities have possibly not been calculated.
-                        for (size_t i = 0; i < n_probs; ++i) {
-                            result.probs.push_back({
-                                cur_p.data[i].id,
-                                i == 0 ? 1.0f : 0.0f
-                            });
-                        }
-                    } else {
-                        for (size_t i = 0; i < n_probs; ++i) {
-                            result.probs.push_back({
-                                cur_p.data[i].id,
-                                i >= n_valid ? 0.0f : cur_p.data[i].p // Tokens filtered out due to e.g. top_k have 0 probability.
-                            });
-                        }
+                    if (k == n_drafted || id != slot.drafted[k]) {
+                        break;
                     }
+
+                    // the target model agrees with the draft - the token is already in the KV cache
+                    slot.n_past += 1;
+                    slot.n_draft_accepted += 1;
+                    slot.cache_tokens.push_back(id);
                 }
 
-                if (!process_token(result, slot)) {
-                    slot.release();
-                    slot.print_timings();
-                    send_final_response(slot);
-                    metrics.on_prediction(slot);
+                if (!slot.drafted.empty()) {
+                    // drop the KV cells of the rejected draft tokens before the next token is decoded at the first of them
+                    if (!llama_kv_cache_seq_rm(ctx, slot.id + 1, system_tokens.size() + slot.n_past, -1) && slot.command != SLOT_COMMAND_RELEASE) {
+                        // the sliding window cache no longer holds the window before the rejected tokens
+                        LOG_ERROR("failed to remove the rejected draft tokens from the KV cache", {
+                            {"id_slot", slot.id},
+                            {"n_past",  slot.n_past},
+                        });
+                        slot.release();
+                        send_error(slot, "failed to remove the rejected draft tokens from the KV cache");
+                    }
                 }
 
                 slot.i_batch = -1;
+                slot.drafted.clear();
             }
         }
 
         LOG_VERBOSE("run slots completed", {});
     }
 
+    // sample and accept the next token of a slot from the outputs at idx in the last batch
+    // it only touches the sampling context of the slot, so different slots can be sampled on different threads
+    completion_token_output sample_token(server_slot & slot, int idx) {
+        const int64_t t_start = ggml_time_us();
+
+        completion_token_output result;
+        const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, idx);
+
+        llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+
+        llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
+        result.tok = id;
+
+        const size_t n_probs = std::min(cur_p.size, (size_t) slot.sparams.n_probs);
+        if (n_probs > 0) {
+            const size_t n_valid = slot.ctx_sampling->n_valid;
+
+            // Make sure at least n_probs top tokens are at the front of the vector:
+            if (slot.sparams.temp == 0.0f && n_probs > n_valid) {
+                llama_sample_top_k(ctx, &cur_p, n_probs, 0);
+            }
+
+            if (slot.sparams.temp == 0.0f) {
+                // With greedy sampling the probabilities have possibly not been calculated.
+                for (size_t j = 0; j < n_probs; ++j) {
+                    result.probs.push_back({
+                        cur_p.data[j].id,
+                        j == 0 ? 1.0f : 0.0f
+                    });
+                }
+            } else {
+                for (size_t j = 0; j < n_probs; ++j) {
+                    result.probs.push_back({
+                        cur_p.data[j].id,
+                        j >= n_valid ? 0.0f : cur_p.data[j].p // Tokens filtered out due to e.g. top_k have 0 probability.
+                    });
+                }
+            }
+        }
+
+        slot.t_sampling += (ggml_time_us() - t_start) / 1e3;
+
+        return result;
+    }
+
     json model_meta() const {
         return json {
             {"vocab_type",  llama_vocab_type    (model)},
@@ -3364,6 +4298,9 @@ int main(int argc, char ** argv) {
         const uint64_t n_tokens_predicted  = data.at("n_tokens_predicted");
         const uint64_t t_tokens_generation = data.at("t_tokens_generation");
 
+        const uint64_t n_draft_total    = data.at("n_draft_total");
+        const uint64_t n_draft_accepted = data.at("n_draft_accepted");
+
         const int32_t kv_cache_used_cells = data.at("kv_cache_used_cells");
 
         // metrics definition: https://prometheus.io/docs/practices/naming/#metric-names
@@ -3384,6 +4321,54 @@ int main(int argc, char ** argv) {
                     {"name",  "tokens_predicted_seconds_total"},
                     {"help",  "Predict process time"},
                     {"value",  (uint64_t) data.at("t_tokens_generation_total") / 1.e3}
+            }, {
+                    {"name",  "draft_tokens_total"},
+                    {"help",  "Number of speculative draft tokens submitted for verification."},
+                    {"value",  n_draft_total}
+            }, {
+                    {"name",  "draft_tokens_accepted_total"},
+                    {"help",  "Number of speculative draft tokens accepted by the target model."},
+                    {"value",  n_draft_accepted}
+            }, {
+                    {"name",  "prefix_cache_hits_total"},
+                    {"help",  "Number of prompts that found a prefix in the shared prefix cache."},
+                    {"value",  (uint64_t) data.at("prefix_cache_hits")}
+            }, {
+                    {"name",  "prefix_cache_misses_total"},
+                    {"help",  "Number of prompts that found no prefix in the shared prefix cache."},
+                    {"value",  (uint64_t) data.at("prefix_cache_lookups") - (uint64_t) data.at("prefix_cache_hits")}
+            }, {
+                    {"name",  "prefix_cache_tokens_reused_total"},
+                    {"help",  "Number of prompt tokens taken from the shared prefix cache."},
+                    {"value",  (uint64_t) data.at("prefix_cache_tokens_reused")}
+            }, {
+                    {"name",  "prefix_cache_evictions_total"},
+                    {"help",  "Number of prefixes evicted from the shared prefix cache."},
+                    {"value",  (uint64_t) data.at("prefix_cache_evictions")}
+            }, {
+                    {"name",  "slot_cache_hits_total"},
+                    {"help",  "Number of prompts restored from a snapshot of an overwritten slot."},
+                    {"value",  (uint64_t) data.at("slot_cache_hits")}
+            }, {
+                    {"name",  "slot_cache_misses_total"},
+                    {"help",  "Number of prompts that found no usable snapshot of an overwritten slot."},
+                    {"value",  (uint64_t) data.at("slot_cache_lookups") - (uint64_t) data.at("slot_cache_hits")}
+            }, {
+                    {"name",  "slot_cache_tokens_restored_total"},
+                    {"help",  "Number of prompt tokens restored from slot snapshots."},
+                    {"value",  (uint64_t) data.at("slot_cache_tokens_restored")}
+            }, {
+                    {"name",  "slot_cache_saves_total"},
+                    {"help",  "Number of snapshots taken of overwritten slots."},
+                    {"value",  (uint64_t) data.at("slot_cache_saves")}
+            }, {
+                    {"name",  "slot_cache_spills_total"},
+                    {"help",  "Number of slot snapshots moved from RAM to disk."},
+                    {"value",  (uint64_t) data.at("slot_cache_spills")}
+            }, {
+                    {"name",  "slot_cache_evictions_total"},
+                    {"help",  "Number of slot snapshots dropped."},
+                    {"value",  (uint64_t) data.at("slot_cache_evictions")}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -3393,6 +4378,22 @@ int main(int argc, char ** argv) {
                     {"name",  "predicted_tokens_seconds"},
                     {"help",  "Average generation throughput in tokens/s."},
                     {"value",  n_tokens_predicted ? 1.e3 / t_tokens_generation * n_tokens_predicted : 0.}
+            },{
+                    {"name",  "draft_acceptance_ratio"},
+                    {"help",  "Fraction of speculative draft tokens accepted by the target model."},
+                    {"value",  n_draft_total ? 1. * n_draft_accepted / n_draft_total : 0.}
+            },{
+                    {"name",  "prefix_cache_entries"},
+                    {"help",  "Number of prefixes held by the shared prefix cache."},
+                    {"value",  (uint64_t) data.at("prefix_cache_entries")}
+            },{
+                    {"name",  "slot_cache_ram_bytes"},
+                    {"help",  "Host RAM used by slot snapshots."},
+                    {"value",  (uint64_t) data.at("slot_cache_ram_bytes")}
+            },{
+                    {"name",  "slot_cache_disk_bytes"},
+                    {"help",  "Disk space used by slot snapshots."},
+                    {"value",  (uint64_t) data.at("slot_cache_disk_bytes")}
             },{
                     {"name",  "kv_cache_usage_ratio"},
                     {"help",  "KV-cache usage. 1 means 100 percent usage."},
@@ -4112,6 +5113,14 @@ int main(int argc, char ** argv) {
 
     ctx_server.queue_tasks.start_loop();
 
+    if (!params.expert_stats_file.empty()) {
+        if (llama_expert_stats_save(ctx_server.ctx, params.expert_stats_file.c_str())) {
+            LOG_INFO("saved expert selection counts", {{"file", params.expert_stats_file}});
+        } else {
+            LOG_ERROR("failed to save expert selection counts", {{"file", params.expert_stats_file}});
+        }
+    }
+
     svr->stop();
     t.join();
 
@@ -102,6 +102,8 @@ extern "C" {
 
     GGML_API GGML_CALL bool ggml_backend_is_cpu                (ggml_backend_t backend);
     GGML_API           void ggml_backend_cpu_set_n_threads     (ggml_backend_t backend_cpu, int n_threads);
+    GGML_API           void ggml_backend_cpu_set_threadpool    (ggml_backend_t backend_cpu, ggml_threadpool_t threadpool);
+    GGML_API           void ggml_backend_cpu_set_lockstep      (ggml_backend_t backend_cpu, bool lockstep);
     GGML_API           void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_callback abort_callback, void * abort_callback_data);
 
     // Create a backend buffer from an existing pointer
@@ -113,6 +115,9 @@ extern "C" {
     GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_hbm_buffer_type(void);
 #endif
 
+    // host buffer that spreads the rows of the tensors over the NUMA nodes (GGML_NUMA_STRATEGY_SHARD)
+    GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_numa_buffer_type(void);
+
     //
     // Backend registry
     //
@@ -597,6 +597,7 @@ extern "C" {
         GGML_OP_MUL_MAT_ID,
         GGML_OP_OUT_PROD,
         GGML_OP_MOE_FUSED_UP_GATE,
+        GGML_OP_MOE_FUSED_DOWN,
 
         GGML_OP_SCALE,
         GGML_OP_SET,
@@ -608,6 +609,7 @@ extern "C" {
         GGML_OP_TRANSPOSE,
         GGML_OP_GET_ROWS,
         GGML_OP_GET_ROWS_BACK,
+        GGML_OP_SET_ROWS,
         GGML_OP_DIAG,
         GGML_OP_DIAG_MASK_INF,
         GGML_OP_DIAG_MASK_ZERO,
@@ -627,6 +629,8 @@ extern "C" {
         GGML_OP_TIMESTEP_EMBEDDING,
         GGML_OP_ARGSORT,
         GGML_OP_ARGSORT_THRESH,
+        GGML_OP_MOE_ROUTE,
+        GGML_OP_MOE_PREFETCH,
         GGML_OP_LEAKY_RELU,
         GGML_OP_SOFTCAP,
         GGML_OP_SOFT_CAP_MAX,
@@ -693,6 +697,7 @@ extern "C" {
         GGML_TENSOR_FLAG_INPUT  = 1,
         GGML_TENSOR_FLAG_OUTPUT = 2,
         GGML_TENSOR_FLAG_PARAM  = 4,
+        GGML_TENSOR_FLAG_NUMA_SHARD = 8, // rows are spread over the NUMA nodes, see ggml_numa_shard_tensor()
     };
 
     // ggml object
@@ -754,6 +759,11 @@ extern "C" {
     // If it returns true, the computation is aborted
     typedef bool (*ggml_abort_callback)(void * data);
 
+    // persistent worker threads that can be reused across ggml_graph_compute() calls
+    // (only used without OpenMP, where the threads would otherwise be created and joined for every graph)
+    struct ggml_threadpool;
+    typedef struct ggml_threadpool * ggml_threadpool_t;
+
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -762,6 +772,12 @@ extern "C" {
 
         int n_threads;
 
+        // optional, to be set by the caller; if NULL, worker threads are created for this computation only
+        ggml_threadpool_t threadpool;
+
+        // compute every node on all threads followed by a barrier, instead of computing independent nodes concurrently
+        bool lockstep;
+
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
@@ -817,6 +833,7 @@ extern "C" {
         GGML_NUMA_STRATEGY_ISOLATE    = 2,
         GGML_NUMA_STRATEGY_NUMACTL    = 3,
         GGML_NUMA_STRATEGY_MIRROR     = 4,
+        GGML_NUMA_STRATEGY_SHARD      = 5, // distribute + split weight rows over the nodes
         GGML_NUMA_STRATEGY_COUNT
     };
 
@@ -844,6 +861,13 @@ extern "C" {
     GGML_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
 
+    // GGML_NUMA_STRATEGY_SHARD on a system with >1 NUMA node
+    GGML_API bool    ggml_numa_shard_enabled(void);
+    // bind consecutive row ranges of a freshly allocated (not yet touched) tensor to the NUMA nodes, so that
+    // the rows are stored on the node of the threads that compute with them in GGML_OP_MUL_MAT(_ID)
+    // returns false and leaves the tensor alone if sharding is not enabled or the tensor is too small
+    GGML_API bool    ggml_numa_shard_tensor(struct ggml_tensor * tensor);
+
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
 
@@ -1041,6 +1065,16 @@ extern "C" {
             struct ggml_tensor  * a,
             int n_experts);
 
+    // sum over the a->ne[1] expert results of each token, each scaled by its router weight
+    // a: [n, n_expert_used, n_tokens], weights: [1, n_expert_used, n_tokens] -> [n, n_tokens]
+    // ids: NULL, or the expert ids [n_expert_used, n_tokens] if a comes from ggml_mul_mat_id_sorted
+    GGML_API struct ggml_tensor * ggml_multi_add_weighted(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * weights,
+            struct ggml_tensor  * ids,
+            int n_expert);
+
     // dst = a
     // view(dst, nb1, nb2, nb3, offset) += b
     // return dst
@@ -1368,6 +1402,34 @@ extern "C" {
             struct ggml_tensor  * ids,
             enum ggml_unary_op    op);
 
+    // same as ggml_mul_mat_id and ggml_moe_up_gate, but the result rows are grouped by expert
+    // (experts in ascending order, tokens in order within an expert) instead of being at [id, token]
+    // b is either one row per token, or itself the grouped result of a previous *_sorted op
+    // only supported by the CPU backend
+    GGML_API struct ggml_tensor * ggml_mul_mat_id_sorted(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * as,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * ids);
+
+    GGML_API struct ggml_tensor * ggml_moe_up_gate_sorted(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * as_up,
+            struct ggml_tensor  * as_gate,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * ids,
+            enum ggml_unary_op    op);
+
+    // MoE down projection + weighted sum over the selected experts
+    // as: [n_ff, n, n_expert], b: [n_ff, n_expert_used, n_tokens], weights: [1, n_expert_used, n_tokens]
+    // result: [n, n_tokens], only supported by the CPU backend
+    GGML_API struct ggml_tensor * ggml_moe_down(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * as,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * ids,
+            struct ggml_tensor  * weights);
+
     // A: m columns, n rows,
     // B: p columns, n rows,
     // result is m columns, p rows
@@ -1613,6 +1675,14 @@ extern "C" {
             struct ggml_tensor  * b,
             struct ggml_tensor  * c);
 
+    // a[:, i1, c[i2]] = b[:, i1, i2], converting the rows of b (F32) to the type of a
+    // returns a view of a - used to scatter the K/V of a batch into the cells of a paged KV cache
+    GGML_API struct ggml_tensor * ggml_set_rows(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c);
+
     GGML_API struct ggml_tensor * ggml_diag(
         struct ggml_context     * ctx,
         struct ggml_tensor      * a);
@@ -1975,6 +2045,58 @@ extern "C" {
             int                   min_entries,
             float                 thresh);
 
+    enum ggml_moe_gating {
+        GGML_MOE_GATING_SOFTMAX,
+        GGML_MOE_GATING_SIGMOID,
+    };
+
+    // MoE router: expert probabilities from the router logits, selection with an optional bias and optionally
+    // limited to the n_group_used best of n_group expert groups, top k (with min_entries/thresh as in
+    // ggml_top_k_thresh), and the weights of the selected experts, optionally normalized, times w_scale.
+    // Group scores are the sum of the two best experts with a bias (DeepSeek V3), else the best expert.
+    // logits: [n_expert, n_tokens], bias: NULL or [n_expert]
+    // result: I32 [k, 2, n_tokens], get at the parts with ggml_moe_route_ids and ggml_moe_route_weights
+    GGML_API struct ggml_tensor * ggml_moe_route(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * logits,
+            struct ggml_tensor  * bias,
+            int                   k,
+            enum ggml_moe_gating  gating,
+            bool                  norm_w,
+            float                 w_scale,
+            int                   n_group,
+            int                   n_group_used,
+            int                   min_entries,
+            float                 thresh);
+
+    // I32 [k, n_tokens], best expert first, -1 for experts dropped by thresh
+    GGML_API struct ggml_tensor * ggml_moe_route_ids(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * route);
+
+    // F32 [1, k, n_tokens]
+    GGML_API struct ggml_tensor * ggml_moe_route_weights(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * route);
+
+    // Asks the OS to start reading the expert slices (index ne[2]) of a, b and c that are selected in ids, so that
+    // the first touch of an mmapped expert does not stall the matrix multiplication on a page fault. The ids are
+    // passed through, use ggml_moe_prefetch_ids as the ids of the multiplications to order them after the request.
+    // ids out of range (e.g. -1) are ignored. a, b and c must be in host memory, b and c can be NULL.
+    // result: I32 [n_used*n_tokens + 2], the ids followed by the number of selected expert slices that were
+    // already resident and the number that had to be requested
+    GGML_API struct ggml_tensor * ggml_moe_prefetch(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * ids,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c);
+
+    // I32 [n_used, n_tokens]
+    GGML_API struct ggml_tensor * ggml_moe_prefetch_ids(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * prefetch);
+
 #define GGML_KQ_MASK_PAD 64
 
     // q:    [n_embd, n_batch,     n_head,    1]
@@ -1996,6 +2118,12 @@ extern "C" {
             struct ggml_tensor * a,
             enum ggml_prec       prec);
 
+    // let the CPU kernels skip the blocks of KV cells that the mask hides from all rows
+    // worth it when large parts of the mask are -inf, e.g. with a paged KV cache shared by several sequences
+    GGML_API void ggml_flash_attn_ext_set_skip_masked(
+            struct ggml_tensor * a,
+            bool                 skip_masked);
+
     // TODO: needs to be adapted to ggml_flash_attn_ext
     GGML_API struct ggml_tensor * ggml_flash_attn_back(
            struct ggml_context * ctx,
@@ -2246,10 +2374,22 @@ extern "C" {
     // when plan.work_size > 0, caller must allocate memory for plan.work_data
     GGML_API struct ggml_cplan ggml_graph_plan   (const struct ggml_cgraph * cgraph, int n_threads /*= GGML_DEFAULT_N_THREADS*/);
     GGML_API enum ggml_status  ggml_graph_compute(      struct ggml_cgraph * cgraph, struct ggml_cplan * cplan);
+
     // same as ggml_graph_compute() but the work data is allocated as a part of the context
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API enum ggml_status  ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
 
+    // n_threads includes the thread calling ggml_graph_compute(), so n_threads - 1 workers are started
+    GGML_API ggml_threadpool_t ggml_threadpool_new          (int n_threads);
+    GGML_API void              ggml_threadpool_free         (ggml_threadpool_t threadpool);
+    GGML_API int               ggml_threadpool_get_n_threads(ggml_threadpool_t threadpool);
+
+    // total time compute threads spent idle in ggml_barrier, summed over all threads
+    // only collected when the GGML_BARRIER_STATS environment variable is set to a non-zero value
+    GGML_API bool ggml_barrier_stats_enabled(void);
+    GGML_API void ggml_barrier_stats_get    (int64_t * wait_us, int64_t * n_waits);
+    GGML_API void ggml_barrier_stats_reset  (void);
+
     GGML_API struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name);
 
     GGML_API void                 ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname);
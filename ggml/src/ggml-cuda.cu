@@ -3462,6 +3462,10 @@ GGML_CALL static bool ggml_backend_cuda_supports_op(ggml_backend_t backend, cons
                     printf("%s: returning false for GGML_OP_MOE_FUSED_UP_GATE because src0->type != src1->type\n", __func__);
                     return false;
                 }
+                if ((op->op == GGML_OP_MUL_MAT_ID && op->op_params[0] != 0) || (op->op == GGML_OP_MOE_FUSED_UP_GATE && op->op_params[1] != 0)) {
+                    // results grouped by expert (ggml_mul_mat_id_sorted, ggml_moe_up_gate_sorted) are CPU only
+                    return false;
+                }
                 //==================================================================
                 //if (ggml_is_quantized(a->type) && ggml_is_quantized(b->type)) {
                 //    return false;
@@ -3622,13 +3626,14 @@ GGML_CALL static bool ggml_backend_cuda_supports_op(ggml_backend_t backend, cons
         case GGML_OP_RMS_NORM_BACK:
             return ggml_is_contiguous(op->src[0]) && op->ne[0] % WARP_SIZE == 0;
             break;
+        case GGML_OP_MULTI_ADD:
+            return op->src[1] == nullptr;
         case GGML_OP_NONE:
         case GGML_OP_RESHAPE:
         case GGML_OP_VIEW:
         case GGML_OP_PERMUTE:
         case GGML_OP_TRANSPOSE:
         case GGML_OP_ADD:
-        case GGML_OP_MULTI_ADD:
         case GGML_OP_MUL:
         case GGML_OP_DIV:
         case GGML_OP_FUSED_RMS_NORM:
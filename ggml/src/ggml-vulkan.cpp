@@ -10372,7 +10372,7 @@ static bool ggml_backend_vk_supports_op(ggml_backend_t backend, const ggml_tenso
             }
             break;
         case GGML_OP_MULTI_ADD:
-            return op->src[0]->type == GGML_TYPE_F32 && op->type == GGML_TYPE_F32 && op->ne[2] == 1 && op->ne[3] == 1;
+            return op->src[0]->type == GGML_TYPE_F32 && op->type == GGML_TYPE_F32 && op->ne[2] == 1 && op->ne[3] == 1 && op->src[1] == nullptr;
         //case GGML_OP_GLU:
         //    switch (ggml_get_glu_op(op)) {
         //        case GGML_GLU_OP_GEGLU:
@@ -10395,6 +10395,10 @@ static bool ggml_backend_vk_supports_op(ggml_backend_t backend, const ggml_tenso
                 const ggml_backend_vk_context * ctx = (const ggml_backend_vk_context *)backend->context;
                 const vk_device& device = ctx->device;
                 if (op->op == GGML_OP_MUL_MAT_ID) {
+                    if (op->op_params[0] != 0) {
+                        // results grouped by expert (ggml_mul_mat_id_sorted) are CPU only
+                        return false;
+                    }
                     if (!device->mul_mat_id_s[src0_type] && !device->mul_mat_id_m[src0_type] && !device->mul_mat_id_l[src0_type]) {
                         // If there's not enough shared memory for row_ids and the result tile, fallback to CPU
                         return false;
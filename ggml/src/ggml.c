@@ -38,6 +38,7 @@
 #include <signal.h>
 #if defined(__gnu_linux__)
 #include <syscall.h>
+#include <linux/futex.h>
 #endif
 
 #define IK_PRINT_TIMING 0
@@ -141,6 +142,7 @@ typedef void * thread_ret_t;
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #endif
@@ -2761,12 +2763,21 @@ struct ggml_context_container {
     struct ggml_context context;
 };
 
+struct ggml_graph_sched;
+
 struct ggml_compute_state_shared {
     const struct ggml_cgraph * cgraph;
     const struct ggml_cplan * cplan;
 
+    // dependency-aware schedule of the graph nodes, NULL when computing in lockstep
+    struct ggml_graph_sched * sched;
+
     int n_threads;
 
+    // true if this is the state of a group of threads that computes a node concurrently with other nodes
+    // (the group cannot use the OpenMP barrier, which synchronizes the entire team)
+    bool subgroup;
+
     // synchronization primitives
     atomic_int n_barrier;
     atomic_int n_barrier_passed;
@@ -2783,6 +2794,7 @@ struct ggml_compute_state {
     ggml_thread_t thrd;
     int ith;
     struct ggml_compute_state_shared * shared;
+    struct ggml_threadpool * threadpool; // set for persistent workers only
 };
 
 struct ggml_compute_params {
@@ -4019,6 +4031,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "MUL_MAT_ID",
     "OUT_PROD",
     "MOE_FUSED_UP_GATE",
+    "MOE_FUSED_DOWN",
 
     "SCALE",
     "SET",
@@ -4030,6 +4043,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "TRANSPOSE",
     "GET_ROWS",
     "GET_ROWS_BACK",
+    "SET_ROWS",
     "DIAG",
     "DIAG_MASK_INF",
     "DIAG_MASK_ZERO",
@@ -4049,6 +4063,8 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "TIMESTEP_EMBEDDING",
     "ARGSORT",
     "ARGSORT_THRESH",
+    "MOE_ROUTE",
+    "MOE_PREFETCH",
     "LEAKY_RELU",
     "SOFTCAP",
     "SOFT_CAP_MAX",
@@ -4079,7 +4095,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 81, "GGML_OP_COUNT != 81");
+static_assert(GGML_OP_COUNT == 85, "GGML_OP_COUNT != 85");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -4114,6 +4130,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "X[i]*Y",
     "X*Y",
     "X*Y1&X*Y2",
+    "sum(X[i]*Y*w)",
 
     "x*v",
     "y-\\>view(x)",
@@ -4125,6 +4142,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "transpose(x)",
     "get_rows(x)",
     "get_rows_back(x)",
+    "set_rows(x)",
     "diag(x)",
     "diag_mask_inf(x)",
     "diag_mask_zero(x)",
@@ -4144,6 +4162,8 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "timestep_embedding(timesteps, dim, max_period)",
     "argsort(x)",
     "argsort_thresh(x)",
+    "moe_route(x)",
+    "moe_prefetch(x)",
     "leaky_relu(x)",
     "k2*tanh(k1*x)",
     "soft_max(k2*tanh(k1*x))",
@@ -4174,7 +4194,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 81, "GGML_OP_COUNT != 81");
+static_assert(GGML_OP_COUNT == 85, "GGML_OP_COUNT != 85");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -4248,20 +4268,49 @@ inline static void ggml_critical_section_start(void) {
     }
 }
 
-#ifdef GGML_USE_OPENMP
-static void ggml_barrier(struct ggml_compute_state_shared * shared) {
-    if (shared->n_threads == 1) {
-        return;
-    }
+//
+// barrier wait statistics
+//
+// Enabled with GGML_BARRIER_STATS=1. Each thread accumulates the time it spends waiting at
+// ggml_barrier in a thread-local counter, which is added to the global totals once per graph.
+//
 
-    #pragma omp barrier
-}
+#if defined(_MSC_VER)
+#define GGML_THREAD_LOCAL __declspec(thread)
 #else
-static void ggml_barrier(struct ggml_compute_state_shared * shared) {
-    if (shared->n_threads == 1) {
-        return;
+#define GGML_THREAD_LOCAL _Thread_local
+#endif
+
+static bool    g_barrier_stats   = false;
+static int64_t g_barrier_wait_us = 0;
+static int64_t g_barrier_n_waits = 0;
+
+static GGML_THREAD_LOCAL int64_t g_barrier_wait_us_local = 0;
+static GGML_THREAD_LOCAL int64_t g_barrier_n_waits_local = 0;
+
+static inline void ggml_barrier_stats_add(int64_t t_start) {
+    g_barrier_wait_us_local += ggml_time_us() - t_start;
+    g_barrier_n_waits_local += 1;
+}
+
+static void ggml_barrier_spin_wait(atomic_int * n_barrier_passed, int passed_old) {
+    const int n_spin_before_sleep = 100000;
+    while (true) {
+        for (int i = 0; i < n_spin_before_sleep; i++) {
+            if (atomic_load(n_barrier_passed) != passed_old) {
+                return;
+            }
+        #if defined(__SSE3__)
+            _mm_pause();
+        #elif defined __ARM_NEON
+            __asm__ __volatile__("isb\n");
+        #endif
+        }
+        sched_yield();
     }
+}
 
+static void ggml_barrier_spin(struct ggml_compute_state_shared * shared) {
     atomic_int * n_barrier = &shared->n_barrier;
     atomic_int * n_barrier_passed = &shared->n_barrier_passed;
 
@@ -4274,22 +4323,44 @@ static void ggml_barrier(struct ggml_compute_state_shared * shared) {
         atomic_fetch_add(n_barrier_passed, 1);
     } else {
         // wait for other threads
-        const int n_spin_before_sleep = 100000;
-        while (true) {
-            for (int i = 0; i < n_spin_before_sleep; i++) {
-                if (atomic_load(n_barrier_passed) != passed_old) {
-                    return;
-                }
-            #if defined(__SSE3__)
-                _mm_pause();
-            #elif defined __ARM_NEON
-                __asm__ __volatile__("isb\n");
-            #endif
-            }
-            sched_yield();
+        if (g_barrier_stats) {
+            const int64_t t_start = ggml_time_us();
+            ggml_barrier_spin_wait(n_barrier_passed, passed_old);
+            ggml_barrier_stats_add(t_start);
+        } else {
+            ggml_barrier_spin_wait(n_barrier_passed, passed_old);
         }
     }
 }
+
+#ifdef GGML_USE_OPENMP
+static void ggml_barrier(struct ggml_compute_state_shared * shared) {
+    if (shared->n_threads == 1) {
+        return;
+    }
+
+    if (shared->subgroup) {
+        ggml_barrier_spin(shared);
+        return;
+    }
+
+    if (g_barrier_stats) {
+        const int64_t t_start = ggml_time_us();
+        #pragma omp barrier
+        ggml_barrier_stats_add(t_start);
+        return;
+    }
+
+    #pragma omp barrier
+}
+#else
+static void ggml_barrier(struct ggml_compute_state_shared * shared) {
+    if (shared->n_threads == 1) {
+        return;
+    }
+
+    ggml_barrier_spin(shared);
+}
 #endif
 
 // TODO: make this somehow automatically executed
@@ -4298,6 +4369,38 @@ inline static void ggml_critical_section_end(void) {
     atomic_flag_clear(&g_state_critical);
 }
 
+static void ggml_barrier_stats_flush(void) {
+    if (!g_barrier_stats || g_barrier_n_waits_local == 0) {
+        return;
+    }
+
+    ggml_critical_section_start();
+    g_barrier_wait_us += g_barrier_wait_us_local;
+    g_barrier_n_waits += g_barrier_n_waits_local;
+    ggml_critical_section_end();
+
+    g_barrier_wait_us_local = 0;
+    g_barrier_n_waits_local = 0;
+}
+
+bool ggml_barrier_stats_enabled(void) {
+    return g_barrier_stats;
+}
+
+void ggml_barrier_stats_get(int64_t * wait_us, int64_t * n_waits) {
+    ggml_critical_section_start();
+    if (wait_us) *wait_us = g_barrier_wait_us;
+    if (n_waits) *n_waits = g_barrier_n_waits;
+    ggml_critical_section_end();
+}
+
+void ggml_barrier_stats_reset(void) {
+    ggml_critical_section_start();
+    g_barrier_wait_us = 0;
+    g_barrier_n_waits = 0;
+    ggml_critical_section_end();
+}
+
 #if defined(__gnu_linux__)
 static cpu_set_t ggml_get_numa_affinity(void) {
     cpu_set_t cpuset;
@@ -4405,6 +4508,75 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+//
+// NUMA sharded weights
+//
+// With GGML_NUMA_STRATEGY_SHARD the rows of each matrix are split into n_nodes consecutive ranges, and
+// range k is placed on node k. Thread ith is pinned to node ith % n_nodes (as for DISTRIBUTE), and in
+// matrix multiplications the threads of node k only compute the rows of range k, so the weights are
+// always read from local memory. For 3D tensors (MoE experts) the split applies to each matrix.
+//
+
+#define GGML_NUMA_SHARD_ROW_ALIGN 32  // row ranges are multiples of this (except the last one)
+
+bool ggml_numa_shard_enabled(void) {
+    return ggml_is_numa() && g_state.numa.numa_strategy == GGML_NUMA_STRATEGY_SHARD;
+}
+
+static void ggml_numa_shard_rows(int64_t nrows, int node, int n_nodes, int64_t * ir0, int64_t * ir1) {
+    const int64_t nblocks = nrows/GGML_NUMA_SHARD_ROW_ALIGN;
+    *ir0 = GGML_NUMA_SHARD_ROW_ALIGN*((nblocks*node)/n_nodes);
+    *ir1 = node == n_nodes - 1 ? nrows : GGML_NUMA_SHARD_ROW_ALIGN*((nblocks*(node + 1))/n_nodes);
+}
+
+#if defined(__gnu_linux__)
+#define GGML_MPOL_PREFERRED 1
+
+static void ggml_numa_bind_range(void * data, size_t size, int node) {
+    const uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+    // only whole pages can be bound, the pages shared with the neighbouring ranges go where they are first touched
+    const uintptr_t first = ((uintptr_t) data + page_size - 1) & ~(page_size - 1);
+    const uintptr_t last  = ((uintptr_t) data + size) & ~(page_size - 1);
+    if (first >= last) {
+        return;
+    }
+    unsigned long nodemask[(GGML_NUMA_MAX_NODES + 8*sizeof(unsigned long) - 1)/(8*sizeof(unsigned long))] = { 0 };
+    nodemask[node/(8*sizeof(unsigned long))] |= 1ul << (node % (8*sizeof(unsigned long)));
+    if (syscall(SYS_mbind, (void *) first, last - first, GGML_MPOL_PREFERRED, nodemask, 8*sizeof(nodemask), 0) != 0) {
+        GGML_PRINT_DEBUG("%s: mbind failed: %s\n", __func__, strerror(errno));
+    }
+}
+#endif
+
+bool ggml_numa_shard_tensor(struct ggml_tensor * tensor) {
+#if defined(__gnu_linux__)
+    const int n_nodes = g_state.numa.n_nodes;
+    if (!ggml_numa_shard_enabled() || tensor->data == NULL || tensor->view_src != NULL) {
+        return false;
+    }
+    if (ggml_n_dims(tensor) < 2 || tensor->ne[3] != 1 || !ggml_is_contiguous(tensor) ||
+        tensor->ne[1] < GGML_NUMA_SHARD_ROW_ALIGN*n_nodes) {
+        return false;
+    }
+
+    for (int64_t i2 = 0; i2 < tensor->ne[2]; ++i2) {
+        char * data = (char *) tensor->data + i2*tensor->nb[2];
+        for (int node = 0; node < n_nodes; ++node) {
+            int64_t ir0, ir1;
+            ggml_numa_shard_rows(tensor->ne[1], node, n_nodes, &ir0, &ir1);
+            ggml_numa_bind_range(data + ir0*tensor->nb[1], (ir1 - ir0)*tensor->nb[1], node);
+        }
+    }
+
+    tensor->flags |= GGML_TENSOR_FLAG_NUMA_SHARD;
+
+    return true;
+#else
+    UNUSED(tensor);
+    return false;
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -4809,6 +4981,11 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
         // initialize time system (required on Windows)
         ggml_time_init();
 
+        {
+            const char * env = getenv("GGML_BARRIER_STATS");
+            g_barrier_stats = env != NULL && atoi(env) != 0;
+        }
+
         // initialize GELU, Quick GELU, SILU and EXP F32 tables
         {
             const uint64_t t_start = ggml_time_us(); UNUSED(t_start);
@@ -5861,6 +6038,37 @@ struct ggml_tensor * ggml_multi_add(
     return result;
 }
 
+struct ggml_tensor * ggml_multi_add_weighted(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * weights,
+        struct ggml_tensor  * ids,
+        int n_expert) {
+
+    GGML_ASSERT(a->type == GGML_TYPE_F32 && weights->type == GGML_TYPE_F32);
+    GGML_ASSERT(a->ne[3] == 1 && a->nb[0] == sizeof(float));
+    GGML_ASSERT(weights->ne[0] == 1 && weights->ne[1] == a->ne[1] && weights->ne[2] == a->ne[2]);
+    if (ids) {
+        GGML_ASSERT(ids->type == GGML_TYPE_I32);
+        GGML_ASSERT(ids->ne[0] == a->ne[1] && ids->ne[1] == a->ne[2]);
+        GGML_ASSERT(ggml_is_contiguous(a) && n_expert > 0);
+    }
+
+    bool is_node = false;
+
+    struct ggml_tensor * result = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, a->ne[0], a->ne[2]);
+
+    result->op   = GGML_OP_MULTI_ADD;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = a;
+    result->src[1] = weights;
+    result->src[2] = ids;
+    result->op_params[0] = a->ne[1];
+    result->op_params[1] = n_expert;
+
+    return result;
+}
+
 // ggml_add_cast
 
 static struct ggml_tensor * ggml_add_cast_impl(
@@ -6965,16 +7173,32 @@ struct ggml_tensor * ggml_mul_mat_id(
     return result;
 }
 
-struct ggml_tensor * ggml_moe_up_gate(
+struct ggml_tensor * ggml_mul_mat_id_sorted(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * as,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * ids) {
+    // with a single expert per token, b rows per token and b rows in expert order could not be told apart
+    GGML_ASSERT(ids->ne[0] > 1);
+    GGML_ASSERT(b->ne[1] == 1 || (b->ne[1] == ids->ne[0] && ggml_is_contiguous(b)));
+
+    struct ggml_tensor * result = ggml_mul_mat_id(ctx, as, b, ids);
+    ggml_set_op_params_i32(result, 0, 1);
+
+    return result;
+}
+
+static struct ggml_tensor * ggml_moe_up_gate_impl(
             struct ggml_context * ctx,
             struct ggml_tensor  * as_up,
             struct ggml_tensor  * as_gate,
             struct ggml_tensor  * b,
             struct ggml_tensor  * ids,
-            enum   ggml_unary_op  op) {
+            enum   ggml_unary_op  op,
+            bool                  sorted) {
     if (as_up->type != as_gate->type || !ggml_are_same_shape(as_up, as_gate)) {
-        struct ggml_tensor * result_up   = ggml_mul_mat_id(ctx, as_up,   b, ids);
-        struct ggml_tensor * result_gate = ggml_mul_mat_id(ctx, as_gate, b, ids);
+        struct ggml_tensor * result_up   = sorted ? ggml_mul_mat_id_sorted(ctx, as_up,   b, ids) : ggml_mul_mat_id(ctx, as_up,   b, ids);
+        struct ggml_tensor * result_gate = sorted ? ggml_mul_mat_id_sorted(ctx, as_gate, b, ids) : ggml_mul_mat_id(ctx, as_gate, b, ids);
         return ggml_fused_mul_unary(ctx, result_gate, result_up, op);
     }
     GGML_ASSERT(!ggml_is_transposed(as_up));
@@ -7005,6 +7229,64 @@ struct ggml_tensor * ggml_moe_up_gate(
     result->src[3] = ids;
 
     ggml_set_op_params_i32(result, 0, (int32_t) op);
+    ggml_set_op_params_i32(result, 1, sorted ? 1 : 0);
+
+    return result;
+}
+
+struct ggml_tensor * ggml_moe_up_gate(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * as_up,
+            struct ggml_tensor  * as_gate,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * ids,
+            enum   ggml_unary_op  op) {
+    return ggml_moe_up_gate_impl(ctx, as_up, as_gate, b, ids, op, false);
+}
+
+struct ggml_tensor * ggml_moe_up_gate_sorted(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * as_up,
+            struct ggml_tensor  * as_gate,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * ids,
+            enum   ggml_unary_op  op) {
+    GGML_ASSERT(ids->ne[0] > 1 && b->ne[1] == 1);
+    return ggml_moe_up_gate_impl(ctx, as_up, as_gate, b, ids, op, true);
+}
+
+struct ggml_tensor * ggml_moe_down(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * as,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * ids,
+            struct ggml_tensor  * weights) {
+    GGML_ASSERT(!ggml_is_transposed(as));
+    GGML_ASSERT(ids->type == GGML_TYPE_I32);
+    GGML_ASSERT(weights->type == GGML_TYPE_F32);
+
+    GGML_ASSERT(as->ne[3] == 1); // as is 3d (one matrix per expert)
+    GGML_ASSERT(b->ne[3] == 1 && ggml_is_contiguous(b));
+    GGML_ASSERT(ids->ne[2] == 1 && ids->ne[3] == 1); // ids is 2d
+    GGML_ASSERT(ids->ne[1] == b->ne[2]); // must have an expert list per b row
+    GGML_ASSERT(ids->ne[0] == b->ne[1]); // one b row per selected expert
+    GGML_ASSERT(as->ne[0] == b->ne[0]); // can_mul_mat
+    GGML_ASSERT(weights->ne[0] == 1 && weights->ne[1] == ids->ne[0] && weights->ne[2] == ids->ne[1]);
+
+    bool is_node = false;
+
+    if (as->grad || b->grad) {
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, as->ne[1], b->ne[2]);
+
+    result->op   = GGML_OP_MOE_FUSED_DOWN;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = as;
+    result->src[1] = b;
+    result->src[2] = ids;
+    result->src[3] = weights;
 
     return result;
 }
@@ -7793,6 +8075,34 @@ struct ggml_tensor * ggml_get_rows_back(
     return result;
 }
 
+// ggml_set_rows
+
+struct ggml_tensor * ggml_set_rows(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c) {
+    GGML_ASSERT(a->ne[0] == b->ne[0] && a->ne[1] == b->ne[1]);
+    GGML_ASSERT(a->ne[3] == 1 && b->ne[3] == 1);
+    GGML_ASSERT(b->type == GGML_TYPE_F32 && b->nb[0] == sizeof(float));
+    GGML_ASSERT(ggml_is_vector(c) && c->type == GGML_TYPE_I32 && c->ne[0] == b->ne[2]);
+    GGML_ASSERT(a->nb[0] == ggml_type_size(a->type));
+
+    if (a->grad || b->grad) {
+        GGML_ABORT("fatal error"); // TODO: implement backward
+    }
+
+    struct ggml_tensor * result = ggml_view_tensor(ctx, a);
+
+    result->op     = GGML_OP_SET_ROWS;
+    result->grad   = NULL;
+    result->src[0] = a;
+    result->src[1] = b;
+    result->src[2] = c;
+
+    return result;
+}
+
 // ggml_diag
 
 struct ggml_tensor * ggml_diag(
@@ -8755,6 +9065,114 @@ struct ggml_tensor * ggml_top_k_thresh(
     return result;
 }
 
+// ggml_moe_route
+
+struct ggml_tensor * ggml_moe_route(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * logits,
+        struct ggml_tensor  * bias,
+        int                   k,
+        enum ggml_moe_gating  gating,
+        bool                  norm_w,
+        float                 w_scale,
+        int                   n_group,
+        int                   n_group_used,
+        int                   min_entries,
+        float                 thresh) {
+    GGML_ASSERT(logits->type == GGML_TYPE_F32 && ggml_is_contiguous_rows(logits));
+    GGML_ASSERT(logits->ne[2] == 1 && logits->ne[3] == 1);
+    GGML_ASSERT(k > 0 && logits->ne[0] >= k);
+    if (bias) {
+        GGML_ASSERT(bias->type == GGML_TYPE_F32 && ggml_is_contiguous(bias) && bias->ne[0] == logits->ne[0]);
+    }
+    if (n_group > 1) {
+        GGML_ASSERT(logits->ne[0] % n_group == 0);
+        GGML_ASSERT(n_group_used > 0 && n_group_used*(logits->ne[0]/n_group) >= k);
+    }
+
+    bool is_node = false;
+
+    struct ggml_tensor * result = ggml_new_tensor_3d(ctx, GGML_TYPE_I32, k, 2, logits->ne[1]);
+
+    ggml_set_op_params_i32(result, 0, (int32_t) gating);
+    ggml_set_op_params_i32(result, 1, norm_w ? 1 : 0);
+    ggml_set_op_params_f32(result, 2, w_scale);
+    ggml_set_op_params_i32(result, 3, n_group > 1 ? n_group : 1);
+    ggml_set_op_params_i32(result, 4, n_group_used);
+    ggml_set_op_params_i32(result, 5, min_entries > 0 && thresh > 0 ? min_entries : 0);
+    ggml_set_op_params_f32(result, 6, thresh);
+
+    result->op   = GGML_OP_MOE_ROUTE;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = logits;
+    result->src[1] = bias;
+
+    return result;
+}
+
+struct ggml_tensor * ggml_moe_route_ids(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * route) {
+    GGML_ASSERT(route->op == GGML_OP_MOE_ROUTE);
+    return ggml_view_2d(ctx, route, route->ne[0], route->ne[2], route->nb[2], 0);
+}
+
+struct ggml_tensor * ggml_moe_route_weights(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * route) {
+    GGML_ASSERT(route->op == GGML_OP_MOE_ROUTE);
+
+    // same as ggml_view_3d, except that the view is F32
+    const int64_t ne[3] = { 1, route->ne[0], route->ne[2] };
+    const size_t offset = route->nb[1];
+
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, GGML_TYPE_F32, 3, ne, route, offset);
+    ggml_format_name(result, "%s (weights)", route->name);
+
+    ggml_set_op_params(result, &offset, sizeof(offset));
+
+    result->op     = GGML_OP_VIEW;
+    result->src[0] = route;
+    result->nb[1]  = sizeof(float);
+    result->nb[2]  = route->nb[2];
+    result->nb[3]  = result->nb[2]*ne[2];
+
+    return result;
+}
+
+// ggml_moe_prefetch
+
+struct ggml_tensor * ggml_moe_prefetch(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * ids,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c) {
+    GGML_ASSERT(ids->type == GGML_TYPE_I32 && ids->ne[2] == 1 && ids->ne[3] == 1);
+    GGML_ASSERT(a != NULL);
+
+    bool is_node = false;
+
+    struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, ids->ne[0]*ids->ne[1] + 2);
+
+    result->op   = GGML_OP_MOE_PREFETCH;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = ids;
+    result->src[1] = a;
+    result->src[2] = b;
+    result->src[3] = c;
+
+    return result;
+}
+
+struct ggml_tensor * ggml_moe_prefetch_ids(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * prefetch) {
+    GGML_ASSERT(prefetch->op == GGML_OP_MOE_PREFETCH);
+    const struct ggml_tensor * ids = prefetch->src[0];
+    return ggml_view_2d(ctx, prefetch, ids->ne[0], ids->ne[1], ids->ne[0]*sizeof(int32_t), 0);
+}
+
 // ggml_flash_attn_ext
 
 struct ggml_tensor * ggml_flash_attn_ext(
@@ -8819,6 +9237,14 @@ void ggml_flash_attn_ext_set_prec(
     ggml_set_op_params_i32(a, 3, prec_i32); // scale is on first pos, max_bias on second
 }
 
+void ggml_flash_attn_ext_set_skip_masked(
+        struct ggml_tensor * a,
+        bool                 skip_masked) {
+    GGML_ASSERT(a->op == GGML_OP_FLASH_ATTN_EXT);
+
+    ggml_set_op_params_i32(a, 4, skip_masked ? 1 : 0); // after scale, max_bias, softcap and prec
+}
+
 // ggml_flash_attn_back
 
 struct ggml_tensor * ggml_flash_attn_back(
@@ -9645,8 +10071,8 @@ static void ggml_compute_forward_dup_same_cont(
     GGML_ASSERT(ggml_is_contiguous(dst) && ggml_is_contiguous(src0));
     GGML_ASSERT(src0->type == dst->type);
 
-    const size_t nb00 = src0->nb[0];
-    const size_t nb0 = dst->nb[0];
+    // nb[0] can be anything when ne[0] == 1 (e.g. a transposed vector), the elements are consecutive
+    const size_t type_size = ggml_type_size(src0->type);
 
     const int ith = params->ith; // thread index
     const int nth = params->nth; // number of threads
@@ -9659,9 +10085,9 @@ static void ggml_compute_forward_dup_same_cont(
 
     if (ie0 < ie1) {
         memcpy(
-            ((char *)  dst->data + ie0*nb0),
-            ((char *) src0->data + ie0*nb00),
-            (ie1 - ie0) * ggml_type_size(src0->type));
+            ((char *)  dst->data + ie0*type_size),
+            ((char *) src0->data + ie0*type_size),
+            (ie1 - ie0) * type_size);
     }
 }
 
@@ -11468,15 +11894,96 @@ static void ggml_compute_forward_multi_add_f32(
     }
 }
 
-static void ggml_compute_forward_multi_add(
+static void ggml_compute_forward_multi_add_weighted_f32(
         const struct ggml_compute_params * params,
         struct ggml_tensor * dst) {
 
-    switch (dst->type) {
-        case GGML_TYPE_F32: {
-            ggml_compute_forward_multi_add_f32(params, dst);
-        } break;
-        default: {
+    const struct ggml_tensor * src = dst->src[0];
+    const struct ggml_tensor * w   = dst->src[1];
+    const struct ggml_tensor * ids = dst->src[2];
+
+    GGML_ASSERT(dst->nb[0] == sizeof(float));
+    GGML_ASSERT(src->nb[0] == sizeof(float));
+    GGML_ASSERT(dst->ne[0] == src->ne[0] && dst->ne[1] == src->ne[2]);
+
+    const int n_add = dst->op_params[0];
+    GGML_ASSERT(n_add == src->ne[1]);
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nr  = dst->ne[1];
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    if (ir0 >= ir1) {
+        return;
+    }
+
+    const int64_t ne0 = dst->ne[0];
+
+    // With ids the expert results are grouped by expert as produced by ggml_mul_mat_id_sorted: the result of
+    // token i1 for expert e is at offset(e) + (number of tokens before i1 that selected e).
+    int64_t * offset = NULL;
+    int64_t * before = NULL;
+    const int n_expert = dst->op_params[1];
+    if (ids) {
+        offset = (int64_t *)params->wdata + ith*(2*n_expert + CACHE_LINE_SIZE_F32);
+        before = offset + n_expert;
+        memset(offset, 0, 2*n_expert*sizeof(int64_t));
+        for (int64_t i1 = 0; i1 < nr; ++i1) {
+            for (int j = 0; j < n_add; ++j) {
+                const int32_t e = *(const int32_t *)((const char *)ids->data + i1*ids->nb[1] + j*ids->nb[0]);
+                if (e < 0 || e >= n_expert) continue;
+                ++offset[e];
+                if (i1 < ir0) ++before[e];
+            }
+        }
+        int64_t sum = 0;
+        for (int e = 0; e < n_expert; ++e) {
+            const int64_t n = offset[e];
+            offset[e] = sum + before[e];
+            sum += n;
+        }
+    }
+
+    for (int i1 = ir0; i1 < ir1; ++i1) {
+
+        float * dst_ptr = (float *) ((char *) dst->data + i1*dst->nb[1]);
+        memset(dst_ptr, 0, ne0*sizeof(float));
+        for (int j = 0; j < n_add; ++j) {
+            const float wj = *(const float *)((const char *)w->data + j*w->nb[1] + i1*w->nb[2]);
+            const char * data;
+            if (ids) {
+                const int32_t e = *(const int32_t *)((const char *)ids->data + i1*ids->nb[1] + j*ids->nb[0]);
+                if (e < 0 || e >= n_expert) continue;
+                data = (const char *)src->data + (offset[e]++)*src->nb[1];
+            } else {
+                data = (const char *)src->data + j*src->nb[1] + i1*src->nb[2];
+            }
+            ggml_vec_mad_f32(ne0, dst_ptr, (const float *)data, wj);
+        }
+    }
+}
+
+static void ggml_compute_forward_multi_add(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    switch (dst->type) {
+        case GGML_TYPE_F32: {
+            if (dst->src[1]) {
+                ggml_compute_forward_multi_add_weighted_f32(params, dst);
+            } else {
+                ggml_compute_forward_multi_add_f32(params, dst);
+            }
+        } break;
+        default: {
             GGML_ABORT("fatal error");
         }
     }
@@ -14581,6 +15088,23 @@ static inline uint32_t simple_gcd(uint32_t a, uint32_t b) {
     return a;
 }
 
+#if GGML_USE_IQK_MULMAT
+// src0 rows [*ir0, *ir1) are resident on the NUMA node of thread ith, and the threads of that node split them
+// as thread *jth of *mth. Needs all threads of the graph, so not used when the node runs on a thread subset.
+static bool ggml_numa_shard_split(const struct ggml_compute_params * params, const struct ggml_tensor * src0,
+        int64_t * ir0, int64_t * ir1, int * jth, int * mth) {
+    const int n_nodes = (int) g_state.numa.n_nodes;
+    if (!(src0->flags & GGML_TENSOR_FLAG_NUMA_SHARD) || params->shared->subgroup || params->nth < n_nodes) {
+        return false;
+    }
+    const int node = params->ith % n_nodes;
+    ggml_numa_shard_rows(src0->ne[1], node, n_nodes, ir0, ir1);
+    *jth = params->ith / n_nodes;
+    *mth = (params->nth - node + n_nodes - 1) / n_nodes;
+    return true;
+}
+#endif
+
 static void ggml_compute_forward_mul_mat(
         const struct ggml_compute_params * params,
               struct ggml_tensor * dst) {
@@ -14631,7 +15155,18 @@ static void ggml_compute_forward_mul_mat(
 #endif
 
 #if GGML_USE_IQK_MULMAT
-    if (dst->type == GGML_TYPE_F32) {
+    int64_t shard_ir0 = 0, shard_ir1 = 0;
+    int     shard_jth = 0, shard_mth = 0;
+    const bool numa_shard = dst->type == GGML_TYPE_F32 && ne02 == 1 && ne03 == 1 && ne12 == 1 && ne13 == 1 &&
+        ggml_numa_shard_split(params, src0, &shard_ir0, &shard_ir1, &shard_jth, &shard_mth);
+
+    if (numa_shard) {
+        if (iqk_mul_mat(shard_ir1 - shard_ir0, ne11, ne00,
+                    src0->type, (const char *)src0->data + shard_ir0*nb01, nb01,
+                    src1->type, src1->data, nb11,
+                    (float *)dst->data + shard_ir0, nb1/sizeof(float), shard_jth, shard_mth)) return;
+    }
+    else if (dst->type == GGML_TYPE_F32) {
         if (iqk_mul_mat_4d(ne01, ne11, ne00,
                     ne02, ne03, ne12, ne13, nb02, nb03, nb12, nb13, nb2/sizeof(float), nb3/sizeof(float),
                     src0->type, src0->data, nb01,
@@ -14664,6 +15199,21 @@ static void ggml_compute_forward_mul_mat(
 UseGgmlGemm1:;
 #endif
 
+#if GGML_USE_IQK_MULMAT
+    // work stealing queue, placed after the converted src1 (and the conversion buffer when src1 is not f32)
+    void * ws_queue     = NULL;
+    long   ws_tile_rows = 0;
+    if (src1->type != vec_dot_type && dst->type == GGML_TYPE_F32 && ne02 == 1 && ne03 == 1 && ne12 == 1 && ne13 == 1) {
+        size_t offs = ggml_row_size(vec_dot_type, ne10)*ne11;
+        if (src1->type != GGML_TYPE_F32) offs += nth*ne10*sizeof(float);
+        offs = GGML_PAD(offs, CACHE_LINE_SIZE);
+        ws_tile_rows = iqk_mul_mat_tile_rows(ne01, ne11, 1, nth);
+        if (ws_tile_rows > 0 && params->wsize >= offs + iqk_work_queue_size(nth)) {
+            ws_queue = (char *)params->wdata + offs;
+        }
+    }
+#endif
+
     if (src1->type != vec_dot_type) {
         char * wdata = params->wdata;
 
@@ -14744,6 +15294,11 @@ UseGgmlGemm1:;
         if (ith == 0) {
             // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
             //atomic_store(&params->shared->current_chunk, nth);
+#if GGML_USE_IQK_MULMAT
+            if (ws_queue) {
+                iqk_work_queue_init(ws_queue, (ne01 + ws_tile_rows - 1)/ws_tile_rows, nth);
+            }
+#endif
         }
 
         ggml_barrier(params->shared);
@@ -14754,6 +15309,14 @@ UseGgmlGemm1:;
 #if GGML_USE_IQK_MULMAT
     if (src1->type != vec_dot_type && dst->type == GGML_TYPE_F32) {
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+        if (numa_shard && iqk_mul_mat(shard_ir1 - shard_ir0, ne11, ne00,
+                    src0->type, (const char *)src0->data + shard_ir0*nb01, nb01,
+                    vec_dot_type, wdata, row_size,
+                    (float *)dst->data + shard_ir0, nb1/sizeof(float), shard_jth, shard_mth)) return;
+        if (ws_queue && iqk_mul_mat_ws(ne01, ne11, ne00,
+                    src0->type, src0->data, nb01,
+                    vec_dot_type, wdata, row_size,
+                    (float *)dst->data, nb1/sizeof(float), ws_tile_rows, ws_queue, ith, nth)) return;
         if (iqk_mul_mat_4d(ne01, ne11, ne00,
                     ne02, ne03, ne12, ne13, nb02, nb03, row_size*ne11, row_size*ne11*ne12,
                     nb2/sizeof(float), nb3/sizeof(float),
@@ -14916,6 +15479,11 @@ static void ggml_compute_forward_mul_mat_id(
     const int n_ids = ids->ne[0]; // n_expert_used
     const int n_as  = ne02;       // n_expert
 
+    // ggml_mul_mat_id_sorted: dst rows are grouped by expert. With one src1 row per token the position
+    // goes into i1 and the dst stride over tokens is zero, else src1 is grouped too and both use it.
+    const bool   sorted  = dst->op_params[0] != 0;
+    const size_t nb2_dst = sorted && ne11 == 1 ? 0 : nb2;
+
     char * wdata_src1_end = (src1->type == vec_dot_type) ?
             (char *) params->wdata :
             (char *) params->wdata + GGML_PAD(ggml_row_size(vec_dot_type, src1->ne[0])*ggml_nrows(src1), sizeof(int64_t));
@@ -14928,6 +15496,23 @@ static void ggml_compute_forward_mul_mat_id(
     int64_t * matrix_row_counts = (int64_t *) (wdata_src1_end); // [n_as]
     struct mmid_row_mapping * matrix_rows = (struct mmid_row_mapping *)(matrix_row_counts + n_as); // [n_as][ne11]
 
+#if GGML_USE_IQK_MULMAT
+    // with NUMA sharded experts each node computes its own rows of every expert, no work stealing then
+    int64_t shard_ir0 = 0, shard_ir1 = 0;
+    int     shard_jth = 0, shard_mth = 0;
+    const bool numa_shard = ne13 == 1 && dst->type == GGML_TYPE_F32 &&
+        ggml_numa_shard_split(params, src0, &shard_ir0, &shard_ir1, &shard_jth, &shard_mth);
+
+    // work stealing queue over the row tiles of all experts that have rows, placed after matrix_rows
+    void * ws_queue = NULL;
+    if (!numa_shard && ne13 == 1 && dst->type == GGML_TYPE_F32 && nth > 1) {
+        size_t offs = GGML_PAD((size_t)((char *)(matrix_rows + n_as*ne12) - (char *)params->wdata), CACHE_LINE_SIZE);
+        if (params->wsize >= offs + iqk_work_queue_size(nth)) {
+            ws_queue = (char *)params->wdata + offs;
+        }
+    }
+#endif
+
     if (src1->type != vec_dot_type) {
         char * wdata = params->wdata;
 
@@ -14952,7 +15537,8 @@ static void ggml_compute_forward_mul_mat_id(
 #define MMID_MATRIX_ROW(row_id, i1) matrix_rows[(row_id)*ne12 + (i1)]
 
     GGML_ASSERT(ids->ne[1] == dst->ne[2]);
-    for (int64_t iid1 = ith; iid1 < ids->ne[1]; iid1 += nth) {
+    // (in the grouped layout the rows of dropped experts are simply not there)
+    for (int64_t iid1 = ith; iid1 < ids->ne[1] && !sorted; iid1 += nth) {
         for (int id = 0; id < n_ids; ++id) {
             const int32_t i02 = *(const int32_t *) ((const char *) ids->data + iid1*ids->nb[1] + id*ids->nb[0]);
             if (i02 < 0 || i02 >= n_as) {
@@ -14979,10 +15565,52 @@ static void ggml_compute_forward_mul_mat_id(
                 matrix_row_counts[i02] += 1;
             }
         }
+
+        if (sorted) {
+            int32_t pos = 0;
+            for (int cur_a = 0; cur_a < n_as; ++cur_a) {
+                for (int64_t k = 0; k < matrix_row_counts[cur_a]; ++k, ++pos) {
+                    struct mmid_row_mapping * row = &MMID_MATRIX_ROW(cur_a, k);
+                    *row = ne11 == 1 ? (struct mmid_row_mapping) {pos, row->i2}
+                                     : (struct mmid_row_mapping) {pos % ne11, pos / ne11};
+                }
+            }
+        }
+
+#if GGML_USE_IQK_MULMAT
+        if (ws_queue) {
+            int n_active = 0;
+            for (int i = 0; i < n_as; ++i) n_active += matrix_row_counts[i] > 0;
+            const long tile_rows = n_active > 0 ? iqk_mul_mat_tile_rows(ne01, ne12*n_ids/n_active, n_active, nth) : 0;
+            if (tile_rows > 0) {
+                iqk_work_queue_init(ws_queue, n_active*((ne01 + tile_rows - 1)/tile_rows), nth);
+            }
+        }
+#endif
     }
 
     ggml_barrier(params->shared);
 
+#if GGML_USE_IQK_MULMAT
+    if (ws_queue) {
+        // same row counts as seen by thread 0 above, so we arrive at the same tile size
+        int n_active = 0;
+        for (int i = 0; i < n_as; ++i) n_active += matrix_row_counts[i] > 0;
+        const long tile_rows = n_active > 0 ? iqk_mul_mat_tile_rows(ne01, ne12*n_ids/n_active, n_active, nth) : 0;
+        if (tile_rows > 0) {
+            const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+            const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+            if (iqk_mul_mat_moe_ws(ne01, ne00, ne11, n_as,
+                        src0->type, src0->data, nb01, nb02,
+                        vec_dot_type, wdata, row_size,
+                        (float *)dst->data, nb1, nb2_dst,
+                        matrix_row_counts, matrix_rows, ne12, tile_rows, ws_queue, ith, nth)) {
+                return;
+            }
+        }
+    }
+#endif
+
     // compute each matrix multiplication in sequence
     for (int cur_a = 0; cur_a < n_as; ++cur_a) {
         const int64_t cne1 = matrix_row_counts[cur_a];
@@ -15000,11 +15628,19 @@ static void ggml_compute_forward_mul_mat_id(
         const int64_t nr1 = cne1; // src1 rows
                                   //
 #if GGML_USE_IQK_MULMAT
+        if (numa_shard) {
+            if (!iqk_mul_mat_moe(shard_ir1 - shard_ir0, nr1, ne00, ne11,
+                        src0->type, src0_cur + shard_ir0*nb01, nb01,
+                        vec_dot_type, (const char *)wdata, row_size,
+                        (float *)dst->data + shard_ir0, nb1, nb2_dst,
+                        matrix_rows + cur_a*ne12, shard_jth, shard_mth)) goto IQK_MulMat_Not_Available;
+            continue;
+        }
         if (ne13 == 1 && dst->type == GGML_TYPE_F32) {
            if (!iqk_mul_mat_moe(nr0, nr1, ne00, ne11,
                        src0->type, (const char *)src0_cur, nb01, ///ggml_type_size(src0->type),
                        vec_dot_type, (const char *)wdata, row_size, ///ggml_type_size(vec_dot_type),
-                       (float *)dst->data, nb1, nb2,
+                       (float *)dst->data, nb1, nb2_dst,
                        matrix_rows + cur_a*ne12, ith, nth)) goto IQK_MulMat_Not_Available;
                 continue;
         }
@@ -15033,7 +15669,7 @@ IQK_MulMat_Not_Available:;
                     ? (i11        + i12 * ne11) * row_size
                     : (i11 * nb11 + i12 * nb12));
 
-                gemv(ne00, (float *)((char *) dst->data + (i1 * nb1 + i2 * nb2)) + src0_cur_start, ne01,
+                gemv(ne00, (float *)((char *) dst->data + (i1 * nb1 + i2 * nb2_dst)) + src0_cur_start, ne01,
                      (const char *) src0_cur + src0_cur_start * nb01, src1_col, 1, src0_cur_end - src0_cur_start);
             }
             continue;
@@ -15061,7 +15697,7 @@ IQK_MulMat_Not_Available:;
                     ? (i11        + i12 * ne11) * row_size
                     : (i11 * nb11 + i12 * nb12));
 
-                gemv(ne00, (float *)((char *) dst->data + (i1 * nb1 + i2 * nb2)) + src0_cur_start, ne01,
+                gemv(ne00, (float *)((char *) dst->data + (i1 * nb1 + i2 * nb2_dst)) + src0_cur_start, ne01,
                      (const char *) src0_cur + src0_cur_start * nb01, src1_col, 1, src0_cur_end - src0_cur_start);
             }
             continue;
@@ -15120,7 +15756,7 @@ IQK_MulMat_Not_Available:;
                         ? (i11      + i12*ne11)*row_size
                         : (i11*nb11 + i12*nb12));
 
-                    float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2));
+                    float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2_dst));
 
                     //for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
                     //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
@@ -15159,6 +15795,12 @@ static void ggml_compute_forward_mul_mat_id_up_gate(
     const int ith = params->ith;
     const int nth = params->nth;
 
+    // up and gate have the same shape, so they are split the same way when both are NUMA sharded
+    int64_t shard_ir0 = 0, shard_ir1 = 0;
+    int     shard_jth = 0, shard_mth = 0;
+    const bool numa_shard = (src0_2->flags & GGML_TENSOR_FLAG_NUMA_SHARD) &&
+        ggml_numa_shard_split(params, src0_1, &shard_ir0, &shard_ir1, &shard_jth, &shard_mth);
+
     const enum ggml_type type = src0->type;
 
     enum ggml_type    const vec_dot_type    = type_traits[type].vec_dot_type;
@@ -15178,6 +15820,11 @@ static void ggml_compute_forward_mul_mat_id_up_gate(
     const int n_ids = ids->ne[0]; // n_expert_used
     const int n_as  = ne02;       // n_expert
 
+    // ggml_moe_up_gate_sorted: dst rows are grouped by expert, the position goes into i1
+    const bool   sorted  = dst->op_params[1] != 0;
+    const size_t nb2_dst = sorted ? 0 : nb2;
+    GGML_ASSERT(!sorted || ne11 == 1);
+
     char * wdata_src1_end = (src1->type == vec_dot_type) ?
             (char *) params->wdata :
             (char *) params->wdata + GGML_PAD(ggml_row_size(vec_dot_type, src1->ne[0])*ggml_nrows(src1), sizeof(int64_t));
@@ -15217,7 +15864,8 @@ static void ggml_compute_forward_mul_mat_id_up_gate(
 #define MMID_MATRIX_ROW(row_id, i1) matrix_rows[(row_id)*ne12 + (i1)]
 
     GGML_ASSERT(ids->ne[1] == dst->ne[2]);
-    for (int64_t iid1 = ith; iid1 < ids->ne[1]; iid1 += nth) {
+    // (in the grouped layout the rows of dropped experts are simply not there)
+    for (int64_t iid1 = ith; iid1 < ids->ne[1] && !sorted; iid1 += nth) {
         for (int id = 0; id < n_ids; ++id) {
             const int32_t i02 = *(const int32_t *) ((const char *) ids->data + iid1*ids->nb[1] + id*ids->nb[0]);
             if (i02 < 0 || i02 >= n_as) {
@@ -15244,6 +15892,15 @@ static void ggml_compute_forward_mul_mat_id_up_gate(
                 matrix_row_counts[i02] += 1;
             }
         }
+
+        if (sorted) {
+            int32_t pos = 0;
+            for (int cur_a = 0; cur_a < n_as; ++cur_a) {
+                for (int64_t k = 0; k < matrix_row_counts[cur_a]; ++k, ++pos) {
+                    MMID_MATRIX_ROW(cur_a, k).i1 = pos;
+                }
+            }
+        }
     }
 
     ggml_barrier(params->shared);
@@ -15268,10 +15925,18 @@ static void ggml_compute_forward_mul_mat_id_up_gate(
         const int64_t nr0 = ne01; // src0 rows
         const int64_t nr1 = cne1; // src1 rows
                                   //
+        if (numa_shard) {
+            if (!iqk_moe_fused_up_gate(shard_ir1 - shard_ir0, nr1, ne00, ne11, dst->op_params[0],
+                                type, src0_1_cur + shard_ir0*nb01, src0_2_cur + shard_ir0*nb01, nb01,
+                                vec_dot_type, (const char *)wdata, row_size,
+                                (float *)dst->data + shard_ir0, nb1, nb2_dst,
+                                matrix_rows + cur_a*ne12, shard_jth, shard_mth)) GGML_ABORT("fatal error");
+            continue;
+        }
         if (!iqk_moe_fused_up_gate(nr0, nr1, ne00, ne11, dst->op_params[0],
                             type, src0_1_cur, src0_2_cur, nb01,
                             vec_dot_type, (const char *)wdata, row_size,
-                            (float *)dst->data, nb1, nb2,
+                            (float *)dst->data, nb1, nb2_dst,
                             matrix_rows + cur_a*ne12, ith, nth)) GGML_ABORT("fatal error");
 
 //        if (nth%2 == 0) {
@@ -15301,6 +15966,138 @@ static void ggml_compute_forward_mul_mat_id_up_gate(
 }
 #endif
 
+// rows of the result computed together per expert by ggml_compute_forward_moe_down, the last tile can be shorter
+static int64_t ggml_moe_down_tile_rows(int64_t nrows) {
+    // 32 is a multiple of the row interleaving of all repacked types, and so is the rest of nrows
+    return MIN(nrows, 32);
+}
+
+static void ggml_compute_forward_moe_down(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+    const struct ggml_tensor * ids  = dst->src[2];
+    const struct ggml_tensor * w    = dst->src[3];
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const enum ggml_type type = src0->type;
+
+    ggml_vec_dot_t    const vec_dot      = type_traits[type].vec_dot;
+    enum ggml_type    const vec_dot_type = type_traits[type].vec_dot_type;
+    ggml_from_float_t const from_float   = type_traits[vec_dot_type].from_float;
+
+    GGML_ASSERT(nb00 == ggml_type_size(type));
+    GGML_ASSERT(nb10 == ggml_type_size(src1->type));
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(ne0 == ne01 && ne1 == ne12 && ne13 == 1);
+
+    const int n_ids = ids->ne[0]; // n_expert_used
+    const int n_as  = ne02;       // n_expert
+
+    const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+
+    char * wdata_src1_end = (src1->type == vec_dot_type) ?
+            (char *) params->wdata :
+            (char *) params->wdata + GGML_PAD(row_size*ggml_nrows(src1), sizeof(int64_t));
+
+    struct mmid_row_mapping {
+        int32_t i1;
+        int32_t i2;
+    };
+
+    int64_t * matrix_row_counts = (int64_t *) (wdata_src1_end); // [n_as]
+    struct mmid_row_mapping * matrix_rows = (struct mmid_row_mapping *)(matrix_row_counts + n_as); // [n_as][ne12]
+
+    // per thread results of one tile for all (expert, token) rows, laid out as [tile_rows, n_ids, ne12]
+    const int64_t tile_rows = ggml_moe_down_tile_rows(ne01);
+    float * tmp = (float *)((char *)params->wdata + GGML_PAD((size_t)((char *)(matrix_rows + n_as*ne12) - (char *)params->wdata), CACHE_LINE_SIZE));
+    tmp += ith*(tile_rows*n_ids*ne12 + CACHE_LINE_SIZE_F32);
+
+    if (src1->type != vec_dot_type) {
+        GGML_ASSERT(src1->type == GGML_TYPE_F32);
+        for (int64_t i12 = 0; i12 < ne12; ++i12) {
+            for (int64_t i11 = ith; i11 < ne11; i11 += nth) {
+                from_float((float *)((char *) src1->data + i12*nb12 + i11*nb11),
+                           (void *)((char *) params->wdata + (i11 + i12*ne11)*row_size),
+                           ne10);
+            }
+        }
+    }
+
+#define MMID_MATRIX_ROW(row_id, i1) matrix_rows[(row_id)*ne12 + (i1)]
+
+    if (ith == 0) {
+        memset(matrix_row_counts, 0, n_as*sizeof(int64_t));
+        for (int64_t iid1 = 0; iid1 < ids->ne[1]; ++iid1) {
+            for (int id = 0; id < n_ids; ++id) {
+                const int32_t i02 = *(const int32_t *) ((const char *) ids->data + iid1*ids->nb[1] + id*ids->nb[0]);
+                if (i02 < 0 || i02 >= n_as) continue;
+                MMID_MATRIX_ROW(i02, matrix_row_counts[i02]) = (struct mmid_row_mapping) {id, iid1};
+                matrix_row_counts[i02] += 1;
+            }
+        }
+    }
+
+    ggml_barrier(params->shared);
+
+    const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+
+    // Each thread owns whole tiles of result rows. The experts are computed into tmp one after the other and
+    // accumulated with their weights right away, so the [ne0, n_ids, ne12] expert results never exist.
+    const int64_t n_tiles = (ne01 + tile_rows - 1)/tile_rows;
+    for (int64_t tile = ith; tile < n_tiles; tile += nth) {
+        const int64_t ir0 = tile*tile_rows;
+        const int64_t nr  = MIN(tile_rows, ne01 - ir0);
+
+        for (int64_t i12 = 0; i12 < ne12; ++i12) {
+            memset((char *)dst->data + i12*nb1 + ir0*nb0, 0, nr*sizeof(float));
+        }
+
+        for (int cur_a = 0; cur_a < n_as; ++cur_a) {
+            const int64_t cne1 = matrix_row_counts[cur_a];
+            if (cne1 == 0) {
+                continue;
+            }
+
+            const char * src0_cur = (const char *) src0->data + cur_a*nb02 + ir0*nb01;
+            const struct mmid_row_mapping * rows = matrix_rows + cur_a*ne12;
+
+#if GGML_USE_IQK_MULMAT
+            if (!iqk_mul_mat_moe(nr, cne1, ne00, ne11,
+                        type, src0_cur, nb01,
+                        vec_dot_type, (const char *)wdata, row_size,
+                        tmp, tile_rows*sizeof(float), tile_rows*ne11*sizeof(float),
+                        rows, 0, 1))
+#endif
+            {
+                for (int64_t k = 0; k < cne1; ++k) {
+                    const int64_t i1 = rows[k].i1 + rows[k].i2*ne11;
+                    const char * src1_col = (const char *)wdata + i1*row_size;
+                    for (int64_t ir = 0; ir < nr; ++ir) {
+                        vec_dot(ne00, tmp + i1*tile_rows + ir, 0, src0_cur + ir*nb01, 0, src1_col, 0, 1);
+                    }
+                }
+            }
+
+            for (int64_t k = 0; k < cne1; ++k) {
+                const int32_t id  = rows[k].i1;
+                const int32_t i12 = rows[k].i2;
+                const float   wk  = *(const float *)((const char *)w->data + id*w->nb[1] + i12*w->nb[2]);
+                ggml_vec_mad_f32(nr, (float *)((char *)dst->data + i12*nb1 + ir0*nb0),
+                        tmp + (id + i12*ne11)*tile_rows, wk);
+            }
+        }
+    }
+
+#undef MMID_MATRIX_ROW
+}
+
 // ggml_compute_forward_out_prod
 
 static void ggml_compute_forward_out_prod_f32(
@@ -16469,6 +17266,48 @@ static void ggml_compute_forward_get_rows_back(
     //}
 }
 
+// ggml_compute_forward_set_rows
+
+static void ggml_compute_forward_set_rows(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+    const struct ggml_tensor * src2 = dst->src[2];
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    ggml_from_float_t const from_float = type_traits[dst->type].from_float;
+    GGML_ASSERT(dst->type == GGML_TYPE_F32 || from_float);
+
+    // rows of src1, divided among the threads
+    const int64_t nr  = ne11*ne12;
+    const int64_t dr  = (nr + nth - 1)/nth;
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i12 = ir/ne11;
+        const int64_t i11 = ir - i12*ne11;
+
+        const int64_t i2 = *(const int32_t *) ((const char *) src2->data + i12*src2->nb[0]);
+        GGML_ASSERT(i2 >= 0 && i2 < ne2);
+
+        const float * x = (const float *) ((const char *) src1->data + i11*nb11 + i12*nb12);
+        char        * y = (char *) dst->data + i11*nb1 + i2*nb2;
+
+        if (dst->type == GGML_TYPE_F32) {
+            memcpy(y, x, ne10*sizeof(float));
+        } else {
+            from_float(x, y, ne10);
+        }
+    }
+}
+
 // ggml_compute_forward_diag
 
 static void ggml_compute_forward_diag_f32(
@@ -18283,43 +19122,268 @@ static void ggml_compute_forward_argsort_thresh(
     }
 }
 
-// ggml_compute_forward_flash_attn_ext
+// ggml_compute_forward_moe_route
 
-static void ggml_compute_forward_flash_attn_ext_f16(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * q,
-        const struct ggml_tensor * k,
-        const struct ggml_tensor * v,
-        const struct ggml_tensor * mask,
-        struct ggml_tensor * dst) {
+static void ggml_compute_forward_moe_route_f32(
+    const struct ggml_compute_params * params,
+    struct ggml_tensor * dst) {
 
-    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
-    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
-    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
-    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
-    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
-    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
-    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
-    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * bias = dst->src[1];
+
+    GGML_TENSOR_UNARY_OP_LOCALS
 
     const int ith = params->ith;
     const int nth = params->nth;
 
-    const int64_t Dk = nek0;
-    const int64_t Dv = nev0;
-    const int64_t N  = neq1;
+    const int   n_expert     = ne00;
+    const int   k            = ne0;
+    const enum ggml_moe_gating gating = (enum ggml_moe_gating) ggml_get_op_params_i32(dst, 0);
+    const bool  norm_w       = ggml_get_op_params_i32(dst, 1) != 0;
+    const float w_scale      = ggml_get_op_params_f32(dst, 2);
+    const int   n_group      = ggml_get_op_params_i32(dst, 3);
+    const int   n_group_used = ggml_get_op_params_i32(dst, 4);
+    const int   min_entries  = ggml_get_op_params_i32(dst, 5);
+    const float thresh       = ggml_get_op_params_f32(dst, 6);
+
+    const int n_per_group = n_expert/n_group;
+
+    float * probs  = (float *) params->wdata + ith*(2*n_expert + n_group + CACHE_LINE_SIZE_F32);
+    float * sel    = probs + n_expert;
+    float * gscore = sel + n_expert;
+
+    for (int64_t i = ith; i < ne01; i += nth) {
+        const float * x = (const float *)((const char *) src0->data + i*nb01);
+        int32_t * ids = (int32_t *)((char *) dst->data + i*nb2);
+        float   * w   = (float   *)((char *) dst->data + i*nb2 + nb1);
+
+        // same arithmetic as ggml_soft_max/ggml_sigmoid, so the result does not depend on which path is taken
+        if (gating == GGML_MOE_GATING_SOFTMAX) {
+            float max = -INFINITY;
+            ggml_vec_max_f32(n_expert, &max, x);
+            ggml_float sum = ggml_vec_soft_max_f32(n_expert, probs, x, max);
+            sum = 1.0/sum;
+            ggml_vec_scale_f32(n_expert, probs, sum);
+        } else {
+            ggml_vec_sigmoid_f32(n_expert, probs, x);
+        }
 
-    GGML_ASSERT(ne0 == Dv);
-    GGML_ASSERT(ne2 == N);
+        if (bias) {
+            ggml_vec_add_f32(n_expert, sel, probs, (const float *) bias->data);
+        } else {
+            ggml_vec_cpy_f32(n_expert, sel, probs);
+        }
+
+        if (n_group > 1) {
+            for (int g = 0; g < n_group; ++g) {
+                const float * sg = sel + g*n_per_group;
+                float best = -INFINITY, second = -INFINITY;
+                for (int j = 0; j < n_per_group; ++j) {
+                    if (sg[j] > best) {
+                        second = best; best = sg[j];
+                    } else if (sg[j] > second) {
+                        second = sg[j];
+                    }
+                }
+                gscore[g] = bias && n_per_group > 1 ? best + second : best;
+            }
+            // the experts of all but the n_group_used best groups are taken out of the selection
+            for (int n = 0; n < n_group - n_group_used; ++n) {
+                int worst = -1;
+                for (int g = 0; g < n_group; ++g) {
+                    if (!isnan(gscore[g]) && (worst < 0 || gscore[g] <= gscore[worst])) worst = g;
+                }
+                gscore[worst] = NAN;
+                for (int j = 0; j < n_per_group; ++j) sel[worst*n_per_group + j] = NAN;
+            }
+        }
 
-    // input tensor rows must be contiguous
-    GGML_ASSERT(nbq0 == ggml_type_size(q->type));
-    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
-    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
+        // top k, best first; chosen and excluded entries are NAN
+        for (int j = 0; j < k; ++j) {
+            int best = -1;
+            for (int e = 0; e < n_expert; ++e) {
+                if (!isnan(sel[e]) && (best < 0 || sel[e] > sel[best])) best = e;
+            }
+            ids[j] = best;
+            w[j]   = best >= 0 ? sel[best] : -INFINITY; // selection values for now
+            if (best >= 0) sel[best] = NAN;
+        }
 
-    GGML_ASSERT(neq0 == Dk);
-    GGML_ASSERT(nek0 == Dk);
-    GGML_ASSERT(nev0 == Dv);
+        const float max_sel = w[0];
+        for (int j = 0; j < k; ++j) {
+            const bool dropped = ids[j] < 0 || (j >= min_entries && min_entries > 0 && w[j] < max_sel*thresh);
+            if (dropped) {
+                ids[j] = -1;
+            }
+            w[j] = dropped ? 0.0f : probs[ids[j]];
+        }
+
+        if (norm_w) {
+            float sum = 0;
+            ggml_vec_sum_f32(k, &sum, w);
+            for (int j = 0; j < k; ++j) w[j] /= sum;
+        }
+        ggml_vec_scale_f32(k, w, w_scale);
+    }
+}
+
+static void ggml_compute_forward_moe_route(
+    const struct ggml_compute_params * params,
+    struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_moe_route_f32(params, dst);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
+// ggml_compute_forward_moe_prefetch
+
+#if defined(__linux__) || defined(__APPLE__)
+#define GGML_MOE_PREFETCH
+#if defined(__APPLE__)
+typedef char ggml_mincore_t;
+#else
+typedef unsigned char ggml_mincore_t;
+#endif
+#endif
+
+// the pages spanned by the largest expert slice of a prefetch node, for the mincore vector
+static size_t ggml_moe_prefetch_max_pages(const struct ggml_tensor * node) {
+#ifdef GGML_MOE_PREFETCH
+    const size_t page = sysconf(_SC_PAGESIZE);
+    size_t max_pages = 0;
+    for (int j = 1; j <= 3; ++j) {
+        if (node->src[j]) {
+            max_pages = MAX(max_pages, node->src[j]->nb[2]/page + 2);
+        }
+    }
+    return max_pages;
+#else
+    GGML_UNUSED(node);
+    return 0;
+#endif
+}
+
+// returns true if the slice is resident, else asks for it to be read in
+static bool ggml_moe_prefetch_slice(const char * data, size_t size, void * vec) {
+#ifdef GGML_MOE_PREFETCH
+    const size_t page = sysconf(_SC_PAGESIZE);
+    char * start = (char *)((uintptr_t) data & ~(uintptr_t)(page - 1));
+    const size_t len = data + size - start;
+    if (mincore(start, len, (ggml_mincore_t *) vec) == 0) {
+        const ggml_mincore_t * v = (const ggml_mincore_t *) vec;
+        const size_t n_pages = (len + page - 1)/page;
+        size_t i = 0;
+        while (i < n_pages && (v[i] & 1)) ++i;
+        if (i == n_pages) {
+            return true;
+        }
+    }
+    posix_madvise(start, len, POSIX_MADV_WILLNEED);
+    return false;
+#else
+    GGML_UNUSED(data);
+    GGML_UNUSED(size);
+    GGML_UNUSED(vec);
+    return false;
+#endif
+}
+
+static void ggml_compute_forward_moe_prefetch(
+    const struct ggml_compute_params * params,
+    struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * ids = dst->src[0];
+
+    if (params->ith != 0) {
+        return;
+    }
+
+    int32_t * out = (int32_t *) dst->data;
+    for (int64_t i1 = 0; i1 < ids->ne[1]; ++i1) {
+        memcpy(out + i1*ids->ne[0], (const char *) ids->data + i1*ids->nb[1], ids->ne[0]*sizeof(int32_t));
+    }
+    const int64_t n_ids = ids->ne[0]*ids->ne[1];
+
+    int64_t n_expert = 0;
+    for (int j = 1; j <= 3; ++j) {
+        if (dst->src[j]) n_expert = MAX(n_expert, dst->src[j]->ne[2]);
+    }
+
+    // each expert is looked at once, however many tokens selected it
+    uint8_t * seen = (uint8_t *) params->wdata;
+    void    * vec  = seen + n_expert;
+    memset(seen, 0, n_expert);
+
+    int32_t n_resident = 0, n_requested = 0;
+    for (int64_t i = 0; i < n_ids; ++i) {
+        const int32_t id = out[i];
+        if (id < 0 || id >= n_expert || seen[id]) {
+            continue;
+        }
+        seen[id] = 1;
+        for (int j = 1; j <= 3; ++j) {
+            const struct ggml_tensor * t = dst->src[j];
+            if (!t || id >= t->ne[2]) {
+                continue;
+            }
+            if (ggml_moe_prefetch_slice((const char *) t->data + id*t->nb[2], t->nb[2], vec)) {
+                ++n_resident;
+            } else {
+                ++n_requested;
+            }
+        }
+    }
+    out[n_ids + 0] = n_resident;
+    out[n_ids + 1] = n_requested;
+}
+
+// ggml_compute_forward_flash_attn_ext
+
+static void ggml_compute_forward_flash_attn_ext_f16(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        struct ggml_tensor * dst) {
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t Dk = nek0;
+    const int64_t Dv = nev0;
+    const int64_t N  = neq1;
+
+    GGML_ASSERT(ne0 == Dv);
+    GGML_ASSERT(ne2 == N);
+
+    // input tensor rows must be contiguous
+    GGML_ASSERT(nbq0 == ggml_type_size(q->type));
+    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
+    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
+
+    GGML_ASSERT(neq0 == Dk);
+    GGML_ASSERT(nek0 == Dk);
+    GGML_ASSERT(nev0 == Dv);
 
     GGML_ASSERT(neq1 == N);
     GGML_ASSERT(nev0 == Dv);
@@ -18362,7 +19426,7 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     }
 
 #if GGML_USE_IQK_MULMAT
-    if (iqk_flash_attn_noalibi(q->type, mask->type, max_bias,
+    if (iqk_flash_attn(q->type, mask->type, max_bias,
                 q->ne[3], q->ne[2], q->nb[3], q->nb[2],
                 k->ne[3], k->ne[2], k->nb[3], k->nb[2],
                 v->ne[3], v->ne[2], v->nb[3], v->nb[2],
@@ -18370,7 +19434,7 @@ static void ggml_compute_forward_flash_attn_ext_f16(
                 k->type, v->type,
                 Dk, Dv, neq1, nek1, q->nb[1], k->nb[1], v->nb[1], mask->nb[1],
                 q->data, k->data, v->data, mask->data,
-                scale, softcap, (float *)dst->data,
+                scale, softcap, ggml_get_op_params_i32(dst, 4) != 0, (float *)dst->data,
                 params->wdata, (barrier_t)ggml_barrier, (void *)params->shared, ith, nth)) return;
 
 //    if (max_bias <= 0.0f && q->type == GGML_TYPE_F32 && mask && mask->type == GGML_TYPE_F16) {
@@ -18398,7 +19462,7 @@ static void ggml_compute_forward_flash_attn_ext_f16(
 //                if (counter++ % (nth/ntg) == ith/ntg) {
 //                    int iq1 = (ith%ntg)*neq1g;
 //                    int this_neq1 = MIN(neq1g, neq1-iq1);
-//                    if (!iqk_flash_attn_noalibi(k->type, v->type,
+//                    if (!iqk_flash_attn(k->type, v->type,
 //                            Dk, Dv, this_neq1, nek1, q->nb[1], k->nb[1], v->nb[1], mask->nb[1], ne1*nb1/sizeof(float),
 //                            (const float *)((const char *)q->data + iq2*q->nb[2] + iq3*q->nb[3] + iq1*q->nb[1]),
 //                            (const void  *)((const char *)k->data + iq2/rk2*k->nb[2] + iq3/rk3*k->nb[3]),
@@ -19981,6 +21045,10 @@ static bool ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_mul_mat_id_up_gate(params, tensor);
             } break;
+        case GGML_OP_MOE_FUSED_DOWN:
+            {
+                ggml_compute_forward_moe_down(params, tensor);
+            } break;
         case GGML_OP_OUT_PROD:
             {
                 ggml_compute_forward_out_prod(params, tensor);
@@ -20033,6 +21101,10 @@ static bool ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_get_rows_back(params, tensor);
             } break;
+        case GGML_OP_SET_ROWS:
+            {
+                ggml_compute_forward_set_rows(params, tensor);
+            } break;
         case GGML_OP_DIAG:
             {
                 ggml_compute_forward_diag(params, tensor);
@@ -20109,6 +21181,14 @@ static bool ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_argsort_thresh(params, tensor);
             } break;
+        case GGML_OP_MOE_ROUTE:
+            {
+                ggml_compute_forward_moe_route(params, tensor);
+            } break;
+        case GGML_OP_MOE_PREFETCH:
+            {
+                ggml_compute_forward_moe_prefetch(params, tensor);
+            } break;
         case GGML_OP_LEAKY_RELU:
             {
                 ggml_compute_forward_leaky_relu(params, tensor);
@@ -20746,6 +21826,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
             }
+        case GGML_OP_MOE_FUSED_DOWN:
+            {
+                GGML_ABORT("fatal error"); // TODO: not implemented
+            }
         case GGML_OP_OUT_PROD:
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
@@ -20935,6 +22019,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
             }
+        case GGML_OP_SET_ROWS:
+            {
+                GGML_ABORT("fatal error"); // TODO: not implemented
+            }
         case GGML_OP_DIAG:
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
@@ -21098,6 +22186,14 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
             }
+        case GGML_OP_MOE_ROUTE:
+            {
+                GGML_ABORT("fatal error"); // TODO: not implemented
+            }
+        case GGML_OP_MOE_PREFETCH:
+            {
+                GGML_ABORT("fatal error"); // TODO: not implemented
+            }
         case GGML_OP_LEAKY_RELU:
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
@@ -21623,7 +22719,9 @@ static void set_numa_thread_affinity(int thread_n) {
 
     switch(g_state.numa.numa_strategy) {
         case GGML_NUMA_STRATEGY_DISTRIBUTE:
+        case GGML_NUMA_STRATEGY_SHARD:
             // run thread on node_num thread_n / (threads per node)
+            // note: ggml_numa_shard_split() relies on this mapping
             node_num = thread_n % g_state.numa.n_nodes;
             break;
         case GGML_NUMA_STRATEGY_ISOLATE:
@@ -21761,7 +22859,9 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
         case GGML_OP_MUL_MAT:
         case GGML_OP_MUL_MAT_ID:
         case GGML_OP_MOE_FUSED_UP_GATE:
+        case GGML_OP_MOE_FUSED_DOWN:
         case GGML_OP_OUT_PROD:
+        case GGML_OP_SET_ROWS:
             {
                 n_tasks = n_threads;
             } break;
@@ -21819,6 +22919,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
         case GGML_OP_TIMESTEP_EMBEDDING:
         case GGML_OP_ARGSORT:
         case GGML_OP_ARGSORT_THRESH:
+        case GGML_OP_MOE_ROUTE:
         case GGML_OP_FLASH_ATTN_EXT:
         case GGML_OP_FLASH_ATTN_BACK:
         case GGML_OP_SSM_CONV:
@@ -21834,6 +22935,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
         case GGML_OP_MAP_CUSTOM1_F32:
         case GGML_OP_MAP_CUSTOM2_F32:
         case GGML_OP_MAP_CUSTOM3_F32:
+        case GGML_OP_MOE_PREFETCH:
             {
                 n_tasks = 1;
             } break;
@@ -21897,6 +22999,259 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
     return n_tasks;
 }
 
+// work buffer size needed to compute node with n_tasks threads
+static size_t ggml_graph_node_work_size(const struct ggml_tensor * node, int n_tasks) {
+    size_t cur = 0;
+
+    switch (node->op) {
+        case GGML_OP_CPY:
+        case GGML_OP_DUP:
+            {
+                if (ggml_is_quantized(node->type) ||
+                    // F16 -> BF16 and BF16 -> F16 copies go through intermediate F32
+                    (node->src[0]->type == GGML_TYPE_F16  && node->src[1] && node->src[1]->type == GGML_TYPE_BF16) ||
+                    (node->src[0]->type == GGML_TYPE_BF16 && node->src[1] && node->src[1]->type == GGML_TYPE_F16)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_MOE_ROUTE:
+            {
+                const int64_t n_expert = node->src[0]->ne[0];
+                const int32_t n_group  = ggml_get_op_params_i32(node, 3);
+                cur = sizeof(float)*(2*n_expert + n_group + CACHE_LINE_SIZE_F32)*n_tasks;
+            } break;
+        case GGML_OP_MOE_PREFETCH:
+            {
+                int64_t n_expert = 0;
+                for (int j = 1; j <= 3; ++j) {
+                    if (node->src[j]) n_expert = MAX(n_expert, node->src[j]->ne[2]);
+                }
+                cur = n_expert + ggml_moe_prefetch_max_pages(node);
+            } break;
+        case GGML_OP_MULTI_ADD:
+            {
+                if (node->src[2]) {
+                    cur = sizeof(int64_t) * (2*node->op_params[1] + CACHE_LINE_SIZE_F32) * n_tasks;
+                }
+            } break;
+        case GGML_OP_ACC:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_MUL_MAT:
+            {
+                const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
+
+                if (node->src[1]->type != vec_dot_type) {
+                    cur = ggml_row_size(vec_dot_type, node->src[1]->ne[0]) * ggml_nrows(node->src[1]);
+                    if (node->src[1]->type != GGML_TYPE_F32) {
+                        cur += n_tasks*node->src[1]->ne[0]*sizeof(float); // src1->type -> f32 -> vec_dot_type
+                    }
+#if GGML_USE_IQK_MULMAT
+                    cur = GGML_PAD(cur, CACHE_LINE_SIZE) + iqk_work_queue_size(n_tasks); // work stealing queue
+#endif
+                }
+            } break;
+        case GGML_OP_MUL_MAT_ID:
+            {
+                cur = 0;
+                const struct ggml_tensor * src0 = node->src[0];
+                const struct ggml_tensor * src1 = node->src[1];
+                const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
+                if (src1->type != vec_dot_type) {
+                    cur += ggml_row_size(vec_dot_type, node->src[1]->ne[0]) * ggml_nrows(node->src[1]);
+                }
+                const int n_as = src0->ne[2];
+                cur += GGML_PAD(cur, sizeof(int64_t));       // align
+                cur += n_as * sizeof(int64_t);               // matrix_row_counts
+                cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
+#if GGML_USE_IQK_MULMAT
+                cur = GGML_PAD(cur, CACHE_LINE_SIZE) + iqk_work_queue_size(n_tasks); // work stealing queue
+#endif
+            } break;
+        case GGML_OP_MOE_FUSED_UP_GATE:
+            {
+                cur = 0;
+                const struct ggml_tensor * src0 = node->src[0];
+                const struct ggml_tensor * src2 = node->src[2];
+                const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
+                if (src2->type != vec_dot_type) {
+                    cur += ggml_row_size(vec_dot_type, node->src[1]->ne[0]) * ggml_nrows(node->src[1]);
+                }
+                const int n_as = src0->ne[2];
+                cur += GGML_PAD(cur, sizeof(int64_t));       // align
+                cur += n_as * sizeof(int64_t);               // matrix_row_counts
+                cur += n_as * src2->ne[2] * sizeof(int64_t); // matrix_rows
+            } break;
+        case GGML_OP_MOE_FUSED_DOWN:
+            {
+                cur = 0;
+                const struct ggml_tensor * src0 = node->src[0];
+                const struct ggml_tensor * src1 = node->src[1];
+                const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
+                if (src1->type != vec_dot_type) {
+                    cur += ggml_row_size(vec_dot_type, src1->ne[0]) * ggml_nrows(src1);
+                }
+                const int n_as = src0->ne[2];
+                cur  = GGML_PAD(cur, sizeof(int64_t));       // align
+                cur += n_as * sizeof(int64_t);               // matrix_row_counts
+                cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
+                cur = GGML_PAD(cur, CACHE_LINE_SIZE);
+                cur += (ggml_moe_down_tile_rows(src0->ne[1])*src1->ne[1]*src1->ne[2] + CACHE_LINE_SIZE_F32)*sizeof(float)*n_tasks;
+            } break;
+        case GGML_OP_OUT_PROD:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_ROPE:
+            {
+                cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_1D:
+            {
+                GGML_ASSERT(node->src[0]->ne[3] == 1);
+                GGML_ASSERT(node->src[1]->ne[2] == 1);
+                GGML_ASSERT(node->src[1]->ne[3] == 1);
+
+                const int64_t ne00 = node->src[0]->ne[0];  // K
+                const int64_t ne01 = node->src[0]->ne[1];  // Cout
+                const int64_t ne02 = node->src[0]->ne[2];  // Cin
+
+                const int64_t ne10 = node->src[1]->ne[0];  // L
+                const int64_t ne11 = node->src[1]->ne[1];  // Cin
+
+                if ((node->src[0]->type == GGML_TYPE_F16 ||
+                     node->src[0]->type == GGML_TYPE_BF16) &&
+                    node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
+                    cur += sizeof(ggml_fp16_t)*ne10*ne11;
+                } else if (node->src[0]->type == GGML_TYPE_F32 &&
+                           node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(float)*ne00*ne01*ne02;
+                    cur += sizeof(float)*ne10*ne11;
+                } else {
+                    GGML_ABORT("fatal error");
+                }
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_2D:
+            {
+                const int64_t ne00 = node->src[0]->ne[0]; // W
+                const int64_t ne01 = node->src[0]->ne[1]; // H
+                const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
+                const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+
+                const int64_t ne10 = node->src[1]->ne[0]; // W
+                const int64_t ne11 = node->src[1]->ne[1]; // H
+                const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+
+                cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
+                cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
+            } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                const int64_t Dk = node->src[0]->ne[0];
+                const int64_t Dv = node->src[2]->ne[0];
+                const int64_t D  = MAX(Dk, Dv);
+
+                cur = 3*sizeof(float)*D*n_tasks; // 3x head size/thread
+#if GGML_USE_IQK_MULMAT
+                size_t qsize = 0;
+                const struct ggml_tensor * q = node->src[0];
+                const struct ggml_tensor * k = node->src[1];
+                if (k->type == GGML_TYPE_Q8_0) {
+                    qsize = ggml_nrows(k)*ggml_row_size(k->type, k->ne[0]);
+                }
+                if (q->ne[1] == 1 && q->ne[3] == 1 && q->ne[2]/k->ne[2] > 1 && n_tasks > 1 && k->ne[1]/32 > 1) {
+                    if (k->ne[2] > 1) {
+                        int gcd = simple_gcd(k->ne[2], n_tasks);
+                        int nth_k  = n_tasks/gcd;
+                        int nek2_k = k->ne[2]/gcd;
+                        int nchunk = nek2_k*k->ne[1]/32;
+                        int npt = (nchunk + nth_k - 1)/nth_k;
+                        int nk;
+                        if (npt*nth_k == nchunk) {
+                            nk = 32 * (k->ne[1]*k->ne[2]/(32*n_tasks));
+                        } else {
+                            //int nm = std::max(1, npt/8);
+                            int nm = 1;
+                            while (true) {
+                                if (nm*4 >= npt) break;
+                                nm *= 2;
+                            }
+                            nk = 32*nm;
+                        }
+                        //int nk = 32 * (k->ne[2]*k->ne[1]/(32*n_tasks));
+                        int nstep_k = k->ne[2]*k->ne[1]/nk;
+                        size_t result_size = (Dv + 16)*q->ne[2]/k->ne[2]*sizeof(float);
+                        size_t size = nstep_k*result_size;
+                        cur = MAX(cur, size+qsize);
+                    } else {
+                        int nstep_k = k->ne[1]/32;
+                        int gcd_k   = simple_gcd(nstep_k, n_tasks);
+                        if (gcd_k > 1) {
+                            int nth_k = n_tasks/gcd_k;
+                            int rk2 = q->ne[2]/k->ne[2];
+                            int nq_per_thread = (rk2 + nth_k - 1)/nth_k;
+                            size_t size = (Dv + 16)*nq_per_thread*sizeof(float)*n_tasks;
+                            if (ggml_is_quantized(k->type)) {
+                                enum ggml_type vec_dot_type = type_traits[k->type].vec_dot_type;
+                                size_t row_size = ggml_row_size(vec_dot_type, q->ne[0]);
+                                size += q->ne[2]*row_size;
+                            }
+                            cur = MAX(cur, size+qsize);
+                        }
+                    }
+                } else {
+                    cur = MAX(cur, qsize);
+                }
+#endif
+            } break;
+        case GGML_OP_FLASH_ATTN_BACK:
+            {
+                const int64_t    D = node->src[0]->ne[0];
+                const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+                const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_BF16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                }
+            } break;
+
+        case GGML_OP_CROSS_ENTROPY_LOSS:
+            {
+                cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
+            } break;
+        case GGML_OP_COUNT:
+            {
+                GGML_ABORT("fatal error");
+            }
+        default:
+            break;
+    }
+
+    return cur;
+}
+
+static size_t ggml_graph_sched_size(const struct ggml_cgraph * cgraph);
+
 struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threads) {
     if (n_threads <= 0) {
         n_threads = GGML_DEFAULT_N_THREADS;
@@ -21917,232 +23272,363 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
 
         max_tasks = MAX(max_tasks, n_tasks);
 
-        size_t cur = 0;
+        const size_t cur = ggml_graph_node_work_size(node, n_tasks);
 
-        switch (node->op) {
-            case GGML_OP_CPY:
-            case GGML_OP_DUP:
-                {
-                    if (ggml_is_quantized(node->type) ||
-                        // F16 -> BF16 and BF16 -> F16 copies go through intermediate F32
-                        (node->src[0]->type == GGML_TYPE_F16  && node->src[1] && node->src[1]->type == GGML_TYPE_BF16) ||
-                        (node->src[0]->type == GGML_TYPE_BF16 && node->src[1] && node->src[1]->type == GGML_TYPE_F16)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_ADD:
-            case GGML_OP_ADD1:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_ACC:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_MUL_MAT:
-                {
-                    const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
+        work_size = MAX(work_size, cur);
+    }
 
-                    if (node->src[1]->type != vec_dot_type) {
-                        cur = ggml_row_size(vec_dot_type, node->src[1]->ne[0]) * ggml_nrows(node->src[1]);
-                        if (node->src[1]->type != GGML_TYPE_F32) {
-                            cur += n_tasks*node->src[1]->ne[0]*sizeof(float); // src1->type -> f32 -> vec_dot_type
-                        }
-                    }
-                } break;
-            case GGML_OP_MUL_MAT_ID:
-                {
-                    cur = 0;
-                    const struct ggml_tensor * src0 = node->src[0];
-                    const struct ggml_tensor * src1 = node->src[1];
-                    const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
-                    if (src1->type != vec_dot_type) {
-                        cur += ggml_row_size(vec_dot_type, node->src[1]->ne[0]) * ggml_nrows(node->src[1]);
-                    }
-                    const int n_as = src0->ne[2];
-                    cur += GGML_PAD(cur, sizeof(int64_t));       // align
-                    cur += n_as * sizeof(int64_t);               // matrix_row_counts
-                    cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
-                } break;
-            case GGML_OP_MOE_FUSED_UP_GATE:
-                {
-                    cur = 0;
-                    const struct ggml_tensor * src0 = node->src[0];
-                    const struct ggml_tensor * src2 = node->src[2];
-                    const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
-                    if (src2->type != vec_dot_type) {
-                        cur += ggml_row_size(vec_dot_type, node->src[1]->ne[0]) * ggml_nrows(node->src[1]);
-                    }
-                    const int n_as = src0->ne[2];
-                    cur += GGML_PAD(cur, sizeof(int64_t));       // align
-                    cur += n_as * sizeof(int64_t);               // matrix_row_counts
-                    cur += n_as * src2->ne[2] * sizeof(int64_t); // matrix_rows
-                } break;
-            case GGML_OP_OUT_PROD:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_SOFT_MAX:
-            case GGML_OP_ROPE:
-                {
-                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_1D:
-                {
-                    GGML_ASSERT(node->src[0]->ne[3] == 1);
-                    GGML_ASSERT(node->src[1]->ne[2] == 1);
-                    GGML_ASSERT(node->src[1]->ne[3] == 1);
-
-                    const int64_t ne00 = node->src[0]->ne[0];  // K
-                    const int64_t ne01 = node->src[0]->ne[1];  // Cout
-                    const int64_t ne02 = node->src[0]->ne[2];  // Cin
-
-                    const int64_t ne10 = node->src[1]->ne[0];  // L
-                    const int64_t ne11 = node->src[1]->ne[1];  // Cin
-
-                    if ((node->src[0]->type == GGML_TYPE_F16 ||
-                         node->src[0]->type == GGML_TYPE_BF16) &&
-                        node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
-                        cur += sizeof(ggml_fp16_t)*ne10*ne11;
-                    } else if (node->src[0]->type == GGML_TYPE_F32 &&
-                               node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(float)*ne00*ne01*ne02;
-                        cur += sizeof(float)*ne10*ne11;
-                    } else {
-                        GGML_ABORT("fatal error");
-                    }
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_2D:
-                {
-                    const int64_t ne00 = node->src[0]->ne[0]; // W
-                    const int64_t ne01 = node->src[0]->ne[1]; // H
-                    const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
-                    const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+    if (work_size > 0) {
+        work_size += CACHE_LINE_SIZE*(n_threads - 1);
+    }
 
-                    const int64_t ne10 = node->src[1]->ne[0]; // W
-                    const int64_t ne11 = node->src[1]->ne[1]; // H
-                    const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+    cplan.n_threads = MIN(max_tasks, n_threads);
+    cplan.work_size = work_size;
+    cplan.work_data = NULL;
 
-                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
-                    cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
-                } break;
-            case GGML_OP_FLASH_ATTN_EXT:
-                {
-                    const int64_t Dk = node->src[0]->ne[0];
-                    const int64_t Dv = node->src[2]->ne[0];
-                    const int64_t D  = MAX(Dk, Dv);
+    if (cplan.n_threads > 1) {
+        // the schedule of the nodes goes at the end of the work buffer
+        cplan.work_size = GGML_PAD(work_size, CACHE_LINE_SIZE) + ggml_graph_sched_size(cgraph);
+    }
 
-                    cur = 3*sizeof(float)*D*n_tasks; // 3x head size/thread
-#if GGML_USE_IQK_MULMAT
-                    size_t qsize = 0;
-                    const struct ggml_tensor * q = node->src[0];
-                    const struct ggml_tensor * k = node->src[1];
-                    if (k->type == GGML_TYPE_Q8_0) {
-                        qsize = ggml_nrows(k)*ggml_row_size(k->type, k->ne[0]);
-                    }
-                    if (q->ne[1] == 1 && q->ne[3] == 1 && q->ne[2]/k->ne[2] > 1 && n_tasks > 1 && k->ne[1]/32 > 1) {
-                        if (k->ne[2] > 1) {
-                            int gcd = simple_gcd(k->ne[2], n_tasks);
-                            int nth_k  = n_tasks/gcd;
-                            int nek2_k = k->ne[2]/gcd;
-                            int nchunk = nek2_k*k->ne[1]/32;
-                            int npt = (nchunk + nth_k - 1)/nth_k;
-                            int nk;
-                            if (npt*nth_k == nchunk) {
-                                nk = 32 * (k->ne[1]*k->ne[2]/(32*n_tasks));
-                            } else {
-                                //int nm = std::max(1, npt/8);
-                                int nm = 1;
-                                while (true) {
-                                    if (nm*4 >= npt) break;
-                                    nm *= 2;
-                                }
-                                nk = 32*nm;
-                            }
-                            //int nk = 32 * (k->ne[2]*k->ne[1]/(32*n_tasks));
-                            int nstep_k = k->ne[2]*k->ne[1]/nk;
-                            size_t result_size = (Dv + 16)*q->ne[2]/k->ne[2]*sizeof(float);
-                            size_t size = nstep_k*result_size;
-                            cur = MAX(cur, size+qsize);
-                        } else {
-                            int nstep_k = k->ne[1]/32;
-                            int gcd_k   = simple_gcd(nstep_k, n_tasks);
-                            if (gcd_k > 1) {
-                                int nth_k = n_tasks/gcd_k;
-                                int rk2 = q->ne[2]/k->ne[2];
-                                int nq_per_thread = (rk2 + nth_k - 1)/nth_k;
-                                size_t size = (Dv + 16)*nq_per_thread*sizeof(float)*n_tasks;
-                                if (ggml_is_quantized(k->type)) {
-                                    enum ggml_type vec_dot_type = type_traits[k->type].vec_dot_type;
-                                    size_t row_size = ggml_row_size(vec_dot_type, q->ne[0]);
-                                    size += q->ne[2]*row_size;
-                                }
-                                cur = MAX(cur, size+qsize);
-                            }
-                        }
-                    } else {
-                        cur = MAX(cur, qsize);
-                    }
-#endif
-                } break;
-            case GGML_OP_FLASH_ATTN_BACK:
-                {
-                    const int64_t    D = node->src[0]->ne[0];
-                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
-                    const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_BF16) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    }
-                } break;
+    return cplan;
+}
 
-            case GGML_OP_CROSS_ENTROPY_LOSS:
-                {
-                    cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
-                } break;
-            case GGML_OP_COUNT:
-                {
-                    GGML_ABORT("fatal error");
-                }
-            default:
-                break;
+//
+// dependency-aware scheduling
+//
+// In lockstep mode every node is computed by all threads and followed by a barrier. For small ops on many
+// threads the barrier dominates. Here consecutive nodes that do not touch each other's data are put into
+// the same step, the threads are split between them in proportion to their estimated cost, and there is
+// a single barrier at the end of the step. A node computed by a subset of the threads gets its own shared
+// state (barrier, chunk counter) and its own slice of the work buffer.
+//
+// Dependencies are detected by overlap of the memory ranges the nodes read and write. This covers views
+// and in-place ops, and also the buffers re-used by the graph allocator, where a later node may write into
+// memory that an earlier node of the same step still reads. A source that is a view counts as reading all
+// of the tensor it views, since some ops read beyond the view (e.g. the other experts of MULTI_ADD).
+//
+// The schedule is built for every compute in the space that ggml_graph_plan reserves for it at the end of
+// the work buffer.
+//
+
+#define GGML_SCHED_MAX_CONCURRENT 8
+
+struct ggml_sched_node {
+    int    node_n; // index in cgraph->nodes
+    int    ith0;   // first thread
+    int    nth;    // number of threads
+    size_t woffs;  // offset in the work buffer
+    size_t wsize;  // size of the work buffer slice
+    struct ggml_compute_state_shared * shared; // NULL if computed by all threads
+};
+
+struct ggml_sched_step {
+    int first; // index of the first node in ggml_graph_sched.nodes
+    int n;     // number of nodes computed concurrently
+};
+
+struct ggml_graph_sched {
+    int n_steps;
+    struct ggml_sched_step           * steps;
+    struct ggml_sched_node           * nodes;
+    struct ggml_compute_state_shared * groups; // shared state of the nodes in steps with more than one node
+};
+
+static size_t ggml_graph_sched_size(const struct ggml_cgraph * cgraph) {
+    return sizeof(struct ggml_graph_sched)
+         + cgraph->n_nodes*(sizeof(struct ggml_sched_step) + sizeof(struct ggml_sched_node) + sizeof(struct ggml_compute_state_shared));
+}
+
+// a node writes its own memory
+static inline bool ggml_sched_writes_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// a node may read all of the tensor that a source views
+static inline bool ggml_sched_read_overlaps(const struct ggml_tensor * src, const struct ggml_tensor * node) {
+    return ggml_sched_writes_overlap(src->view_src ? src->view_src : src, node);
+}
+
+// true if node reads or writes memory that other writes, or writes memory that other reads
+static bool ggml_sched_conflict(const struct ggml_tensor * node, const struct ggml_tensor * other) {
+    if (ggml_sched_writes_overlap(node, other)) {
+        return true;
+    }
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        const struct ggml_tensor * src = node->src[i];
+        if (src && ggml_sched_read_overlaps(src, other)) {
+            return true;
+        }
+        src = other->src[i];
+        if (src && ggml_sched_read_overlaps(src, node)) {
+            return true;
         }
+    }
+    return false;
+}
 
-        work_size = MAX(work_size, cur);
+static bool ggml_sched_can_group(const struct ggml_tensor * node) {
+    if (node->data == NULL) {
+        return false;
+    }
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        if (node->src[i] && node->src[i]->data == NULL) {
+            return false;
+        }
+        // NUMA sharded weights need the threads of all nodes
+        if (node->src[i] && (node->src[i]->flags & GGML_TENSOR_FLAG_NUMA_SHARD)) {
+            return false;
+        }
     }
+    switch (node->op) {
+        // flash attention derives its work split and buffer layout from the total number of threads,
+        // and user ops may make their own assumptions about it
+        case GGML_OP_FLASH_ATTN_EXT:
+        case GGML_OP_FLASH_ATTN_BACK:
+        case GGML_OP_MAP_UNARY:
+        case GGML_OP_MAP_BINARY:
+        case GGML_OP_MAP_CUSTOM1_F32:
+        case GGML_OP_MAP_CUSTOM2_F32:
+        case GGML_OP_MAP_CUSTOM3_F32:
+        case GGML_OP_MAP_CUSTOM1:
+        case GGML_OP_MAP_CUSTOM2:
+        case GGML_OP_MAP_CUSTOM3:
+            return false;
+        default:
+            return true;
+    }
+}
 
-    if (work_size > 0) {
-        work_size += CACHE_LINE_SIZE*(n_threads - 1);
+// ggml_compute_forward may fuse a node with the next one in the graph when that one consumes its result.
+// Such a node is kept in a step of its own, computed by all threads, so that the fusion is still possible.
+static bool ggml_sched_may_fuse(const struct ggml_cgraph * cgraph, int node_n) {
+    if (node_n + 1 >= cgraph->n_nodes) {
+        return false;
+    }
+    const struct ggml_tensor * next = cgraph->nodes[node_n + 1];
+    if (ggml_is_noop(next)) {
+        return false;
+    }
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        if (next->src[i] == cgraph->nodes[node_n]) {
+            return true;
+        }
     }
+    return false;
+}
 
-    cplan.n_threads = MIN(max_tasks, n_threads);
-    cplan.work_size = work_size;
-    cplan.work_data = NULL;
+static double ggml_sched_node_cost(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ID:
+            return (double)ggml_nelements(node)*node->src[0]->ne[0];
+        case GGML_OP_MOE_FUSED_UP_GATE:
+            return 2.0*ggml_nelements(node)*node->src[0]->ne[0];
+        case GGML_OP_MOE_FUSED_DOWN:
+            return (double)ggml_nelements(node)*node->src[1]->ne[1]*node->src[0]->ne[0];
+        default:
+            return (double)ggml_nelements(node);
+    }
+}
 
-    return cplan;
+// splits n_threads between the nodes of a step in proportion to their cost, at least one thread per node
+static void ggml_sched_split_threads(const struct ggml_cgraph * cgraph, struct ggml_sched_node * nodes, int n, int n_threads) {
+    double cost[GGML_SCHED_MAX_CONCURRENT];
+    double total = 0;
+    for (int j = 0; j < n; ++j) {
+        cost[j] = MAX(1.0, ggml_sched_node_cost(cgraph->nodes[nodes[j].node_n]));
+        total += cost[j];
+    }
+    int n_used = 0;
+    for (int j = 0; j < n; ++j) {
+        nodes[j].nth = MAX(1, (int)(n_threads*cost[j]/total));
+        n_used += nodes[j].nth;
+    }
+    while (n_used > n_threads) {
+        int jmax = 0;
+        for (int j = 1; j < n; ++j) if (nodes[j].nth > nodes[jmax].nth) jmax = j;
+        --nodes[jmax].nth; --n_used;
+    }
+    while (n_used < n_threads) {
+        int jmax = 0;
+        for (int j = 1; j < n; ++j) if (cost[j]/nodes[j].nth > cost[jmax]/nodes[jmax].nth) jmax = j;
+        ++nodes[jmax].nth; ++n_used;
+    }
+}
+
+// assigns threads and work buffer slices to the nodes of a step, returns false if the work buffer is too small
+static bool ggml_sched_layout_step(const struct ggml_cgraph * cgraph, struct ggml_sched_node * nodes, int n, int n_threads, size_t work_size) {
+    ggml_sched_split_threads(cgraph, nodes, n, n_threads);
+    size_t offs = 0;
+    int ith0 = 0;
+    for (int j = 0; j < n; ++j) {
+        struct ggml_tensor * node = cgraph->nodes[nodes[j].node_n];
+        size_t cur = ggml_graph_node_work_size(node, MIN(nodes[j].nth, ggml_get_n_tasks(node, nodes[j].nth)));
+        if (cur > 0) {
+            cur = GGML_PAD(cur + CACHE_LINE_SIZE*(nodes[j].nth - 1), CACHE_LINE_SIZE);
+        }
+        nodes[j].ith0  = ith0;
+        nodes[j].woffs = offs;
+        nodes[j].wsize = cur;
+        ith0 += nodes[j].nth;
+        offs += cur;
+    }
+    return offs <= work_size;
+}
+
+// node computed by all threads with the entire work buffer
+static void ggml_sched_node_init(struct ggml_sched_node * sn, int node_n, int n_threads, size_t work_size) {
+    sn->node_n = node_n;
+    sn->ith0   = 0;
+    sn->nth    = n_threads;
+    sn->woffs  = 0;
+    sn->wsize  = work_size;
+    sn->shared = NULL;
+}
+
+// returns NULL if the work buffer has no room for the schedule, the graph is then computed in lockstep
+static struct ggml_graph_sched * ggml_graph_sched_build(const struct ggml_cgraph * cgraph, const struct ggml_cplan * cplan, int n_threads) {
+    const int n_nodes = cgraph->n_nodes;
+
+    const size_t size = ggml_graph_sched_size(cgraph);
+    if (cplan->work_data == NULL || cplan->work_size < size) {
+        return NULL;
+    }
+    // the part of the work buffer that is left to the nodes
+    const size_t work_size = (cplan->work_size - size) & ~((size_t) CACHE_LINE_SIZE - 1);
+
+    char * buf = (char *) cplan->work_data + work_size;
+
+    struct ggml_graph_sched * sched = (struct ggml_graph_sched *) buf; buf += sizeof(struct ggml_graph_sched);
+    sched->groups  = (struct ggml_compute_state_shared *) buf;    buf += n_nodes*sizeof(struct ggml_compute_state_shared);
+    sched->nodes   = (struct ggml_sched_node *) buf;              buf += n_nodes*sizeof(struct ggml_sched_node);
+    sched->steps   = (struct ggml_sched_step *) buf;
+    sched->n_steps = 0;
+
+    const int max_concurrent = MIN(GGML_SCHED_MAX_CONCURRENT, n_threads);
+
+    int n_sched  = 0;
+    int n_groups = 0;
+
+    struct ggml_sched_step * step = NULL;
+
+    for (int node_n = 0; node_n < n_nodes; ++node_n) {
+        struct ggml_tensor * node = cgraph->nodes[node_n];
+
+        if (ggml_is_noop(node) || node->op == GGML_OP_NONE || ggml_is_empty(node)) {
+            continue;
+        }
+
+        bool join = step && step->n < max_concurrent &&
+                    ggml_sched_can_group(node) && !ggml_sched_may_fuse(cgraph, node_n) &&
+                    ggml_sched_can_group(cgraph->nodes[sched->nodes[step->first].node_n]) &&
+                    !ggml_sched_may_fuse(cgraph, sched->nodes[step->first].node_n);
+        for (int j = 0; join && j < step->n; ++j) {
+            join = !ggml_sched_conflict(node, cgraph->nodes[sched->nodes[step->first + j].node_n]);
+        }
+
+        ggml_sched_node_init(&sched->nodes[n_sched], node_n, n_threads, work_size);
+
+        if (join) {
+            if (ggml_sched_layout_step(cgraph, sched->nodes + step->first, step->n + 1, n_threads, work_size)) {
+                ++step->n;
+                ++n_sched;
+                continue;
+            }
+            // undo the layout of the failed attempt to add node
+            if (step->n > 1) {
+                ggml_sched_layout_step(cgraph, sched->nodes + step->first, step->n, n_threads, work_size);
+            } else {
+                ggml_sched_node_init(&sched->nodes[step->first], sched->nodes[step->first].node_n, n_threads, work_size);
+            }
+            ggml_sched_node_init(&sched->nodes[n_sched], node_n, n_threads, work_size);
+        }
+
+        step = &sched->steps[sched->n_steps++];
+        step->first = n_sched++;
+        step->n     = 1;
+    }
+
+    for (int i = 0; i < sched->n_steps; ++i) {
+        const struct ggml_sched_step * st = &sched->steps[i];
+        if (st->n == 1) {
+            continue;
+        }
+        for (int j = st->first; j < st->first + st->n; ++j) {
+            struct ggml_compute_state_shared * group = &sched->groups[n_groups++];
+            memset(group, 0, sizeof(*group));
+            group->cgraph    = cgraph;
+            group->cplan     = cplan;
+            group->n_threads = sched->nodes[j].nth;
+            group->subgroup  = true;
+            group->ec        = GGML_STATUS_SUCCESS;
+            atomic_store(&group->n_barrier, 0);
+            atomic_store(&group->n_barrier_passed, 0);
+            atomic_store(&group->current_chunk, 0);
+            sched->nodes[j].shared = group;
+        }
+    }
+
+    return sched;
+}
+
+static void ggml_graph_compute_thread_sched(struct ggml_compute_state * state) {
+    const struct ggml_cgraph      * cgraph = state->shared->cgraph;
+    const struct ggml_cplan       * cplan  = state->shared->cplan;
+    const struct ggml_graph_sched * sched  = state->shared->sched;
+
+    // node already computed by fusing it with the previous one
+    int skip_n = -1;
+
+    for (int i = 0; i < sched->n_steps; ++i) {
+        const struct ggml_sched_step * step = &sched->steps[i];
+
+        for (int j = step->first; j < step->first + step->n; ++j) {
+            const struct ggml_sched_node * sn = &sched->nodes[j];
+            if (sn->node_n == skip_n || state->ith < sn->ith0 || state->ith >= sn->ith0 + sn->nth) {
+                continue;
+            }
+            struct ggml_compute_params params = {
+                /*.ith   =*/ state->ith - sn->ith0,
+                /*.nth   =*/ sn->nth,
+                /*.wsize =*/ sn->wsize,
+                /*.wdata =*/ cplan->work_data ? cplan->work_data + sn->woffs : NULL,
+                /*.shared=*/ sn->shared ? sn->shared : state->shared,
+            };
+            // only nodes computed by all threads may be fused, then every thread skips the next node
+            struct ggml_tensor * next = !sn->shared && sn->node_n < cgraph->n_nodes-1 ? cgraph->nodes[sn->node_n+1] : NULL;
+            if (ggml_compute_forward(&params, cgraph->nodes[sn->node_n], next)) {
+                skip_n = sn->node_n + 1;
+            }
+            break;
+        }
+
+        if (state->ith == 0 && cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
+            state->shared->ec = GGML_STATUS_ABORTED;
+        }
+
+        ggml_barrier(state->shared);
+
+        if (state->shared->ec != GGML_STATUS_SUCCESS) {
+            break;
+        }
+    }
 }
 
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
 
+    if (state->shared->sched) {
+        ggml_graph_compute_thread_sched(state);
+        ggml_barrier_stats_flush();
+        return 0;
+    }
+
     const struct ggml_cgraph * cgraph = state->shared->cgraph;
     const struct ggml_cplan  * cplan  = state->shared->cplan;
 
-    set_numa_thread_affinity(state->ith);
-
     struct ggml_compute_params params = {
         /*.ith   =*/ state->ith,
         /*.nth   =*/ state->shared->n_threads,
@@ -22187,9 +23673,250 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     if (state->ith == 0) printf("ggml_barrier(...): %d us\n", (int)(t_end - t_start - t_eval));
 #endif
 
+    ggml_barrier_stats_flush();
+
     return 0;
 }
 
+#ifndef GGML_USE_OPENMP
+static thread_ret_t ggml_graph_compute_secondary_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+
+    set_numa_thread_affinity(state->ith);
+
+    return ggml_graph_compute_thread(state);
+}
+#endif
+
+//
+// persistent thread pool
+//
+// Workers are started once and pinned once. Between graphs they spin on a generation counter for a while
+// (token generation calls ggml_graph_compute() back-to-back, so the next graph usually arrives while they spin),
+// and then park on a futex (Linux) or a condition variable (everywhere else) so that an idle process does not
+// burn CPU.
+//
+
+#define GGML_THREADPOOL_N_SPIN 100000
+
+#if defined(GGML_USE_OPENMP)
+// the OpenMP runtime keeps its own threads around, the pool only remembers the thread count
+typedef int ggml_park_t;
+#elif defined(__gnu_linux__)
+typedef int ggml_park_t;
+static void ggml_park_init   (ggml_park_t * park) { UNUSED(park); }
+static void ggml_park_destroy(ggml_park_t * park) { UNUSED(park); }
+static void ggml_park_wait(ggml_park_t * park, atomic_int * gen, int gen_old) {
+    UNUSED(park);
+    syscall(SYS_futex, (int *) gen, FUTEX_WAIT_PRIVATE, gen_old, NULL, NULL, 0);
+}
+static void ggml_park_wake(ggml_park_t * park, atomic_int * gen) {
+    UNUSED(park);
+    syscall(SYS_futex, (int *) gen, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#elif defined(_WIN32)
+typedef struct {
+    SRWLOCK            lock;
+    CONDITION_VARIABLE cond;
+} ggml_park_t;
+static void ggml_park_init(ggml_park_t * park) {
+    InitializeSRWLock(&park->lock);
+    InitializeConditionVariable(&park->cond);
+}
+static void ggml_park_destroy(ggml_park_t * park) { UNUSED(park); }
+static void ggml_park_wait(ggml_park_t * park, atomic_int * gen, int gen_old) {
+    AcquireSRWLockExclusive(&park->lock);
+    while (atomic_load(gen) == gen_old) {
+        SleepConditionVariableSRW(&park->cond, &park->lock, INFINITE, 0);
+    }
+    ReleaseSRWLockExclusive(&park->lock);
+}
+static void ggml_park_wake(ggml_park_t * park, atomic_int * gen) {
+    UNUSED(gen);
+    AcquireSRWLockExclusive(&park->lock);
+    ReleaseSRWLockExclusive(&park->lock);
+    WakeAllConditionVariable(&park->cond);
+}
+#else
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+} ggml_park_t;
+static void ggml_park_init(ggml_park_t * park) {
+    pthread_mutex_init(&park->mutex, NULL);
+    pthread_cond_init(&park->cond, NULL);
+}
+static void ggml_park_destroy(ggml_park_t * park) {
+    pthread_cond_destroy(&park->cond);
+    pthread_mutex_destroy(&park->mutex);
+}
+static void ggml_park_wait(ggml_park_t * park, atomic_int * gen, int gen_old) {
+    pthread_mutex_lock(&park->mutex);
+    while (atomic_load(gen) == gen_old) {
+        pthread_cond_wait(&park->cond, &park->mutex);
+    }
+    pthread_mutex_unlock(&park->mutex);
+}
+static void ggml_park_wake(ggml_park_t * park, atomic_int * gen) {
+    UNUSED(gen);
+    // taking the mutex makes sure a worker cannot miss the wake-up between checking gen and going to sleep
+    pthread_mutex_lock(&park->mutex);
+    pthread_mutex_unlock(&park->mutex);
+    pthread_cond_broadcast(&park->cond);
+}
+#endif
+
+struct ggml_threadpool {
+    int n_threads; // including the thread that calls ggml_graph_compute()
+
+    struct ggml_compute_state * workers; // [n_threads], workers[0] is not started
+
+    struct ggml_compute_state_shared * shared; // the graph being computed
+
+    atomic_int n_graph;    // incremented by the main thread to start a graph
+    atomic_int n_active;   // workers that have not yet finished the current graph
+    atomic_int n_sleeping; // workers parked in ggml_park_wait()
+    atomic_int stop;
+
+    ggml_park_t park;
+};
+
+#ifndef GGML_USE_OPENMP
+static inline void ggml_threadpool_pause(void) {
+#if defined(__SSE3__)
+    _mm_pause();
+#elif defined __ARM_NEON
+    __asm__ __volatile__("isb\n");
+#endif
+}
+
+static int ggml_threadpool_wait_graph(struct ggml_threadpool * tp, int gen_old) {
+    for (int i = 0; i < GGML_THREADPOOL_N_SPIN; ++i) {
+        int gen = atomic_load(&tp->n_graph);
+        if (gen != gen_old) {
+            return gen;
+        }
+        ggml_threadpool_pause();
+    }
+    while (true) {
+        atomic_fetch_add(&tp->n_sleeping, 1);
+        ggml_park_wait(&tp->park, &tp->n_graph, gen_old);
+        atomic_fetch_sub(&tp->n_sleeping, 1);
+        int gen = atomic_load(&tp->n_graph);
+        if (gen != gen_old) {
+            return gen;
+        }
+    }
+}
+
+static thread_ret_t ggml_threadpool_worker(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool    * tp    = state->threadpool;
+
+    set_numa_thread_affinity(state->ith);
+
+    int gen = 0;
+    while (true) {
+        gen = ggml_threadpool_wait_graph(tp, gen);
+        if (atomic_load(&tp->stop)) {
+            break;
+        }
+        struct ggml_compute_state_shared * shared = tp->shared;
+        if (state->ith < shared->n_threads) {
+            state->shared = shared;
+            ggml_graph_compute_thread(state);
+        }
+        atomic_fetch_sub(&tp->n_active, 1);
+    }
+
+    return 0;
+}
+#endif
+
+ggml_threadpool_t ggml_threadpool_new(int n_threads) {
+    GGML_ASSERT(n_threads > 0);
+
+    struct ggml_threadpool * tp = GGML_CALLOC(1, sizeof(struct ggml_threadpool));
+    tp->n_threads = n_threads;
+    tp->workers   = GGML_CALLOC(n_threads, sizeof(struct ggml_compute_state));
+    atomic_store(&tp->n_graph,    0);
+    atomic_store(&tp->n_active,   0);
+    atomic_store(&tp->n_sleeping, 0);
+    atomic_store(&tp->stop,       0);
+
+    for (int j = 0; j < n_threads; ++j) {
+        tp->workers[j] = (struct ggml_compute_state) {
+            .thrd       = 0,
+            .ith        = j,
+            .shared     = NULL,
+            .threadpool = tp,
+        };
+    }
+
+#ifndef GGML_USE_OPENMP
+    ggml_park_init(&tp->park);
+
+    for (int j = 1; j < n_threads; ++j) {
+        const int rc = ggml_thread_create(&tp->workers[j].thrd, NULL, ggml_threadpool_worker, &tp->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+#endif
+
+    return tp;
+}
+
+void ggml_threadpool_free(ggml_threadpool_t tp) {
+    if (!tp) {
+        return;
+    }
+
+#ifndef GGML_USE_OPENMP
+    atomic_store(&tp->stop, 1);
+    atomic_fetch_add(&tp->n_graph, 1);
+    ggml_park_wake(&tp->park, &tp->n_graph);
+
+    for (int j = 1; j < tp->n_threads; ++j) {
+        const int rc = ggml_thread_join(tp->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    ggml_park_destroy(&tp->park);
+#endif
+
+    GGML_FREE(tp->workers);
+    GGML_FREE(tp);
+}
+
+int ggml_threadpool_get_n_threads(ggml_threadpool_t tp) {
+    return tp->n_threads;
+}
+
+#ifndef GGML_USE_OPENMP
+static void ggml_threadpool_compute(struct ggml_threadpool * tp, struct ggml_compute_state_shared * shared) {
+    tp->shared = shared;
+    atomic_store(&tp->n_active, tp->n_threads - 1);
+
+    // publish the graph, then wake up whoever went to sleep
+    // (a worker that registers as sleeping after this check sees the new generation in ggml_park_wait() and returns)
+    atomic_fetch_add(&tp->n_graph, 1);
+    if (atomic_load(&tp->n_sleeping) > 0) {
+        ggml_park_wake(&tp->park, &tp->n_graph);
+    }
+
+    // this is a work thread too
+    struct ggml_compute_state * state = &tp->workers[0];
+    state->shared = shared;
+    ggml_graph_compute_thread(state);
+
+    // shared lives on the stack of ggml_graph_compute(), so all workers must be done with it before we return
+    while (atomic_load(&tp->n_active) > 0) {
+        ggml_threadpool_pause();
+    }
+}
+#endif
+
 enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     GGML_ASSERT(cplan);
     GGML_ASSERT(cplan->n_threads > 0);
@@ -22200,7 +23927,9 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
     struct ggml_compute_state_shared state_shared = {
         /*.cgraph                  =*/ cgraph,
         /*.cgraph_plan             =*/ cplan,
+        /*.sched                   =*/ NULL,
         /*.n_threads               =*/ n_threads,
+        /*.subgroup                =*/ false,
         /*.n_barrier               =*/ 0,
         /*.n_barrier_passed        =*/ 0,
         /*.abort_callback          =*/ NULL,
@@ -22221,6 +23950,9 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
                 // update the number of threads from the actual number of threads that we got from OpenMP
                 n_threads = omp_get_num_threads();
                 state_shared.n_threads = n_threads;
+                if (!cplan->lockstep && n_threads > 1) {
+                    state_shared.sched = ggml_graph_sched_build(cgraph, cplan, n_threads);
+                }
             }
 
             struct ggml_compute_state worker = {
@@ -22228,6 +23960,7 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
                 .ith    = omp_get_thread_num(),
                 .shared = &state_shared,
             };
+            set_numa_thread_affinity(worker.ith);
             ggml_graph_compute_thread(&worker);
         }
 //#if IK_PRINT_TIMING
@@ -22240,9 +23973,22 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
             .ith    = 0,
             .shared = &state_shared,
         };
+        set_numa_thread_affinity(worker.ith);
         ggml_graph_compute_thread(&worker);
     }
 #else
+    if (!cplan->lockstep && n_threads > 1) {
+        state_shared.sched = ggml_graph_sched_build(cgraph, cplan, n_threads);
+    }
+
+    struct ggml_threadpool * tp = cplan->threadpool;
+    if (tp && tp->n_threads >= n_threads) {
+        set_numa_thread_affinity(0);
+        ggml_threadpool_compute(tp, &state_shared);
+        clear_numa_thread_affinity();
+        return state_shared.ec;
+    }
+
     struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
 
     for (int j = 0; j < n_threads; ++j) {
@@ -22255,13 +24001,13 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
 
     // create thread pool
     for (int j = 1; j < n_threads; ++j) {
-        const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
+        const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_secondary_thread, &workers[j]);
         GGML_ASSERT(rc == 0);
         UNUSED(rc);
     }
 
     // this is a work thread too
-    ggml_graph_compute_thread(&workers[0]);
+    ggml_graph_compute_secondary_thread(&workers[0]);
 
     // join or kill thread pool
     if (n_threads > 1) {
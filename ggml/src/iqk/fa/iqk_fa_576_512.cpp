@@ -9,7 +9,7 @@ namespace {
 template <int step_k, typename KHelper, typename VHelper>
 inline void iqk_deepseek_helper(KHelper& kh, VHelper& vh,
                         int nq1, int nk1, int stride_q, int stride_m, int stride_qkv,
-                        const float * q, const char * mask, float scale, float softcap, float * qkv, float * M, float * S) {
+                        const float * q, const char * mask, float scale, float softcap, float slope, bool skip_masked, float * qkv, float * M, float * S) {
     auto update = [&nq1, &mask, &q, &qkv, &M, &S, stride_q, stride_m, stride_qkv] (int n) {
         nq1 -= n;
         if (nq1 == 0) return true;
@@ -21,29 +21,29 @@ inline void iqk_deepseek_helper(KHelper& kh, VHelper& vh,
     };
     if (nq1 >= 16) {
         int n_step = nq1/16;
-        FlashAttn<576, 512, 16, step_k> fa(scale, softcap);
+        FlashAttn<576, 512, 16, step_k> fa(scale, softcap, slope, skip_masked);
         fa.compute(kh, vh, 16*n_step, nk1, stride_q, stride_m, stride_qkv, q, mask, qkv, M, S);
         if (update(16*n_step)) return;
     }
     if (nq1 >= 8) {
         int n_step = nq1/8;
-        FlashAttn<576, 512, 8, step_k> fa(scale, softcap);
+        FlashAttn<576, 512, 8, step_k> fa(scale, softcap, slope, skip_masked);
         fa.compute(kh, vh, 8*n_step, nk1, stride_q, stride_m, stride_qkv, q, mask, qkv, M, S);
         if (update(8*n_step)) return;
     }
     if (nq1 >= 4) {
         int n_step = nq1/4;
-        FlashAttn<576, 512, 4, step_k> fa(scale, softcap);
+        FlashAttn<576, 512, 4, step_k> fa(scale, softcap, slope, skip_masked);
         fa.compute(kh, vh, 4*n_step, nk1, stride_q, stride_m, stride_qkv, q, mask, qkv, M, S);
         if (update(4*n_step)) return;
     }
     if (nq1 >= 2) {
         int n_step = nq1/2;
-        FlashAttn<576, 512, 2, step_k> fa(scale, softcap);
+        FlashAttn<576, 512, 2, step_k> fa(scale, softcap, slope, skip_masked);
         fa.compute(kh, vh, 2*n_step, nk1, stride_q, stride_m, stride_qkv, q, mask, qkv, M, S);
         if (update(2*n_step)) return;
     }
-    FlashAttn<576, 512, 1, step_k> fa(scale, softcap);
+    FlashAttn<576, 512, 1, step_k> fa(scale, softcap, slope, skip_masked);
     fa.compute(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, qkv, M, S);
 }
 
@@ -51,37 +51,37 @@ template <int step_k>
 inline bool iqk_deepseek_helper(ggml_type type_k,
                         int nq1, int nk1, int stride_q, int stride_k, int stride_v, int stride_m, int stride_qkv,
                         const float * q, const char * k, const char * v, const char * mask,
-                        float scale, float softcap, float * qkv, float * M, float * S) {
+                        float scale, float softcap, float slope, bool skip_masked, float * qkv, float * M, float * S) {
     if (type_k == GGML_TYPE_Q8_0) {
         HelperQ80 kh((const char *)k, stride_k);
         HelperQ80 vh((const char *)v, stride_v);
-        iqk_deepseek_helper<step_k>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, qkv, M, S);
+        iqk_deepseek_helper<step_k>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         return true;
     }
     if (type_k == GGML_TYPE_Q8_0_R8) {
         HelperQ80R8<576> kh((const char *)k, stride_k);
         HelperQ80 vh((const char *)v, stride_v);
-        iqk_deepseek_helper<step_k>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, qkv, M, S);
+        iqk_deepseek_helper<step_k>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         return true;
     }
     if (type_k == GGML_TYPE_Q6_0) {
         HelperQ60 kh((const char *)k, stride_k);
         HelperQ60 vh((const char *)v, stride_v);
-        iqk_deepseek_helper<step_k>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, qkv, M, S);
+        iqk_deepseek_helper<step_k>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         return true;
     }
 #if GGML_IQK_FA_ALL_QUANTS
     if (type_k == GGML_TYPE_Q8_KV) {
         HelperQ8KV<576> kh((const char *)k, stride_k);
         HelperQ8KV<512> vh((const char *)v, stride_v);
-        iqk_deepseek_helper<step_k>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, qkv, M, S);
+        iqk_deepseek_helper<step_k>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         return true;
     }
 #endif
     if (type_k == GGML_TYPE_F16) {
         HelperF16 kh((const char *)k, stride_k);
         HelperF16 vh((const char *)v, stride_v);
-        iqk_deepseek_helper<step_k>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, qkv, M, S);
+        iqk_deepseek_helper<step_k>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         return true;
     }
 #ifdef __AVX512BF16__
@@ -89,10 +89,10 @@ inline bool iqk_deepseek_helper(ggml_type type_k,
         HelperBF16<576, step_k> kh((const char *)k, stride_k);
         HelperBF16<512, step_k> vh((const char *)v, stride_v);
         if (nq1 % 8 == 0) {
-            FlashAttnBF16<576, 512, 8, step_k> fa(scale, softcap);
+            FlashAttnBF16<576, 512, 8, step_k> fa(scale, softcap, slope, skip_masked);
             fa.compute(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, (const char *)mask, qkv, M, S);
         } else {
-            FlashAttnBF16<576, 512, 1, step_k> fa(scale, softcap);
+            FlashAttnBF16<576, 512, 1, step_k> fa(scale, softcap, slope, skip_masked);
             fa.compute(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, (const char *)mask, qkv, M, S);
         }
         return true;
@@ -113,7 +113,7 @@ IQK_FA_CASE(iqk_fa_576_512) {
     }
     stride_q /= sizeof(float); // q stride as float
     return iqk_deepseek_helper<32>(type_k, nq, nk, stride_q, stride_k, stride_v, stride_m, stride_qkv,
-                        q, (const char *)k, (const char *)v, (const char *)mask, scale, softcap, qkv, M, S);
+                        q, (const char *)k, (const char *)v, (const char *)mask, scale, softcap, slope, skip_masked, qkv, M, S);
 
 }
 
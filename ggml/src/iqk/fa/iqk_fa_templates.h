@@ -738,7 +738,11 @@ struct FlashMS {
 //#endif
     using cache_t = float;
 
-    FlashMS(float scale, float softcap) : vscale(F16::set1(scale)), softcap(softcap), h_inf(GGML_FP32_TO_FP16(-INFINITY)) {}
+    // slope > 0 is the ALiBi slope of the head: the mask then holds the (negative) distance of the KV cell to the
+    // token, and slope*mask is added to the scaled K*Q, instead of the mask just hiding the cells with -inf
+    // skip_masked: skip the blocks of KV cells that the mask hides from all rows of a q step (see is_masked_block)
+    FlashMS(float scale, float softcap, float slope, bool skip_masked) : vscale(F16::set1(scale)), softcap(softcap), slope(slope),
+        skip_masked(skip_masked), h_inf(GGML_FP32_TO_FP16(-INFINITY)) {}
 
     inline void init_qstep() {
         for (int j = 0; j < q_step; ++j) {
@@ -830,7 +834,21 @@ struct FlashMS {
         }
         return vmaxvq_f32(vmax);
     }
+    inline float load_apply_alibi_and_scale(int j, float32x4_t * vk, const char * mask) {
+        float32x4_t vmax = vdupq_n_f32(-INFINITY);
+        auto vscale32 = vcvt_f32_f16(vget_low_f16(vscale));
+        auto vslope   = vdupq_n_f32(slope);
+        auto v_softcap = vdupq_n_f32(softcap);
+        for (int l = 0; l < k_step/4; ++l) {
+            auto val = vmulq_f32(vscale32, vld1q_f32(cache + k_step*j + 4*l));
+            if (softcap > 0.0f) val = vmulq_f32(v_softcap, v_tanh(val));
+            vk[l] = vfmaq_f32(val, vslope, vcvt_f32_f16(vld1_f16((const float16_t *)mask + 4*l)));
+            vmax = vmaxq_f32(vmax, vk[l]);
+        }
+        return vmaxvq_f32(vmax);
+    }
     inline float load_apply_mask_and_scale(int j, float32x4_t * vk, const char * mask) {
+        if (slope > 0.0f) return load_apply_alibi_and_scale(j, vk, mask);
         auto vzero = vdupq_n_f16(0);
         auto vinf  = vdupq_n_f32(-INFINITY);
         for (int l = 0; l < k_step/8; ++l) {
@@ -890,7 +908,24 @@ struct FlashMS {
         return _mm512_or_ps(_mm512_and_ps(mf, val), _mm512_andnot_ps(mf, vinf));
     }
 #endif
+    inline float load_apply_alibi_and_scale(int j, F16::Data * vk, const char * mask) {
+        auto vslope = F16::set1(slope);
+        if (softcap <= 0) {
+            for (int l = 0; l < k_step/F16::block_size; ++l) {
+                auto val = F16::mul(vscale, F16::load(cache + k_step*j + F16::block_size*l));
+                vk[l] = F16::fmadd(val, vslope, F16::load(mask, l));
+            }
+        } else {
+            auto v_softcap = F16::set1(softcap);
+            for (int l = 0; l < k_step/F16::block_size; ++l) {
+                auto val = F16::mul(v_softcap, v_tanh(F16::mul(vscale, F16::load(cache + k_step*j + F16::block_size*l))));
+                vk[l] = F16::fmadd(val, vslope, F16::load(mask, l));
+            }
+        }
+        return F16::reduce_max<k_step>(vk);
+    }
     inline float load_apply_mask_and_scale(int j, F16::Data * vk, const char * mask) {
+        if (slope > 0.0f) return load_apply_alibi_and_scale(j, vk, mask);
 #ifdef HAVE_FANCY_SIMD
         auto vzero = _mm256_set1_epi16(0);
         auto vinf  = _mm512_set1_ps(-INFINITY);
@@ -952,6 +987,8 @@ struct FlashMS {
     float vms[q_step];
     const F16::Data vscale;
     const float  softcap;
+    const float  slope;
+    const bool   skip_masked;
     const ggml_half h_inf;
 
 };
@@ -1327,6 +1364,24 @@ struct FlashQKfp32 {
     }
 };
 
+// true if the mask hides all k_step KV cells from all nq rows of q, so that the block can be skipped.
+// With a paged KV cache large parts of the cache belong to other sequences, and skipping them makes the
+// kernels effectively gather the blocks of each sequence. The check is only done when the graph asks
+// for it (ggml_flash_attn_ext_set_skip_masked). The rows are scanned from the last one, which sees the
+// most of a causal mask.
+template <int k_step>
+static inline bool is_masked_block(int nq, int stride_m, const char * mask) {
+    constexpr uint16_t kMinusInf = 0xfc00; // fp16 -INFINITY
+    if (((const uint16_t *)(mask + (nq - 1)*stride_m))[0] != kMinusInf) return false;
+    for (int j = nq - 1; j >= 0; --j) {
+        auto mr = (const uint16_t *)(mask + j*stride_m);
+        for (int l = 0; l < k_step; ++l) {
+            if (mr[l] != kMinusInf) return false;
+        }
+    }
+    return true;
+}
+
 template <int Dk, int Dv, int q_step, int k_step, typename KHelper, typename VHelper, typename KQHelper>
 void compute_helper(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q, int stride_m, int stride_qkv,
         FlashMS<q_step, k_step>& fms,
@@ -1346,6 +1401,12 @@ void compute_helper(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q, in
 #endif
         auto mr = mask;
         for (int k1 = 0; k1 < nk1/k_step; ++k1) {
+            if (fms.skip_masked && is_masked_block<k_step>(q_step, stride_m, mr)) {
+                kh.next_block(k_step);
+                vh.next_block(k_step);
+                mr += k_step*sizeof(ggml_half);
+                continue;
+            }
 #ifdef __aarch64__
             KQHelper::multiply_mask_kq(kh, Dk, stride_m, q_f16, mr, fms);
 #else
@@ -1373,6 +1434,12 @@ void compute_helper(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q, in
 #endif
         auto mr = mask;
         for (int k1 = 0; k1 < nk1/k_step; ++k1) {
+            if (fms.skip_masked && is_masked_block<k_step>(n_left, stride_m, mr)) {
+                kh.next_block(k_step);
+                vh.next_block(k_step);
+                mr += k_step*sizeof(ggml_half);
+                continue;
+            }
 #ifdef __aarch64__
             KQHelper::multiply_mask_kq(n_left, kh, Dk, stride_m, q_f16, mr, fms);
 #else
@@ -1405,6 +1472,12 @@ void compute_helper_q(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q,
             HelperQ80::convert<Dk>(q_step, stride_q, q, q8r);
             auto mr = mask;
             for (int k1 = 0; k1 < nk1/k_step; ++k1) {
+                if (fms.skip_masked && is_masked_block<k_step>(q_step, stride_m, mr)) {
+                    kh.next_block(k_step);
+                    vh.next_block(k_step);
+                    mr += k_step*sizeof(ggml_half);
+                    continue;
+                }
                 HelperQ80R8<Dk>::repack(k_step, kh.block, kh.stride, q8r8);
                 KQHelper::mul_mask_kq(khr8, stride_m, q8r, mr, fms);
                 fqkv.accumulate_qkv(vh, fms);
@@ -1432,6 +1505,12 @@ void compute_helper_q(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q,
 #endif
         auto mr = mask;
         for (int k1 = 0; k1 < nk1/k_step; ++k1) {
+            if (fms.skip_masked && is_masked_block<k_step>(q_step, stride_m, mr)) {
+                kh.next_block(k_step);
+                vh.next_block(k_step);
+                mr += k_step*sizeof(ggml_half);
+                continue;
+            }
 #if FA_TIMING
             t1 = Perf::cur_time();
             KQHelper::mul_mask_kq(kh, stride_m, q8, mr, fms);
@@ -1468,6 +1547,12 @@ void compute_helper_q(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q,
         HelperQ80::convert<Dk>(n_left, stride_q, q, q8);
         auto mr = mask;
         for (int k1 = 0; k1 < nk1/k_step; ++k1) {
+            if (fms.skip_masked && is_masked_block<k_step>(n_left, stride_m, mr)) {
+                kh.next_block(k_step);
+                vh.next_block(k_step);
+                mr += k_step*sizeof(ggml_half);
+                continue;
+            }
             KQHelper::mul_mask_kq(n_left, kh, stride_m, q8, mr, fms);
             fqkv.accumulate_qkv(n_left, vh, fms);
             kh.next_block(k_step);
@@ -1504,7 +1589,7 @@ struct FlashAttn {
     static_assert(k_step%F16::block_size == 0);
     static_assert(q_step <= 4 || q_step%4 == 0);
 
-    FlashAttn(float scale, float softcap) : fms(scale, softcap) {}
+    FlashAttn(float scale, float softcap, float slope, bool skip_masked) : fms(scale, softcap, slope, skip_masked) {}
 
     template <typename KHelper, typename VHelper>
     void compute(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q, int stride_m, int stride_qkv,
@@ -1736,9 +1821,9 @@ struct FlashQKbf16 {
                 }
             }
         }
-        __m512 vk[k_step/16];
+        F16::Data vk[k_step/16];
         for (int j = 0; j < q_step; ++j) {
-            fms.update_M_S(j, vk);
+            fms.update_M_S(j, vk, mask + stride_m*j);
         }
     }
 
@@ -1885,9 +1970,9 @@ struct FlashQKbf16 {
                 }
             }
         }
-        __m512 vk[k_step/16];
+        F16::Data vk[k_step/16];
         for (int j = 0; j < nq; ++j) {
-            fms.update_M_S(j, vk);
+            fms.update_M_S(j, vk, mask + stride_m*j);
         }
     }
 
@@ -1927,7 +2012,7 @@ struct FlashAttnBF16 {
     static_assert(k_step%32 == 0);
     static_assert(q_step <= 4 || q_step%4 == 0);
 
-    FlashAttnBF16(float scale, float softcap) : fms(scale, softcap) {}
+    FlashAttnBF16(float scale, float softcap, float slope, bool skip_masked) : fms(scale, softcap, slope, skip_masked) {}
 
     template <typename KHelper, typename VHelper>
     void compute(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q, int stride_m, int stride_qkv,
@@ -2004,7 +2089,7 @@ struct FlashAttnBF16 {
 
 template <int Dk, int Dv, int k_step, typename KHelper, typename VHelper>
 inline void iqk_flash_helper(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q, int stride_m, int stride_qkv,
-                        const float * q, const char * mask, float scale, float softcap, float * qkv, float * M, float * S) {
+                        const float * q, const char * mask, float scale, float softcap, float slope, bool skip_masked, float * qkv, float * M, float * S) {
 
     auto update = [&nq1, &mask, &q, &qkv, &M, &S, stride_q, stride_m, stride_qkv] (int n) {
         nq1 -= n;
@@ -2018,48 +2103,48 @@ inline void iqk_flash_helper(KHelper& kh, VHelper& vh, int nq1, int nk1, int str
     if (nk1 >= 512) {
         if (nq1 >= 128) {
             int n_step = nq1/128;
-            FlashAttn<Dk, Dv, 64, k_step> fa(scale, softcap);
+            FlashAttn<Dk, Dv, 64, k_step> fa(scale, softcap, slope, skip_masked);
             fa.compute(kh, vh, 128*n_step, nk1, stride_q, stride_m, stride_qkv, q, (const char *)mask, qkv, M, S);
             if (update(128*n_step)) return;
         }
         if (nq1 >= 64) {
             int n_step = nq1/64;
-            FlashAttn<Dk, Dv, 64, k_step> fa(scale, softcap);
+            FlashAttn<Dk, Dv, 64, k_step> fa(scale, softcap, slope, skip_masked);
             fa.compute(kh, vh, 64*n_step, nk1, stride_q, stride_m, stride_qkv, q, (const char *)mask, qkv, M, S);
             if (update(64*n_step)) return;
         }
         if (nq1 >= 32) {
             int n_step = nq1/32;
-            FlashAttn<Dk, Dv, 32, k_step> fa(scale, softcap);
+            FlashAttn<Dk, Dv, 32, k_step> fa(scale, softcap, slope, skip_masked);
             fa.compute(kh, vh, 32*n_step, nk1, stride_q, stride_m, stride_qkv, q, (const char *)mask, qkv, M, S);
             if (update(32*n_step)) return;
         }
         if (nq1 >= 16) {
             int n_step = nq1/16;
-            FlashAttn<Dk, Dv, 16, k_step> fa(scale, softcap);
+            FlashAttn<Dk, Dv, 16, k_step> fa(scale, softcap, slope, skip_masked);
             fa.compute(kh, vh, 16*n_step, nk1, stride_q, stride_m, stride_qkv, q, (const char *)mask, qkv, M, S);
             if (update(16*n_step)) return;
         }
     }
     if (nq1 >= 8) {
         int n_step = nq1/8;
-        FlashAttn<Dk, Dv, 8, k_step> fa(scale, softcap);
+        FlashAttn<Dk, Dv, 8, k_step> fa(scale, softcap, slope, skip_masked);
         fa.compute(kh, vh, 8*n_step, nk1, stride_q, stride_m, stride_qkv, q, (const char *)mask, qkv, M, S);
         if (update(8*n_step)) return;
     }
     else if (nq1 >= 4) {
         int n_step = nq1/4;
-        FlashAttn<Dk, Dv, 4, k_step> fa(scale, softcap);
+        FlashAttn<Dk, Dv, 4, k_step> fa(scale, softcap, slope, skip_masked);
         fa.compute(kh, vh, 4*n_step, nk1, stride_q, stride_m, stride_qkv, q, (const char *)mask, qkv, M, S);
         if (update(4*n_step)) return;
     }
     else if (nq1 >= 2) {
         int n_step = nq1/2;
-        FlashAttn<Dk, Dv, 2, k_step> fa(scale, softcap);
+        FlashAttn<Dk, Dv, 2, k_step> fa(scale, softcap, slope, skip_masked);
         fa.compute(kh, vh, 2*n_step, nk1, stride_q, stride_m, stride_qkv, q, (const char *)mask, qkv, M, S);
         if (update(2*n_step)) return;
     }
-    FlashAttn<Dk, Dv, 1, k_step> fa(scale, softcap);
+    FlashAttn<Dk, Dv, 1, k_step> fa(scale, softcap, slope, skip_masked);
     fa.compute(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, (const char *)mask, qkv, M, S);
 }
 
@@ -2067,26 +2152,26 @@ inline void iqk_flash_helper(KHelper& kh, VHelper& vh, int nq1, int nk1, int str
 template <int Dk, int Dv, int k_step>
 inline void iqk_flash_helper_T(int nq1, int nk1, int stride_q, int stride_k, int stride_v, int stride_m, int stride_qkv,
                         const float * q, const char * k, const char * v, const char * mask,
-                        float scale, float softcap, float * qkv, float * M, float * S) {
+                        float scale, float softcap, float slope, bool skip_masked, float * qkv, float * M, float * S) {
     HelperBF16<Dk, k_step> kh(k, stride_k);
     HelperBF16<Dv, k_step> vh(v, stride_v);
     if (nk1 >= 4096) {
         if (nq1 >= 64) {
-            FlashAttnBF16<Dk, Dv, 64, k_step> fa(scale, softcap);
+            FlashAttnBF16<Dk, Dv, 64, k_step> fa(scale, softcap, slope, skip_masked);
             fa.compute(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, (const char *)mask, qkv, M, S);
             return;
         }
         else if (nq1 >= 16) {
-            FlashAttnBF16<Dk, Dv, 16, k_step> fa(scale, softcap);
+            FlashAttnBF16<Dk, Dv, 16, k_step> fa(scale, softcap, slope, skip_masked);
             fa.compute(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, (const char *)mask, qkv, M, S);
             return;
         }
     }
     if (nq1 >= 8) {
-        FlashAttnBF16<Dk, Dv, 8, k_step> fa(scale, softcap);
+        FlashAttnBF16<Dk, Dv, 8, k_step> fa(scale, softcap, slope, skip_masked);
         fa.compute(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, (const char *)mask, qkv, M, S);
     } else {
-        FlashAttnBF16<Dk, Dv, 1, k_step> fa(scale, softcap);
+        FlashAttnBF16<Dk, Dv, 1, k_step> fa(scale, softcap, slope, skip_masked);
         fa.compute(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, (const char *)mask, qkv, M, S);
     }
 }
@@ -2096,43 +2181,43 @@ template <int Dk, int Dv, int k_step, typename KHelper>
 inline bool iqk_flash_helper_T(KHelper& kh, ggml_type type_v,
                         int nq1, int nk1, int stride_q, int stride_v, int stride_m, int stride_qkv,
                         const float * q, const char * v, const char * mask,
-                        float scale, float softcap, float * qkv, float * M, float * S) {
+                        float scale, float softcap, float slope, bool skip_masked, float * qkv, float * M, float * S) {
 
     switch (type_v) {
         case GGML_TYPE_F16: {
             HelperF16 vh(v, stride_v);
-            iqk_flash_helper<Dk, Dv, k_step>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, qkv, M, S);
+            iqk_flash_helper<Dk, Dv, k_step>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         } break;
 #ifdef __AVX512BF16__
         case GGML_TYPE_BF16: {
             HelperBF16<Dv, k_step> vh(v, stride_v);
-            iqk_flash_helper<Dk, Dv, k_step>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, qkv, M, S);
+            iqk_flash_helper<Dk, Dv, k_step>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         } break;
 #endif
         case GGML_TYPE_Q8_0: {
             HelperQ80 vh(v, stride_v);
-            iqk_flash_helper<Dk, Dv, k_step>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, qkv, M, S);
+            iqk_flash_helper<Dk, Dv, k_step>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         } break;
         case GGML_TYPE_Q8_KV: {
             HelperQ8KV<Dv> vh(v, stride_v);
-            iqk_flash_helper<Dk, Dv, k_step>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, qkv, M, S);
+            iqk_flash_helper<Dk, Dv, k_step>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         } break;
         case GGML_TYPE_Q6_0: {
             HelperQ60 vh(v, stride_v);
-            iqk_flash_helper<Dk, Dv, k_step>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, qkv, M, S);
+            iqk_flash_helper<Dk, Dv, k_step>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         } break;
 #if GGML_IQK_FA_ALL_QUANTS
         case GGML_TYPE_Q4_0: {
             HelperQ40 vh(v, stride_v);
-            iqk_flash_helper<Dk, Dv, k_step>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, qkv, M, S);
+            iqk_flash_helper<Dk, Dv, k_step>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         } break;
         case GGML_TYPE_Q4_1: {
             HelperQ41 vh(v, stride_v);
-            iqk_flash_helper<Dk, Dv, k_step>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, qkv, M, S);
+            iqk_flash_helper<Dk, Dv, k_step>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         } break;
         case GGML_TYPE_IQ4_NL: {
             HelperIQ4nl vh(v, stride_v);
-            iqk_flash_helper<Dk, Dv, k_step>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, qkv, M, S);
+            iqk_flash_helper<Dk, Dv, k_step>(kh, vh, nq1, nk1, stride_q, stride_m, stride_qkv, q, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         } break;
 #endif
         default: return false;
@@ -2144,42 +2229,42 @@ template <int Dk, int Dv, int k_step>
 inline bool iqk_flash_helper_T(ggml_type type_k, ggml_type type_v,
                         int nq1, int nk1, int stride_q, int stride_k, int stride_v, int stride_m, int stride_qkv,
                         const float * q, const char * k, const char * v, const char * mask,
-                        float scale, float softcap, float * qkv, float * M, float * S) {
+                        float scale, float softcap, float slope, bool skip_masked, float * qkv, float * M, float * S) {
 
     bool result = false;
     switch (type_k) {
         case GGML_TYPE_F16: {
             HelperF16 kh(k, stride_k);
-            result = iqk_flash_helper_T<Dk, Dv, k_step>(kh, type_v, nq1, nk1, stride_q, stride_v, stride_m, stride_qkv, q, v, mask, scale, softcap, qkv, M, S);
+            result = iqk_flash_helper_T<Dk, Dv, k_step>(kh, type_v, nq1, nk1, stride_q, stride_v, stride_m, stride_qkv, q, v, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         } break;
         case GGML_TYPE_Q8_0: {
             HelperQ80 kh(k, stride_k);
-            result = iqk_flash_helper_T<Dk, Dv, k_step>(kh, type_v, nq1, nk1, stride_q, stride_v, stride_m, stride_qkv, q, v, mask, scale, softcap, qkv, M, S);
+            result = iqk_flash_helper_T<Dk, Dv, k_step>(kh, type_v, nq1, nk1, stride_q, stride_v, stride_m, stride_qkv, q, v, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         } break;
         case GGML_TYPE_Q8_0_R8: {
             HelperQ80R8<Dk> kh(k, stride_k);
-            result = iqk_flash_helper_T<Dk, Dv, k_step>(kh, type_v, nq1, nk1, stride_q, stride_v, stride_m, stride_qkv, q, v, mask, scale, softcap, qkv, M, S);
+            result = iqk_flash_helper_T<Dk, Dv, k_step>(kh, type_v, nq1, nk1, stride_q, stride_v, stride_m, stride_qkv, q, v, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         } break;
         case GGML_TYPE_Q6_0: {
             HelperQ60 kh(k, stride_k);
-            result = iqk_flash_helper_T<Dk, Dv, k_step>(kh, type_v, nq1, nk1, stride_q, stride_v, stride_m, stride_qkv, q, v, mask, scale, softcap, qkv, M, S);
+            result = iqk_flash_helper_T<Dk, Dv, k_step>(kh, type_v, nq1, nk1, stride_q, stride_v, stride_m, stride_qkv, q, v, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         } break;
 #if GGML_IQK_FA_ALL_QUANTS
         case GGML_TYPE_Q8_KV: {
             HelperQ8KV<Dk> kh(k, stride_k);
-            result = iqk_flash_helper_T<Dk, Dv, k_step>(kh, type_v, nq1, nk1, stride_q, stride_v, stride_m, stride_qkv, q, v, mask, scale, softcap, qkv, M, S);
+            result = iqk_flash_helper_T<Dk, Dv, k_step>(kh, type_v, nq1, nk1, stride_q, stride_v, stride_m, stride_qkv, q, v, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         } break;
         case GGML_TYPE_Q4_0: {
             HelperQ40 kh(k, stride_k);
-            result = iqk_flash_helper_T<Dk, Dv, k_step>(kh, type_v, nq1, nk1, stride_q, stride_v, stride_m, stride_qkv, q, v, mask, scale, softcap, qkv, M, S);
+            result = iqk_flash_helper_T<Dk, Dv, k_step>(kh, type_v, nq1, nk1, stride_q, stride_v, stride_m, stride_qkv, q, v, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         } break;
         case GGML_TYPE_Q4_1: {
             HelperQ41 kh(k, stride_k);
-            result = iqk_flash_helper_T<Dk, Dv, k_step>(kh, type_v, nq1, nk1, stride_q, stride_v, stride_m, stride_qkv, q, v, mask, scale, softcap, qkv, M, S);
+            result = iqk_flash_helper_T<Dk, Dv, k_step>(kh, type_v, nq1, nk1, stride_q, stride_v, stride_m, stride_qkv, q, v, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         } break;
         case GGML_TYPE_IQ4_NL: {
             HelperIQ4nl kh(k, stride_k);
-            result = iqk_flash_helper_T<Dk, Dv, k_step>(kh, type_v, nq1, nk1, stride_q, stride_v, stride_m, stride_qkv, q, v, mask, scale, softcap, qkv, M, S);
+            result = iqk_flash_helper_T<Dk, Dv, k_step>(kh, type_v, nq1, nk1, stride_q, stride_v, stride_m, stride_qkv, q, v, mask, scale, softcap, slope, skip_masked, qkv, M, S);
         } break;
 #endif
         default: break;
@@ -2193,7 +2278,7 @@ inline bool iqk_flash_helper_T(ggml_type type_k, ggml_type type_v,
 #define IQK_FA_CASE(name) bool name(int int_type_k, int int_type_v,int nq,int nk,\
                          int stride_q, int stride_k, int stride_v, int stride_m, int stride_qkv,\
                          const float * q, const void * k, const void * v, const void * mask,\
-                         float scale, float softcap,\
+                         float scale, float softcap, float slope, bool skip_masked,\
                          float       * qkv, float * M, float * S)
 
 IQK_FA_CASE(iqk_fa_576_512);
@@ -47,7 +47,7 @@ inline void accumulate_qkv(int Dv, float& M, float& S, float Mj, float Sj, float
 
 // TODO: get the ggml_type enum here without polution
 //
-extern "C" IQK_API bool iqk_flash_attn_noalibi(int type_q, int type_mask, float max_bias,
+extern "C" IQK_API bool iqk_flash_attn(int type_q, int type_mask, float max_bias,
                             int neq3, int neq2, long nbq3, long nbq2,
                             int nek3, int nek2, long nbk3, long nbk2,
                             int nev3, int nev2, long nbv3, long nbv2,
@@ -68,11 +68,20 @@ extern "C" IQK_API bool iqk_flash_attn_noalibi(int type_q, int type_mask, float
                             const void  * mask,     // mask. If not null, assumed to be fp16. nq x nk elements
                             float         scale,    // scale applied before softmax
                             float         softcap,  // if > 0, a "soft-cap" operation is applied before softmax
+                            bool          skip_masked, // skip the blocks of k/v that the mask hides from all rows of q
                             float       * qkv,      // v*softmax(scale*(k*q))
                             [[maybe_unused]] void * work_buffer_in, [[maybe_unused]] barrier_t barrier, [[maybe_unused]] void * barrier_data,
                             int ith, int nth) {
 
-    if (type_q != 0 || type_mask != 1 || max_bias > 0) return false;
+    if (type_q != 0 || type_mask != 1) return false;
+
+    // ALiBi: per-head slopes, computed as in ggml_compute_forward_flash_attn_ext_f16
+    const uint32_t n_head_log2 = 1u << (uint32_t) floor(log2(neq2));
+    const float m0 = powf(2.0f, -(max_bias       ) / n_head_log2);
+    const float m1 = powf(2.0f, -(max_bias / 2.0f) / n_head_log2);
+    auto head_slope = [max_bias, n_head_log2, m0, m1] (uint32_t h) {
+        return max_bias > 0 ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 0.0f;
+    };
 
     int rk2 = neq2/nek2;
     int rv2 = neq2/nev2;
@@ -106,7 +115,9 @@ extern "C" IQK_API bool iqk_flash_attn_noalibi(int type_q, int type_mask, float
     // (especially when combining the results from the threads).
     // So, for now, making it work just for MLA (nek2 = 1).
     // I think it would also speed up things for GQA, but I'm leaving this for another day.
-    if (neq3 == 1 && rk2 > 1 && neq1 == 1 && nth >= 1 && nek1/32 > 1 && nek2 == 1) {
+    // The two paths below process the heads that share a K/V head as the rows of q, so they cannot have
+    // per-head ALiBi slopes. ALiBi models do not use GQA anyway.
+    if (max_bias <= 0 && neq3 == 1 && rk2 > 1 && neq1 == 1 && nth >= 1 && nek1/32 > 1 && nek2 == 1) {
         int nstep_k = nek1/32;
         int gcd_k   = simple_gcd(nstep_k, nth);
         if (gcd_k >= 1) {
@@ -140,7 +151,7 @@ extern "C" IQK_API bool iqk_flash_attn_noalibi(int type_q, int type_mask, float
                 if (!iqk_flash_attn_impl(int_type_k, int_type_v,
                             Dk, Dv, nq_this_thread, nek1/gcd_k, nbq2, stride_k, stride_v, 0, Dv, //Dk*sizeof(uint16_t), Dv,
                             (const float *)qth, (const void *)kth, (const void *)vth, (const void *)mth,
-                            scale, softcap,
+                            scale, softcap, 0.0f, skip_masked,
                             work_this_thread, work_this_thread + (Dv+0)*nq_this_thread, work_this_thread + (Dv+1)*nq_this_thread)) return false;
 
                 barrier(barrier_data);
@@ -179,7 +190,7 @@ extern "C" IQK_API bool iqk_flash_attn_noalibi(int type_q, int type_mask, float
         }
     }
 
-    if (neq3 == 1 && rk2 > 1 && rk2 == rv2 && neq1 == 1 && nth >= 1 && nek2*nek1 >= 32*nth) {
+    if (max_bias <= 0 && neq3 == 1 && rk2 > 1 && rk2 == rv2 && neq1 == 1 && nth >= 1 && nek2*nek1 >= 32*nth) {
         auto result_size = (Dv + 16)*rk2*sizeof(float);
         int gcd = simple_gcd(nek2, nth);
         if (false && gcd > 1) {
@@ -204,7 +215,7 @@ extern "C" IQK_API bool iqk_flash_attn_noalibi(int type_q, int type_mask, float
                 if (!iqk_flash_attn_impl(int_type_k, int_type_v,
                             Dk, Dv, rk2, nek1_thread, nbq2, stride_k, stride_v, 0, Dv,
                             this_q, (const void *)this_k, (const void *)this_v, (const void *)this_m,
-                            scale, softcap, this_result, this_result + (Dv+0)*rk2, this_result + (Dv+1)*rk2)) return false;
+                            scale, softcap, 0.0f, skip_masked, this_result, this_result + (Dv+0)*rk2, this_result + (Dv+1)*rk2)) return false;
             }
 
             barrier(barrier_data);
@@ -260,7 +271,7 @@ extern "C" IQK_API bool iqk_flash_attn_noalibi(int type_q, int type_mask, float
             if (!iqk_flash_attn_impl(int_type_k, int_type_v,
                      Dk, Dv, rk2, this_nk, nbq2, stride_k, stride_v, 0, Dv,
                      this_q, (const void *)this_k, (const void *)this_v, (const void *)this_m,
-                     scale, softcap, this_result, this_result + (Dv+0)*rk2, this_result + (Dv+1)*rk2)) return false;
+                     scale, softcap, 0.0f, skip_masked, this_result, this_result + (Dv+0)*rk2, this_result + (Dv+1)*rk2)) return false;
         }
 
         barrier(barrier_data);
@@ -315,7 +326,7 @@ extern "C" IQK_API bool iqk_flash_attn_noalibi(int type_q, int type_mask, float
                         (const void  *)((const char *)k + iq2/rk2*nbk2 + iq3/rk3*nbk3),
                         (const void  *)((const char *)v + iq2/rv2*nbv2 + iq3/rv3*nbv3),
                         (const void  *)((const char *)mask + iq1*stride_m),
-                        scale, softcap,
+                        scale, softcap, head_slope(iq2), skip_masked,
                         (float *)((char *)qkv + (iq3*ne2*ne1 + iq2 + iq1*ne1)*nb1), nullptr, nullptr)) return false;
             }
         }
@@ -326,7 +337,7 @@ extern "C" IQK_API bool iqk_flash_attn_noalibi(int type_q, int type_mask, float
 
 #else
 
-bool iqk_flash_attn_noalibi([[maybe_unused]] int type_q, [[maybe_unused]] int type_mask, [[maybe_unused]] float max_bias,
+bool iqk_flash_attn([[maybe_unused]] int type_q, [[maybe_unused]] int type_mask, [[maybe_unused]] float max_bias,
                             [[maybe_unused]] int neq3, [[maybe_unused]] int neq2, [[maybe_unused]] long nbq3, [[maybe_unused]] long nbq2,
                             [[maybe_unused]] int nek3, [[maybe_unused]] int nek2, [[maybe_unused]] long nbk3, [[maybe_unused]] long nbk2,
                             [[maybe_unused]] int nev3, [[maybe_unused]] int nev2, [[maybe_unused]] long nbv3, [[maybe_unused]] long nbv2,
@@ -347,6 +358,7 @@ bool iqk_flash_attn_noalibi([[maybe_unused]] int type_q, [[maybe_unused]] int ty
                             [[maybe_unused]] const void  * mask,     // mask. If not null, assumed to be fp16. nq x nk elements
                             [[maybe_unused]] float         scale,    // scale applied before softmax
                             [[maybe_unused]] float         softcap,  // if > 0, a "soft-cap" operation is applied before softmax
+                            [[maybe_unused]] bool          skip_masked, // skip the blocks of k/v that the mask hides from all rows of q
                             [[maybe_unused]] float       * qkv,      // v*softmax(scale*(k*q))
                             [[maybe_unused]] void * work_buffer, [[maybe_unused]] barrier_t barrier, [[maybe_unused]] void * barrier_data,
                             [[maybe_unused]] int ith, [[maybe_unused]] int nth) {
@@ -25,6 +25,8 @@ bool iqk_flash_attn_impl(int type_k,             // type of k
                          const void  * mask,     // mask. If not null, assumed to be fp16. nq x nk elements
                          float         scale,    // scale applied before softmax
                          float         softcap,  // if > 0, a "soft-cap" operation is applied before softmax
+                         float         slope,    // if > 0, the ALiBi slope of the head, applied to the mask
+                         bool          skip_masked, // skip the blocks of k/v that the mask hides from all rows of q
                          float       * qkv,      // v*softmax(scale*(k*q))
                          float       * M,
                          float       * S);
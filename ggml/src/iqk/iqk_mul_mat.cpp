@@ -11,6 +11,7 @@
 
 #if defined IQK_IMPLEMENT
 
+#include <atomic>
 #include <cstring>
 #include <type_traits>
 #include <vector>
@@ -486,6 +487,122 @@ extern "C" IQK_API int iqk_dequant_type(int type, int Ny) {
     return MulMat::is_dequant_better(ggml_type(type), Ny);
 }
 
+namespace {
+//
+// One slot per thread, each in its own cache line. Owner and thieves both advance next with fetch_add,
+// so overshooting end is harmless.
+//
+struct WorkQueueSlot {
+    std::atomic<long> next;
+    long end;
+};
+constexpr size_t k_work_queue_slot_size = 64;
+static_assert(sizeof(WorkQueueSlot) <= k_work_queue_slot_size);
+
+inline WorkQueueSlot * work_queue_slot(void * queue, int i) {
+    return (WorkQueueSlot *)((char *)queue + i*k_work_queue_slot_size);
+}
+
+long work_queue_next(void * queue, int ith, int nth) {
+    for (int k = 0; k < nth; ++k) {
+        auto slot = work_queue_slot(queue, (ith + k) % nth);
+        if (slot->next.load(std::memory_order_relaxed) >= slot->end) continue;
+        auto tile = slot->next.fetch_add(1, std::memory_order_relaxed);
+        if (tile < slot->end) return tile;
+    }
+    return -1;
+}
+
+bool can_mul_mat(int typeA, int typeB, long ne00, long Ny) {
+    MulMat mm;
+    auto dequant_type = MulMat::is_dequant_better(ggml_type(typeA), Ny);
+    return MulMat::prepare(dequant_type, typeB, ne00, mm, Ny);
+}
+}
+
+extern "C" IQK_API size_t iqk_work_queue_size(int nth) {
+    return nth*k_work_queue_slot_size;
+}
+
+extern "C" IQK_API void iqk_work_queue_init(void * queue, long ntiles, int nth) {
+    for (int i = 0; i < nth; ++i) {
+        auto slot = new (work_queue_slot(queue, i)) WorkQueueSlot;
+        slot->next.store(ntiles*i/nth, std::memory_order_relaxed);
+        slot->end = ntiles*(i+1)/nth;
+    }
+}
+
+extern "C" IQK_API long iqk_mul_mat_tile_rows(long Nx, long Ny, long n_mat, int nth) {
+    constexpr long k_min_rows = 32; // multiple of the row interleaving of all repacked types and of the dequantization step
+    if (nth < 2 || Nx%k_min_rows != 0 || Nx*n_mat < 2*k_min_rows*nth) return 0;
+    // For small Ny a tile costs the same as a re-read of its weight rows, so we can afford more tiles.
+    // For large Ny each tile re-reads all of B, so keep them bigger.
+    long tiles_per_thread = Ny < 32 ? 4 : 2;
+    long tile_rows = k_min_rows*(Nx*n_mat/(tiles_per_thread*nth*k_min_rows));
+    return std::max(k_min_rows, std::min(tile_rows, Nx));
+}
+
+extern "C" IQK_API bool iqk_mul_mat_ws(long Nx, long Ny, long ne00,
+        int typeA, const void * A, long strideA,
+        int typeB, const void * B, long strideB,
+        float * C, long stride_C, long tile_rows, void * queue, int ith, int nth) {
+
+    if (!can_mul_mat(typeA, typeB, ne00, Ny)) return false;
+
+    long tile;
+    while ((tile = work_queue_next(queue, ith, nth)) >= 0) {
+        long first = tile*tile_rows;
+        long nrows = std::min(tile_rows, Nx - first);
+        if (!iqk_mul_mat(nrows, Ny, ne00, typeA, (const char *)A + first*strideA, strideA, typeB, B, strideB,
+                    C + first, stride_C, 0, 1)) {
+            GGML_ABORT("Fatal error");
+        }
+    }
+    return true;
+}
+
+extern "C" IQK_API bool iqk_mul_mat_moe_ws(long Nx, long ne00, int ne11, int n_as,
+        int typeA, const void * A, long strideA, long strideA_as,
+        int typeB, const void * B, long strideB,
+        float * C, long nb1, long nb2,
+        const int64_t * matrix_row_counts, const void * matrix_rows, long row_stride,
+        long tile_rows, void * queue, int ith, int nth) {
+
+    const mmid_row_mapping * row_mapping = (const mmid_row_mapping *)matrix_rows;
+
+    for (int i = 0; i < n_as; ++i) {
+        if (matrix_row_counts[i] > 0 && !can_mul_mat(typeA, typeB, ne00, matrix_row_counts[i])) return false;
+    }
+
+    const long tiles_per_matrix = (Nx + tile_rows - 1)/tile_rows;
+
+    // tiles are numbered consecutively over the experts that have rows, walk forward from the previous one
+    int  cur_a      = 0;
+    long first_tile = 0;
+    long tile;
+    while ((tile = work_queue_next(queue, ith, nth)) >= 0) {
+        if (tile < first_tile) {
+            cur_a = 0; first_tile = 0;
+        }
+        while (true) {
+            if (matrix_row_counts[cur_a] > 0) {
+                if (tile < first_tile + tiles_per_matrix) break;
+                first_tile += tiles_per_matrix;
+            }
+            ++cur_a;
+            GGML_ASSERT(cur_a < n_as);
+        }
+        long first = (tile - first_tile)*tile_rows;
+        long nrows = std::min(tile_rows, Nx - first);
+        if (!iqk_mul_mat_moe(nrows, matrix_row_counts[cur_a], ne00, ne11,
+                    typeA, (const char *)A + cur_a*strideA_as + first*strideA, strideA,
+                    typeB, B, strideB, C + first, nb1, nb2, row_mapping + cur_a*row_stride, 0, 1)) {
+            GGML_ABORT("Fatal error");
+        }
+    }
+    return true;
+}
+
 extern "C" IQK_API bool iqk_mul_mat(long Nx, long Ny, long ne00,
         int typeA, const void * A, long strideA,
         int typeB, const void * B, long strideB,
@@ -1183,6 +1300,8 @@ bool iqk_flash_attn_impl(int int_type_k,         // type of k
                          const void  * mask,     // mask. If not null, assumed to be fp16. nq x nk elements
                          float         scale,    // scale applied before softmax
                          float         softcap,  // if > 0, a "soft-cap" operation is applied before softmax
+                         float         slope,    // if > 0, the ALiBi slope of the head, applied to the mask
+                         bool          skip_masked, // skip the blocks of k/v that the mask hides from all rows of q
                          float       * qkv,      // v*softmax(scale*(k*q))
                          float * M, float * S) {
 
@@ -1190,32 +1309,32 @@ bool iqk_flash_attn_impl(int int_type_k,         // type of k
 
     if (Dk == 576 && Dv == 512) {
         return iqk_fa_576_512(int_type_k, int_type_v, nq1, nk1, stride_q, stride_k, stride_v, stride_m, stride_qkv,
-                q, k, v, mask, scale, softcap, qkv, M, S);
+                q, k, v, mask, scale, softcap, slope, skip_masked, qkv, M, S);
     }
 
     if (Dk == 192 && Dv == 128) {
         return iqk_fa_192_128(int_type_k, int_type_v, nq1, nk1, stride_q, stride_k, stride_v, stride_m, stride_qkv,
-                q, k, v, mask, scale, softcap, qkv, M, S);
+                q, k, v, mask, scale, softcap, slope, skip_masked, qkv, M, S);
     }
 
     if (Dk == 256 && Dv == 256) {
         return iqk_fa_256_256(int_type_k, int_type_v, nq1, nk1, stride_q, stride_k, stride_v, stride_m, stride_qkv,
-                q, k, v, mask, scale, softcap, qkv, M, S);
+                q, k, v, mask, scale, softcap, slope, skip_masked, qkv, M, S);
     }
 
     if (Dk == 128 && Dv == 128) {
         return iqk_fa_128_128(int_type_k, int_type_v, nq1, nk1, stride_q, stride_k, stride_v, stride_m, stride_qkv,
-                q, k, v, mask, scale, softcap, qkv, M, S);
+                q, k, v, mask, scale, softcap, slope, skip_masked, qkv, M, S);
     }
 
     if (Dk == 96 && Dv == 96) {
         return iqk_fa_96_96(int_type_k, int_type_v, nq1, nk1, stride_q, stride_k, stride_v, stride_m, stride_qkv,
-                q, k, v, mask, scale, softcap, qkv, M, S);
+                q, k, v, mask, scale, softcap, slope, skip_masked, qkv, M, S);
     }
 
     if (Dk == 64 && Dv == 64) {
         return iqk_fa_64_64(int_type_k, int_type_v, nq1, nk1, stride_q, stride_k, stride_v, stride_m, stride_qkv,
-                q, k, v, mask, scale, softcap, qkv, M, S);
+                q, k, v, mask, scale, softcap, slope, skip_masked, qkv, M, S);
     }
 
     return false;
@@ -1255,4 +1374,33 @@ extern "C" IQK_API bool iqk_moe_fused_up_gate(long /*Nx*/, long /*Ny*/, long /*n
     return false;
 }
 
+extern "C" IQK_API size_t iqk_work_queue_size(int /*nth*/) {
+    return 0;
+}
+
+extern "C" IQK_API void iqk_work_queue_init(void * /*queue*/, long /*ntiles*/, int /*nth*/) {
+}
+
+extern "C" IQK_API long iqk_mul_mat_tile_rows(long /*Nx*/, long /*Ny*/, long /*n_mat*/, int /*nth*/) {
+    return 0;
+}
+
+extern "C" IQK_API bool iqk_mul_mat_ws(long /*Nx*/, long /*Ny*/, long /*ne00*/,
+        int /*typeA*/, const void * /*A*/, long /*strideA*/,
+        int /*typeB*/, const void * /*B*/, long /*strideB*/,
+        float * /*C*/, long /*stride_C*/, long /*tile_rows*/, void * /*queue*/, int /*ith*/, int /*nth*/) {
+    GGML_ABORT("Unsupported CPU. You may need to manually set compilation flags\n");
+    return false;
+}
+
+extern "C" IQK_API bool iqk_mul_mat_moe_ws(long /*Nx*/, long /*ne00*/, int /*ne11*/, int /*n_as*/,
+        int /*typeA*/, const void * /*A*/, long /*strideA*/, long /*strideA_as*/,
+        int /*typeB*/, const void * /*B*/, long /*strideB*/,
+        float * /*C*/, long /*nb1*/, long /*nb2*/,
+        const int64_t * /*matrix_row_counts*/, const void * /*matrix_rows*/, long /*row_stride*/,
+        long /*tile_rows*/, void * /*queue*/, int /*ith*/, int /*nth*/) {
+    GGML_ABORT("Unsupported CPU. You may need to manually set compilation flags\n");
+    return false;
+}
+
 #endif
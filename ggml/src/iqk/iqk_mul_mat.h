@@ -5,6 +5,7 @@
 //
 
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include "iqk_config.h"
@@ -36,9 +37,35 @@ IQK_API bool iqk_moe_fused_up_gate(long Nx, long Ny, long ne00, int ne11, int un
 
 IQK_API int iqk_dequant_type(int type, int Ny);
 
+// Work stealing.
+// The rows of the result are split into tiles of tile_rows rows. Each thread starts with a contiguous
+// range of tiles (so it keeps touching the same part of the weights from one call to the next), and takes
+// tiles from the ranges of the other threads once its own range is done.
+// The queue is iqk_work_queue_size(nth) bytes of memory shared between the threads. It must be initialized
+// with iqk_work_queue_init() by one thread, and there must be a barrier between that and the threads
+// calling the *_ws() functions. iqk_mul_mat_tile_rows() returns 0 if work stealing is not applicable.
+IQK_API size_t iqk_work_queue_size(int nth);
+IQK_API void   iqk_work_queue_init(void * queue, long ntiles, int nth);
+IQK_API long   iqk_mul_mat_tile_rows(long Nx, long Ny, long n_mat, int nth);
+
+IQK_API bool iqk_mul_mat_ws(long Nx, long Ny, long ne00,
+        int typeA, const void * A, long strideA,
+        int typeB, const void * B, long strideB,
+        float * C, long stride_C, long tile_rows, void * queue, int ith, int nth);
+
+// matrix_row_counts and matrix_rows are the expert -> rows mapping built by ggml_compute_forward_mul_mat_id(),
+// with row_stride entries per expert in matrix_rows. ntiles for iqk_work_queue_init() is the sum of
+// (Nx + tile_rows - 1)/tile_rows over the experts with a non-zero row count.
+IQK_API bool iqk_mul_mat_moe_ws(long Nx, long ne00, int ne11, int n_as,
+        int typeA, const void * A, long strideA, long strideA_as,
+        int typeB, const void * B, long strideB,
+        float * C, long nb1, long nb2,
+        const int64_t * matrix_row_counts, const void * matrix_rows, long row_stride,
+        long tile_rows, void * queue, int ith, int nth);
+
 typedef void (*barrier_t) (void *);
 
-IQK_API bool iqk_flash_attn_noalibi(int type_q, int type_mask, float max_bias,
+IQK_API bool iqk_flash_attn(int type_q, int type_mask, float max_bias,
                             int neq3, int neq2, long nbq3, long nbq2,
                             int nek3, int nek2, long nbk3, long nbk2,
                             int nev3, int nev2, long nbv3, long nbv2,
@@ -59,6 +86,7 @@ IQK_API bool iqk_flash_attn_noalibi(int type_q, int type_mask, float max_bias,
                             const void  * mask,     // mask. If not null, assumed to be fp16. nq x nk elements
                             float         scale,    // scale applied before softmax
                             float         softcap,  // if > 0, a "soft-cap" operation is applied before softmax
+                            bool          skip_masked, // skip the blocks of k/v that the mask hides from all rows of q
                             float       * qkv,      // v*softmax(scale*(k*q))
                             void * work_buffer, barrier_t barrier, void * barrier_data,
                             int ith, int nth);
@@ -7863,6 +7863,10 @@ int iqk_repacked_type(const struct ggml_tensor * tensor) {
 }
 
 void iqk_repack_tensor(struct ggml_tensor * tensor) {
+    iqk_repack_tensor_threads(tensor, std::max(1, int(std::thread::hardware_concurrency()/2)));
+}
+
+void iqk_repack_tensor_threads(struct ggml_tensor * tensor, int max_thread) {
     constexpr int kChunk = 8;
     if (!tensor) return;
     if (!ggml_is_contiguous(tensor)) return;
@@ -7877,9 +7881,8 @@ void iqk_repack_tensor(struct ggml_tensor * tensor) {
 
     auto nrows = ggml_nrows(tensor);
 
-    int max_thread = std::max(1, int(std::thread::hardware_concurrency()/2));
     int num_chunks = (nrows + kChunk*r.num_rows - 1)/(kChunk*r.num_rows);
-    int nthread = std::min(num_chunks, max_thread);
+    int nthread = std::max(1, std::min(num_chunks, max_thread));
 
     //printf("%s(%s): %s -> %s. %d rows, %d chunks, %d threads\n", __func__, tensor->name, ggml_type_name(tensor->type), ggml_type_name(r.new_type),
     //        int(tensor->ne[1]), num_chunks, nthread);
@@ -368,12 +368,17 @@ extern "C" {
 
         const struct llama_model_tensor_buft_override * tensor_buft_overrides;
 
+        // expert routing counts written by llama_expert_stats_save(); the n_hot_experts most used experts
+        // of each layer whose experts stay in RAM are copied to fast memory (0 = a quarter of the experts)
+        const char * hot_experts;
+        int32_t n_hot_experts;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;    // only load the vocabulary, no weights
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
-        bool repack_tensors;// repack if available
+        bool repack_tensors;// repack if available (with use_mmap, via a <model>.rtr sidecar cache)
         bool use_thp;       // uase transparent huge pages (linux only)
     };
 
@@ -401,6 +406,7 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, < 0 disabled (default)
+        uint32_t kv_block_size;    // paged KV cache: cells per block allocated to a sequence, 0 = contiguous (default)
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -415,7 +421,12 @@ extern "C" {
         bool flash_attn;  // whether to use flash attention [EXPERIMENTAL]
         int  mla_attn;    // whether to use MLA attention [EXPERIMENTAL]
         int  attn_max_batch;    // maximum batch size for attention computations [EXPERIMENTAL]
+        int  mla_pp_batch;      // MLA = 2,3 with FA: min. ubatch size for attention with decompressed K/V instead of MLA, -1 = auto, 0 = never [EXPERIMENTAL]
         bool fused_moe_up_gate; // whether to use fused MoE up/down op [EXPERIMENTAL]
+        bool graph_lockstep;    // CPU: compute graph nodes one at a time on all threads instead of running independent nodes concurrently
+        bool swa_kv_cache;      // sliding window attention layers keep only their window in a separate, smaller KV cache [EXPERIMENTAL]
+        bool expert_stats;      // record how often each expert of each MoE layer is selected, see llama_expert_stats_save
+        bool expert_prefetch;   // ask the OS to read in the mmapped slices of the selected experts before they are used
         int  min_experts;
         float thresh_experts;
 
@@ -542,6 +553,10 @@ extern "C" {
 
     LLAMA_API void llama_set_offload_policy(struct llama_context * lctx, int op, bool on_or_off);
 
+    // Write the per-layer expert selection counts recorded with llama_context_params.expert_stats to a file
+    // that can be used as llama_model_params.hot_experts. Returns false if nothing was recorded or on error.
+    LLAMA_API bool llama_expert_stats_save(const struct llama_context * ctx, const char * fname);
+
     // Frees all allocated memory
     LLAMA_API void llama_free(struct llama_context * ctx);
 
@@ -1233,6 +1248,36 @@ extern "C" {
           llama_token_data_array * candidates_p,
                            float   top_n_sigma);
 
+    /// @details Same as llama_sample_temp() followed by llama_sample_top_k(), llama_sample_top_p() or llama_sample_min_p() on an array
+    /// with all n_vocab tokens, but these read the raw logits instead. Only the tokens that are kept are written to candidates, which
+    /// must have room for n_vocab entries.
+    LLAMA_API void llama_sample_top_k_logits(
+            struct llama_context * ctx,
+          llama_token_data_array * candidates,
+                     const float * logits,
+                         int32_t   n_vocab,
+                           float   temp,
+                         int32_t   k,
+                          size_t   min_keep);
+
+    LLAMA_API void llama_sample_top_p_logits(
+            struct llama_context * ctx,
+          llama_token_data_array * candidates,
+                     const float * logits,
+                         int32_t   n_vocab,
+                           float   temp,
+                           float   p,
+                          size_t   min_keep);
+
+    LLAMA_API void llama_sample_min_p_logits(
+            struct llama_context * ctx,
+          llama_token_data_array * candidates,
+                     const float * logits,
+                         int32_t   n_vocab,
+                           float   temp,
+                           float   p,
+                          size_t   min_keep);
+
     ///  @details DRY sampler, designed by p-e-w, as described in: https://github.com/oobabooga/text-generation-webui/pull/5677, porting Koboldcpp implementation authored by pi6am: https://github.com/LostRuins/koboldcpp/pull/982
     LLAMA_API struct llama_sampler_dry * llama_sampler_init_dry(
         const struct llama_vocab* model,
@@ -1377,10 +1422,26 @@ std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
         const std::string & src,
         llama_partial_utf8 partial_start);
 
+// Same as llama_grammar_sample, but matches the piece of every candidate against the grammar instead of using the
+// cached masks of the vocabulary. Used as a reference in the tests.
+void llama_grammar_sample_candidates(
+        const struct llama_grammar * grammar,
+        const struct llama_context * ctx,
+            llama_token_data_array * candidates);
+
 // Randomly selects a token from the candidates based on their probabilities using given std::mt19937.
 // This is a temporary workaround in order to fix race conditions when sampling with multiple sequences.
 llama_token llama_sample_token_with_rng(struct llama_context * ctx, llama_token_data_array * candidates, std::mt19937 & rng);
 
+// Same as llama_sample_xtc, but draws the chance to apply XTC from the given std::mt19937.
+void llama_sample_xtc_with_rng(
+        struct llama_context * ctx,
+      llama_token_data_array * candidates_p,
+                       float   probability,
+                       float   threshold,
+                       size_t  min_keep,
+                std::mt19937 & rng);
+
 #endif // LLAMA_API_INTERNAL
 
 #endif // LLAMA_H
@@ -4,6 +4,8 @@
 #include "llama-sampling.h"
 
 #include <algorithm>
+#include <cstring>
+#include <mutex>
 
 // Decodes a UTF-8 string which may end in an incomplete sequence. Adds a terminating 0 for use as
 // pointer. If an invalid sequence is encountered, returns `llama_partial_utf8.n_remain == -1`.
@@ -464,12 +466,241 @@ struct llama_grammar * llama_grammar_copy_impl(const struct llama_grammar * gram
     return result;
 }
 
-void llama_grammar_sample_impl(const struct llama_grammar * grammar, const struct llama_vocab * vocab, const struct llama_sampling * smpl, llama_token_data_array * candidates) {
-    GGML_ASSERT(grammar);
-    GGML_ASSERT(vocab);
+//
+// vocabulary masks
+//
+// Instead of decoding and matching the piece of every candidate, the pieces of the whole vocabulary are walked once
+// per grammar state in a prefix trie: the grammar only advances once per trie node, and a subtree is skipped as soon
+// as its prefix is rejected. The result is a bitmask of the allowed tokens that is cached in the grammar, so that
+// states seen before (e.g. inside a JSON string) cost a single lookup per candidate.
+//
 
-    int64_t t_start_sample_us = ggml_time_us();
+// max number of cached masks per grammar
+#define LLAMA_GRAMMAR_MAX_MASKS 512
+
+// below this number of candidates, matching them one by one is cheaper than computing the mask of the vocabulary
+#define LLAMA_GRAMMAR_MIN_MASK_CANDIDATES 256
+
+static std::shared_ptr<const llama_token_trie> llama_token_trie_build(const struct llama_vocab & vocab) {
+    auto trie = std::make_shared<llama_token_trie>();
+
+    const int32_t n_vocab = vocab.n_tokens();
+    trie->n_vocab = n_vocab;
+
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        const std::string & piece = vocab.cache_token_to_piece.at(id);
+
+        if (llama_token_is_eog_impl(vocab, id)) {
+            trie->eog.push_back(id);
+        } else if (!piece.empty() && piece[0] != 0) {
+            trie->tokens.push_back(id);
+        }
+    }
+
+    // like decode_utf8(), the pieces end at the first 0
+    std::sort(trie->tokens.begin(), trie->tokens.end(), [&](llama_token a, llama_token b) {
+        return strcmp(vocab.cache_token_to_piece[a].c_str(), vocab.cache_token_to_piece[b].c_str()) < 0;
+    });
+
+    auto & nodes = trie->nodes;
+
+    // nodes on the path to the previous piece, path[d] is at depth d + 1
+    std::vector<uint32_t> path;
+
+    const char * prev = "";
+    for (uint32_t i = 0; i < (uint32_t) trie->tokens.size(); ++i) {
+        const char * piece = vocab.cache_token_to_piece[trie->tokens[i]].c_str();
+
+        size_t n_common = 0;
+        while (prev[n_common] != 0 && prev[n_common] == piece[n_common]) {
+            n_common++;
+        }
+
+        // close the subtrees that are not on the path to this piece
+        while (path.size() > n_common) {
+            nodes[path.back()].next = nodes.size();
+            path.pop_back();
+        }
+
+        for (size_t d = n_common; piece[d] != 0; ++d) {
+            GGML_ASSERT(d < UINT16_MAX);
+            path.push_back(nodes.size());
+            nodes.push_back({ 0, i, i, (uint16_t) (d + 1), (uint8_t) piece[d] });
+        }
+
+        // the pieces are sorted, so the tokens ending at a node are consecutive and come before its subtree
+        nodes[path.back()].tok_end = i + 1;
+
+        trie->max_depth = std::max(trie->max_depth, (int32_t) path.size());
+
+        prev = piece;
+    }
+
+    while (!path.empty()) {
+        nodes[path.back()].next = nodes.size();
+        path.pop_back();
+    }
+
+    return trie;
+}
+
+static std::shared_ptr<const llama_token_trie> llama_token_trie_get(const struct llama_vocab & vocab) {
+    // grammars of different sequences can be sampled from different threads
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!vocab.token_trie) {
+        const int64_t t_start_us = ggml_time_us();
+
+        vocab.token_trie = llama_token_trie_build(vocab);
+
+        LLAMA_LOG_INFO("%s: built the token trie of %zu nodes in %.2f ms\n", __func__,
+                vocab.token_trie->nodes.size(), (ggml_time_us() - t_start_us)/1000.0);
+    }
+
+    return vocab.token_trie;
+}
+
+// grammar state after a prefix of the pieces
+struct llama_grammar_trie_state {
+    const llama_grammar_stacks * stacks; // either stacks_own or those of a shorter prefix
+          llama_grammar_stacks   stacks_own;
+
+    // partial UTF-8 sequence, as in decode_utf8()
+    uint32_t value;
+    int      n_remain;
+    bool     continued; // still completing the partial sequence of the grammar, the bytes are validated
+};
+
+// advances the state of the parent node by one byte of the pieces
+// returns false if all the pieces that continue with this byte are rejected
+static bool llama_grammar_trie_step(
+        const llama_grammar_rules     & rules,
+        const llama_grammar_trie_state & parent,
+        const uint8_t                    byte,
+              llama_grammar_trie_state & state) {
+    static const int lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
+
+    if (parent.n_remain > 0) {
+        if (parent.continued && (byte >> 6) != 2) {
+            // invalid sequence
+            return false;
+        }
+        state.value     = (parent.value << 6) + (byte & 0x3F);
+        state.n_remain  = parent.n_remain - 1;
+        state.continued = parent.continued && state.n_remain > 0;
+    } else {
+        const int n_remain = lookup[byte >> 4] - 1;
+        if (n_remain < 0) {
+            // invalid sequence
+            return false;
+        }
+        state.value     = byte & ((1 << (7 - n_remain)) - 1);
+        state.n_remain  = n_remain;
+        state.continued = false;
+    }
+
+    if (state.n_remain > 0) {
+        // the grammar only advances with complete code points
+        state.stacks = parent.stacks;
+        return true;
+    }
+
+    const uint32_t chr = state.value;
+    if (chr == 0) {
+        return false;
+    }
+
+    // check the stacks first, most bytes are rejected in most states
+    bool any_match = false;
+    for (const auto & stack : *parent.stacks) {
+        if (!stack.empty() && llama_grammar_match_char(stack.back(), chr).first) {
+            any_match = true;
+            break;
+        }
+    }
+    if (!any_match) {
+        return false;
+    }
+
+    llama_grammar_accept(rules, *parent.stacks, chr, state.stacks_own);
+    state.stacks = &state.stacks_own;
+
+    return !state.stacks_own.empty();
+}
 
+// returns true if a piece can end in this state, see llama_grammar_reject_candidates_for_stack()
+static bool llama_grammar_trie_accepts(const llama_grammar_trie_state & state) {
+    if (state.n_remain == 0) {
+        return !state.stacks->empty();
+    }
+
+    for (const auto & stack : *state.stacks) {
+        if (!stack.empty() && llama_grammar_match_partial_char(stack.back(), { state.value, state.n_remain })) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::vector<uint32_t> llama_grammar_vocab_mask(const struct llama_grammar & grammar, const llama_token_trie & trie) {
+    std::vector<uint32_t> mask((trie.n_vocab + 31)/32, 0);
+
+    std::vector<llama_grammar_trie_state> states(trie.max_depth + 1);
+    {
+        auto & root = states[0];
+        root.stacks    = &grammar.stacks;
+        root.value     = grammar.partial_utf8.value;
+        root.n_remain  = std::max(grammar.partial_utf8.n_remain, 0);
+        root.continued = root.n_remain > 0;
+    }
+
+    for (size_t i = 0; i < trie.nodes.size(); ) {
+        const auto & node  = trie.nodes[i];
+              auto & state = states[node.depth];
+
+        if (!llama_grammar_trie_step(grammar.rules, states[node.depth - 1], node.byte, state)) {
+            i = node.next;
+            continue;
+        }
+
+        if (node.tok_begin < node.tok_end && llama_grammar_trie_accepts(state)) {
+            for (uint32_t it = node.tok_begin; it < node.tok_end; ++it) {
+                const llama_token id = trie.tokens[it];
+                mask[id >> 5] |= 1u << (id & 31);
+            }
+        }
+
+        ++i;
+    }
+
+    bool allow_eog = false;
+    for (const auto & stack : grammar.stacks) {
+        if (stack.empty()) {
+            allow_eog = true;
+            break;
+        }
+    }
+
+    if (allow_eog) {
+        for (const llama_token id : trie.eog) {
+            mask[id >> 5] |= 1u << (id & 31);
+        }
+    }
+
+    return mask;
+}
+
+static void llama_grammar_apply_mask(const std::vector<uint32_t> & mask, llama_token_data_array * candidates) {
+    for (size_t i = 0; i < candidates->size; ++i) {
+        const llama_token id = candidates->data[i].id;
+        if (!(mask[id >> 5] & (1u << (id & 31)))) {
+            candidates->data[i].logit = -INFINITY;
+        }
+    }
+}
+
+static void llama_grammar_reject_pieces(const struct llama_grammar * grammar, const struct llama_vocab * vocab, llama_token_data_array * candidates) {
     bool allow_eog = false;
     for (const auto & stack : grammar->stacks) {
         if (stack.empty()) {
@@ -504,6 +735,42 @@ void llama_grammar_sample_impl(const struct llama_grammar * grammar, const struc
     for (const auto & reject : rejects) {
         candidates->data[reject.index].logit = -INFINITY;
     }
+}
+
+void llama_grammar_sample_impl(const struct llama_grammar * grammar, const struct llama_vocab * vocab, const struct llama_sampling * smpl, llama_token_data_array * candidates) {
+    GGML_ASSERT(grammar);
+    GGML_ASSERT(vocab);
+
+    int64_t t_start_sample_us = ggml_time_us();
+
+    // the value of the partial UTF-8 sequence is left over from the last code point when the sequence is complete
+    const llama_partial_utf8 & partial = grammar->partial_utf8;
+    auto key = std::make_pair(grammar->stacks, partial.n_remain > 0 ? std::make_pair(partial.value, partial.n_remain) : std::make_pair(0u, 0));
+
+    auto it = grammar->masks.find(key);
+    if (it == grammar->masks.end() && candidates->size < LLAMA_GRAMMAR_MIN_MASK_CANDIDATES) {
+        llama_grammar_reject_pieces(grammar, vocab, candidates);
+    } else {
+        if (it == grammar->masks.end()) {
+            if (grammar->masks.size() >= LLAMA_GRAMMAR_MAX_MASKS) {
+                grammar->masks.clear();
+            }
+            const auto trie = llama_token_trie_get(*vocab);
+            it = grammar->masks.emplace(std::move(key), llama_grammar_vocab_mask(*grammar, *trie)).first;
+        }
+        llama_grammar_apply_mask(it->second, candidates);
+    }
+
+    smpl->t_sample_us += ggml_time_us() - t_start_sample_us;
+}
+
+void llama_grammar_sample_candidates_impl(const struct llama_grammar * grammar, const struct llama_vocab * vocab, const struct llama_sampling * smpl, llama_token_data_array * candidates) {
+    GGML_ASSERT(grammar);
+    GGML_ASSERT(vocab);
+
+    int64_t t_start_sample_us = ggml_time_us();
+
+    llama_grammar_reject_pieces(grammar, vocab, candidates);
 
     smpl->t_sample_us += ggml_time_us() - t_start_sample_us;
 }
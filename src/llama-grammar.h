@@ -2,15 +2,41 @@
 
 #include "llama-impl.h"
 
+#include <map>
+
 struct llama_vocab;
 struct llama_sampling;
 
+// prefix trie of the token pieces of a vocabulary, flattened in depth-first order
+struct llama_token_trie {
+    struct node {
+        uint32_t next;      // index of the first node after the subtree of this one
+        uint32_t tok_begin; // tokens[tok_begin, tok_end) have the piece ending at this node
+        uint32_t tok_end;
+        uint16_t depth;     // number of bytes of the piece up to this node, >= 1
+        uint8_t  byte;
+    };
+
+    std::vector<node>        nodes;
+    std::vector<llama_token> tokens;  // sorted by piece
+    std::vector<llama_token> eog;     // end-of-generation tokens, not in the trie
+
+    int32_t n_vocab   = 0;
+    int32_t max_depth = 0;
+};
+
+// grammar state (stacks + partial UTF-8 sequence) -> one bit per token of the vocabulary
+using llama_grammar_masks = std::map<std::pair<llama_grammar_stacks, std::pair<uint32_t, int>>, std::vector<uint32_t>>;
+
 struct llama_grammar {
     const llama_grammar_rules  rules;
           llama_grammar_stacks stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
+
+    // allowed tokens for the states seen so far
+    mutable llama_grammar_masks masks;
 };
 
 //
@@ -32,6 +58,14 @@ void llama_grammar_sample_impl(
        const struct llama_sampling * smpl,
             llama_token_data_array * candidates);
 
+// same as llama_grammar_sample_impl, but matches the piece of every candidate against the grammar instead of using
+// the masks of the vocabulary
+void llama_grammar_sample_candidates_impl(
+        const struct llama_grammar * grammar,
+          const struct llama_vocab * vocab,
+       const struct llama_sampling * smpl,
+            llama_token_data_array * candidates);
+
 void llama_grammar_accept_token_impl(
               struct llama_grammar * grammar,
           const struct llama_vocab * vocab,
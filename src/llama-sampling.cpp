@@ -3,12 +3,19 @@
 #include "llama-grammar.h"
 
 #include <algorithm>
+#include <cmath>
 #include <cstring>
 #include <ctime>
 #include <cfloat>
 #include <numeric>
 #include <unordered_map>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 static void llama_log_softmax(float * array, size_t size) {
     float max_l = *std::max_element(array, array + size);
     float sum = 0.f;
@@ -436,15 +443,15 @@ void llama_sample_temp_impl(struct llama_sampling * smpl, llama_token_data_array
     }
 }
 
-void llama_sample_xtc_impl(struct llama_sampling * smpl, llama_token_data_array * candidates, float probability, float threshold, size_t min_keep) {
+void llama_sample_xtc_impl(struct llama_sampling * smpl, llama_token_data_array * candidates, float probability, float threshold, size_t min_keep, std::mt19937 * rng) {
     if (probability <= 0 || threshold > 0.5f || candidates->size < 2) {
         return;
     }
-    GGML_ASSERT(smpl);
+    GGML_ASSERT(smpl && rng);
     const int64_t t_start_sample_us = ggml_time_us();
     if (probability < 1) {
         std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
-        float chance = distribution(smpl->rng);
+        float chance = distribution(*rng);
         if (chance > probability) return;
     }
 
@@ -527,6 +534,312 @@ void llama_sample_top_n_sigma_impl(struct llama_sampling * smpl, llama_token_dat
     }
 }
 
+//
+// samplers on the raw logits
+//
+// The whole vocabulary is only scanned with SIMD max/count/threshold passes over the contiguous logits, and a
+// llama_token_data entry is only written for the tokens that survive the pruning. The thresholds are compared with
+// the logits before the temperature is applied, the kept tokens get logit/temp like with llama_sample_temp().
+//
+
+// distances to the max logit (after the temperature) at which the vocabulary is cut, the last one keeps everything
+static constexpr float llama_logits_cut[] = { 0.5f, 1.0f, 2.0f, 4.0f, 8.0f, 16.0f, 32.0f, INFINITY };
+static constexpr int   llama_logits_n_cut = sizeof(llama_logits_cut)/sizeof(llama_logits_cut[0]);
+
+static float llama_logits_max(const float * logits, int64_t n) {
+    float res = -INFINITY;
+    int64_t i = 0;
+#if defined(__SSE2__)
+    __m128 mx[4] = { _mm_set1_ps(-INFINITY), _mm_set1_ps(-INFINITY), _mm_set1_ps(-INFINITY), _mm_set1_ps(-INFINITY) };
+    for (; i + 16 <= n; i += 16) {
+        for (int j = 0; j < 4; ++j) {
+            mx[j] = _mm_max_ps(mx[j], _mm_loadu_ps(logits + i + 4*j));
+        }
+    }
+    __m128 m = _mm_max_ps(_mm_max_ps(mx[0], mx[1]), _mm_max_ps(mx[2], mx[3]));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    res = _mm_cvtss_f32(m);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t mx[4] = { vdupq_n_f32(-INFINITY), vdupq_n_f32(-INFINITY), vdupq_n_f32(-INFINITY), vdupq_n_f32(-INFINITY) };
+    for (; i + 16 <= n; i += 16) {
+        for (int j = 0; j < 4; ++j) {
+            mx[j] = vmaxq_f32(mx[j], vld1q_f32(logits + i + 4*j));
+        }
+    }
+    res = vmaxvq_f32(vmaxq_f32(vmaxq_f32(mx[0], mx[1]), vmaxq_f32(mx[2], mx[3])));
+#endif
+    for (; i < n; ++i) {
+        res = std::max(res, logits[i]);
+    }
+    return res;
+}
+
+// number of logits >= thresh
+static int64_t llama_logits_count(const float * logits, int64_t n, float thresh) {
+    int64_t res = 0;
+    int64_t i = 0;
+#if defined(__SSE2__)
+    const __m128 t = _mm_set1_ps(thresh);
+    while (i + 16 <= n) {
+        // the 32-bit lane counters are flushed before they can overflow
+        const int64_t i_end = std::min(n - 15, i + (int64_t(1) << 30));
+        __m128i cnt = _mm_setzero_si128();
+        for (; i < i_end; i += 16) {
+            for (int j = 0; j < 4; ++j) {
+                cnt = _mm_sub_epi32(cnt, _mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(logits + i + 4*j), t)));
+            }
+        }
+        int32_t c[4];
+        _mm_storeu_si128((__m128i *) c, cnt);
+        res += (int64_t) c[0] + c[1] + c[2] + c[3];
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t t = vdupq_n_f32(thresh);
+    while (i + 16 <= n) {
+        const int64_t i_end = std::min(n - 15, i + (int64_t(1) << 30));
+        uint32x4_t cnt = vdupq_n_u32(0);
+        for (; i < i_end; i += 16) {
+            for (int j = 0; j < 4; ++j) {
+                cnt = vsubq_u32(cnt, vcgeq_f32(vld1q_f32(logits + i + 4*j), t));
+            }
+        }
+        res += vaddvq_u32(cnt);
+    }
+#endif
+    for (; i < n; ++i) {
+        res += logits[i] >= thresh;
+    }
+    return res;
+}
+
+// is any of the 16 logits >= thresh
+static inline bool llama_logits_any16(const float * logits, float thresh) {
+#if defined(__SSE2__)
+    const __m128 t = _mm_set1_ps(thresh);
+    const __m128 m = _mm_or_ps(_mm_or_ps(_mm_cmpge_ps(_mm_loadu_ps(logits +  0), t), _mm_cmpge_ps(_mm_loadu_ps(logits +  4), t)),
+                               _mm_or_ps(_mm_cmpge_ps(_mm_loadu_ps(logits +  8), t), _mm_cmpge_ps(_mm_loadu_ps(logits + 12), t)));
+    return _mm_movemask_ps(m) != 0;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t t = vdupq_n_f32(thresh);
+    const uint32x4_t m = vorrq_u32(vorrq_u32(vcgeq_f32(vld1q_f32(logits +  0), t), vcgeq_f32(vld1q_f32(logits +  4), t)),
+                                   vorrq_u32(vcgeq_f32(vld1q_f32(logits +  8), t), vcgeq_f32(vld1q_f32(logits + 12), t)));
+    return vmaxvq_u32(m) != 0;
+#else
+    bool any = false;
+    for (int j = 0; j < 16; ++j) {
+        any = any || logits[j] >= thresh;
+    }
+    return any;
+#endif
+}
+
+// write the tokens with logit >= thresh to candidates, in vocabulary order
+static void llama_logits_collect(const float * logits, int64_t n, float temp, float thresh, llama_token_data_array * candidates) {
+    size_t n_kept = 0;
+
+    int64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        // most blocks have no token to keep
+        if (!llama_logits_any16(logits + i, thresh)) {
+            continue;
+        }
+
+        for (int64_t j = i; j < i + 16; ++j) {
+            if (logits[j] >= thresh) {
+                candidates->data[n_kept++] = llama_token_data{ (llama_token) j, logits[j]/temp, 0.0f };
+            }
+        }
+    }
+    for (; i < n; ++i) {
+        if (logits[i] >= thresh) {
+            candidates->data[n_kept++] = llama_token_data{ (llama_token) i, logits[i]/temp, 0.0f };
+        }
+    }
+
+    candidates->size   = n_kept;
+    candidates->sorted = false;
+}
+
+// probability mass and number of tokens within each cut, not normalized (the max token has exp(0) = 1)
+static void llama_logits_cut_mass(const float * logits, int64_t n, float temp, float max_l, double * mass, int64_t * count) {
+    for (int ic = 0; ic < llama_logits_n_cut; ++ic) {
+        mass [ic] = 0.0;
+        count[ic] = 0;
+    }
+
+    int64_t i = 0;
+#if defined(__SSE2__)
+    // exp(-d) = 2^(-d*log2(e)), with the fractional power from a polynomial on [-0.5, 0.5]
+    const __m128 inv_temp = _mm_set1_ps(1.0f/temp);
+    const __m128 mx       = _mm_set1_ps(max_l*temp);
+    const __m128 log2e    = _mm_set1_ps(-1.44269504f);
+    const __m128 z_min    = _mm_set1_ps(-126.0f);
+    while (i + 4 <= n) {
+        const int64_t i_end = std::min(n - 3, i + (int64_t(1) << 16));
+        __m128  sum[llama_logits_n_cut];
+        __m128i cnt[llama_logits_n_cut];
+        for (int ic = 0; ic < llama_logits_n_cut; ++ic) {
+            sum[ic] = _mm_setzero_ps();
+            cnt[ic] = _mm_setzero_si128();
+        }
+        for (; i < i_end; i += 4) {
+            const __m128  d  = _mm_mul_ps(_mm_sub_ps(mx, _mm_loadu_ps(logits + i)), inv_temp);
+            const __m128  z  = _mm_max_ps(_mm_mul_ps(d, log2e), z_min);
+            const __m128i zi = _mm_cvtps_epi32(z);
+            const __m128  f  = _mm_sub_ps(z, _mm_cvtepi32_ps(zi));
+            __m128 p = _mm_set1_ps(1.54035304e-4f);
+            p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.33335581e-3f));
+            p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.61812911e-3f));
+            p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.55041087e-2f));
+            p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.40226507e-1f));
+            p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.93147181e-1f));
+            p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+            const __m128 e = _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(p), _mm_slli_epi32(zi, 23)));
+            for (int ic = 0; ic < llama_logits_n_cut; ++ic) {
+                const __m128 in = _mm_cmple_ps(d, _mm_set1_ps(llama_logits_cut[ic]));
+                sum[ic] = _mm_add_ps(sum[ic], _mm_and_ps(in, e));
+                cnt[ic] = _mm_sub_epi32(cnt[ic], _mm_castps_si128(in));
+            }
+        }
+        for (int ic = 0; ic < llama_logits_n_cut; ++ic) {
+            float   s[4];
+            int32_t c[4];
+            _mm_storeu_ps(s, sum[ic]);
+            _mm_storeu_si128((__m128i *) c, cnt[ic]);
+            mass [ic] += (double) s[0] + s[1] + s[2] + s[3];
+            count[ic] += (int64_t) c[0] + c[1] + c[2] + c[3];
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        const float d = max_l - logits[i]/temp;
+        const float e = expf(-d);
+        for (int ic = 0; ic < llama_logits_n_cut; ++ic) {
+            if (d <= llama_logits_cut[ic]) {
+                mass [ic] += e;
+                count[ic] += 1;
+            }
+        }
+    }
+}
+
+static void llama_sample_top_k_logits(llama_token_data_array * candidates, const float * logits, int32_t n_vocab, float temp, int32_t k) {
+    const float max_l = llama_logits_max(logits, n_vocab);
+
+    // find the closest cut that keeps at least k tokens
+    int ic = 0;
+    for (; ic < llama_logits_n_cut - 1; ++ic) {
+        if (llama_logits_count(logits, n_vocab, max_l - llama_logits_cut[ic]*temp) >= k) {
+            break;
+        }
+    }
+
+    llama_logits_collect(logits, n_vocab, temp, max_l - llama_logits_cut[ic]*temp, candidates);
+
+    std::partial_sort(candidates->data, candidates->data + k, candidates->data + candidates->size,
+        [](const llama_token_data & a, const llama_token_data & b) {
+            return a.logit > b.logit;
+        });
+
+    candidates->size   = k;
+    candidates->sorted = true;
+}
+
+void llama_sample_top_k_logits_impl(struct llama_sampling * smpl, llama_token_data_array * candidates, const float * logits, int32_t n_vocab, float temp, int32_t k, size_t min_keep) {
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    if (k <= 0) {
+        k = n_vocab;
+    }
+
+    k = std::max(k, (int) min_keep);
+    k = std::min(k, n_vocab);
+
+    llama_sample_top_k_logits(candidates, logits, n_vocab, temp, k);
+
+    if (smpl) {
+        smpl->t_sample_us += ggml_time_us() - t_start_sample_us;
+    }
+}
+
+void llama_sample_top_p_logits_impl(struct llama_sampling * smpl, llama_token_data_array * candidates, const float * logits, int32_t n_vocab, float temp, float p, size_t min_keep) {
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    const float max_l = llama_logits_max(logits, n_vocab)/temp;
+
+    double  mass [llama_logits_n_cut];
+    int64_t count[llama_logits_n_cut];
+    llama_logits_cut_mass(logits, n_vocab, temp, max_l, mass, count);
+
+    const double sum = mass[llama_logits_n_cut - 1];
+
+    // the closest cut that contains the nucleus and min_keep tokens, with some margin for the rounding of the sums
+    int ic = 0;
+    for (; ic < llama_logits_n_cut - 1; ++ic) {
+        if (mass[ic] >= 1.001*p*sum && count[ic] >= (int64_t) min_keep) {
+            break;
+        }
+    }
+
+    while (true) {
+        llama_logits_collect(logits, n_vocab, temp, (max_l - llama_logits_cut[ic])*temp, candidates);
+
+        std::sort(candidates->data, candidates->data + candidates->size, [](const llama_token_data & a, const llama_token_data & b) {
+            return a.logit > b.logit;
+        });
+        candidates->sorted = true;
+
+        double cum_sum = 0.0;
+        size_t last_idx = 0;
+        for (size_t i = 0; i < candidates->size; ++i) {
+            candidates->data[i].p = expf(candidates->data[i].logit - max_l)/sum;
+            cum_sum += candidates->data[i].p;
+
+            if (cum_sum >= p && i + 1 >= min_keep) {
+                last_idx = i + 1;
+                break;
+            }
+        }
+
+        if (last_idx > 0) {
+            candidates->size = last_idx;
+            break;
+        }
+
+        if (ic == llama_logits_n_cut - 1) {
+            // rounding - keep everything
+            break;
+        }
+
+        // the mass of the cut was slightly overestimated
+        ++ic;
+    }
+
+    if (smpl) {
+        smpl->t_sample_us += ggml_time_us() - t_start_sample_us;
+    }
+}
+
+void llama_sample_min_p_logits_impl(struct llama_sampling * smpl, llama_token_data_array * candidates, const float * logits, int32_t n_vocab, float temp, float p, size_t min_keep) {
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    const float max_l = llama_logits_max(logits, n_vocab);
+    const float min_logit = max_l + logf(p)*temp; // min logit for p_i >= p * p_max
+
+    if (p <= 0.0f) {
+        llama_logits_collect(logits, n_vocab, temp, -INFINITY, candidates);
+    } else if (llama_logits_count(logits, n_vocab, min_logit) >= (int64_t) min_keep) {
+        llama_logits_collect(logits, n_vocab, temp, min_logit, candidates);
+    } else {
+        // too few tokens pass the threshold - keep the min_keep most likely ones
+        llama_sample_top_k_logits(candidates, logits, n_vocab, temp, std::min((int32_t) min_keep, n_vocab));
+    }
+
+    if (smpl) {
+        smpl->t_sample_us += ggml_time_us() - t_start_sample_us;
+    }
+}
 
 void llama_sample_repetition_penalties_impl(
         struct llama_sampling * smpl,
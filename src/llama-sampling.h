@@ -1,6 +1,7 @@
 #pragma once
 
 #include "llama-impl.h"
+#include <atomic>
 #include <unordered_map>
 struct llama_sampling {
     llama_sampling(int32_t n_vocab) : n_vocab(n_vocab) {}
@@ -9,8 +10,9 @@ struct llama_sampling {
 
     int32_t n_vocab = 0;
 
-    mutable int64_t t_sample_us = 0;
-    mutable int32_t n_sample = 0;
+    // atomic: independent sampling contexts may sample from the same llama_context concurrently
+    mutable std::atomic<int64_t> t_sample_us{0};
+    mutable std::atomic<int32_t> n_sample{0};
 
     void reset_timings() const {
         t_sample_us = 0;
@@ -32,9 +34,13 @@ void llama_sample_tail_free_impl(struct llama_sampling * smpl, llama_token_data_
 void llama_sample_typical_impl  (struct llama_sampling * smpl, llama_token_data_array * candidates, float p, size_t min_keep);
 void llama_sample_entropy_impl  (struct llama_sampling * smpl, llama_token_data_array * candidates, float min_temp, float max_temp, float exponent_val);
 void llama_sample_temp_impl     (struct llama_sampling * smpl, llama_token_data_array * candidates, float temp);
-void llama_sample_xtc_impl      (struct llama_sampling * smpl, llama_token_data_array * candidates, float probability, float threshold, size_t min_keep);
+void llama_sample_xtc_impl      (struct llama_sampling * smpl, llama_token_data_array * candidates, float probability, float threshold, size_t min_keep, std::mt19937 * rng);
 void llama_sample_top_n_sigma_impl(struct llama_sampling * smpl, llama_token_data_array * candidates, float top_n_sigma);
 
+void llama_sample_top_k_logits_impl(struct llama_sampling * smpl, llama_token_data_array * candidates, const float * logits, int32_t n_vocab, float temp, int32_t k, size_t min_keep);
+void llama_sample_top_p_logits_impl(struct llama_sampling * smpl, llama_token_data_array * candidates, const float * logits, int32_t n_vocab, float temp, float p, size_t min_keep);
+void llama_sample_min_p_logits_impl(struct llama_sampling * smpl, llama_token_data_array * candidates, const float * logits, int32_t n_vocab, float temp, float p, size_t min_keep);
+
 struct llama_sampler_dry {
     int32_t total_context_size;
 
@@ -6,6 +6,9 @@
 #include <vector>
 #include <unordered_map>
 #include <map>
+#include <memory>
+
+struct llama_token_trie;
 
 struct llama_vocab {
     using id    = llama_token;
@@ -31,6 +34,8 @@ struct llama_vocab {
     std::vector<id>    cache_special_tokens;
     std::vector<token> cache_token_to_piece; // llama_token_to_piece(special = true);
 
+    mutable std::shared_ptr<const llama_token_trie> token_trie; // prefix trie of the pieces, built by the first grammar that needs it
+
     std::map<std::pair<std::string, std::string>, int> bpe_ranks;
 
     // default LLaMA special tokens
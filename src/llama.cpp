@@ -56,7 +56,7 @@
             #include <sys/mman.h>
             #include <fcntl.h>
         #endif
-        #if defined(_POSIX_MEMLOCK_RANGE)
+        #if defined(_POSIX_MEMLOCK_RANGE) || defined(__APPLE__)
             #include <sys/resource.h>
         #endif
     #endif
@@ -74,6 +74,8 @@
     #include <io.h>
 #endif
 
+#include <sys/stat.h>
+
 #if __cplusplus >= 202000L
     #define LU8(x) (const char*)(u8##x)
 #else
@@ -82,8 +84,10 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <chrono>
 #include <cfloat>
 #include <cinttypes>
 #include <climits>
@@ -328,6 +332,8 @@ enum llm_kv {
     LLM_KV_EXPERT_WEIGHTS_SCALE,
     LLM_KV_EXPERT_WEIGHTS_NORM,
     LLM_KV_EXPERT_GATING_FUNC,
+    LLM_KV_EXPERT_GROUP_COUNT,
+    LLM_KV_EXPERT_GROUP_USED_COUNT,
     LLM_KV_POOLING_TYPE,
     LLM_KV_LOGIT_SCALE,
     LLM_KV_DECODER_START_TOKEN_ID,
@@ -437,6 +443,8 @@ static const std::map<llm_kv, const char *> LLM_KV_NAMES = {
     { LLM_KV_EXPERT_WEIGHTS_SCALE,              "%s.expert_weights_scale"              },
     { LLM_KV_EXPERT_WEIGHTS_NORM,               "%s.expert_weights_norm"               },
     { LLM_KV_EXPERT_GATING_FUNC,                "%s.expert_gating_func"                },
+    { LLM_KV_EXPERT_GROUP_COUNT,                "%s.expert_group_count"                },
+    { LLM_KV_EXPERT_GROUP_USED_COUNT,           "%s.expert_group_used_count"           },
     { LLM_KV_POOLING_TYPE ,                     "%s.pooling_type"                      },
     { LLM_KV_LOGIT_SCALE,                       "%s.logit_scale"                       },
     { LLM_KV_DECODER_START_TOKEN_ID,            "%s.decoder_start_token_id"            },
@@ -2685,6 +2693,8 @@ struct llama_hparams {
     float    expert_weights_scale = 0.0;
     bool     expert_weights_norm = false;
     uint32_t expert_gating_func = LLM_EXPERT_GATING_FUNC_SOFTMAX;
+    uint32_t n_expert_groups = 0;    // group-limited routing (DeepSeek): experts are only selected from
+    uint32_t n_group_used    = 0;    // the n_group_used best of n_expert_groups groups
 
     float f_norm_eps;
     float f_norm_rms_eps;
@@ -2760,6 +2770,8 @@ struct llama_hparams {
         if (this->n_ff_exp           != other.n_ff_exp)           return true;
         if (this->n_ff_shexp         != other.n_ff_shexp)         return true;
         if (this->n_expert_shared    != other.n_expert_shared)    return true;
+        if (this->n_expert_groups    != other.n_expert_groups)    return true;
+        if (this->n_group_used       != other.n_group_used)       return true;
 
         if (this->rope_finetuned  != other.rope_finetuned)  return true;
         if (this->n_ctx_orig_yarn != other.n_ctx_orig_yarn) return true;
@@ -2845,6 +2857,11 @@ struct llama_hparams {
         // corresponds to Mamba's ssm_states size
         return ssm_d_state * ssm_d_inner;
     }
+
+    // whether the layer attends to a sliding window of n_swa tokens only
+    bool is_swa(uint32_t il) const {
+        return n_swa > 0 && n_swa_pattern > 1 && il % n_swa_pattern < n_swa_pattern - 1;
+    }
 };
 
 static_assert(std::is_trivially_copyable<llama_hparams>::value, "llama_hparams must be trivially copyable");
@@ -2868,6 +2885,7 @@ struct llama_cparams {
     float yarn_beta_fast;
     float yarn_beta_slow;
     float defrag_thold;
+    uint32_t kv_block_size;
 
     bool embeddings;
     bool causal_attn;
@@ -2875,7 +2893,12 @@ struct llama_cparams {
     bool flash_attn;
     int  mla_attn;
     int  attn_max_batch;
+    int  mla_pp_batch;
     bool fused_moe_up_gate;
+    bool graph_lockstep;
+    bool swa_kv_cache;
+    bool expert_stats;
+    bool expert_prefetch;
     int  min_experts;
     float thresh_experts;
 
@@ -2962,6 +2985,13 @@ struct llama_layer {
     struct ggml_tensor * ffn_down_exps;
     struct ggml_tensor * ffn_up_exps ;
 
+    // copies of the most used experts in fast memory (llama_model_params.hot_experts)
+    struct ggml_tensor * ffn_gate_exps_hot = nullptr;
+    struct ggml_tensor * ffn_down_exps_hot = nullptr;
+    struct ggml_tensor * ffn_up_exps_hot   = nullptr;
+    struct ggml_tensor * ffn_exps_hot_map  = nullptr; // I32 [n_expert]: slot in the hot tensors, -1 if cold
+    struct ggml_tensor * ffn_exps_cold_map = nullptr; // I32 [n_expert]: the expert itself if cold, -1 if hot
+
     // ff shared expert (shexp)
     struct ggml_tensor * ffn_gate_inp_shexp;
     struct ggml_tensor * ffn_gate_shexp;
@@ -3047,6 +3077,23 @@ struct llama_kv_cache {
     // computed before each graph build
     uint32_t n = 0;
 
+    // paged mode (block_size > 0): the cells are handed out to the sequences in blocks of block_size
+    // cells. The tokens of a sequence go to the free cells of the block it was last given (its tail),
+    // and it gets the next free block when the tail is full, so the tokens of a ubatch no longer need
+    // a contiguous run of free cells and the cache does not fragment into single-cell holes.
+    // The K/V of the ubatch are scattered into ubatch_cells (see llm_build_kv_store).
+    uint32_t block_size = 0;
+
+    std::vector<int32_t>  block_seq;    // per block: the sequence it was handed out to
+    std::vector<uint32_t> block_used;   // per block: number of used cells
+    std::vector<int32_t>  seq_tail;     // per sequence: the block new cells are taken from, -1 = none
+    std::vector<int32_t>  ubatch_cells; // per token of the last allocated ubatch: the cell it was stored to
+
+    // scratch buffers of the KQ mask construction (llama_set_inputs)
+    std::vector<llama_seq_id> mask_seqs;     // distinct sequences of the ubatch
+    std::vector<uint64_t>     mask_cell_seq; // per cell: bitmask of the ubatch sequences it belongs to
+    std::vector<llama_pos>    mask_cell_pos; // per cell: its position, INT32_MAX if empty
+
     ggml_type type_k = GGML_TYPE_F16;
     ggml_type type_v = GGML_TYPE_F16;
 
@@ -3210,6 +3257,9 @@ struct llama_context {
             ggml_backend_free(backend);
         }
 
+        // the CPU backend refers to the thread pool, so it must go after the backends
+        ggml_threadpool_free(threadpool);
+
         ggml_backend_buffer_free(buf_output);
     }
 
@@ -3218,6 +3268,7 @@ struct llama_context {
     struct llama_cparams        cparams;
     struct llama_sampling       sampling;
     struct llama_kv_cache       kv_self;
+    struct llama_kv_cache       kv_swa;  // window of the sliding window attention layers (cparams.swa_kv_cache), size = 0 if not used
     struct llama_control_vector cvec;
 
     std::vector<float> scale_data;
@@ -3233,6 +3284,9 @@ struct llama_context {
 #endif
     ggml_backend_t backend_cpu = nullptr;
 
+    // persistent worker threads of the CPU backend, sized for max(n_threads, n_threads_batch)
+    ggml_threadpool_t threadpool = nullptr;
+
     bool has_evaluated_once = false;
 
     int64_t t_start_us;
@@ -3246,6 +3300,12 @@ struct llama_context {
     int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     int32_t n_eval   = 0; // number of eval calls
 
+    // expert prefetch (cparams.expert_prefetch): selected expert slices that were already resident or had to be
+    // requested, and the major page faults while computing
+    uint64_t n_prefetch_resident  = 0;
+    uint64_t n_prefetch_requested = 0;
+    int64_t  n_major_faults       = 0;
+
     // host buffer for the model output (logits and embeddings)
     ggml_backend_buffer_t buf_output = nullptr;
 
@@ -3290,6 +3350,7 @@ struct llama_context {
     struct ggml_tensor * inp_KQ_mask;     // F32 [kv_size, n_batch]
     struct ggml_tensor * inp_KQ_mask_swa; // F32 [kv_size, n_batch]
     struct ggml_tensor * inp_K_shift;     // I32 [kv_size]
+    struct ggml_tensor * inp_K_shift_swa; // I32 [kv_size_swa]
     struct ggml_tensor * inp_mean;        // F32 [n_batch, n_batch]
     struct ggml_tensor * inp_cls;         // I32 [n_batch]
     struct ggml_tensor * inp_s_copy;      // I32 [kv_size]
@@ -3299,6 +3360,14 @@ struct llama_context {
     struct ggml_tensor * inp_embd_enc;      // F32 [n_embd, n_outputs_enc]
     struct ggml_tensor * inp_KQ_mask_cross; // F32 [n_outputs_enc, n_batch]
     struct ggml_tensor * inp_scale = nullptr; // F32 [n_tokens]
+    struct ggml_tensor * inp_kv_idxs;       // I32 [n_batch] (paged KV cache)
+
+    // expert selection counts (cparams.expert_stats), [n_layer][n_expert]
+    std::vector<std::vector<uint64_t>> expert_counts;
+    // the top-k views of the expert selections in the current graph, per layer
+    std::vector<std::pair<int, struct ggml_tensor *>> moe_selected;
+    // the expert prefetch nodes of the current graph
+    std::vector<struct ggml_tensor *> moe_prefetch;
 };
 
 struct llama_lora_weight {
@@ -3464,13 +3533,15 @@ static size_t llama_get_device_memory(const llama_model & model, int device) {
 // kv cache helpers
 //
 
+// layers: the layers to allocate K/V for, empty = all (the others get nullptr tensors)
 static bool llama_kv_cache_init(
              struct llama_kv_cache & cache,
                const llama_context * ctx,
                          ggml_type   type_k,
                          ggml_type   type_v,
                           uint32_t   kv_size,
-                              bool   offload) {
+                              bool   offload,
+         const std::vector<bool> & layers = {}) {
     const llama_model & model = ctx->model;
     const llama_cparams & cparams = ctx->cparams;
 
@@ -3494,6 +3565,31 @@ static bool llama_kv_cache_init(
     cache.cells.clear();
     cache.cells.resize(kv_size);
 
+    cache.block_size = 0;
+    cache.block_seq.clear();
+    cache.block_used.clear();
+    cache.seq_tail.clear();
+
+    if (cparams.kv_block_size > 0) {
+        // the K/V are scattered into the cache with GGML_OP_SET_ROWS, which is only implemented on the CPU
+        bool kv_on_host = true;
+        if (offload) {
+            for (int64_t i = 0; i < n_layer; ++i) {
+                kv_on_host = kv_on_host && ggml_backend_buft_is_host(model.buft_layer[i].buft);
+            }
+        }
+
+        if (cache.recurrent || !cparams.flash_attn) {
+            LLAMA_LOG_WARN("%s: the paged KV cache requires flash attention - using a contiguous KV cache\n", __func__);
+        } else if (!kv_on_host) {
+            LLAMA_LOG_WARN("%s: the paged KV cache is not supported with an offloaded KV cache - using a contiguous KV cache\n", __func__);
+        } else {
+            cache.block_size = std::min(cparams.kv_block_size, kv_size);
+            LLAMA_LOG_INFO("%s: paged KV cache with %u blocks of %u cells\n", __func__,
+                    (kv_size + cache.block_size - 1)/cache.block_size, cache.block_size);
+        }
+    }
+
     if (cache.recurrent) {
         // init state copy sources
         for (uint32_t i = 0; i < cache.size; ++i) {
@@ -3501,14 +3597,16 @@ static bool llama_kv_cache_init(
         }
     }
 
+    const auto has_layer = [&](int64_t il) {
+        return layers.empty() || layers[il];
+    };
+
     // count used buffer types
     std::map<ggml_backend_buffer_type_t, int> buft_layer_count;
-    if (offload) {
-        for (int64_t i = 0; i < n_layer; ++i) {
-            buft_layer_count[model.buft_layer[i].buft]++;
+    for (int64_t i = 0; i < n_layer; ++i) {
+        if (has_layer(i)) {
+            buft_layer_count[offload ? model.buft_layer[i].buft : llama_default_buffer_type_cpu(true)]++;
         }
-    } else {
-        buft_layer_count[llama_default_buffer_type_cpu(true)] = n_layer;
     }
 
     // create a context for each buffer type
@@ -3570,6 +3668,14 @@ static bool llama_kv_cache_init(
         const uint32_t n_embd_head_k= hparams.n_embd_head_k;
 
 
+        if (!has_layer(i)) {
+            cache.k_l.push_back(nullptr);
+            if (needs_v_cache) {
+                cache.v_l.push_back(nullptr);
+            }
+            continue;
+        }
+
         struct ggml_context * ctx = offload ? ctx_map.at(model.buft_layer[i].buft) : cache.ctxs.front();
         ggml_tensor * k;
         ggml_tensor * v;
@@ -3732,6 +3838,163 @@ static bool llama_kv_cache_find_slot(
     return true;
 }
 
+// sliding window KV cache: drop the cells that the tokens of the batch and all later tokens of their sequences
+// no longer attend - a token at position p sees the positions (p - n_swa, p]
+// seq_pos_min holds the first position of each sequence in the ubatches of the current llama_decode call, including
+// this one, so that the sequence can still be truncated anywhere in these ubatches (e.g. rejected draft tokens)
+// the sequences that are not in the call keep the window of their last position, so that the cache never holds
+// more than n_swa cells of a sequence plus the tokens of the call
+static void llama_kv_cache_prune_swa(
+           struct llama_kv_cache & cache,
+        const struct llama_batch & batch,
+                        uint32_t   n_swa,
+        std::vector<std::pair<llama_seq_id, llama_pos>> & batch_pos_min) {
+    for (uint32_t i = 0; i < (uint32_t) batch.n_tokens; ++i) {
+        for (int32_t j = 0; j < batch.n_seq_id[i]; ++j) {
+            const llama_seq_id seq_id = batch.seq_id[i][j];
+            auto it = std::find_if(batch_pos_min.begin(), batch_pos_min.end(), [seq_id](const auto & p) { return p.first == seq_id; });
+            if (it == batch_pos_min.end()) {
+                batch_pos_min.emplace_back(seq_id, batch.pos[i]);
+            } else {
+                it->second = std::min(it->second, batch.pos[i]);
+            }
+        }
+    }
+
+    std::vector<std::pair<llama_seq_id, llama_pos>> seq_pos_min = batch_pos_min;
+
+    const size_t n_seq_batch = seq_pos_min.size();
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        const llama_kv_cell & cell = cache.cells[i];
+        for (const llama_seq_id seq_id : cell.seq_id) {
+            auto it = std::find_if(seq_pos_min.begin(), seq_pos_min.end(), [seq_id](const auto & p) { return p.first == seq_id; });
+            if (it == seq_pos_min.end()) {
+                seq_pos_min.emplace_back(seq_id, cell.pos);
+            } else if (it - seq_pos_min.begin() >= (ptrdiff_t) n_seq_batch) {
+                it->second = std::max(it->second, cell.pos);
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        llama_kv_cell & cell = cache.cells[i];
+        if (cell.is_empty()) {
+            continue;
+        }
+        for (const auto & [seq_id, pos_min] : seq_pos_min) {
+            if (cell.pos <= pos_min - (llama_pos) n_swa) {
+                cell.seq_id.erase(seq_id);
+            }
+        }
+        if (cell.is_empty()) {
+            cell.pos = -1;
+            cache.used--;
+        }
+    }
+}
+
+// undo a successful llama_kv_cache_find_slot of a (non-recurrent) cache when the batch cannot be processed
+static void llama_kv_cache_release_slot(struct llama_kv_cache & cache, uint32_t n_tokens) {
+    for (uint32_t i = 0; i < n_tokens; ++i) {
+        cache.cells[cache.head + i].pos = -1;
+        cache.cells[cache.head + i].seq_id.clear();
+    }
+    cache.used -= n_tokens;
+}
+
+// paged KV cache: one cell per token, taken from the tail block of the (first) sequence of the token,
+// or from a free block when the tail is full - the cells are recorded in cache.ubatch_cells
+static bool llama_kv_cache_find_slot_paged(
+           struct llama_kv_cache & cache,
+        const struct llama_batch & batch) {
+    const uint32_t n_tokens   = batch.n_tokens;
+    const uint32_t block_size = cache.block_size;
+    const uint32_t n_blocks   = (cache.size + block_size - 1)/block_size;
+
+    GGML_ASSERT(!cache.recurrent && block_size > 0);
+
+    if (cache.used + n_tokens > cache.size) {
+        return false;
+    }
+
+    // count the used cells of each block
+    cache.block_seq.resize(n_blocks, -1);
+    cache.block_used.assign(n_blocks, 0);
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (cache.cells[i].pos >= 0) {
+            cache.block_used[i/block_size]++;
+        }
+    }
+
+    const auto block_end = [&](uint32_t ib) {
+        return std::min(cache.size, (ib + 1)*block_size);
+    };
+
+    const auto find_free = [&](uint32_t i0, uint32_t i1) -> int32_t {
+        for (uint32_t i = i0; i < i1; ++i) {
+            if (cache.cells[i].pos < 0) {
+                return i;
+            }
+        }
+        return -1;
+    };
+
+    cache.ubatch_cells.resize(n_tokens);
+
+    uint32_t ib_next = (cache.head/block_size) % n_blocks; // where to start looking for a free block
+
+    for (uint32_t i = 0; i < n_tokens; ++i) {
+        const llama_seq_id seq_id = batch.seq_id[i][0];
+        GGML_ASSERT(seq_id >= 0);
+
+        if ((size_t) seq_id >= cache.seq_tail.size()) {
+            cache.seq_tail.resize(seq_id + 1, -1);
+        }
+
+        int32_t cell = -1;
+
+        // the tail block is only reused while the sequence still holds cells in it
+        const int32_t tail = cache.seq_tail[seq_id];
+        if (tail >= 0 && cache.block_seq[tail] == seq_id && cache.block_used[tail] > 0) {
+            cell = find_free(tail*block_size, block_end(tail));
+        }
+
+        if (cell < 0) {
+            for (uint32_t k = 0; k < n_blocks; ++k) {
+                const uint32_t ib = (ib_next + k) % n_blocks;
+                if (cache.block_used[ib] == 0) {
+                    cache.block_seq[ib]     = seq_id;
+                    cache.seq_tail[seq_id]  = ib;
+                    cell    = ib*block_size;
+                    ib_next = (ib + 1) % n_blocks;
+                    break;
+                }
+            }
+        }
+
+        if (cell < 0) {
+            // all blocks are in use - take any free cell
+            cell = find_free(0, cache.size);
+        }
+
+        GGML_ASSERT(cell >= 0); // cannot fail, the number of used cells was checked above
+
+        cache.cells[cell].pos = batch.pos[i];
+        for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
+            cache.cells[cell].seq_id.insert(batch.seq_id[i][j]);
+        }
+
+        cache.block_used[cell/block_size]++;
+        cache.ubatch_cells[i] = cell;
+    }
+
+    cache.used += n_tokens;
+    cache.head  = ib_next*block_size;
+
+    return true;
+}
+
 // find how many cells are currently in use
 static uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
     for (uint32_t i = cache.size; i > 0; --i) {
@@ -4191,6 +4454,70 @@ static size_t llama_model_max_nodes(const llama_model & /*model*/) {
     return 65536;
 }
 
+//
+// run-time-repack cache
+//
+
+static const char * LLAMA_RTR_KEY_SOURCE = "rtr.source";
+static const char * LLAMA_RTR_KEY_CPU    = "rtr.cpu_features";
+
+// Hashing the full model would cost about as much as repacking it, so the source is identified by
+// its metadata (which includes all tensor names, types and offsets) plus the size and mtime of each file.
+static std::string llama_rtr_cache_key(const std::vector<std::string> & fnames, const gguf_context * meta) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto mix = [&hash](const void * data, size_t n) {
+        const uint8_t * p = (const uint8_t *) data;
+        for (size_t i = 0; i < n; ++i) {
+            hash = (hash ^ p[i]) * 0x100000001b3ull;
+        }
+    };
+
+    std::vector<uint8_t> buf(gguf_get_meta_size(meta));
+    gguf_get_meta_data(meta, buf.data());
+    mix(buf.data(), buf.size());
+
+    for (const auto & fname : fnames) {
+        struct stat st;
+        if (stat(fname.c_str(), &st) != 0) {
+            continue;
+        }
+        const int64_t size  = st.st_size;
+        const int64_t mtime = st.st_mtime;
+        mix(&size,  sizeof(size));
+        mix(&mtime, sizeof(mtime));
+    }
+
+    return format("%016" PRIx64, hash);
+}
+
+// the repacked layouts depend on the instruction set the kernels were built for
+static std::string llama_rtr_cpu_features() {
+    std::string res;
+    auto add = [&res](const char * name, int has) {
+        if (has) {
+            if (!res.empty()) {
+                res += ',';
+            }
+            res += name;
+        }
+    };
+    add("avx",         ggml_cpu_has_avx());
+    add("avx_vnni",    ggml_cpu_has_avx_vnni());
+    add("avx2",        ggml_cpu_has_avx2());
+    add("avx512",      ggml_cpu_has_avx512());
+    add("avx512_vbmi", ggml_cpu_has_avx512_vbmi());
+    add("avx512_vnni", ggml_cpu_has_avx512_vnni());
+    add("avx512_bf16", ggml_cpu_has_avx512_bf16());
+    add("fma",         ggml_cpu_has_fma());
+    add("f16c",        ggml_cpu_has_f16c());
+    add("neon",        ggml_cpu_has_neon());
+    add("arm_fma",     ggml_cpu_has_arm_fma());
+    add("sve",         ggml_cpu_has_sve());
+    add("fp16_va",     ggml_cpu_has_fp16_va());
+    add("matmul_int8", ggml_cpu_has_matmul_int8());
+    return res;
+}
+
 struct llama_model_loader {
     int n_kv      = 0;
     int n_tensors = 0;
@@ -4204,7 +4531,13 @@ struct llama_model_loader {
     bool repack_tensors = false;
     bool use_thp = false;
 
+    // sidecar GGUF with the run-time-repacked tensors, keyed by the source files and the CPU features
+    std::string rtr_cache_fname;
+    std::string rtr_cache_key;
+    bool rtr_cache_write = false;
+
     llama_files files;
+    std::vector<std::string> fnames; // paths of files, for opening additional handles
     llama_ftype ftype;
     llama_fver  fver;
 
@@ -4228,6 +4561,9 @@ struct llama_model_loader {
     };
     std::vector<llama_tensor_weight> weights;
 
+    // weights of the repacked tensors found in the sidecar cache
+    std::unordered_map<std::string, llama_tensor_weight> rtr_weights;
+
     std::unordered_map<std::string, struct llama_model_kv_override> kv_overrides;
     const llama_model_tensor_buft_override * tensor_buft_overrides;
 
@@ -4287,6 +4623,7 @@ struct llama_model_loader {
 
         files.emplace_back(new llama_file(fname.c_str(), "rb"));
         contexts.emplace_back(ctx);
+        fnames.emplace_back(fname);
 
         // Save tensors data offset of the main file.
         // For subsidiary files, `meta` tensor data offset must not be used,
@@ -4329,6 +4666,7 @@ struct llama_model_loader {
 
                 files.emplace_back(new llama_file(split_path, "rb"));
                 contexts.emplace_back(ctx);
+                fnames.emplace_back(split_path);
 
                 // Save tensors data offset info of the shard.
                 for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur; cur = ggml_get_next_tensor(ctx, cur)) {
@@ -4521,7 +4859,18 @@ struct llama_model_loader {
             use_mmap = false;
         }
         if (repack_tensors) {
-            use_mmap = false;
+            // repacking happens in place, so it needs writable tensor data; with mmap we use the repacked
+            // tensors from a sidecar cache if a valid one exists, else we load without mmap and create it
+            if (use_mmap) {
+                rtr_cache_fname = fname + ".rtr";
+                rtr_cache_key   = llama_rtr_cache_key(fnames, meta);
+                if (!load_rtr_cache()) {
+                    use_mmap = false;
+                    rtr_cache_write = true;
+                }
+            } else {
+                use_mmap = false;
+            }
         }
 
         this->use_mmap = use_mmap;
@@ -4841,6 +5190,148 @@ struct llama_model_loader {
         }
     }
 
+    // Returns true if the sidecar cache matches the model and the CPU. Its file is appended to files,
+    // its tensors are collected in rtr_weights and get used by apply_rtr_cache().
+    bool load_rtr_cache() {
+        struct stat st;
+        if (stat(rtr_cache_fname.c_str(), &st) != 0) {
+            return false;
+        }
+
+        struct ggml_context * ctx = NULL;
+        struct gguf_init_params params = {
+            /*.no_alloc = */ true,
+            /*.ctx      = */ &ctx,
+        };
+        struct gguf_context * rtr = gguf_init_from_file(rtr_cache_fname.c_str(), params);
+        if (!rtr) {
+            return false;
+        }
+
+        auto get_str = [rtr](const char * key) {
+            const int kid = gguf_find_key(rtr, key);
+            return kid >= 0 && gguf_get_kv_type(rtr, kid) == GGUF_TYPE_STRING ? std::string(gguf_get_val_str(rtr, kid)) : std::string();
+        };
+
+        bool ok = get_str(LLAMA_RTR_KEY_SOURCE) == rtr_cache_key && get_str(LLAMA_RTR_KEY_CPU) == llama_rtr_cpu_features();
+        if (ok) {
+            files.emplace_back(new llama_file(rtr_cache_fname.c_str(), "rb"));
+            fnames.emplace_back(rtr_cache_fname);
+            const uint16_t idx = files.size() - 1;
+            for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur; cur = ggml_get_next_tensor(ctx, cur)) {
+                const auto * weight = get_weight(cur->name);
+                if (!weight || !ggml_are_same_shape(weight->tensor, cur) || ggml_nbytes(weight->tensor) != ggml_nbytes(cur)) {
+                    ok = false;
+                    break;
+                }
+                rtr_weights.emplace(cur->name, llama_tensor_weight(files.back().get(), idx, cur->name, rtr, cur));
+            }
+            if (!ok) {
+                rtr_weights.clear();
+                files.pop_back();
+                fnames.pop_back();
+            }
+        }
+        gguf_free(rtr);
+
+        if (!ok) {
+            ggml_free(ctx);
+            LLAMA_LOG_INFO("%s: repack cache %s is stale, it will be recreated\n", __func__, rtr_cache_fname.c_str());
+            return false;
+        }
+        contexts.emplace_back(ctx);
+        LLAMA_LOG_INFO("%s: using %d repacked tensors from %s\n", __func__, (int) rtr_weights.size(), rtr_cache_fname.c_str());
+        return true;
+    }
+
+    // Points the tensors that are kept in host buffers at their repacked copies in the sidecar cache.
+    // Must be called after all tensors are created and before init_mappings().
+    int apply_rtr_cache(const std::map<ggml_backend_buffer_type_t, ggml_context *> & ctx_map) {
+        if (rtr_weights.empty()) {
+            return 0;
+        }
+
+        // a duplicated tensor that is also offloaded must keep its original layout
+        std::set<std::string> offloaded;
+        for (const auto & it : ctx_map) {
+            if (ggml_backend_buft_is_host(it.first)) {
+                continue;
+            }
+            for (ggml_tensor * cur = ggml_get_first_tensor(it.second); cur; cur = ggml_get_next_tensor(it.second, cur)) {
+                offloaded.insert(ggml_get_name(cur));
+            }
+        }
+
+        int n_applied = 0;
+        for (const auto & it : ctx_map) {
+            if (!ggml_backend_buft_is_host(it.first)) {
+                continue;
+            }
+            for (ggml_tensor * cur = ggml_get_first_tensor(it.second); cur; cur = ggml_get_next_tensor(it.second, cur)) {
+                auto rtr = rtr_weights.find(ggml_get_name(cur));
+                if (rtr == rtr_weights.end() || offloaded.count(rtr->first)) {
+                    continue;
+                }
+                for (auto & weight : weights) {
+                    if (rtr->first == weight.tensor->name) {
+                        weight = rtr->second;
+                        break;
+                    }
+                }
+                // the repacked types have the same row size, so only the type changes (as in iqk_repack_tensor)
+                cur->type = rtr->second.tensor->type;
+                ++n_applied;
+            }
+        }
+        return n_applied;
+    }
+
+    // Writes the tensors repacked in this run to the sidecar cache, so the next load can mmap them.
+    void write_rtr_cache(const std::vector<const ggml_tensor *> & repacked) const {
+        struct gguf_context * ctx_out = gguf_init_empty();
+        gguf_set_val_str(ctx_out, LLAMA_RTR_KEY_SOURCE, rtr_cache_key.c_str());
+        gguf_set_val_str(ctx_out, LLAMA_RTR_KEY_CPU,    llama_rtr_cpu_features().c_str());
+
+        std::vector<const ggml_tensor *> tensors;
+        for (const auto * cur : repacked) {
+            // wk_b/wv_b computed at load time are not in the model, and attn_kv_b must stay unpacked
+            // for llm_prepare_mla() to be able to compute them on the next load
+            if (!get_weight(ggml_get_name(cur)) || strstr(ggml_get_name(cur), "attn_kv_b")) {
+                continue;
+            }
+            gguf_add_tensor(ctx_out, cur);
+            tensors.push_back(cur);
+        }
+
+        // write to a temporary file first, so that an interrupted write never leaves a truncated cache behind
+        const std::string fname_tmp = rtr_cache_fname + ".tmp";
+        bool ok = false;
+        {
+            std::ofstream fout(fname_tmp, std::ios::binary);
+            if (fout) {
+                std::vector<uint8_t> meta_data(gguf_get_meta_size(ctx_out));
+                gguf_get_meta_data(ctx_out, meta_data.data());
+                fout.write((const char *) meta_data.data(), meta_data.size());
+
+                const size_t align = GGUF_DEFAULT_ALIGNMENT;
+                for (const auto * cur : tensors) {
+                    const size_t n_size = ggml_nbytes(cur);
+                    fout.write((const char *) cur->data, n_size);
+                    zeros(fout, GGML_PAD(n_size, align) - n_size);
+                }
+                ok = fout.good();
+            }
+        }
+        gguf_free(ctx_out);
+
+        if (ok && std::rename(fname_tmp.c_str(), rtr_cache_fname.c_str()) == 0) {
+            LLAMA_LOG_INFO("%s: wrote %d repacked tensors to %s\n", __func__, (int) tensors.size(), rtr_cache_fname.c_str());
+        } else {
+            std::remove(fname_tmp.c_str());
+            LLAMA_LOG_WARN("%s: failed to write repack cache %s\n", __func__, rtr_cache_fname.c_str());
+        }
+    }
+
     void init_mappings(bool prefetch = true, llama_mlocks * mlock_mmaps = nullptr, bool use_thp = false) {
         if (use_mmap) {
             mappings.reserve(files.size());
@@ -4915,6 +5406,130 @@ struct llama_model_loader {
     size_t size_data = 0;
     std::vector<std::pair<size_t, size_t>> mmaps_used;
 
+    // tensors repacked while loading, see host_tensor_reader
+    std::vector<const ggml_tensor *> repacked;
+
+    // Reads the tensors that live in host buffers (without mmap) on a pool of threads, each with its own
+    // file handles. Tensors are split into chunks, so large tensors are read in parallel too, and the thread
+    // that reads the last chunk of a tensor validates and repacks it, overlapping that with the other reads.
+    struct host_tensor_reader {
+        static constexpr size_t chunk_size = 64*1024*1024;
+        static constexpr int    max_threads = 8;
+
+        struct chunk {
+            int    tensor;
+            size_t offs; // offset within the tensor
+            size_t size;
+        };
+
+        llama_model_loader & ml;
+        std::vector<ggml_tensor *> tensors;
+        std::vector<chunk> chunks;
+        std::unique_ptr<std::atomic<int>[]> pending; // chunks still to be read, per tensor
+
+        std::atomic<int>    next_chunk{0};
+        std::atomic<int>    n_running{0};
+        std::atomic<size_t> size_done{0};
+        std::atomic<bool>   abort{false};
+
+        int n_repack_thread = 1; // threads per repacked tensor, so that the workers together use half the cores
+
+        std::mutex mutex;
+        std::vector<const ggml_tensor *> invalid;
+        std::exception_ptr error;
+
+        std::vector<std::thread> workers;
+
+        host_tensor_reader(llama_model_loader & ml, std::vector<ggml_tensor *> && tensors_) : ml(ml), tensors(std::move(tensors_)) {
+            pending.reset(new std::atomic<int>[tensors.size()]);
+            for (int it = 0; it < (int) tensors.size(); ++it) {
+                const size_t n_size = ggml_nbytes(tensors[it]);
+                int n_chunk = 0;
+                for (size_t offs = 0; offs < n_size || n_chunk == 0; offs += chunk_size) {
+                    chunks.push_back({it, offs, std::min(chunk_size, n_size - offs)});
+                    ++n_chunk;
+                }
+                pending[it] = n_chunk;
+            }
+            if (chunks.empty()) {
+                return;
+            }
+            const int n_thread = std::max(1, std::min({(int) std::thread::hardware_concurrency(), max_threads, (int) chunks.size()}));
+            n_running = n_thread;
+            n_repack_thread = std::max(1, (int) std::thread::hardware_concurrency()/2/n_thread);
+            for (int i = 0; i < n_thread; ++i) {
+                workers.emplace_back([this] { work(); });
+            }
+        }
+
+        ~host_tensor_reader() {
+            abort = true;
+            join();
+        }
+
+        void join() {
+            for (auto & w : workers) {
+                w.join();
+            }
+            workers.clear();
+        }
+
+        bool done() const {
+            return n_running == 0;
+        }
+
+        void work() {
+            std::vector<std::unique_ptr<llama_file>> handles(ml.files.size());
+            try {
+                while (!abort) {
+                    const int ic = next_chunk.fetch_add(1);
+                    if (ic >= (int) chunks.size()) {
+                        break;
+                    }
+                    const auto & c = chunks[ic];
+                    ggml_tensor * cur = tensors[c.tensor];
+                    const auto & weight = ml.require_weight(ggml_get_name(cur));
+                    auto & file = handles[weight.idx];
+                    if (!file) {
+                        file.reset(new llama_file(ml.fnames.at(weight.idx).c_str(), "rb"));
+                    }
+                    file->seek(weight.offs + c.offs, SEEK_SET);
+                    file->read_raw((char *) cur->data + c.offs, c.size);
+                    size_done += c.size;
+
+                    if (pending[c.tensor].fetch_sub(1) == 1) {
+                        finish(cur);
+                    }
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                abort = true;
+            }
+            --n_running;
+        }
+
+        void finish(ggml_tensor * cur) {
+            if (ml.check_tensors && !ggml_validate_row_data(cur->type, cur->data, ggml_nbytes(cur))) {
+                std::lock_guard<std::mutex> lock(mutex);
+                invalid.push_back(cur);
+                return;
+            }
+            // attn_kv_b is needed unpacked by llm_prepare_mla, it gets repacked after that
+            if (ml.repack_tensors && !strstr(ggml_get_name(cur), "attn_kv_b")) {
+                const auto orig_type = cur->type;
+                iqk_repack_tensor_threads(cur, n_repack_thread);
+                if (cur->type != orig_type) {
+                    std::lock_guard<std::mutex> lock(ml.repacked_mutex);
+                    ml.repacked.push_back(cur);
+                }
+            }
+        }
+    };
+    std::mutex repacked_mutex;
+
     // Returns false if cancelled by progress_callback
     bool load_all_data(
             struct ggml_context * ctx,
@@ -4965,15 +5580,29 @@ struct llama_model_loader {
         }
 #endif
 
+        // without mmap the tensors in host buffers are read in the background while the others are uploaded here
+        std::vector<ggml_tensor *> host_tensors;
+        if (!use_mmap) {
+            for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+                if (get_weight(ggml_get_name(cur)) && ggml_backend_buffer_is_host(cur->buffer)) {
+                    host_tensors.push_back(cur);
+                }
+            }
+        }
+        host_tensor_reader reader(*this, std::move(host_tensors));
+
         for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
             const auto * weight = get_weight(ggml_get_name(cur));
             if (weight == nullptr) {
                 // this can happen with split experts models
                 continue;
             }
+            if (!use_mmap && ggml_backend_buffer_is_host(cur->buffer)) {
+                continue;
+            }
 
             if (progress_callback) {
-                if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
+                if (!progress_callback((float) (size_done + reader.size_done) / size_data, progress_callback_user_data)) {
                     return false;
                 }
             }
@@ -5011,15 +5640,7 @@ struct llama_model_loader {
             } else {
                 GGML_ASSERT(weight->idx < files.size());
                 const auto & file = files.at(weight->idx);
-                if (ggml_backend_buffer_is_host(cur->buffer)) {
-                    file->seek(weight->offs, SEEK_SET);
-                    file->read_raw(cur->data, n_size);
-                    if (check_tensors) {
-                        validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
-                            return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
-                        }));
-                    }
-                } else {
+                {
 #if defined(GGML_USE_CUDA)
                     // If cuda_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
                     if (cuda_backend) {
@@ -5069,8 +5690,26 @@ struct llama_model_loader {
         }
 #endif
 
+        while (!reader.done()) {
+            if (progress_callback) {
+                if (!progress_callback((float) (size_done + reader.size_done) / size_data, progress_callback_user_data)) {
+                    return false;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        reader.join();
+        if (reader.error) {
+            std::rethrow_exception(reader.error);
+        }
+        size_done += reader.size_done;
+
         // check validation results
         bool validation_failed = false;
+        for (const auto * cur : reader.invalid) {
+            LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, ggml_get_name(cur));
+            validation_failed = true;
+        }
         for (auto & future : validation_result) {
             auto result = future.get();
             if (!result.second) {
@@ -5773,6 +6412,7 @@ static void llm_load_hparams(
         case LLM_ARCH_GEMMA2:
             {
                 hparams.n_swa = 4096; // default value of gemma 2
+                hparams.n_swa_pattern = 2;
                 ml.get_key(LLM_KV_ATTENTION_SLIDING_WINDOW, hparams.n_swa, false);
                 ml.get_key(LLM_KV_ATTENTION_LAYERNORM_RMS_EPS, hparams.f_norm_rms_eps);
                 ml.get_key(LLM_KV_ATTN_LOGIT_SOFTCAPPING, hparams.f_attn_logit_softcapping, false);
@@ -6000,6 +6640,16 @@ static void llm_load_hparams(
                     // that have no expert_gating_func model parameter set
                     hparams.expert_gating_func = LLM_EXPERT_GATING_FUNC_SOFTMAX;
                 }
+                ml.get_key(LLM_KV_EXPERT_GROUP_COUNT, hparams.n_expert_groups, false);
+                ml.get_key(LLM_KV_EXPERT_GROUP_USED_COUNT, hparams.n_group_used, false);
+                if (hparams.n_expert_groups > 1 && (hparams.n_group_used == 0 || hparams.n_expert % hparams.n_expert_groups != 0 ||
+                    hparams.n_group_used*(hparams.n_expert/hparams.n_expert_groups) < hparams.n_expert_used)) {
+                    // the group-limited routing cannot select n_expert_used experts, route over all experts instead
+                    LLAMA_LOG_WARN("%s: ignoring n_expert_groups = %u with n_group_used = %u for %u of %u experts\n", __func__,
+                            hparams.n_expert_groups, hparams.n_group_used, hparams.n_expert_used, hparams.n_expert);
+                    hparams.n_expert_groups = 0;
+                    hparams.n_group_used    = 0;
+                }
                 ml.get_key(LLM_KV_ROPE_SCALING_YARN_LOG_MUL, hparams.rope_yarn_log_mul);
 
                 switch (hparams.n_layer) {
@@ -6874,6 +7524,10 @@ static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
         LLAMA_LOG_INFO("%s: expert_weights_scale = %.1f\n",   __func__, hparams.expert_weights_scale);
         LLAMA_LOG_INFO("%s: expert_weights_norm  = %d\n",     __func__, hparams.expert_weights_norm);
         LLAMA_LOG_INFO("%s: expert_gating_func   = %s\n",     __func__, llama_expert_gating_func_name((enum llm_expert_gating_func_type) hparams.expert_gating_func));
+        if (hparams.n_expert_groups > 1) {
+            LLAMA_LOG_INFO("%s: n_expert_groups      = %d\n",     __func__, hparams.n_expert_groups);
+            LLAMA_LOG_INFO("%s: n_group_used         = %d\n",     __func__, hparams.n_group_used);
+        }
         LLAMA_LOG_INFO("%s: rope_yarn_log_mul    = %.4f\n",   __func__, hparams.rope_yarn_log_mul);
     }
 
@@ -7181,6 +7835,135 @@ static void llm_prepare_mla(llama_model & model, int mla) {
     ggml_free(ctx);
 }
 
+// Copies the most selected experts of each MoE layer, according to the counts written by llama_expert_stats_save(),
+// to fast memory: the main GPU if there is one, else freshly allocated (NUMA-local, huge-page eligible) RAM.
+// The original expert tensors stay where they are (e.g. mmap'ed) and are only used for the cold experts.
+static void llm_load_hot_experts(llama_model & model, const char * fname, int n_hot, bool repacked, int main_gpu) {
+    std::ifstream in(fname);
+    if (!in) {
+        throw std::runtime_error(format("failed to open expert statistics %s", fname));
+    }
+    std::map<int, std::vector<uint64_t>> counts;
+    for (std::string line; std::getline(in, line); ) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream str(line);
+        int il, n_expert;
+        if (!(str >> il >> n_expert) || il < 0 || n_expert <= 0) {
+            throw std::runtime_error(format("invalid expert statistics in %s: %s", fname, line.c_str()));
+        }
+        auto & c = counts[il];
+        c.resize(n_expert);
+        for (auto & x : c) {
+            if (!(str >> x)) {
+                throw std::runtime_error(format("invalid expert statistics in %s: %s", fname, line.c_str()));
+            }
+        }
+    }
+
+    const int64_t n_expert = model.hparams.n_expert;
+    if (n_hot <= 0) {
+        n_hot = std::max<int64_t>(1, n_expert/4);
+    }
+
+    // repacked tensors can only be used by the CPU
+    ggml_backend_buffer_type_t buft_hot = llama_default_buffer_type_cpu(true);
+    if (llama_supports_gpu_offload() && !repacked) {
+        buft_hot = llama_default_buffer_type_offload(model, main_gpu);
+    }
+
+    std::vector<std::pair<int, std::vector<int>>> hot_layers;
+    for (const auto & it : counts) {
+        const int il = it.first;
+        if (il >= (int) model.layers.size() || (int64_t) it.second.size() != n_expert || n_hot >= n_expert) {
+            continue;
+        }
+        const auto & layer = model.layers[il];
+        bool ok = layer.ffn_up_exps && layer.ffn_gate_exps && layer.ffn_down_exps;
+        for (auto * t : { layer.ffn_up_exps, layer.ffn_gate_exps, layer.ffn_down_exps }) {
+            ok = ok && t->buffer && ggml_backend_buffer_is_host(t->buffer) && t->ne[2] == n_expert;
+        }
+        if (!ok) {
+            continue; // already in fast memory (offloaded), or not a MoE layer
+        }
+        std::vector<int> order(n_expert);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&c = it.second](int a, int b) { return c[a] > c[b]; });
+        order.resize(n_hot);
+        hot_layers.emplace_back(il, std::move(order));
+    }
+    if (hot_layers.empty()) {
+        LLAMA_LOG_WARN("%s: no layers with experts in RAM match the statistics in %s\n", __func__, fname);
+        return;
+    }
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ 3*hot_layers.size()*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context * ctx_hot = ggml_init(params);
+    params.mem_size = 2*hot_layers.size()*ggml_tensor_overhead();
+    ggml_context * ctx_map = ggml_init(params);
+    if (!ctx_hot || !ctx_map) {
+        throw std::runtime_error("failed to create ggml context for hot experts");
+    }
+    model.ctxs.push_back(ctx_hot);
+    model.ctxs.push_back(ctx_map);
+
+    auto new_hot = [ctx_hot, n_hot](const ggml_tensor * src) {
+        ggml_tensor * t = ggml_new_tensor_3d(ctx_hot, src->type, src->ne[0], src->ne[1], n_hot);
+        ggml_format_name(t, "%s.hot", src->name);
+        return t;
+    };
+    for (auto & it : hot_layers) {
+        auto & layer = model.layers[it.first];
+        layer.ffn_up_exps_hot   = new_hot(layer.ffn_up_exps);
+        layer.ffn_gate_exps_hot = new_hot(layer.ffn_gate_exps);
+        layer.ffn_down_exps_hot = new_hot(layer.ffn_down_exps);
+        layer.ffn_exps_hot_map  = ggml_new_tensor_2d(ctx_map, GGML_TYPE_I32, 1, n_expert);
+        layer.ffn_exps_cold_map = ggml_new_tensor_2d(ctx_map, GGML_TYPE_I32, 1, n_expert);
+        ggml_format_name(layer.ffn_exps_hot_map,  "blk.%d.ffn_exps_hot_map",  it.first);
+        ggml_format_name(layer.ffn_exps_cold_map, "blk.%d.ffn_exps_cold_map", it.first);
+    }
+
+    ggml_backend_buffer_t buf_hot = ggml_backend_alloc_ctx_tensors_from_buft(ctx_hot, buft_hot);
+    ggml_backend_buffer_t buf_map = ggml_backend_alloc_ctx_tensors_from_buft(ctx_map, llama_default_buffer_type_cpu(true));
+    if (!buf_hot || !buf_map) {
+        throw std::runtime_error("failed to allocate buffers for hot experts");
+    }
+    ggml_backend_buffer_set_usage(buf_hot, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+    ggml_backend_buffer_set_usage(buf_map, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+    model.bufs.push_back(buf_hot);
+    model.bufs.push_back(buf_map);
+
+    std::vector<int32_t> hot_map(n_expert), cold_map(n_expert);
+    for (auto & it : hot_layers) {
+        auto & layer = model.layers[it.first];
+        for (int64_t e = 0; e < n_expert; ++e) {
+            hot_map[e]  = -1;
+            cold_map[e] = e;
+        }
+        for (int slot = 0; slot < n_hot; ++slot) {
+            const int e = it.second[slot];
+            hot_map[e]  = slot;
+            cold_map[e] = -1;
+            for (auto src_hot : { std::make_pair(layer.ffn_up_exps,   layer.ffn_up_exps_hot),
+                                  std::make_pair(layer.ffn_gate_exps, layer.ffn_gate_exps_hot),
+                                  std::make_pair(layer.ffn_down_exps, layer.ffn_down_exps_hot) }) {
+                const ggml_tensor * src = src_hot.first;
+                ggml_backend_tensor_set(src_hot.second, (const char *) src->data + e*src->nb[2], slot*src_hot.second->nb[2], src->nb[2]);
+            }
+        }
+        ggml_backend_tensor_set(layer.ffn_exps_hot_map,  hot_map.data(),  0, ggml_nbytes(layer.ffn_exps_hot_map));
+        ggml_backend_tensor_set(layer.ffn_exps_cold_map, cold_map.data(), 0, ggml_nbytes(layer.ffn_exps_cold_map));
+    }
+
+    LLAMA_LOG_INFO("%s: copied %d hot experts of %d layers to %s (%.2f MiB)\n", __func__, n_hot, (int) hot_layers.size(),
+            ggml_backend_buft_name(buft_hot), ggml_backend_buffer_get_size(buf_hot)/1024.0/1024.0);
+}
+
 // Returns false if cancelled by progress_callback
 static bool llm_load_tensors(
         llama_model_loader & ml,
@@ -7191,6 +7974,8 @@ static bool llm_load_tensors(
         int main_gpu,
         const float * tensor_split,
         bool use_mlock,
+        const char * hot_experts,
+        int n_hot_experts,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
     model.t_start_us = ggml_time_us();
@@ -7205,14 +7990,24 @@ static bool llm_load_tensors(
     const int i_gpu_start = std::max((int) hparams.n_layer - n_gpu_layers, (int) 0);
     bool use_mmap_buffer = true;
 
+    // with --numa shard the weights kept on the CPU are copied into buffers that place the rows of each
+    // matrix on the NUMA node of the threads that use them, instead of being used from the mmap
+    const bool numa_shard = ggml_numa_shard_enabled();
+    ggml_backend_buffer_type_t buft_cpu = llama_default_buffer_type_cpu(true);
+    if (numa_shard && buft_cpu == ggml_backend_cpu_buffer_type()) {
+        LLAMA_LOG_INFO("%s: NUMA sharding enabled, weights will not be used from the mmap\n", __func__);
+        buft_cpu = ggml_backend_cpu_numa_buffer_type();
+        use_mmap_buffer = false;
+    }
+
     // there is very little benefit to offloading the input layer, so always keep it on the CPU
-    model.buft_input = llama_default_buffer_type_cpu(true);
+    model.buft_input = buft_cpu;
 
     model.buft_layer.resize(n_layer);
 
     // assign cpu layers
     for (int i = 0; i < i_gpu_start; ++i) {
-        model.buft_layer[i] = llama_default_buffer_type_cpu(true);
+        model.buft_layer[i] = buft_cpu;
     }
 
     if (split_mode == LLAMA_SPLIT_MODE_LAYER) {
@@ -7250,7 +8045,7 @@ static bool llm_load_tensors(
             int layer_gpu = std::upper_bound(splits.begin(), splits.begin() + device_count, float(act_gpu_layers - 1)/act_gpu_layers) - splits.begin();
             model.buft_output = llama_default_buffer_type_offload(model, layer_gpu);
         } else {
-            model.buft_output = llama_default_buffer_type_cpu(true);
+            model.buft_output = buft_cpu;
         }
     } else {
         ggml_backend_buffer_type_t split_buft;
@@ -7274,7 +8069,7 @@ static bool llm_load_tensors(
                 llama_default_buffer_type_offload(model, main_gpu)
             };
         } else {
-            model.buft_output = llama_default_buffer_type_cpu(true);
+            model.buft_output = buft_cpu;
         }
     }
 
@@ -7364,13 +8159,15 @@ static bool llm_load_tensors(
 
         model.layers.resize(n_layer);
 
-        auto create_tensor = [&ml, &ctx_map, &ctx_for_buft] (ggml_context * ctx, const std::string & name, const std::vector<int64_t> & ne, int flags = 0) {
+        auto create_tensor = [&ml, &ctx_map, &ctx_for_buft, numa_shard] (ggml_context * ctx, const std::string & name, const std::vector<int64_t> & ne, int flags = 0) {
             if (ml.tensor_buft_overrides) {
                 for (const auto * overrides = ml.tensor_buft_overrides; overrides->pattern != nullptr; ++overrides) {
                     std::regex pattern(overrides->pattern);
                     if (std::regex_search(name, pattern)) {
-                        LLAMA_LOG_INFO("Tensor %s buffer type overriden to %s\n", name.c_str(), ggml_backend_buft_name(overrides->buft));
-                        ctx = ctx_for_buft(overrides->buft);
+                        // tensors overridden to CPU (e.g. the experts of a partially offloaded MoE model) get sharded too
+                        auto buft = numa_shard && overrides->buft == ggml_backend_cpu_buffer_type() ? ggml_backend_cpu_numa_buffer_type() : overrides->buft;
+                        LLAMA_LOG_INFO("Tensor %s buffer type overriden to %s\n", name.c_str(), ggml_backend_buft_name(buft));
+                        ctx = ctx_for_buft(buft);
                         break;
                     }
                 }
@@ -9384,6 +10181,10 @@ static bool llm_load_tensors(
 
     ml.done_getting_tensors();
 
+    if (int n_rtr = ml.apply_rtr_cache(ctx_map); n_rtr > 0) {
+        LLAMA_LOG_INFO("%s: mapping %d repacked tensors from the repack cache\n", __func__, n_rtr);
+    }
+
     ml.init_mappings(true, use_mlock ? &model.mlock_mmaps : nullptr, ml.use_thp);
     model.mappings.reserve(ml.mappings.size());
 
@@ -9504,6 +10305,7 @@ static bool llm_load_tensors(
     }
 
     // load tensor data
+    const int64_t t_load_start_us = ggml_time_us();
     for (auto & it : ctx_bufs) {
         ggml_context * ctx = it.first;
         auto & bufs = it.second;
@@ -9511,6 +10313,11 @@ static bool llm_load_tensors(
             return false;
         }
     }
+    if (!ml.use_mmap) {
+        const double t_load = 1e-6*(ggml_time_us() - t_load_start_us);
+        LLAMA_LOG_INFO("%s: read %.2f GiB of tensor data in %.2f s (%.2f GB/s)\n", __func__,
+                ml.size_done/1024.0/1024.0/1024.0, t_load, t_load > 0 ? 1e-9*ml.size_done/t_load : 0.0);
+    }
 
     llm_prepare_mla(model, mla_attn);
 
@@ -9530,17 +10337,27 @@ static bool llm_load_tensors(
         if (n_modified > 0) printf("============ Modified %d tensors\n", n_modified);
     }
 
-    if (!ml.use_mmap && ml.repack_tensors) {
-        int n_repacked = 0;
+    if (ml.repack_tensors) {
+        // most tensors have already been repacked by load_all_data
+        std::vector<const ggml_tensor *> repacked = ml.repacked;
         for (auto& it : model.tensors_by_name) {
             if (ggml_backend_buffer_is_host(it.second->buffer)) {
+                // mmap'ed weights are read-only, their repacked versions come from the repack cache
+                if (ml.use_mmap && ml.get_weight(it.first.c_str())) continue;
                 auto orig_type = it.second->type;
                 iqk_repack_tensor(it.second);
-                if (it.second->type != orig_type) ++n_repacked;
+                if (it.second->type != orig_type) repacked.push_back(it.second);
                 //printf("Repacking tensor %s\n", it.first.c_str());
             }
         }
-        if (n_repacked > 0) printf("============ Repacked %d tensors\n", n_repacked);
+        if (!repacked.empty()) printf("============ Repacked %d tensors\n", (int)repacked.size());
+        if (ml.rtr_cache_write) {
+            ml.write_rtr_cache(repacked);
+        }
+    }
+
+    if (hot_experts && model.hparams.n_expert > 0) {
+        llm_load_hot_experts(model, hot_experts, n_hot_experts, ml.repack_tensors, main_gpu);
     }
 
     if (model.arch == LLM_ARCH_BITNET) {
@@ -9630,7 +10447,7 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
 
         if (!llm_load_tensors(
             ml, model, params.n_gpu_layers, params.mla, params.split_mode,  params.main_gpu, params.tensor_split, params.use_mlock,
-            params.progress_callback, params.progress_callback_user_data
+            params.hot_experts, params.n_hot_experts, params.progress_callback, params.progress_callback_user_data
         )) {
             return -2;
         }
@@ -9699,6 +10516,25 @@ static struct ggml_tensor * llm_build_inp_embd(
     return inpL;
 }
 
+// paged KV cache: the cells the K/V of the ubatch are stored to, nullptr if they are stored contiguously at kv_head
+static struct ggml_tensor * llm_build_inp_kv_idxs(
+        struct ggml_context * ctx,
+             llama_context & lctx,
+                    int32_t   n_tokens,
+         const llm_build_cb & cb) {
+    if (lctx.kv_self.block_size == 0 || !lctx.cparams.causal_attn) {
+        return nullptr;
+    }
+
+    if (!lctx.inp_kv_idxs) {
+        lctx.inp_kv_idxs = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_tokens);
+        cb(lctx.inp_kv_idxs, "inp_kv_idxs", -1);
+        ggml_set_input(lctx.inp_kv_idxs);
+    }
+
+    return lctx.inp_kv_idxs;
+}
+
 static void llm_build_kv_store(
         struct ggml_context * ctx,
         const llama_hparams & hparams,
@@ -9709,10 +10545,9 @@ static void llm_build_kv_store(
          struct ggml_tensor * v_cur,
                     int32_t   n_tokens,
                     int32_t   kv_head,
+         struct ggml_tensor * kv_idxs,
          const llm_build_cb & cb,
                     int64_t   il) {
-    const int64_t n_ctx = cparams.n_ctx;
-
     const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
     const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
@@ -9721,7 +10556,36 @@ static void llm_build_kv_store(
     const int64_t n_embd_head_k = hparams.n_embd_head_k;
     const int64_t n_embd_head_v = hparams.n_embd_head_v;
 
-    GGML_ASSERT(kv.size == n_ctx);
+    if (kv_idxs) {
+        // paged KV cache - scatter the rows of the tokens into their cells
+        // note: the K rows are set per head, so that row-wise quantization matches the contiguous store
+        GGML_ASSERT(cparams.flash_attn);
+
+        auto k_row_size = ggml_row_size(kv.k_l[il]->type, n_embd_head_k);
+        ggml_tensor * k_cache_rows = ggml_view_3d(ctx, kv.k_l[il], n_embd_head_k, n_head_kv, kv.size,
+                k_row_size, k_row_size*n_head_kv, 0);
+
+        if (!ggml_is_contiguous(k_cur)) {
+            k_cur = ggml_cont(ctx, k_cur);
+        }
+        k_cur = ggml_reshape_3d(ctx, k_cur, n_embd_head_k, n_head_kv, n_tokens);
+
+        ggml_build_forward_expand(graph, ggml_set_rows(ctx, k_cache_rows, k_cur, kv_idxs));
+
+        auto v_row_size = ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa);
+        ggml_tensor * v_cache_rows = ggml_view_3d(ctx, kv.v_l[il], n_embd_v_gqa, 1, kv.size,
+                v_row_size, v_row_size, 0);
+        cb(v_cache_rows, "v_cache_rows", il);
+
+        if (!ggml_is_contiguous(v_cur)) {
+            v_cur = ggml_cont(ctx, v_cur);
+        }
+        v_cur = ggml_reshape_3d(ctx, v_cur, n_embd_v_gqa, 1, n_tokens);
+
+        ggml_build_forward_expand(graph, ggml_set_rows(ctx, v_cache_rows, v_cur, kv_idxs));
+
+        return;
+    }
 
     //struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_k_gqa,
     //        (ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa))*kv_head);
@@ -9742,7 +10606,7 @@ static void llm_build_kv_store(
     } else {
         // note: the V cache is transposed when not using flash attention
         v_cache_view = ggml_view_2d(ctx, kv.v_l[il], n_tokens, n_embd_v_gqa,
-                (  n_ctx)*ggml_element_size(kv.v_l[il]),
+                (kv.size)*ggml_element_size(kv.v_l[il]),
                 (kv_head)*ggml_element_size(kv.v_l[il]));
 
         v_cur = ggml_transpose(ctx, v_cur);
@@ -9998,60 +10862,95 @@ llm_expert_gating_func_type   gating_op,
     ggml_tensor * logits = llm_build_lora_mm(lctx, ctx, gate_inp, cur); // [n_expert, n_tokens]
     cb(logits, "ffn_moe_logits", il);
 
-    //ggml_tensor * probs = ggml_soft_max(ctx, logits); // [n_expert, n_tokens]
-    ggml_tensor * probs = nullptr;
-    switch (gating_op) {
-        case LLM_EXPERT_GATING_FUNC_SOFTMAX:
-            {
-                probs = ggml_soft_max(ctx, logits); // [n_expert, n_tokens]
-            } break;
-        case LLM_EXPERT_GATING_FUNC_SIGMOID:
-            {
-                probs = ggml_sigmoid(ctx, logits); // [n_expert, n_tokens]
-            } break;
-        default:
-            GGML_ABORT("fatal error");
-    }
-    cb(probs, "ffn_moe_probs", il);
+    const auto & hparams = lctx.model.hparams;
+    const bool cpu_only = lctx.backends.size() == 1 && lctx.backends.front() == lctx.backend_cpu;
+
+    // Group-limited routing only exists in the fused router, which is therefore also used when offloading
+    // (the scheduler runs it on the CPU then).
+    const bool group_limited = hparams.n_expert_groups > 1 && hparams.n_group_used < hparams.n_expert_groups;
+
+    ggml_tensor * selected_experts; // [n_expert_used, n_tokens]
+    ggml_tensor * weights;          // [1, n_expert_used, n_tokens]
+    if (!weight_before_ffn && (cpu_only || group_limited)) {
+        enum ggml_moe_gating gating;
+        switch (gating_op) {
+            case LLM_EXPERT_GATING_FUNC_SOFTMAX: gating = GGML_MOE_GATING_SOFTMAX; break;
+            case LLM_EXPERT_GATING_FUNC_SIGMOID: gating = GGML_MOE_GATING_SIGMOID; break;
+            default:
+                GGML_ABORT("fatal error");
+        }
+        ggml_tensor * route = ggml_moe_route(ctx, logits, exp_probs_b, n_expert_used, gating, norm_w, scale_w ? w_scale : 1.0f,
+                group_limited ? hparams.n_expert_groups : 1, hparams.n_group_used,
+                lctx.cparams.min_experts, lctx.cparams.thresh_experts);
+        cb(route, "ffn_moe_route", il);
 
-    // add experts selection bias - introduced in DeepSeek V3
-    // leave probs unbiased as it's later used to get expert weights
-    ggml_tensor * selection_probs = probs;
-    if (exp_probs_b != nullptr) {
-        selection_probs = ggml_add(ctx, probs, exp_probs_b);
-        cb(selection_probs, "ffn_moe_probs_biased", il);
-    }
+        selected_experts = ggml_moe_route_ids(ctx, route);
+        cb(selected_experts, "ffn_moe_topk", il);
 
-    // llama4 doesn't have exp_probs_b, and sigmoid is only used after top_k
-    // see: https://github.com/meta-llama/llama-models/blob/699a02993512fb36936b1b0741e13c06790bcf98/models/llama4/moe.py#L183-L198
-    if (lctx.model.arch == LLM_ARCH_LLAMA4) {
-        selection_probs = logits;
-    }
+        weights = ggml_moe_route_weights(ctx, route);
+        cb(weights, "ffn_moe_weights", il);
+    } else {
+        //ggml_tensor * probs = ggml_soft_max(ctx, logits); // [n_expert, n_tokens]
+        ggml_tensor * probs = nullptr;
+        switch (gating_op) {
+            case LLM_EXPERT_GATING_FUNC_SOFTMAX:
+                {
+                    probs = ggml_soft_max(ctx, logits); // [n_expert, n_tokens]
+                } break;
+            case LLM_EXPERT_GATING_FUNC_SIGMOID:
+                {
+                    probs = ggml_sigmoid(ctx, logits); // [n_expert, n_tokens]
+                } break;
+            default:
+                GGML_ABORT("fatal error");
+        }
+        cb(probs, "ffn_moe_probs", il);
+
+        // add experts selection bias - introduced in DeepSeek V3
+        // leave probs unbiased as it's later used to get expert weights
+        ggml_tensor * selection_probs = probs;
+        if (exp_probs_b != nullptr) {
+            selection_probs = ggml_add(ctx, probs, exp_probs_b);
+            cb(selection_probs, "ffn_moe_probs_biased", il);
+        }
+
+        // llama4 doesn't have exp_probs_b, and sigmoid is only used after top_k
+        // see: https://github.com/meta-llama/llama-models/blob/699a02993512fb36936b1b0741e13c06790bcf98/models/llama4/moe.py#L183-L198
+        if (lctx.model.arch == LLM_ARCH_LLAMA4) {
+            selection_probs = logits;
+        }
 
-    // select experts
-    ggml_tensor * selected_experts = ggml_top_k_thresh(ctx, selection_probs, n_expert_used,
-            lctx.cparams.min_experts, lctx.cparams.thresh_experts); // [n_expert_used, n_tokens]
-    cb(selected_experts->src[0], "ffn_moe_argsort", il);
-    cb(selected_experts, "ffn_moe_topk", il);
+        // select experts
+        selected_experts = ggml_top_k_thresh(ctx, selection_probs, n_expert_used,
+                lctx.cparams.min_experts, lctx.cparams.thresh_experts); // [n_expert_used, n_tokens]
+        cb(selected_experts->src[0], "ffn_moe_argsort", il);
+        cb(selected_experts, "ffn_moe_topk", il);
 
-    ggml_tensor * weights = ggml_get_rows(ctx,
-            ggml_reshape_3d(ctx, probs, 1, n_expert, n_tokens), selected_experts); // [1, n_expert_used, n_tokens]
-    cb(weights, "ffn_moe_weights", il);
+        weights = ggml_get_rows(ctx,
+                ggml_reshape_3d(ctx, probs, 1, n_expert, n_tokens), selected_experts); // [1, n_expert_used, n_tokens]
+        cb(weights, "ffn_moe_weights", il);
 
-    if (norm_w) {
-        weights = ggml_reshape_2d(ctx, weights, n_expert_used, n_tokens);
+        if (norm_w) {
+            weights = ggml_reshape_2d(ctx, weights, n_expert_used, n_tokens);
 
-        ggml_tensor * weights_sum = ggml_sum_rows(ctx, weights); // [1, n_tokens]
-        cb(weights_sum, "ffn_moe_weights_sum", il);
+            ggml_tensor * weights_sum = ggml_sum_rows(ctx, weights); // [1, n_tokens]
+            cb(weights_sum, "ffn_moe_weights_sum", il);
 
-        weights = ggml_div(ctx, weights, weights_sum); // [n_expert_used, n_tokens]
-        cb(weights, "ffn_moe_weights_norm", il);
+            weights = ggml_div(ctx, weights, weights_sum); // [n_expert_used, n_tokens]
+            cb(weights, "ffn_moe_weights_norm", il);
 
-        weights = ggml_reshape_3d(ctx, weights, 1, n_expert_used, n_tokens);
+            weights = ggml_reshape_3d(ctx, weights, 1, n_expert_used, n_tokens);
+        }
+        if (scale_w) {
+            weights = ggml_scale(ctx, weights, w_scale);
+            cb(weights, "ffn_moe_weights_scaled", il);
+        }
     }
-    if (scale_w) {
-        weights = ggml_scale(ctx, weights, w_scale);
-        cb(weights, "ffn_moe_weights_scaled", il);
+
+    if (lctx.cparams.expert_stats) {
+        // keep the selection alive until llama_decode has counted it
+        ggml_set_output(selected_experts->view_src);
+        lctx.moe_selected.emplace_back(il, selected_experts);
     }
 
     cur = ggml_reshape_3d(ctx, cur, n_embd, 1, n_tokens);
@@ -10064,23 +10963,94 @@ llm_expert_gating_func_type   gating_op,
         cb(cur, "ffn_moe_weighted", il);
     }
 
-    ggml_tensor * par;
-    if (lctx.cparams.fused_moe_up_gate) {
-        par = ggml_moe_up_gate(ctx, up_exps, gate_exps, cur, selected_experts, type_op == LLM_FFN_SILU ? GGML_UNARY_OP_SILU : GGML_UNARY_OP_GELU);
-    } else {
-        ggml_tensor * up = llm_build_lora_mm_id(lctx, ctx, up_exps, cur, selected_experts); // [n_ff, n_expert_used, n_tokens]
-        cb(up, "ffn_moe_up", il);
+    const auto & layer = lctx.model.layers[il];
+
+    // With -ser dropped experts have id -1, which the id maps of the hot/cold split cannot represent, so the split is not used then.
+    const bool hot_cold_split = layer.ffn_exps_hot_map && up_exps == layer.ffn_up_exps &&
+        !(lctx.cparams.min_experts > 0 && lctx.cparams.thresh_experts > 0);
+
+    // The slices of the selected experts in mmapped host memory are requested from the OS before the expert
+    // matrix multiplications, which take their ids from the prefetch node, touch them.
+    auto prefetch = [&](ggml_tensor * ids, ggml_tensor * up_exps, ggml_tensor * gate_exps, ggml_tensor * down_exps) {
+        if (!lctx.cparams.expert_prefetch || !up_exps->buffer || !ggml_backend_buffer_is_host(up_exps->buffer)) {
+            return ids;
+        }
+        ggml_tensor * pf = ggml_moe_prefetch(ctx, ids, up_exps, gate_exps, down_exps);
+        cb(pf, "ffn_moe_prefetch", il);
+        ggml_set_output(pf);
+        lctx.moe_prefetch.push_back(pf);
+        return ggml_moe_prefetch_ids(ctx, pf);
+    };
+    if (!hot_cold_split) {
+        selected_experts = prefetch(selected_experts, up_exps, gate_exps, down_exps);
+    }
+
+    const bool cpu_fused_moe = cpu_only && n_expert_used > 1 && !weight_before_ffn && !layer.ffn_exps_hot_map && lctx.lora_adapters.empty();
+
+    // Prompt processing on the CPU: the up/gate results are produced grouped by expert, the down projection reads
+    // and writes them in that order, and the weighted sum scatters them back to the tokens.
+    if (cpu_fused_moe && lctx.cparams.fused_moe_up_gate && n_tokens >= 32) {
+        ggml_tensor * par = ggml_moe_up_gate_sorted(ctx, up_exps, gate_exps, cur, selected_experts,
+                type_op == LLM_FFN_SILU ? GGML_UNARY_OP_SILU : GGML_UNARY_OP_GELU);
+        cb(par, "ffn_moe_gate_par", il);
+
+        ggml_tensor * experts = ggml_mul_mat_id_sorted(ctx, down_exps, par, selected_experts); // [n_embd, n_expert_used*n_tokens] by expert
+        cb(experts, "ffn_moe_down", il);
+
+        return ggml_multi_add_weighted(ctx, experts, weights, selected_experts, n_expert);
+    }
+
+    auto build_par = [&](ggml_tensor * up_exps, ggml_tensor * gate_exps, ggml_tensor * selected_experts) {
+        ggml_tensor * par;
+        if (lctx.cparams.fused_moe_up_gate) {
+            par = ggml_moe_up_gate(ctx, up_exps, gate_exps, cur, selected_experts, type_op == LLM_FFN_SILU ? GGML_UNARY_OP_SILU : GGML_UNARY_OP_GELU);
+        } else {
+            ggml_tensor * up = llm_build_lora_mm_id(lctx, ctx, up_exps, cur, selected_experts); // [n_ff, n_expert_used, n_tokens]
+            cb(up, "ffn_moe_up", il);
+
+            ggml_tensor * gate = llm_build_lora_mm_id(lctx, ctx, gate_exps, cur, selected_experts); // [n_ff, n_expert_used, n_tokens]
+            cb(gate, "ffn_moe_gate", il);
 
-        ggml_tensor * gate = llm_build_lora_mm_id(lctx, ctx, gate_exps, cur, selected_experts); // [n_ff, n_expert_used, n_tokens]
-        cb(gate, "ffn_moe_gate", il);
+            // This is equivalent to the commented out code below
+            par = ggml_fused_mul_unary(ctx, gate, up, type_op == LLM_FFN_SILU ? GGML_UNARY_OP_SILU : GGML_UNARY_OP_GELU);
+        }
+        cb(par, "ffn_moe_gate_par", il);
+        return par;
+    };
 
-        // This is equivalent to the commented out code below
-        par = ggml_fused_mul_unary(ctx, gate, up, type_op == LLM_FFN_SILU ? GGML_UNARY_OP_SILU : GGML_UNARY_OP_GELU);
+    // Token generation on the CPU: the down projection accumulates the weighted expert results directly into
+    // the [n_embd, n_tokens] output.
+    if (cpu_fused_moe && n_tokens < 32) {
+        ggml_tensor * par = build_par(up_exps, gate_exps, selected_experts);
+        ggml_tensor * moe_out = ggml_moe_down(ctx, down_exps, par, selected_experts, weights); // [n_embd, n_tokens]
+        cb(moe_out, "ffn_moe_down", il);
+        return moe_out;
     }
-    cb(par, "ffn_moe_gate_par", il);
 
-    ggml_tensor * experts = llm_build_lora_mm_id(lctx, ctx, down_exps, par, selected_experts); // [n_embd, n_expert_used, n_tokens]
-    cb(experts, "ffn_moe_down", il);
+    auto build_experts = [&](ggml_tensor * up_exps, ggml_tensor * gate_exps, ggml_tensor * down_exps, ggml_tensor * selected_experts) {
+        ggml_tensor * par = build_par(up_exps, gate_exps, selected_experts);
+        ggml_tensor * experts = llm_build_lora_mm_id(lctx, ctx, down_exps, par, selected_experts); // [n_embd, n_expert_used, n_tokens]
+        cb(experts, "ffn_moe_down", il);
+        return experts;
+    };
+
+    ggml_tensor * experts;
+    if (hot_cold_split) {
+        // Hot experts are computed from their copies, the others from the original tensors. The matrix
+        // multiplications skip (and zero) the rows with ids out of range, so the two partial results add up.
+        ggml_tensor * ids = ggml_reshape_2d(ctx, ggml_cont(ctx, selected_experts), n_expert_used*n_tokens, 1);
+        ggml_tensor * ids_hot  = ggml_reshape_2d(ctx, ggml_get_rows(ctx, layer.ffn_exps_hot_map,  ids), n_expert_used, n_tokens);
+        ggml_tensor * ids_cold = ggml_reshape_2d(ctx, ggml_get_rows(ctx, layer.ffn_exps_cold_map, ids), n_expert_used, n_tokens);
+        cb(ids_hot,  "ffn_moe_ids_hot",  il);
+        cb(ids_cold, "ffn_moe_ids_cold", il);
+        ids_cold = prefetch(ids_cold, up_exps, gate_exps, down_exps);
+        experts = ggml_add(ctx,
+                build_experts(layer.ffn_up_exps_hot, layer.ffn_gate_exps_hot, layer.ffn_down_exps_hot, ids_hot),
+                build_experts(up_exps, gate_exps, down_exps, ids_cold));
+        cb(experts, "ffn_moe_down_hot_cold", il);
+    } else {
+        experts = build_experts(up_exps, gate_exps, down_exps, selected_experts);
+    }
 
     if (!weight_before_ffn) {
         experts = ggml_mul(ctx, experts, weights);
@@ -10139,7 +11109,6 @@ static struct ggml_tensor * llm_build_kqv(
     const llama_hparams & hparams = lctx.model.hparams;
     const llama_cparams & cparams = lctx.cparams;
 
-    const int64_t n_ctx         = cparams.n_ctx;
     const int64_t n_head        = hparams.n_head(il);
     const int64_t n_head_kv     = hparams.n_head_kv(il);
     const int64_t n_embd_head_k = hparams.n_embd_head_k;
@@ -10168,7 +11137,6 @@ static struct ggml_tensor * llm_build_kqv(
 
     if (cparams.flash_attn) {
         GGML_UNUSED(model);
-        GGML_UNUSED(n_ctx);
 
         // split cached v into n_head heads (not transposed)
         struct ggml_tensor * v =
@@ -10191,6 +11159,11 @@ static struct ggml_tensor * llm_build_kqv(
         }
         //ggml_flash_attn_ext_set_prec(cur, GGML_PREC_F32);
 
+        // in paged mode the blocks of the other sequences are spread over the KV view, skip them
+        if (kv.block_size > 0) {
+            ggml_flash_attn_ext_set_skip_masked(cur, true);
+        }
+
         cur = ggml_reshape_2d(ctx, cur, n_embd_head_v*n_head, n_tokens);
     } else {
 
@@ -10198,8 +11171,8 @@ static struct ggml_tensor * llm_build_kqv(
         struct ggml_tensor * v =
             ggml_view_3d(ctx, kv.v_l[il],
                     n_kv, n_embd_head_v, n_head_kv,
-                    ggml_element_size(kv.v_l[il])*n_ctx,
-                    ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head_v,
+                    ggml_element_size(kv.v_l[il])*kv.size,
+                    ggml_element_size(kv.v_l[il])*kv.size*n_embd_head_v,
                     0);
         cb(v, "v", il);
 
@@ -10242,8 +11215,6 @@ static struct ggml_tensor * llm_build_kqv(
             }
             cb(kq, "kq_soft_max_ext", il);
 
-            GGML_ASSERT(kv.size == n_ctx);
-
             struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
             cb(kqv, "kqv", il);
 
@@ -10342,7 +11313,8 @@ static struct ggml_tensor * llm_build_kv(
     ggml_build_forward_expand(graph, k_cur);
     ggml_build_forward_expand(graph, v_cur);
 
-    llm_build_kv_store(ctx, hparams, cparams, kv, graph, k_cur, v_cur, n_tokens, kv_head, cb, il);
+    llm_build_kv_store(ctx, hparams, cparams, kv, graph, k_cur, v_cur, n_tokens, kv_head,
+            llm_build_inp_kv_idxs(ctx, lctx, n_tokens, cb), cb, il);
 
     struct ggml_tensor * cur;
 
@@ -10360,6 +11332,7 @@ struct llm_build_context {
     const llama_cparams  & cparams;
     const llama_batch    & batch;
     const llama_kv_cache & kv_self;
+    const llama_kv_cache & kv_swa;
 
     const int64_t n_embd;
     const int64_t n_layer;
@@ -10388,6 +11361,8 @@ struct llm_build_context {
     const int32_t n_outputs;
     const int32_t n_outputs_enc;
     const int32_t kv_head;  // index of where we store new KV data in the cache
+    const int32_t n_kv_swa;    // same as n_kv and kv_head for kv_swa (sliding window attention layers)
+    const int32_t kv_head_swa;
     const int32_t n_ctx_orig;
 
     const bool flash_attn;
@@ -10419,6 +11394,7 @@ struct llm_build_context {
         cparams          (lctx.cparams),
         batch            (batch),
         kv_self          (lctx.kv_self),
+        kv_swa           (lctx.kv_swa),
         n_embd           (hparams.n_embd),
         n_layer          (hparams.n_layer),
         n_rot            (hparams.n_rot),
@@ -10444,6 +11420,8 @@ struct llm_build_context {
         n_outputs        (worst_case ? n_tokens : lctx.n_outputs),
         n_outputs_enc    (worst_case ? n_tokens : lctx.embd_enc.size() / hparams.n_embd),
         kv_head          (worst_case ? (kv_self.recurrent ? 0 : kv_self.size - n_tokens) : kv_self.head),
+        n_kv_swa         (worst_case ? kv_swa.size : kv_swa.n),
+        kv_head_swa      (worst_case ? std::max<int32_t>(0, kv_swa.size - n_tokens) : kv_swa.head),
         n_ctx_orig       (cparams.n_ctx_orig_yarn),
         flash_attn       (cparams.flash_attn),
         mla_attn         (cparams.mla_attn),
@@ -10474,6 +11452,7 @@ struct llm_build_context {
         lctx.inp_KQ_mask     = nullptr;
         lctx.inp_KQ_mask_swa = nullptr;
         lctx.inp_K_shift     = nullptr;
+        lctx.inp_K_shift_swa = nullptr;
         lctx.inp_mean        = nullptr;
         lctx.inp_cls         = nullptr;
         lctx.inp_s_copy      = nullptr;
@@ -10482,6 +11461,9 @@ struct llm_build_context {
         lctx.inp_pos_bucket    = nullptr;
         lctx.inp_embd_enc      = nullptr;
         lctx.inp_KQ_mask_cross = nullptr;
+        lctx.inp_kv_idxs       = nullptr;
+        lctx.moe_selected.clear();
+        lctx.moe_prefetch.clear();
     }
 
     void free() {
@@ -10494,25 +11476,35 @@ struct llm_build_context {
     struct ggml_cgraph * build_k_shift() {
         struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
 
-        GGML_ASSERT(kv_self.size == n_ctx);
-
-        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_ctx);
+        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, kv_self.size);
         cb(lctx.inp_K_shift, "K_shift", -1);
         ggml_set_input(lctx.inp_K_shift);
 
+        if (kv_swa.size > 0) {
+            lctx.inp_K_shift_swa = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, kv_swa.size);
+            cb(lctx.inp_K_shift_swa, "K_shift_swa", -1);
+            ggml_set_input(lctx.inp_K_shift_swa);
+        }
+
         for (int il = 0; il < n_layer; ++il) {
+            const bool use_swa = kv_swa.size > 0 && hparams.is_swa(il);
+            const llama_kv_cache & kv = use_swa ? kv_swa : kv_self;
+            struct ggml_tensor * k_l = kv.k_l[il];
+            if (!k_l) {
+                continue;
+            }
             const int64_t n_head_kv = hparams.n_head_kv(il);
             const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
             struct ggml_tensor * rope_factors = build_rope_factors(il);
             struct ggml_tensor * tmp =
                 // we rotate only the first n_rot dimensions
                 ggml_rope_ext_inplace(ctx0,
-                        ggml_view_3d(ctx0, kv_self.k_l[il],
-                            n_embd_head_k, n_head_kv, n_ctx,
-                            ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
-                            ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
+                        ggml_view_3d(ctx0, k_l,
+                            n_embd_head_k, n_head_kv, kv.size,
+                            ggml_row_size(k_l->type, n_embd_head_k),
+                            ggml_row_size(k_l->type, n_embd_k_gqa),
                             0),
-                        lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
+                        use_swa ? lctx.inp_K_shift_swa : lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
 
             cb(tmp, "K_shifted", il);
@@ -10545,7 +11537,7 @@ struct llm_build_context {
         return gf;
     }
 
-    struct ggml_cgraph * build_defrag(const std::vector<uint32_t> & ids) {
+    struct ggml_cgraph * build_defrag(const llama_kv_cache & kv, const std::vector<uint32_t> & ids) {
         struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
 
         for (uint32_t i = 0; i < ids.size(); ++i) {
@@ -10562,45 +11554,48 @@ struct llm_build_context {
             }
 
             for (int il = 0; il < n_layer; ++il) {
+                if (!kv.k_l[il]) {
+                    continue;
+                }
                 const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
                 const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
-                ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv_self.k_l[il],
+                ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv.k_l[il],
                         n_embd_k_gqa, nm,
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*i));
+                        ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                        ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa*i));
 
-                ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv_self.k_l[il],
+                ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv.k_l[il],
                         n_embd_k_gqa, nm,
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*id));
+                        ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                        ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa*id));
 
                 ggml_tensor * view_v_src = nullptr;
                 ggml_tensor * view_v_dst = nullptr;
 
-                if (kv_self.v_l.size() > il) {
+                if (kv.v_l.size() > il && kv.v_l[il]) {
                     // Note: with MLA the V cache may not be present.
                     if (flash_attn) {
                         // NOTE: the V cache is not transposed when using flash attention
-                        view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
+                        view_v_src = ggml_view_2d(ctx0, kv.v_l[il],
                                 n_embd_v_gqa, nm,
-                                ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
-                                ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*i));
+                                ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                                ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa*i));
 
-                        view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
+                        view_v_dst = ggml_view_2d(ctx0, kv.v_l[il],
                                 n_embd_v_gqa, nm,
-                                ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
-                                ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*id));
+                                ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                                ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa*id));
                     } else {
-                        view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
+                        view_v_src = ggml_view_2d(ctx0, kv.v_l[il],
                                 nm, n_embd_v_gqa,
-                                ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
-                                ggml_row_size(kv_self.v_l[il]->type, i));
+                                ggml_row_size(kv.v_l[il]->type, kv.size),
+                                ggml_row_size(kv.v_l[il]->type, i));
 
-                        view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
+                        view_v_dst = ggml_view_2d(ctx0, kv.v_l[il],
                                 nm, n_embd_v_gqa,
-                                ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
-                                ggml_row_size(kv_self.v_l[il]->type, id));
+                                ggml_row_size(kv.v_l[il]->type, kv.size),
+                                ggml_row_size(kv.v_l[il]->type, id));
                     }
                 }
 
@@ -10669,7 +11664,7 @@ struct llm_build_context {
         GGML_ASSERT(hparams.n_swa > 0);
 
         lctx.inp_KQ_mask_swa = causal
-            ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv,     GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
+            ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, kv_swa.size > 0 ? n_kv_swa : n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
             : ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_tokens, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
         cb(lctx.inp_KQ_mask_swa, "KQ_mask_swa", -1);
         ggml_set_input(lctx.inp_KQ_mask_swa);
@@ -14336,9 +15331,11 @@ struct llm_build_context {
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, lctx, kv_self, gf,
+                const bool use_kv_swa = kv_swa.size > 0 && hparams.is_swa(il);
+                cur = llm_build_kv(ctx0, lctx, use_kv_swa ? kv_swa : kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask_l, n_tokens, kv_head, n_kv, 1.0f, cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask_l, n_tokens,
+                        use_kv_swa ? kv_head_swa : kv_head, use_kv_swa ? n_kv_swa : n_kv, 1.0f, cb, il);
             }
 
             cur = llm_build_norm(ctx0, cur, hparams,
@@ -14474,8 +15471,10 @@ struct llm_build_context {
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, lctx, kv_self, gf, model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask_l, n_tokens, kv_head, n_kv, hparams.f_attention_scale, cb, il);
+                const bool use_kv_swa = kv_swa.size > 0 && is_sliding;
+                cur = llm_build_kv(ctx0, lctx, use_kv_swa ? kv_swa : kv_self, gf, model.layers[il].wo, NULL,
+                        Kcur, Vcur, Qcur, KQ_mask_l, n_tokens, use_kv_swa ? kv_head_swa : kv_head, use_kv_swa ? n_kv_swa : n_kv,
+                        hparams.f_attention_scale, cb, il);
             }
 
             cur = llm_build_norm(ctx0, cur, hparams, model.layers[il].attn_post_norm, NULL, LLM_NORM_RMS, cb, il);
@@ -15620,9 +16619,20 @@ struct llm_build_context {
                     cb(kvr, "kvr", il);
 
                     auto row_size = ggml_row_size(kv_self.k_l[il]->type, kv_lora_rank + n_embd_head_qk_rope);
-                    ggml_tensor * kv_cache_view = ggml_view_2d(ctx0, kv_self.k_l[il], kv_self.k_l[il]->ne[0], n_tokens,
-                            row_size, row_size*kv_head);
-                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, kvr, kv_cache_view));
+                    if (ggml_tensor * kv_idxs = llm_build_inp_kv_idxs(ctx0, lctx, n_tokens, cb)) {
+                        // paged KV cache
+                        ggml_tensor * kv_cache_rows = ggml_view_3d(ctx0, kv_self.k_l[il], kv_self.k_l[il]->ne[0], 1, kv_self.size,
+                                row_size, row_size, 0);
+                        if (!ggml_is_contiguous(kvr)) {
+                            kvr = ggml_cont(ctx0, kvr);
+                        }
+                        kvr = ggml_reshape_3d(ctx0, kvr, kv_self.k_l[il]->ne[0], 1, n_tokens);
+                        ggml_build_forward_expand(gf, ggml_set_rows(ctx0, kv_cache_rows, kvr, kv_idxs));
+                    } else {
+                        ggml_tensor * kv_cache_view = ggml_view_2d(ctx0, kv_self.k_l[il], kv_self.k_l[il]->ne[0], n_tokens,
+                                row_size, row_size*kv_head);
+                        ggml_build_forward_expand(gf, ggml_cpy(ctx0, kvr, kv_cache_view));
+                    }
                     ggml_tensor * kv_cache = ggml_view_2d(ctx0, kv_self.k_l[il],
                             kv_lora_rank + n_embd_head_qk_rope, n_kv,
                             ggml_row_size(kv_self.k_l[il]->type, kv_lora_rank + n_embd_head_qk_rope), 0);
@@ -15630,7 +16640,10 @@ struct llm_build_context {
 
                     ggml_tensor * kqv;
 
-                    if (lctx.cparams.mla_attn > 1 && lctx.cparams.flash_attn && pp_opt) { // PP for mla=2,3
+                    // PP for mla=2,3: decompress K/V and use standard attention for large enough ubatches
+                    const bool use_std_attn = lctx.cparams.mla_pp_batch > 0 && n_tokens >= lctx.cparams.mla_pp_batch;
+
+                    if (lctx.cparams.mla_attn > 1 && lctx.cparams.flash_attn && use_std_attn) {
 
                         auto kv_cache_nope = ggml_view_2d(ctx0, kv_self.k_l[il], kv_lora_rank, n_kv, kv_self.k_l[il]->nb[1],
                                 ggml_row_size(kv_self.k_l[il]->type, n_embd_head_qk_rope));
@@ -16363,8 +17376,10 @@ struct llm_build_context {
                     cb(Kcur, "Kcur", il);
                 }
 
-                cur = llm_build_kv(ctx0, lctx, kv_self, gf, model.layers[il].wo, model.layers[il].bo, Kcur, Vcur, Qcur,
-                                   KQ_mask_l, n_tokens, kv_head, n_kv, 1.0f / sqrtf(float(n_embd_head)), cb, il);
+                const bool use_kv_swa = kv_swa.size > 0 && is_sliding;
+                cur = llm_build_kv(ctx0, lctx, use_kv_swa ? kv_swa : kv_self, gf, model.layers[il].wo, model.layers[il].bo, Kcur, Vcur, Qcur,
+                                   KQ_mask_l, n_tokens, use_kv_swa ? kv_head_swa : kv_head, use_kv_swa ? n_kv_swa : n_kv,
+                                   1.0f / sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -16590,7 +17605,8 @@ struct llm_build_context {
                 struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
-                llm_build_kv_store(ctx0, hparams, cparams, kv_self, gf, Kcur, Vcur, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, cparams, kv_self, gf, Kcur, Vcur, n_tokens, kv_head,
+                        llm_build_inp_kv_idxs(ctx0, lctx, n_tokens, cb), cb, il);
 
                 struct ggml_tensor * k =
                     ggml_view_3d(ctx0, kv_self.k_l[il],
@@ -17391,7 +18407,7 @@ struct llm_build_context {
     }
 };
 
-static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const std::vector<uint32_t> & ids) {
+static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const llama_kv_cache & kv, const std::vector<uint32_t> & ids) {
     llama_batch dummy;
     dummy.n_tokens = 0;
 
@@ -17401,7 +18417,7 @@ static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const
 
     llm.init();
 
-    struct ggml_cgraph * result = llm.build_defrag(ids);
+    struct ggml_cgraph * result = llm.build_defrag(kv, ids);
 
     llm.free();
 
@@ -17721,6 +18737,16 @@ static void llama_set_k_shift(llama_context & lctx) {
     for (int i = 0; i < kv_size; ++i) {
         data[i] = lctx.kv_self.cells[i].delta;
     }
+
+    if (lctx.inp_K_shift_swa) {
+        assert(ggml_backend_buffer_is_host(lctx.inp_K_shift_swa->buffer));
+
+        int32_t * data_swa = (int32_t *) lctx.inp_K_shift_swa->data;
+
+        for (uint32_t i = 0; i < lctx.kv_swa.size; ++i) {
+            data_swa[i] = lctx.kv_swa.cells[i].delta;
+        }
+    }
 }
 
 static void llama_set_s_copy(llama_context & lctx) {
@@ -17759,6 +18785,127 @@ static int32_t llama_relative_position_bucket(llama_pos x, llama_pos y, uint64_t
     return relative_bucket;
 }
 
+// fill the causal KQ mask of a ubatch from the cells of the KV cache kv - data_swa gets the mask with the
+// old tokens cut off for sliding window attention; either of data and data_swa may be nullptr
+static void llama_set_kq_mask(llama_kv_cache & kv, const llama_hparams & hparams, const llama_batch & batch, float * data, float * data_swa) {
+    const int64_t n_kv     = kv.n;
+    const int64_t n_tokens = batch.n_tokens;
+
+    // For causal attention, use only the previous KV cells
+    // of the correct sequence for each token of the batch.
+    // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
+    //
+    // The sequences of the cells are first gathered into a bitmask over the distinct sequences of the
+    // ubatch, so that each row of the mask is filled by a branch-free loop the compiler vectorizes,
+    // instead of a std::set lookup per element. Sequences beyond the first 64 of a ubatch take the slow path.
+    const int64_t n_tokens_pad = GGML_PAD(n_tokens, GGML_KQ_MASK_PAD);
+
+    auto & seqs     = kv.mask_seqs;
+    auto & cell_seq = kv.mask_cell_seq;
+    auto & cell_pos = kv.mask_cell_pos;
+
+    seqs.clear();
+    for (int j = 0; j < n_tokens; ++j) {
+        const llama_seq_id seq_id = batch.seq_id[j][0];
+        if (std::find(seqs.begin(), seqs.end(), seq_id) == seqs.end()) {
+            seqs.push_back(seq_id);
+        }
+    }
+
+    const int n_seqs = std::min<int>(seqs.size(), 64);
+
+    cell_seq.resize(n_kv);
+    cell_pos.resize(n_kv);
+
+    // a single sequence filling the cells [0, n_used) at consecutive positions (the common case with
+    // one slot) makes the mask purely causal: each row is a run of zeros followed by a run of -INFINITY
+    bool    causal_run = n_seqs == 1 && !hparams.use_alibi;
+    int64_t n_used     = 0; // cells up to the last one of the sequence
+
+    for (int i = 0; i < n_kv; ++i) {
+        const llama_kv_cell & cell = kv.cells[i];
+
+        uint64_t mask = 0;
+        for (const llama_seq_id id : cell.seq_id) {
+            for (int s = 0; s < n_seqs; ++s) {
+                if (seqs[s] == id) {
+                    mask |= 1ull << s;
+                }
+            }
+        }
+
+        cell_seq[i] = mask;
+        cell_pos[i] = cell.pos < 0 ? INT32_MAX : cell.pos;
+
+        if (mask) {
+            causal_run = causal_run && n_used == i && cell.pos == kv.cells[0].pos + i;
+            n_used = i + 1;
+        }
+    }
+
+    for (int j = 0; j < n_tokens; ++j) {
+        const llama_pos    pos    = batch.pos[j];
+        const llama_seq_id seq_id = batch.seq_id[j][0];
+
+        const int s = std::find(seqs.begin(), seqs.end(), seq_id) - seqs.begin();
+
+        float * row = data ? data + j*n_kv : data_swa + j*n_kv;
+
+        if (causal_run) {
+            const int64_t n_visible = std::max<int64_t>(0, std::min<int64_t>(n_used, pos - kv.cells[0].pos + 1));
+            std::fill(row, row + n_visible, 0.0f);
+            std::fill(row + n_visible, row + n_kv, -INFINITY);
+        } else if (s < n_seqs) {
+            const uint64_t bit = 1ull << s;
+            if (hparams.use_alibi) {
+                for (int i = 0; i < n_kv; ++i) {
+                    row[i] = (cell_seq[i] & bit) && cell_pos[i] <= pos ? -std::abs(cell_pos[i] - pos) : -INFINITY;
+                }
+            } else {
+                for (int i = 0; i < n_kv; ++i) {
+                    row[i] = (cell_seq[i] & bit) && cell_pos[i] <= pos ? 0.0f : -INFINITY;
+                }
+            }
+        } else {
+            for (int i = 0; i < n_kv; ++i) {
+                const llama_kv_cell & cell = kv.cells[i];
+                if (!cell.has_seq_id(seq_id) || cell.pos > pos) {
+                    row[i] = -INFINITY;
+                } else {
+                    row[i] = hparams.use_alibi ? -std::abs(cell.pos - pos) : 0.0f;
+                }
+            }
+        }
+
+        // may need to cut off old tokens for sliding window
+        if (data_swa) {
+            float * row_swa = data_swa + j*n_kv;
+            if (row_swa != row) {
+                std::copy(row, row + n_kv, row_swa);
+            }
+            if (hparams.n_attn_chunk) {
+                const llama_pos pos_chunk_start = (pos / hparams.n_attn_chunk) * hparams.n_attn_chunk;
+                for (int i = 0; i < n_kv; ++i) {
+                    row_swa[i] = cell_pos[i] < pos_chunk_start ? -INFINITY : row_swa[i];
+                }
+            } else {
+                const llama_pos pos_swa = pos - (llama_pos) hparams.n_swa;
+                for (int i = 0; i < n_kv; ++i) {
+                    row_swa[i] = cell_pos[i] <= pos_swa ? -INFINITY : row_swa[i];
+                }
+            }
+        }
+    }
+
+    if (data) {
+        std::fill(data + n_tokens*n_kv, data + n_tokens_pad*n_kv, -INFINITY);
+    }
+
+    if (data_swa) {
+        std::fill(data_swa + n_tokens*n_kv, data_swa + n_tokens_pad*n_kv, -INFINITY);
+    }
+}
+
 static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
     //
     // set input data
@@ -17790,6 +18937,13 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
         ggml_backend_tensor_set(lctx.inp_pos, batch.pos, 0, n_tokens*ggml_element_size(lctx.inp_pos));
     }
 
+    if (lctx.inp_kv_idxs) {
+        const int64_t n_tokens = batch.n_tokens;
+
+        GGML_ASSERT((int64_t) lctx.kv_self.ubatch_cells.size() == n_tokens);
+        ggml_backend_tensor_set(lctx.inp_kv_idxs, lctx.kv_self.ubatch_cells.data(), 0, n_tokens*ggml_element_size(lctx.inp_kv_idxs));
+    }
+
     if (lctx.inp_pos && lctx.inp_scale) {
         int n_tokens = batch.n_tokens;
         GGML_ASSERT(ggml_nelements(lctx.inp_scale) >= n_tokens);
@@ -17839,10 +18993,6 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
     if (lctx.inp_KQ_mask || lctx.inp_KQ_mask_swa) {
         // NOTE: hparams.causal_attn indicates the model is capable of generation and uses the kv cache.
         if (cparams.causal_attn && !lctx.is_encoding) {
-            const int64_t n_kv     = kv_self.n;
-            const int64_t n_tokens = batch.n_tokens;
-
-
             float * data     = nullptr;
             float * data_swa = nullptr;
 
@@ -17856,62 +19006,16 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
                 data_swa = (float *) lctx.inp_KQ_mask_swa->data;
             }
 
-            // For causal attention, use only the previous KV cells
-            // of the correct sequence for each token of the batch.
-            // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
-            for (int h = 0; h < 1; ++h) {
-                for (int j = 0; j < n_tokens; ++j) {
-                    const llama_pos    pos    = batch.pos[j];
-                    const llama_seq_id seq_id = batch.seq_id[j][0];
-
-                    for (int i = 0; i < n_kv; ++i) {
-                        float f;
-                        if (!lctx.kv_self.cells[i].has_seq_id(seq_id) || lctx.kv_self.cells[i].pos > pos) {
-                            f = -INFINITY;
-                        } else {
-                            if (hparams.use_alibi) {
-                                f = -std::abs(lctx.kv_self.cells[i].pos - pos);
-                            } else {
-                                f = 0.0f;
-                            }
-                        }
-
-                        if (data) {
-                            data[h*(n_kv*n_tokens) + j*n_kv + i] = f;
-                        }
-
-                        // may need to cut off old tokens for sliding window
-                        if (data_swa) {
-                            if (hparams.n_attn_chunk) {
-                                llama_pos pos_chunk_start = (pos / hparams.n_attn_chunk) * hparams.n_attn_chunk;
-                                if (lctx.kv_self.cells[i].pos < pos_chunk_start || pos < pos_chunk_start) {
-                                    f = -INFINITY;
-                                }
-                            } else {
-                                if (pos - kv_self.cells[i].pos >= (int32_t)hparams.n_swa) {
-                                    f = -INFINITY;
-                                }
-                            }
-                            data_swa[h*(n_kv*n_tokens) + j*n_kv + i] = f;
-                        }
-                    }
-                }
-
+            if (lctx.kv_swa.size > 0) {
+                // the sliding window attention layers attend the cells of their own cache
                 if (data) {
-                    for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                        for (int j = 0; j < n_kv; ++j) {
-                            data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                        }
-                    }
+                    llama_set_kq_mask(lctx.kv_self, hparams, batch, data, nullptr);
                 }
-
                 if (data_swa) {
-                    for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                        for (int j = 0; j < n_kv; ++j) {
-                            data_swa[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                        }
-                    }
+                    llama_set_kq_mask(lctx.kv_swa, hparams, batch, nullptr, data_swa);
                 }
+            } else {
+                llama_set_kq_mask(lctx.kv_self, hparams, batch, data, data_swa);
             }
         } else {
             // when using kv cache, the mask needs to match the kv cache size
@@ -18230,6 +19334,7 @@ static void llama_graph_compute(
 
     if (lctx.backend_cpu != nullptr) {
         ggml_backend_cpu_set_n_threads(lctx.backend_cpu, n_threads);
+        ggml_backend_cpu_set_lockstep(lctx.backend_cpu, lctx.cparams.graph_lockstep);
         ggml_backend_cpu_set_abort_callback(lctx.backend_cpu, lctx.abort_callback, lctx.abort_callback_data);
     }
 #ifdef GGML_USE_BLAS
@@ -18243,6 +19348,53 @@ static void llama_graph_compute(
     // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(lctx.sched));
 }
 
+// count the experts selected in the graph that was just computed
+static void llama_expert_stats_update(llama_context & lctx) {
+    ggml_backend_sched_synchronize(lctx.sched);
+
+    std::vector<int32_t> ids;
+    for (const auto & it : lctx.moe_selected) {
+        // the selection is a view (best first) into the argsort or router result, a row every nb[1] bytes
+        const ggml_tensor * sorted = it.second->view_src;
+        const int64_t n_used = it.second->ne[0];
+        const int64_t stride = it.second->nb[1]/sizeof(int32_t);
+        ids.resize(ggml_nelements(sorted));
+        ggml_backend_tensor_get(sorted, ids.data(), 0, ggml_nbytes(sorted));
+
+        auto & counts = lctx.expert_counts[it.first];
+        for (int64_t i = 0; i < it.second->ne[1]; ++i) {
+            for (int64_t j = 0; j < n_used; ++j) {
+                const int32_t id = ids[i*stride + j];
+                if (id >= 0 && id < (int32_t) counts.size()) {
+                    ++counts[id];
+                }
+            }
+        }
+    }
+}
+
+// add up the resident and requested expert slices reported by the prefetch nodes of the graph that was just computed
+static void llama_expert_prefetch_update(llama_context & lctx) {
+    ggml_backend_sched_synchronize(lctx.sched);
+
+    for (const ggml_tensor * pf : lctx.moe_prefetch) {
+        int32_t counts[2];
+        ggml_backend_tensor_get(pf, counts, ggml_nbytes(pf) - sizeof(counts), sizeof(counts));
+        lctx.n_prefetch_resident  += counts[0];
+        lctx.n_prefetch_requested += counts[1];
+    }
+}
+
+static int64_t llama_major_faults() {
+#if defined(_POSIX_MEMLOCK_RANGE) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        return usage.ru_majflt;
+    }
+#endif
+    return 0;
+}
+
 // decode a batch of tokens by evaluating the transformer
 //
 //   - lctx:      llama context
@@ -18330,6 +19482,9 @@ static int llama_decode_internal(
         }
     }
 
+    // first position of each sequence in the ubatches so far, see llama_kv_cache_prune_swa
+    std::vector<std::pair<llama_seq_id, llama_pos>> swa_pos_min;
+
     for (uint32_t cur_token = 0; cur_token < n_tokens_all; cur_token += n_ubatch) {
         const uint32_t n_tokens = std::min(n_ubatch, n_tokens_all - cur_token);
         llama_batch u_batch = {
@@ -18405,7 +19560,11 @@ static int llama_decode_internal(
                 kv_self.head = 0;
             }
 
-            if (!llama_kv_cache_find_slot(kv_self, u_batch)) {
+            if (kv_self.block_size > 0) {
+                if (!llama_kv_cache_find_slot_paged(kv_self, u_batch)) {
+                    return 1;
+                }
+            } else if (!llama_kv_cache_find_slot(kv_self, u_batch)) {
                 return 1;
             }
 
@@ -18417,6 +19576,31 @@ static int llama_decode_internal(
                 kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv_self), pad)));
                 //kv_self.n = llama_kv_cache_cell_max(kv_self);
             }
+
+            if (lctx.kv_swa.size > 0) {
+                auto & kv_swa = lctx.kv_swa;
+
+                llama_kv_cache_prune_swa(kv_swa, u_batch, hparams.n_swa, swa_pos_min);
+
+                if (kv_swa.head > kv_swa.used + 2*n_tokens) {
+                    kv_swa.head = 0;
+                }
+
+                bool ok = llama_kv_cache_find_slot(kv_swa, u_batch);
+                if (!ok) {
+                    // the window cache has room for the batch, but the pruned cells may not leave a contiguous run
+                    llama_kv_cache_defrag(kv_swa);
+                    llama_kv_cache_update(&lctx);
+                    ok = llama_kv_cache_find_slot(kv_swa, u_batch);
+                }
+                if (!ok) {
+                    llama_kv_cache_release_slot(kv_self, n_tokens);
+                    return 1;
+                }
+
+                const uint32_t pad = llama_kv_cache_get_padding(cparams);
+                kv_swa.n = std::min(kv_swa.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv_swa), pad)));
+            }
         }
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
@@ -18454,8 +19638,18 @@ static int llama_decode_internal(
 
         llama_set_inputs(lctx, u_batch);
 
+        const int64_t n_major_faults = cparams.expert_prefetch ? llama_major_faults() : 0;
+
         llama_graph_compute(lctx, gf, n_threads);
 
+        if (!lctx.moe_selected.empty()) {
+            llama_expert_stats_update(lctx);
+        }
+        if (cparams.expert_prefetch) {
+            llama_expert_prefetch_update(lctx);
+            lctx.n_major_faults += llama_major_faults() - n_major_faults;
+        }
+
         // update the kv ring buffer
         {
             kv_self.head += n_tokens;
@@ -18539,7 +19733,8 @@ static int llama_decode_internal(
     //llama_synchronize(&lctx);
 
     // decide if we need to defrag the kv cache
-    if (cparams.causal_attn && cparams.defrag_thold >= 0.0f) {
+    // note: a paged KV cache does not need a contiguous run of cells, and compacting it would mix up its blocks
+    if (cparams.causal_attn && cparams.defrag_thold >= 0.0f && kv_self.block_size == 0) {
         const float fragmentation = kv_self.n >= 128 ? 1.0f - float(kv_self.used)/float(kv_self.n) : 0.0f;
 
         // queue defragmentation for next llama_kv_cache_update
@@ -18740,15 +19935,13 @@ static int llama_encode_internal(
 }
 
 // find holes from the beginning of the KV cache and fill them by moving data from the end of the cache
-static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
-    auto & kv_self = lctx.kv_self;
-
+static void llama_kv_cache_defrag_internal(struct llama_context & lctx, struct llama_kv_cache & cache) {
     const auto & hparams = lctx.model.hparams;
 
     const uint32_t n_layer = hparams.n_layer;
 
-    const uint32_t n_kv   = llama_kv_cache_cell_max(kv_self);
-    const uint32_t n_used = kv_self.used;
+    const uint32_t n_kv   = llama_kv_cache_cell_max(cache);
+    const uint32_t n_used = cache.used;
 
     assert(n_used <= n_kv);
 
@@ -18773,7 +19966,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     std::vector<uint32_t> ids(n_kv, n_kv);
 
     for (uint32_t i0 = 0; i0 < n_used; ++i0) {
-        const auto & cell0 = kv_self.cells[i0];
+        const auto & cell0 = cache.cells[i0];
 
         if (!cell0.is_empty()) {
             ids[i0] = i0;
@@ -18786,7 +19979,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
         uint32_t nh = 1;
 
         // determine the size of the hole
-        while (i0 + nh < n_used && kv_self.cells[i0 + nh].is_empty()) {
+        while (i0 + nh < n_used && cache.cells[i0 + nh].is_empty()) {
             nh++;
         }
 
@@ -18795,7 +19988,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 
         // starting from the end, find nh non-empty cells
         for (; is > i0; --is) {
-            const auto & cell1 = kv_self.cells[is];
+            const auto & cell1 = cache.cells[is];
 
             if (cell1.is_empty() || ids[is] != n_kv) {
                 continue;
@@ -18824,7 +20017,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 
         // go back and move the nf cells to the hole
         for (; i1 < n_kv; ++i1) {
-            auto & cell1 = kv_self.cells[i1];
+            auto & cell1 = cache.cells[i1];
 
             if (cell1.is_empty() || ids[i1] != n_kv) {
                 if (n_moves == max_moves) {
@@ -18840,11 +20033,11 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
             ids[i1] = i0 + nf;
 
             // move the cell meta data
-            kv_self.cells[i0 + nf] = cell1;
+            cache.cells[i0 + nf] = cell1;
 
             // clear the old cell and move the head there
             cell1 = llama_kv_cell();
-            kv_self.head = n_used;
+            cache.head = n_used;
 
             if (!cont) {
                 n_moves++;
@@ -18888,23 +20081,23 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa();
     const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa();
 
-    const uint32_t kv_size = kv_self.size;
+    const uint32_t kv_size = cache.size;
 
     std::vector<uint8_t> buf_k;
     std::vector<uint8_t> buf_v;
 
     for (uint32_t il = 0; il < n_layer; ++il) {
-        const size_t k_size_row = ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa);
-        const size_t k_size     = ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*kv_size);
+        const size_t k_size_row = ggml_row_size(cache.k_l[il]->type, n_embd_k_gqa);
+        const size_t k_size     = ggml_row_size(cache.k_l[il]->type, n_embd_k_gqa*kv_size);
 
-        const size_t v_size_el = ggml_type_size(kv_self.v_l[il]->type);
-        const size_t v_size    = ggml_row_size (kv_self.v_l[il]->type, n_embd_v_gqa*kv_size);
+        const size_t v_size_el = ggml_type_size(cache.v_l[il]->type);
+        const size_t v_size    = ggml_row_size (cache.v_l[il]->type, n_embd_v_gqa*kv_size);
 
         buf_k.resize(k_size);
         buf_v.resize(v_size);
 
-        ggml_backend_tensor_get(kv_self.k_l[il], buf_k.data(), 0, buf_k.size());
-        ggml_backend_tensor_get(kv_self.v_l[il], buf_v.data(), 0, buf_v.size());
+        ggml_backend_tensor_get(cache.k_l[il], buf_k.data(), 0, buf_k.size());
+        ggml_backend_tensor_get(cache.v_l[il], buf_v.data(), 0, buf_v.size());
 
         // batch move [i, i+nm) to [id, id+nm)
         // note: cells can move only to a lower index
@@ -18942,15 +20135,15 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
             i += nm - 1;
         }
 
-        ggml_backend_tensor_set(kv_self.k_l[il], buf_k.data(), 0, buf_k.size());
-        ggml_backend_tensor_set(kv_self.v_l[il], buf_v.data(), 0, buf_v.size());
+        ggml_backend_tensor_set(cache.k_l[il], buf_k.data(), 0, buf_k.size());
+        ggml_backend_tensor_set(cache.v_l[il], buf_v.data(), 0, buf_v.size());
     }
 #else
     // ggml_graph defrag
 
     ggml_backend_sched_reset(lctx.sched);
 
-    ggml_cgraph * gf = llama_build_graph_defrag(lctx, ids);
+    ggml_cgraph * gf = llama_build_graph_defrag(lctx, cache, ids);
 
     llama_graph_compute(lctx, gf, lctx.cparams.n_threads);
 #endif
@@ -18964,7 +20157,7 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
     bool need_reserve = false;
 
     // apply K-shift if needed
-    if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && lctx.kv_self.has_shift) {
+    if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && (lctx.kv_self.has_shift || lctx.kv_swa.has_shift)) {
         if (lctx.model.arch == LLM_ARCH_DEEPSEEK2) { // not supported due to MLA
             GGML_ABORT("Deepseek2 does not support K-shift");
         }
@@ -18983,13 +20176,11 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
             need_reserve = true;
         }
 
-        {
-            auto & kv_self = lctx.kv_self;
-
-            kv_self.has_shift = false;
+        for (auto * kv : {&lctx.kv_self, &lctx.kv_swa}) {
+            kv->has_shift = false;
 
-            for (uint32_t i = 0; i < kv_self.size; ++i) {
-                kv_self.cells[i].delta = 0;
+            for (uint32_t i = 0; i < kv->size; ++i) {
+                kv->cells[i].delta = 0;
             }
         }
     }
@@ -19021,12 +20212,14 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
     }
 
     // defragment the KV cache if needed
-    if (lctx.kv_self.do_defrag) {
-        llama_kv_cache_defrag_internal(lctx);
+    for (auto * kv : {&lctx.kv_self, &lctx.kv_swa}) {
+        if (kv->do_defrag) {
+            llama_kv_cache_defrag_internal(lctx, *kv);
 
-        need_reserve = true;
+            need_reserve = true;
 
-        lctx.kv_self.do_defrag = false;
+            kv->do_defrag = false;
+        }
     }
 
     // reserve a worst case graph again
@@ -20738,6 +21931,8 @@ struct llama_model_params llama_model_default_params() {
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
         /*.tensor_buft_overrides       =*/ nullptr,
+        /*.hot_experts                 =*/ nullptr,
+        /*.n_hot_experts               =*/ 0,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
@@ -20774,6 +21969,7 @@ struct llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.kv_block_size               =*/ 0,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
@@ -20784,7 +21980,12 @@ struct llama_context_params llama_context_default_params() {
         /*.flash_attn                  =*/ false,
         /*.mla_attn                    =*/ 0,
         /*.attn_max_batch              =*/ 0,
+        /*.mla_pp_batch                =*/ -1,
         /*.fused_moe_up_gate           =*/ false,
+        /*.graph_lockstep              =*/ false,
+        /*.swa_kv_cache                =*/ false,
+        /*.expert_stats                =*/ false,
+        /*.expert_prefetch             =*/ false,
         /*.min_experts                 =*/ -1,
         /*.thtesh_experts              =*/ 0.0f,
         /*.abort_callback              =*/ nullptr,
@@ -20986,15 +22187,25 @@ struct llama_context * llama_new_context_with_model(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.kv_block_size    = params.kv_block_size;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
     cparams.mla_attn         = params.mla_attn;
     cparams.attn_max_batch   = params.attn_max_batch;
+    cparams.mla_pp_batch     = params.mla_pp_batch;
     cparams.fused_moe_up_gate= params.fused_moe_up_gate;
+    cparams.graph_lockstep   = params.graph_lockstep;
+    cparams.swa_kv_cache     = params.swa_kv_cache;
+    cparams.expert_stats     = params.expert_stats && hparams.n_expert > 0;
+    cparams.expert_prefetch  = params.expert_prefetch && hparams.n_expert > 0 && !model->mappings.empty();
     cparams.min_experts      = params.min_experts;
     cparams.thresh_experts   = params.thresh_experts;
 
+    if (cparams.expert_stats) {
+        ctx->expert_counts.assign(hparams.n_layer, std::vector<uint64_t>(hparams.n_expert, 0));
+    }
+
     cparams.pooling_type     = params.pooling_type;
 
     cparams.n_ctx            = params.n_ctx           == 0    ? hparams.n_ctx_train           : params.n_ctx;
@@ -21064,14 +22275,33 @@ struct llama_context * llama_new_context_with_model(
         cparams.mla_attn = 0;
     }
 
+    if (cparams.mla_attn > 1 && cparams.flash_attn && cparams.mla_pp_batch < 0) {
+        // Attention in the latent space costs (n_lora + n_rope) + n_lora multiply-adds per head, query and KV cell,
+        // with K/V decompressed by wkv_b it costs (n_nope + n_rope) + n_v, plus n_lora*(n_nope + n_v) per head and
+        // KV cell to decompress them once per ubatch. The switch-over is where the two break even.
+        const auto & hparams = model->hparams;
+        const int64_t n_lora = hparams.n_lora_kv;
+        const int64_t n_rope = hparams.n_rot;
+        const int64_t n_nope = hparams.n_embd_head_k - hparams.n_rot;
+        const int64_t n_v    = hparams.n_embd_head_v;
+        const int64_t gain   = (2*n_lora + n_rope) - (n_nope + n_rope + n_v);
+        cparams.mla_pp_batch = gain > 0 ? (n_lora*(n_nope + n_v) + gain - 1)/gain : 0;
+    } else if (cparams.mla_pp_batch < 0) {
+        cparams.mla_pp_batch = 0;
+    }
+
     LLAMA_LOG_INFO("%s: n_ctx      = %u\n",     __func__, cparams.n_ctx);
     LLAMA_LOG_INFO("%s: n_batch    = %u\n",     __func__, cparams.n_batch);
     LLAMA_LOG_INFO("%s: n_ubatch   = %u\n",     __func__, cparams.n_ubatch);
     LLAMA_LOG_INFO("%s: flash_attn = %d\n",     __func__, cparams.flash_attn);
     LLAMA_LOG_INFO("%s: mla_attn   = %d\n",     __func__, cparams.mla_attn);
     LLAMA_LOG_INFO("%s: attn_max_b = %d\n",     __func__, cparams.attn_max_batch);
+    LLAMA_LOG_INFO("%s: mla_pp_b   = %d\n",     __func__, cparams.mla_pp_batch);
     LLAMA_LOG_INFO("%s: fused_moe  = %d\n",     __func__, cparams.fused_moe_up_gate);
     LLAMA_LOG_INFO("%s: ser        = %d, %g\n", __func__, cparams.min_experts, cparams.thresh_experts);
+    if (cparams.expert_prefetch) {
+        LLAMA_LOG_INFO("%s: expert prefetch enabled\n", __func__);
+    }
     LLAMA_LOG_INFO("%s: freq_base  = %.1f\n",   __func__, cparams.rope_freq_base);
     LLAMA_LOG_INFO("%s: freq_scale = %g\n",     __func__, cparams.rope_freq_scale);
 
@@ -21246,22 +22476,65 @@ struct llama_context * llama_new_context_with_model(
         }
         ctx->backends.push_back(ctx->backend_cpu);
 
-        if (!llama_kv_cache_init(ctx->kv_self, ctx, type_k, type_v, kv_size, cparams.offload_kqv)) {
+        ctx->threadpool = ggml_threadpool_new((int) std::max(cparams.n_threads, cparams.n_threads_batch));
+        ggml_backend_cpu_set_threadpool(ctx->backend_cpu, ctx->threadpool);
+
+        // the sliding window attention layers can keep their K/V in a separate cache that only holds the last
+        // n_swa positions of each sequence, plus the tokens of a batch and room for the fragmentation
+        std::vector<bool> layers_self;
+        std::vector<bool> layers_swa;
+        uint32_t kv_size_swa = 0;
+
+        if (cparams.swa_kv_cache) {
+            const auto & hparams = model->hparams;
+
+            const uint32_t pad = llama_kv_cache_get_padding(cparams);
+            const uint32_t n_window = GGML_PAD(cparams.n_seq_max*hparams.n_swa + cparams.n_batch + cparams.n_ubatch, pad);
+
+            const bool supported = model->arch == LLM_ARCH_GEMMA2 || model->arch == LLM_ARCH_GEMMA3 || model->arch == LLM_ARCH_COHERE2;
+
+            if (!supported || hparams.n_swa_pattern <= 1) {
+                LLAMA_LOG_WARN("%s: the SWA KV cache is not supported for this model - ignoring\n", __func__);
+            } else if (cparams.kv_block_size > 0) {
+                LLAMA_LOG_WARN("%s: the SWA KV cache is not supported with a paged KV cache - ignoring\n", __func__);
+            } else if (n_window >= kv_size) {
+                LLAMA_LOG_INFO("%s: the SWA KV cache would not be smaller than the context - not used\n", __func__);
+            } else {
+                kv_size_swa = n_window;
+                for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+                    layers_self.push_back(!hparams.is_swa(il));
+                    layers_swa.push_back(hparams.is_swa(il));
+                }
+            }
+        }
+
+        if (!llama_kv_cache_init(ctx->kv_self, ctx, type_k, type_v, kv_size, cparams.offload_kqv, layers_self)) {
             LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
         }
 
+        if (kv_size_swa > 0) {
+            LLAMA_LOG_INFO("%s: SWA KV cache with %u cells for the window of %u tokens\n", __func__, kv_size_swa, model->hparams.n_swa);
+            if (!llama_kv_cache_init(ctx->kv_swa, ctx, type_k, type_v, kv_size_swa, cparams.offload_kqv, layers_swa)) {
+                LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for the SWA cache\n", __func__);
+                llama_free(ctx);
+                return nullptr;
+            }
+        }
+
         {
             size_t memory_size_k = 0;
             size_t memory_size_v = 0;
 
-            for (auto & k : ctx->kv_self.k_l) {
-                memory_size_k += ggml_nbytes(k);
-            }
+            for (const auto * kv : { &ctx->kv_self, &ctx->kv_swa }) {
+                for (auto & k : kv->k_l) {
+                    memory_size_k += k ? ggml_nbytes(k) : 0;
+                }
 
-            for (auto & v : ctx->kv_self.v_l) {
-                memory_size_v += ggml_nbytes(v);
+                for (auto & v : kv->v_l) {
+                    memory_size_v += v ? ggml_nbytes(v) : 0;
+                }
             }
 
             if (memory_size_k + memory_size_v > 0) {
@@ -21830,9 +23103,33 @@ int32_t llama_get_kv_cache_used_cells(const struct llama_context * ctx) {
 
 void llama_kv_cache_clear(struct llama_context * ctx) {
     llama_kv_cache_clear(ctx->kv_self);
+    llama_kv_cache_clear(ctx->kv_swa);
 }
 
 bool llama_kv_cache_seq_rm(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    if (ctx->kv_swa.size > 0) {
+        // the tokens after p0 attend the window before it - if the sliding window cache has already dropped some of
+        // these cells, the sequence cannot be truncated here and has to be processed again
+        if (p0 > 0 && (p1 < 0 || p1 == std::numeric_limits<llama_pos>::max())) {
+            const llama_pos lo = std::max<llama_pos>(0, p0 - (llama_pos) ctx->model.hparams.n_swa + 1);
+            auto count = [seq_id, lo, p0](const llama_kv_cache & cache) {
+                uint32_t n = 0;
+                for (uint32_t i = 0; i < cache.size; ++i) {
+                    const llama_kv_cell & cell = cache.cells[i];
+                    if (cell.pos >= lo && cell.pos < p0 && (seq_id < 0 ? !cell.is_empty() : cell.has_seq_id(seq_id))) {
+                        ++n;
+                    }
+                }
+                return n;
+            };
+            if (count(ctx->kv_swa) < count(ctx->kv_self)) {
+                return false;
+            }
+        }
+        if (!llama_kv_cache_seq_rm(ctx->kv_swa, seq_id, p0, p1)) {
+            return false;
+        }
+    }
     return llama_kv_cache_seq_rm(ctx->kv_self, seq_id, p0, p1);
 }
 
@@ -21841,10 +23138,12 @@ void llama_kv_cache_seq_cp(struct llama_context * ctx, llama_seq_id seq_id_src,
         return;
     }
     llama_kv_cache_seq_cp(ctx->kv_self, seq_id_src, seq_id_dst, p0, p1);
+    llama_kv_cache_seq_cp(ctx->kv_swa,  seq_id_src, seq_id_dst, p0, p1);
 }
 
 void llama_kv_cache_seq_keep(struct llama_context * ctx, llama_seq_id seq_id) {
     llama_kv_cache_seq_keep(ctx->kv_self, seq_id);
+    llama_kv_cache_seq_keep(ctx->kv_swa,  seq_id);
 }
 
 void llama_kv_cache_seq_add(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
@@ -21853,6 +23152,7 @@ void llama_kv_cache_seq_add(struct llama_context * ctx, llama_seq_id seq_id, lla
     }
 
     llama_kv_cache_seq_add(ctx->kv_self, seq_id, p0, p1, delta);
+    llama_kv_cache_seq_add(ctx->kv_swa,  seq_id, p0, p1, delta);
 }
 
 void llama_kv_cache_seq_div(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
@@ -21861,6 +23161,7 @@ void llama_kv_cache_seq_div(struct llama_context * ctx, llama_seq_id seq_id, lla
     }
 
     llama_kv_cache_seq_div(ctx->kv_self, seq_id, p0, p1, d);
+    llama_kv_cache_seq_div(ctx->kv_swa,  seq_id, p0, p1, d);
 }
 
 llama_pos llama_kv_cache_seq_pos_max(struct llama_context * ctx, llama_seq_id seq_id) {
@@ -21998,8 +23299,7 @@ struct llama_data_write {
         }
     }
 
-    void write_kv_cache_data(const struct llama_context * ctx, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) {
-        const struct llama_kv_cache & kv_self = ctx->kv_self;
+    void write_kv_cache_data(const struct llama_context * ctx, const llama_kv_cache & kv_self, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) {
         const struct llama_hparams & hparams = ctx->model.hparams;
 
         // v_state: 0 -> not transposed V cache
@@ -22016,6 +23316,9 @@ struct llama_data_write {
         // Iterate and write all the keys first, each row is a cell
         // Get whole range at a time
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (!kv_self.k_l[il]) {
+                continue; // the layer has its K/V in the other cache
+            }
             const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
             const uint32_t n_embd_head_qk_rope = hparams.n_rot;
             const uint32_t kv_lora_rank = hparams.n_lora_kv;
@@ -22038,6 +23341,9 @@ struct llama_data_write {
 
         if (v_state == 0) {
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (!kv_self.v_l[il]) {
+                    continue;
+                }
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Write value type
@@ -22060,6 +23366,9 @@ struct llama_data_write {
             // When v is transposed, we also need the element size and get the element ranges from each row
             const uint32_t kv_size = kv_self.size;
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (!kv_self.v_l[il]) {
+                    continue;
+                }
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Write value type
@@ -22088,7 +23397,14 @@ struct llama_data_write {
     }
 
     void write_kv_cache(const struct llama_context * ctx, llama_seq_id seq_id = -1) {
-        const struct llama_kv_cache & kv_self = ctx->kv_self;
+        write_kv_cache(ctx, ctx->kv_self, seq_id);
+
+        if (ctx->kv_swa.size > 0) {
+            write_kv_cache(ctx, ctx->kv_swa, seq_id);
+        }
+    }
+
+    void write_kv_cache(const struct llama_context * ctx, const llama_kv_cache & kv_self, llama_seq_id seq_id) {
         std::vector<std::pair<uint32_t, uint32_t>> cell_ranges; // ranges, from inclusive, to exclusive
         uint32_t cell_count = 0;
 
@@ -22123,7 +23439,7 @@ struct llama_data_write {
         write(&cell_count, sizeof(cell_count));
 
         write_kv_cache_meta(kv_self, cell_ranges, seq_id);
-        write_kv_cache_data(ctx, cell_ranges);
+        write_kv_cache_data(ctx, kv_self, cell_ranges);
     }
 };
 
@@ -22133,6 +23449,8 @@ struct llama_data_read {
     virtual size_t get_size_read() = 0;
     virtual ~llama_data_read() = default;
 
+    std::vector<int32_t> dst_cells; // paged KV cache: the cells a sequence is restored to
+
     void read_string(std::string & str) {
         uint32_t str_size;
         read_to(&str_size, sizeof(str_size));
@@ -22215,8 +23533,8 @@ struct llama_data_read {
         }
     }
 
-    bool read_kv_cache_meta(struct llama_context * ctx, uint32_t cell_count, llama_seq_id dest_seq_id = -1) {
-        struct llama_kv_cache & kv_self = ctx->kv_self;
+    bool read_kv_cache_meta(struct llama_context * ctx, llama_kv_cache & kv_self, uint32_t cell_count, llama_seq_id dest_seq_id = -1) {
+        dst_cells.clear();
 
         if (dest_seq_id != -1) {
             // single sequence
@@ -22242,6 +23560,19 @@ struct llama_data_read {
                 batch.n_seq_id[i] = 1;
                 batch.seq_id[i][0] = dest_seq_id;
             }
+
+            if (kv_self.block_size > 0) {
+                // paged KV cache - the cells do not have to be contiguous
+                const bool ok = llama_kv_cache_find_slot_paged(kv_self, batch);
+                llama_batch_free(batch);
+                if (!ok) {
+                    LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
+                    return false;
+                }
+                dst_cells = kv_self.ubatch_cells;
+                return true;
+            }
+
             if (!llama_kv_cache_find_slot(kv_self, batch)) {
                 llama_batch_free(batch);
                 LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
@@ -22299,9 +23630,28 @@ struct llama_data_read {
         return true;
     }
 
-    bool read_kv_cache_data(struct llama_context * ctx, uint32_t cell_count) {
+    // set the rows of cell_count cells starting at kv_self.head, or of dst_cells with a paged KV cache
+    void set_cell_rows(const struct llama_kv_cache & kv_self, struct ggml_tensor * t, const uint8_t * src, size_t row_size, uint32_t cell_count) {
+        if (dst_cells.empty()) {
+            ggml_backend_tensor_set(t, src, kv_self.head * row_size, cell_count * row_size);
+            return;
+        }
+
+        GGML_ASSERT(dst_cells.size() == cell_count);
+
+        // one call per run of consecutive cells
+        for (uint32_t i0 = 0; i0 < cell_count; ) {
+            uint32_t i1 = i0 + 1;
+            while (i1 < cell_count && dst_cells[i1] == dst_cells[i1 - 1] + 1) {
+                ++i1;
+            }
+            ggml_backend_tensor_set(t, src + i0 * row_size, dst_cells[i0] * row_size, (i1 - i0) * row_size);
+            i0 = i1;
+        }
+    }
+
+    bool read_kv_cache_data(struct llama_context * ctx, llama_kv_cache & kv_self, uint32_t cell_count) {
         const struct llama_hparams & hparams = ctx->model.hparams;
-        struct llama_kv_cache & kv_self = ctx->kv_self;
 
         // v_state: 0 -> not transposed V cache
         //          1 -> transposed V cache
@@ -22328,6 +23678,9 @@ struct llama_data_read {
 
         // For each layer, read the keys for each cell, one row is one cell, read as one contiguous block
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (!kv_self.k_l[il]) {
+                continue; // the layer has its K/V in the other cache
+            }
             const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
             const uint32_t n_embd_head_qk_rope = hparams.n_rot;
             const uint32_t kv_lora_rank = hparams.n_lora_kv;
@@ -22353,12 +23706,15 @@ struct llama_data_read {
 
             if (cell_count) {
                 // Read and set the keys for the whole cell range
-                ggml_backend_tensor_set(kv_self.k_l[il], read(cell_count * k_size_row), kv_self.head * k_size_row, cell_count * k_size_row);
+                set_cell_rows(kv_self, kv_self.k_l[il], read(cell_count * k_size_row), k_size_row, cell_count);
             }
         }
 
         if (v_state == 0) {
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (!kv_self.v_l[il]) {
+                    continue;
+                }
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Read type of value
@@ -22381,13 +23737,16 @@ struct llama_data_read {
 
                 if (cell_count) {
                     // Read and set the values for the whole cell range
-                    ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_row), kv_self.head * v_size_row, cell_count * v_size_row);
+                    set_cell_rows(kv_self, kv_self.v_l[il], read(cell_count * v_size_row), v_size_row, cell_count);
                 }
             }
         }
         else if (v_state == 1) {
             // For each layer, read the values for each cell (transposed)
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (!kv_self.v_l[il]) {
+                    continue;
+                }
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Read type of value
@@ -22429,10 +23788,11 @@ struct llama_data_read {
     }
 
     void read_kv_cache(struct llama_context * ctx, llama_seq_id seq_id = -1) {
-        uint32_t cell_count;
-        read_to(&cell_count, sizeof(cell_count));
+        bool res = read_kv_cache(ctx, ctx->kv_self, seq_id);
 
-        bool res = read_kv_cache_meta(ctx, cell_count, seq_id) && read_kv_cache_data(ctx, cell_count);
+        if (res && ctx->kv_swa.size > 0) {
+            res = read_kv_cache(ctx, ctx->kv_swa, seq_id);
+        }
 
         if (!res) {
             if (seq_id == -1) {
@@ -22443,6 +23803,13 @@ struct llama_data_read {
             throw std::runtime_error("failed to restore kv cache");
         }
     }
+
+    bool read_kv_cache(struct llama_context * ctx, llama_kv_cache & kv_self, llama_seq_id seq_id) {
+        uint32_t cell_count;
+        read_to(&cell_count, sizeof(cell_count));
+
+        return read_kv_cache_meta(ctx, kv_self, cell_count, seq_id) && read_kv_cache_data(ctx, kv_self, cell_count);
+    }
 };
 
 struct llama_data_write_dummy : llama_data_write {
@@ -22850,6 +24217,13 @@ size_t llama_state_seq_load_file(struct llama_context * ctx, const char * filepa
 void llama_set_n_threads(struct llama_context * ctx, uint32_t n_threads, uint32_t n_threads_batch) {
     ctx->cparams.n_threads       = n_threads;
     ctx->cparams.n_threads_batch = n_threads_batch;
+
+    const int n_threads_max = (int) std::max(n_threads, n_threads_batch);
+    if (ctx->backend_cpu && (!ctx->threadpool || ggml_threadpool_get_n_threads(ctx->threadpool) < n_threads_max)) {
+        ggml_threadpool_free(ctx->threadpool);
+        ctx->threadpool = ggml_threadpool_new(n_threads_max);
+        ggml_backend_cpu_set_threadpool(ctx->backend_cpu, ctx->threadpool);
+    }
 }
 
 uint32_t llama_n_threads(struct llama_context * ctx) {
@@ -22957,17 +24331,23 @@ void llama_synchronize(struct llama_context * ctx) {
     // the stats will be added to the prompt evaluation stats
     // this should only happen when using batch size 1 to evaluate a batch
 
+    // nothing was evaluated since the last synchronization - leave the context untouched,
+    // so that reading the outputs from several threads after a synchronization is safe
+    if (ctx->n_queued_tokens == 0) {
+        return;
+    }
+
     // add the evaluation to the stats
     if (ctx->n_queued_tokens == 1) {
         ctx->t_eval_us += ggml_time_us() - ctx->t_compute_start_us;
         ctx->n_eval++;
-    } else if (ctx->n_queued_tokens > 1) {
+    } else {
         ctx->t_p_eval_us += ggml_time_us() - ctx->t_compute_start_us;
         ctx->n_p_eval += ctx->n_queued_tokens;
     }
 
     // get a more accurate load time, upon first eval
-    if (ctx->n_queued_tokens > 0 && !ctx->has_evaluated_once) {
+    if (!ctx->has_evaluated_once) {
         ctx->t_load_us = ggml_time_us() - ctx->t_start_us;
         ctx->has_evaluated_once = true;
     }
@@ -23844,6 +25224,13 @@ void llama_grammar_sample(
     llama_grammar_sample_impl(grammar, &ctx->model.vocab, &ctx->sampling, candidates);
 }
 
+void llama_grammar_sample_candidates(
+      const struct llama_grammar * grammar,
+      const struct llama_context * ctx,
+          llama_token_data_array * candidates) {
+    llama_grammar_sample_candidates_impl(grammar, &ctx->model.vocab, &ctx->sampling, candidates);
+}
+
 void llama_sample_grammar(
             struct llama_context * ctx,
           llama_token_data_array * candidates,
@@ -23900,13 +25287,30 @@ void llama_sample_temp(struct llama_context * ctx, llama_token_data_array * cand
 
 void llama_sample_xtc(struct llama_context * ctx, llama_token_data_array * candidates_p,
                            float   probability, float threshold, size_t min_keep) {
-    llama_sample_xtc_impl(ctx ? &ctx->sampling : nullptr, candidates_p, probability, threshold, min_keep);
+    llama_sample_xtc_impl(ctx ? &ctx->sampling : nullptr, candidates_p, probability, threshold, min_keep, ctx ? &ctx->sampling.rng : nullptr);
+}
+
+void llama_sample_xtc_with_rng(struct llama_context * ctx, llama_token_data_array * candidates_p,
+                           float   probability, float threshold, size_t min_keep, std::mt19937 & rng) {
+    llama_sample_xtc_impl(ctx ? &ctx->sampling : nullptr, candidates_p, probability, threshold, min_keep, &rng);
 }
 
 void llama_sample_top_n_sigma(struct llama_context * ctx, llama_token_data_array * candidates_p, float top_n_sigma) {
     llama_sample_top_n_sigma_impl(ctx ? &ctx->sampling : nullptr, candidates_p, top_n_sigma);
 }
 
+void llama_sample_top_k_logits(struct llama_context * ctx, llama_token_data_array * candidates, const float * logits, int32_t n_vocab, float temp, int32_t k, size_t min_keep) {
+    llama_sample_top_k_logits_impl(ctx ? &ctx->sampling : nullptr, candidates, logits, n_vocab, temp, k, min_keep);
+}
+
+void llama_sample_top_p_logits(struct llama_context * ctx, llama_token_data_array * candidates, const float * logits, int32_t n_vocab, float temp, float p, size_t min_keep) {
+    llama_sample_top_p_logits_impl(ctx ? &ctx->sampling : nullptr, candidates, logits, n_vocab, temp, p, min_keep);
+}
+
+void llama_sample_min_p_logits(struct llama_context * ctx, llama_token_data_array * candidates, const float * logits, int32_t n_vocab, float temp, float p, size_t min_keep) {
+    llama_sample_min_p_logits_impl(ctx ? &ctx->sampling : nullptr, candidates, logits, n_vocab, temp, p, min_keep);
+}
+
 
 void llama_sample_dry(struct llama_context* ctx, struct llama_sampler_dry* smpl,  llama_token_data_array* candidates_p) {
     llama_sampler_dry_apply(smpl, candidates_p);
@@ -24022,11 +25426,11 @@ struct llama_timings llama_get_timings(struct llama_context * ctx) {
         /*.t_start_ms  =*/ 1e-3 * ctx->t_start_us,
         /*.t_end_ms    =*/ 1.00 * ggml_time_ms(),
         /*.t_load_ms   =*/ 1e-3 * ctx->t_load_us,
-        /*.t_sample_ms =*/ 1e-3 * ctx->sampling.t_sample_us,
+        /*.t_sample_ms =*/ 1e-3 * ctx->sampling.t_sample_us.load(),
         /*.t_p_eval_ms =*/ 1e-3 * ctx->t_p_eval_us,
         /*.t_eval_ms   =*/ 1e-3 * ctx->t_eval_us,
 
-        /*.n_sample =*/ std::max(1, ctx->sampling.n_sample),
+        /*.n_sample =*/ std::max(1, ctx->sampling.n_sample.load()),
         /*.n_p_eval =*/ std::max(0, ctx->n_p_eval),
         /*.n_eval   =*/ std::max(1, ctx->n_eval),
     };
@@ -24046,6 +25450,18 @@ void llama_print_timings(struct llama_context * ctx) {
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, timings.t_eval_ms, timings.n_eval, timings.t_eval_ms / timings.n_eval, 1e3 / timings.t_eval_ms * timings.n_eval);
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (timings.t_end_ms - timings.t_start_ms), (timings.n_p_eval + timings.n_eval));
+    if (ggml_barrier_stats_enabled()) {
+        int64_t wait_us = 0, n_waits = 0;
+        ggml_barrier_stats_get(&wait_us, &n_waits);
+        LLAMA_LOG_INFO("%s:     barrier idle = %10.2f ms / %5" PRId64 " waits  (%8.2f us per wait, summed over all threads)\n",
+                __func__, 1e-3 * wait_us, n_waits, n_waits > 0 ? (double) wait_us / n_waits : 0.0);
+    }
+    if (ctx->cparams.expert_prefetch) {
+        const int n_tokens = std::max(1, ctx->n_p_eval + ctx->n_eval);
+        LLAMA_LOG_INFO("%s:  expert prefetch = %10" PRIu64 " of %" PRIu64 " expert slices resident, %" PRId64 " major faults (%8.2f per token)\n",
+                __func__, ctx->n_prefetch_resident, ctx->n_prefetch_resident + ctx->n_prefetch_requested, ctx->n_major_faults,
+                (double) ctx->n_major_faults / n_tokens);
+    }
 }
 
 void llama_reset_timings(struct llama_context * ctx) {
@@ -24054,6 +25470,12 @@ void llama_reset_timings(struct llama_context * ctx) {
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
 
     ctx->sampling.reset_timings();
+
+    ctx->n_prefetch_resident  = 0;
+    ctx->n_prefetch_requested = 0;
+    ctx->n_major_faults       = 0;
+
+    ggml_barrier_stats_reset();
 }
 
 const char * llama_print_system_info(void) {
@@ -24096,20 +25518,20 @@ void llama_dump_timing_info_yaml(FILE * stream, const llama_context * ctx) {
     fprintf(stream, "mst_p_eval: %.2f  # ms / token during prompt processing\n",
             1.0e-3 * ctx->t_p_eval_us / ctx->n_p_eval);
     fprintf(stream, "mst_sample: %.2f  # ms / token during sampling\n",
-            1.0e-3 * ctx->sampling.t_sample_us / ctx->sampling.n_sample);
+            1.0e-3 * ctx->sampling.t_sample_us.load() / ctx->sampling.n_sample.load());
     fprintf(stream, "n_eval: %d  # number of tokens generated (excluding the first one)\n", ctx->n_eval);
     fprintf(stream, "n_p_eval: %d  # number of tokens processed in batches at the beginning\n", ctx->n_p_eval);
-    fprintf(stream, "n_sample: %d  # number of sampled tokens\n", ctx->sampling.n_sample);
+    fprintf(stream, "n_sample: %d  # number of sampled tokens\n", ctx->sampling.n_sample.load());
     fprintf(stream, "t_eval_us: %" PRId64 "  # total microseconds spent generating tokens\n", ctx->t_eval_us);
     fprintf(stream, "t_load_us: %" PRId64 "  # total microseconds spent loading the model\n", ctx->t_load_us);
     fprintf(stream, "t_p_eval_us: %" PRId64 "  # total microseconds spent prompt processing\n", ctx->t_p_eval_us);
-    fprintf(stream, "t_sample_us: %" PRId64 "  # total microseconds spent sampling\n", ctx->sampling.t_sample_us);
+    fprintf(stream, "t_sample_us: %" PRId64 "  # total microseconds spent sampling\n", ctx->sampling.t_sample_us.load());
     fprintf(stream, "ts_eval: %.2f  # tokens / second during generation\n",
             1.0e6 * ctx->n_eval / ctx->t_eval_us);
     fprintf(stream, "ts_p_eval: %.2f  # tokens / second during prompt processing\n",
             1.0e6 * ctx->n_p_eval / ctx->t_p_eval_us);
     fprintf(stream, "ts_sample: %.2f  # tokens / second during sampling\n",
-            1.0e6 * ctx->sampling.n_sample / ctx->sampling.t_sample_us);
+            1.0e6 * ctx->sampling.n_sample.load() / ctx->sampling.t_sample_us.load());
 }
 
 // For internal test use
@@ -24168,3 +25590,26 @@ void llama_set_offload_policy(struct llama_context * lctx, int op, bool on_or_of
     printf("XXXXXXXXXXXXXXXXXXXXXXXXXXXX offload(%s) = %d\n", op_name, on_or_off);
     ggml_backend_sched_set_op_offload(lctx->sched, ggml_op(op), on_or_off);
 }
+
+bool llama_expert_stats_save(const struct llama_context * ctx, const char * fname) {
+    if (!ctx || ctx->expert_counts.empty()) {
+        return false;
+    }
+    std::ofstream out(fname);
+    if (!out) {
+        return false;
+    }
+    out << "# expert selection counts: layer n_expert count_0 ... count_{n_expert-1}\n";
+    for (size_t il = 0; il < ctx->expert_counts.size(); ++il) {
+        const auto & counts = ctx->expert_counts[il];
+        if (std::all_of(counts.begin(), counts.end(), [](uint64_t c) { return c == 0; })) {
+            continue; // dense layer
+        }
+        out << il << ' ' << counts.size();
+        for (auto c : counts) {
+            out << ' ' << c;
+        }
+        out << '\n';
+    }
+    return out.good();
+}
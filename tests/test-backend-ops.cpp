@@ -726,6 +726,46 @@ struct test_get_rows : public test_case {
     }
 };
 
+// GGML_OP_SET_ROWS
+struct test_set_rows : public test_case {
+    const ggml_type type;
+    const int n; // cols
+    const int h; // rows per cell
+    const int m; // cells
+    const int r; // cells to set
+
+    std::string vars() override {
+        return VARS_TO_STR5(type, n, h, m, r);
+    }
+
+    test_set_rows(ggml_type type = GGML_TYPE_F32, int n = 32, int h = 1, int m = 8, int r = 3)
+        : type(type), n(n), h(h), m(m), r(r) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * dst = ggml_new_tensor_3d(ctx, type, n, h, m);
+        ggml_tensor * src = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n, h, r);
+        ggml_tensor * idx = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, r);
+        ggml_tensor * out = ggml_set_rows(ctx, dst, src, idx);
+        return out;
+    }
+
+    void initialize_tensors(ggml_context * ctx) override {
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+            if (t->type == GGML_TYPE_I32) {
+                // distinct cells
+                std::vector<int> data(m);
+                for (int i = 0; i < m; i++) {
+                    data[i] = i;
+                }
+                std::shuffle(data.begin(), data.end(), std::default_random_engine(rand()));
+                ggml_backend_tensor_set(t, data.data(), 0, r * sizeof(int));
+            } else {
+                init_tensor_uniform(t);
+            }
+        }
+    }
+};
+
 // GGML_OP_REPEAT
 struct test_repeat : public test_case {
     const ggml_type type;
@@ -2122,6 +2162,11 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
         }
     }
 
+    for (ggml_type type : {GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q8_0}) {
+        test_cases.emplace_back(new test_set_rows(type, 256, 1, 16, 5));
+        test_cases.emplace_back(new test_set_rows(type, 64, 4, 16, 7));
+    }
+
     for (ggml_type type_input : {GGML_TYPE_F32}) {
         for (ggml_op_pool pool_type : {GGML_OP_POOL_AVG, GGML_OP_POOL_MAX}) {
             for (int k0 : {1, 3}) {
@@ -0,0 +1,462 @@
+// Checks ops that only have a CPU implementation, or fused ops whose CPU path differs from the unfused graph, against
+// the equivalent graph of basic ops. test-backend-ops cannot catch these as it compares the other backends to the CPU.
+//
+// - SET_ROWS against one CPY per row into a view of the destination
+// - FLASH_ATTN_EXT that skips the fully masked KV blocks (paged KV cache) against the one that does not
+// - MOE_ROUTE against the router of soft_max/sigmoid, argsort and get_rows, with and without expert groups
+// - the MoE FFN with the results grouped by expert (ggml_moe_up_gate_sorted, ggml_mul_mat_id_sorted and
+//   ggml_multi_add_weighted) and with the fused down projection (ggml_moe_down) against MUL_MAT_ID, MUL and MULTI_ADD
+// - FLASH_ATTN_EXT with ALiBi (max_bias > 0) against MUL_MAT and SOFT_MAX
+
+#include <ggml.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static const int n_threads = 2;
+
+static ggml_context * new_context() {
+    ggml_init_params params = {
+        /*.mem_size   =*/ 64*1024*1024,
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+    return ggml_init(params);
+}
+
+static void compute(ggml_context * ctx, ggml_tensor * t) {
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, t);
+    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+}
+
+static void init_tensor(ggml_tensor * t, std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> data(ggml_nelements(t));
+    for (auto & x : data) {
+        x = dist(rng);
+    }
+    if (t->type == GGML_TYPE_F32) {
+        memcpy(t->data, data.data(), ggml_nbytes(t));
+    } else {
+        ggml_quantize_chunk(t->type, data.data(), t->data, 0, ggml_nrows(t), t->ne[0], nullptr);
+    }
+}
+
+static double nmse(const float * a, const float * b, int64_t n) {
+    double sum_a2 = 0;
+    double sum_d2 = 0;
+    for (int64_t i = 0; i < n; ++i) {
+        if (!std::isfinite(a[i]) || !std::isfinite(b[i])) {
+            return INFINITY;
+        }
+        sum_a2 += (double)a[i]*a[i];
+        sum_d2 += ((double)a[i] - b[i])*((double)a[i] - b[i]);
+    }
+    return sum_d2/sum_a2;
+}
+
+static bool report(const char * what, bool ok) {
+    printf("  %-60s %s\n", what, ok ? "OK" : "FAIL");
+    return ok;
+}
+
+// a[:, i1, c[i2]] = b[:, i1, i2] - the converted rows and the cells that are not written have to match the CPY graph
+// byte for byte, and the rows read back with GET_ROWS have to match b up to the conversion error
+static bool test_set_rows(ggml_type type, double max_nmse, std::mt19937 & rng) {
+    const int64_t ne0 = 64, ne1 = 4, n_cells = 32, n_rows = 8;
+
+    ggml_context * ctx = new_context();
+
+    ggml_tensor * a     = ggml_new_tensor_3d(ctx, type, ne0, ne1, n_cells);
+    ggml_tensor * a_ref = ggml_new_tensor_3d(ctx, type, ne0, ne1, n_cells);
+    ggml_tensor * b     = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, ne0, ne1, n_rows);
+    ggml_tensor * c     = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_rows);
+
+    init_tensor(a, rng);
+    memcpy(a_ref->data, a->data, ggml_nbytes(a));
+    init_tensor(b, rng);
+
+    std::vector<int32_t> cells(n_cells);
+    for (int i = 0; i < n_cells; ++i) {
+        cells[i] = i;
+    }
+    std::shuffle(cells.begin(), cells.end(), rng);
+    memcpy(c->data, cells.data(), ggml_nbytes(c));
+
+    ggml_tensor * out = ggml_set_rows(ctx, a, b, c);
+    compute(ctx, out);
+    ggml_tensor * rows = ggml_get_rows(ctx, ggml_reshape_2d(ctx, out, ne0*ne1, n_cells), c);
+    compute(ctx, rows);
+
+    for (int64_t i2 = 0; i2 < n_rows; ++i2) {
+        ggml_tensor * src = ggml_view_2d(ctx, b,     ne0, ne1, b->nb[1],     i2*b->nb[2]);
+        ggml_tensor * dst = ggml_view_2d(ctx, a_ref, ne0, ne1, a_ref->nb[1], cells[i2]*a_ref->nb[2]);
+        compute(ctx, ggml_cpy(ctx, src, dst));
+    }
+
+    const double err = nmse((const float *) b->data, (const float *) rows->data, ggml_nelements(b));
+
+    char what[128];
+    snprintf(what, sizeof(what), "SET_ROWS %s vs CPY: nmse of the rows read back = %.2e", ggml_type_name(type), err);
+    const bool ok = report(what, memcmp(a->data, a_ref->data, ggml_nbytes(a)) == 0 && err < max_nmse);
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+// the KV blocks of the other sequences of a paged cache are hidden from all rows, the partly masked blocks are not
+static bool test_flash_attn_skip_masked(ggml_type type_k, std::mt19937 & rng) {
+    const int64_t D = 128, n_q = 8, n_kv = 512, n_head = 4, n_block = 64;
+
+    ggml_context * ctx = new_context();
+
+    ggml_tensor * q    = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, D, n_q,  n_head);
+    ggml_tensor * k    = ggml_new_tensor_3d(ctx, type_k,        D, n_kv, n_head);
+    ggml_tensor * v    = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, D, n_kv, n_head);
+    ggml_tensor * mask = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_kv, GGML_PAD(n_q, GGML_KQ_MASK_PAD));
+
+    init_tensor(q, rng);
+    init_tensor(k, rng);
+    init_tensor(v, rng);
+
+    ggml_fp16_t * m = (ggml_fp16_t *) mask->data;
+    for (int64_t j = 0; j < mask->ne[1]; ++j) {
+        for (int64_t i = 0; i < n_kv; ++i) {
+            const bool visible = (i/n_block) % 2 == 0 && (i/n_block < 6 || i % n_block <= j);
+            m[j*n_kv + i] = ggml_fp32_to_fp16(visible ? 0.0f : -INFINITY);
+        }
+    }
+
+    const float scale = 1.0f/sqrtf((float) D);
+
+    ggml_tensor * out     = ggml_flash_attn_ext(ctx, q, k, v, mask, scale, 0.0f, 0.0f);
+    ggml_tensor * out_ref = ggml_flash_attn_ext(ctx, q, k, v, mask, scale, 0.0f, 0.0f);
+    ggml_flash_attn_ext_set_skip_masked(out, true);
+    compute(ctx, out);
+    compute(ctx, out_ref);
+
+    const double err = nmse((const float *) out_ref->data, (const float *) out->data, ggml_nelements(out));
+
+    char what[128];
+    snprintf(what, sizeof(what), "FLASH_ATTN_EXT K %s skip masked blocks: nmse = %.2e", ggml_type_name(type_k), err);
+    const bool ok = report(what, err < 1e-10);
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+// the mask holds the distance of the KV cells to the query positions, so that ALiBi gives each head its own slope
+static bool test_flash_attn_alibi(ggml_type type_k, std::mt19937 & rng) {
+    const int64_t D = 128, n_q = 8, n_kv = 256, n_head = 8;
+    const float max_bias = 8.0f;
+
+    ggml_context * ctx = new_context();
+
+    ggml_tensor * q    = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, D, n_q,  n_head);
+    ggml_tensor * k    = ggml_new_tensor_3d(ctx, type_k,        D, n_kv, n_head);
+    ggml_tensor * v    = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, D, n_kv, n_head);
+    ggml_tensor * mask = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_kv, GGML_PAD(n_q, GGML_KQ_MASK_PAD));
+
+    init_tensor(q, rng);
+    init_tensor(k, rng);
+    init_tensor(v, rng);
+
+    ggml_fp16_t * m = (ggml_fp16_t *) mask->data;
+    for (int64_t j = 0; j < mask->ne[1]; ++j) {
+        const int64_t pos = n_kv - n_q + j;
+        for (int64_t i = 0; i < n_kv; ++i) {
+            m[j*n_kv + i] = ggml_fp32_to_fp16(i <= pos ? -(float)(pos - i) : -INFINITY);
+        }
+    }
+
+    const float scale = 1.0f/sqrtf((float) D);
+
+    ggml_tensor * out = ggml_flash_attn_ext(ctx, q, k, v, mask, scale, max_bias, 0.0f); // [D, n_head, n_q]
+
+    ggml_tensor * kq  = ggml_soft_max_ext(ctx, ggml_mul_mat(ctx, k, q), mask, scale, max_bias); // [n_kv, n_q, n_head]
+    ggml_tensor * kqv = ggml_mul_mat(ctx, ggml_cont(ctx, ggml_transpose(ctx, ggml_cast(ctx, v, GGML_TYPE_F32))), kq);
+    ggml_tensor * ref = ggml_cont(ctx, ggml_permute(ctx, kqv, 0, 2, 1, 3)); // [D, n_head, n_q]
+
+    compute(ctx, out);
+    compute(ctx, ref);
+
+    const double err = nmse((const float *) ref->data, (const float *) out->data, ggml_nelements(out));
+
+    char what[128];
+    snprintf(what, sizeof(what), "FLASH_ATTN_EXT K %s ALiBi vs SOFT_MAX: nmse = %.2e", ggml_type_name(type_k), err);
+    const bool ok = report(what, err < 1e-4);
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+struct test_route_params {
+    const char * name;
+    ggml_moe_gating gating;
+    bool  with_bias;
+    bool  norm_w;
+    float w_scale;
+    int   n_group;
+    int   n_group_used;
+};
+
+// the unfused router, with the group-limited selection of DeepSeek: the score of a group is the sum of its two best
+// experts when there is a selection bias, else its best expert, and only the experts of the n_group_used best groups
+// can be selected. The experts of the selected groups are gathered, the ids are gathered along from a map of ids.
+static void build_route_ref(ggml_context * ctx, const test_route_params & tp, ggml_tensor * logits, ggml_tensor * bias,
+        ggml_tensor * expert_ids, int k, ggml_tensor ** ids, ggml_tensor ** weights) {
+    const int64_t n_expert = logits->ne[0], n_tokens = logits->ne[1];
+
+    ggml_tensor * probs = tp.gating == GGML_MOE_GATING_SOFTMAX ? ggml_soft_max(ctx, logits) : ggml_sigmoid(ctx, logits);
+    ggml_tensor * sel   = bias ? ggml_add(ctx, probs, bias) : probs;
+
+    ggml_tensor * w;
+    if (tp.n_group > 1) {
+        const int64_t n_per_group = n_expert/tp.n_group;
+        const int     n_best      = bias && n_per_group > 1 ? 2 : 1;
+
+        ggml_tensor * groups = ggml_reshape_3d(ctx, sel, n_per_group, tp.n_group, n_tokens);
+        ggml_tensor * best   = ggml_get_rows(ctx, ggml_reshape_4d(ctx, groups, 1, n_per_group, tp.n_group, n_tokens),
+                ggml_top_k(ctx, groups, n_best)); // [1, n_best, n_group, n_tokens]
+        ggml_tensor * scores = ggml_sum_rows(ctx, ggml_reshape_3d(ctx, best, n_best, tp.n_group, n_tokens));
+        ggml_tensor * used   = ggml_top_k(ctx, ggml_reshape_2d(ctx, scores, tp.n_group, n_tokens), tp.n_group_used);
+
+        const int64_t n_used = n_per_group*tp.n_group_used;
+
+        ggml_tensor * sel_used   = ggml_reshape_2d(ctx, ggml_get_rows(ctx, groups, used), n_used, n_tokens);
+        ggml_tensor * probs_used = ggml_get_rows(ctx, ggml_reshape_3d(ctx, probs, n_per_group, tp.n_group, n_tokens), used);
+        ggml_tensor * ids_used   = ggml_get_rows(ctx, expert_ids, used);
+
+        ggml_tensor * top = ggml_top_k(ctx, sel_used, k);
+        *ids = ggml_get_rows(ctx, ggml_reshape_3d(ctx, ids_used,   1, n_used, n_tokens), top);
+        w    = ggml_get_rows(ctx, ggml_reshape_3d(ctx, probs_used, 1, n_used, n_tokens), top);
+    } else {
+        ggml_tensor * top = ggml_top_k(ctx, sel, k);
+        *ids = ggml_cont(ctx, top);
+        w    = ggml_get_rows(ctx, ggml_reshape_3d(ctx, probs, 1, n_expert, n_tokens), top);
+    }
+
+    w = ggml_reshape_2d(ctx, w, k, n_tokens);
+    if (tp.norm_w) {
+        w = ggml_div(ctx, w, ggml_sum_rows(ctx, w));
+    }
+    *weights = ggml_scale(ctx, w, tp.w_scale);
+}
+
+static bool test_moe_route(const test_route_params & tp, std::mt19937 & rng) {
+    const int64_t n_expert = 64, n_tokens = 13;
+    const int k = 8;
+
+    ggml_context * ctx = new_context();
+
+    ggml_tensor * logits     = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_expert, n_tokens);
+    ggml_tensor * bias       = tp.with_bias ? ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_expert) : nullptr;
+    ggml_tensor * expert_ids = ggml_new_tensor_3d(ctx, GGML_TYPE_I32, n_expert/tp.n_group, tp.n_group, n_tokens);
+
+    std::normal_distribution<float> dist(0.0f, 2.0f);
+    for (int64_t i = 0; i < ggml_nelements(logits); ++i) {
+        ((float *) logits->data)[i] = dist(rng);
+    }
+    for (int64_t i = 0; bias && i < n_expert; ++i) {
+        ((float *) bias->data)[i] = 0.05f*dist(rng);
+    }
+    for (int64_t i = 0; i < ggml_nelements(expert_ids); ++i) {
+        ((int32_t *) expert_ids->data)[i] = i % n_expert;
+    }
+
+    ggml_tensor * route = ggml_moe_route(ctx, logits, bias, k, tp.gating, tp.norm_w, tp.w_scale, tp.n_group, tp.n_group_used, 0, 0.0f);
+    compute(ctx, route);
+
+    ggml_tensor * ids_ref;
+    ggml_tensor * w_ref;
+    build_route_ref(ctx, tp, logits, bias, expert_ids, k, &ids_ref, &w_ref);
+    compute(ctx, ids_ref);
+    compute(ctx, w_ref);
+
+    int n_ids_diff = 0;
+    std::vector<float> w(k*n_tokens);
+    for (int64_t i = 0; i < n_tokens; ++i) {
+        const char * row = (const char *) route->data + i*route->nb[2];
+        for (int j = 0; j < k; ++j) {
+            n_ids_diff += ((const int32_t *) row)[j] != ((const int32_t *) ids_ref->data)[i*k + j];
+            w[i*k + j] = ((const float *) (row + route->nb[1]))[j];
+        }
+    }
+    const double err = nmse((const float *) w_ref->data, w.data(), k*n_tokens);
+
+    char what[128];
+    snprintf(what, sizeof(what), "MOE_ROUTE %s: %d ids differ, nmse of the weights = %.2e", tp.name, n_ids_diff, err);
+    const bool ok = report(what, n_ids_diff == 0 && err < 1e-12);
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+// the experts of one MoE FFN, the tokens, their experts and router weights
+struct test_moe {
+    ggml_tensor * up;
+    ggml_tensor * gate;
+    ggml_tensor * down;
+    ggml_tensor * x;
+    ggml_tensor * ids;
+    ggml_tensor * weights;
+
+    // the rows of the results grouped by expert: experts in ascending order, tokens in order within an expert
+    std::vector<int> sorted_rows;
+};
+
+static test_moe new_moe(ggml_context * ctx, ggml_type type, int64_t n_embd, int64_t n_ff, int n_expert, int n_expert_used,
+        int64_t n_tokens, bool drop, std::mt19937 & rng) {
+    test_moe moe;
+    moe.up      = ggml_new_tensor_3d(ctx, type, n_embd, n_ff, n_expert);
+    moe.gate    = ggml_new_tensor_3d(ctx, type, n_embd, n_ff, n_expert);
+    moe.down    = ggml_new_tensor_3d(ctx, type, n_ff, n_embd, n_expert);
+    moe.x       = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_embd, 1, n_tokens);
+    moe.ids     = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, n_expert_used, n_tokens);
+    moe.weights = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, 1, n_expert_used, n_tokens);
+
+    for (ggml_tensor * t : { moe.up, moe.gate, moe.down, moe.x, moe.weights }) {
+        init_tensor(t, rng);
+    }
+
+    std::vector<int32_t> experts(n_expert);
+    for (int e = 0; e < n_expert; ++e) {
+        experts[e] = e;
+    }
+    int32_t * ids = (int32_t *) moe.ids->data;
+    for (int64_t i = 0; i < n_tokens; ++i) {
+        std::shuffle(experts.begin(), experts.end(), rng);
+        std::copy(experts.begin(), experts.begin() + n_expert_used, ids + i*n_expert_used);
+        if (drop && i % 3 == 0) {
+            // the last expert dropped by the threshold of -ser
+            ids[(i + 1)*n_expert_used - 1] = -1;
+            ((float *) moe.weights->data)[(i + 1)*n_expert_used - 1] = 0.0f;
+        }
+    }
+
+    for (int e = 0; e < n_expert; ++e) {
+        for (int64_t i = 0; i < n_tokens*n_expert_used; ++i) {
+            if (ids[i] == e) {
+                moe.sorted_rows.push_back(i);
+            }
+        }
+    }
+
+    return moe;
+}
+
+// compare the rows of a result grouped by expert with the rows of the [row, id, token] result, where the rows of
+// dropped experts are zero
+static double nmse_sorted(const test_moe & moe, const ggml_tensor * sorted, const ggml_tensor * ref) {
+    const int64_t n = ref->ne[0];
+    std::vector<float> unsorted(ggml_nelements(ref));
+    for (size_t r = 0; r < moe.sorted_rows.size(); ++r) {
+        memcpy(unsorted.data() + moe.sorted_rows[r]*n, (const float *) sorted->data + r*n, n*sizeof(float));
+    }
+    return nmse((const float *) ref->data, unsorted.data(), ggml_nelements(ref));
+}
+
+static bool test_moe_ffn(ggml_type type, int64_t n_embd, bool drop, std::mt19937 & rng) {
+    const int64_t n_ff = 128, n_tokens = 40;
+    const int n_expert = 8, n_expert_used = 3;
+
+    ggml_context * ctx = new_context();
+
+    test_moe moe = new_moe(ctx, type, n_embd, n_ff, n_expert, n_expert_used, n_tokens, drop, rng);
+
+    // the unfused FFN
+    ggml_tensor * up      = ggml_mul_mat_id(ctx, moe.up,   moe.x, moe.ids);
+    ggml_tensor * gate    = ggml_mul_mat_id(ctx, moe.gate, moe.x, moe.ids);
+    ggml_tensor * par     = ggml_mul(ctx, ggml_silu(ctx, gate), up);
+    ggml_tensor * experts = ggml_mul_mat_id(ctx, moe.down, par, moe.ids);
+    ggml_tensor * out     = ggml_multi_add(ctx,
+            ggml_view_2d(ctx, ggml_mul(ctx, experts, moe.weights), n_embd, n_tokens, experts->nb[2], 0), n_expert_used);
+
+    ggml_tensor * up_sorted      = ggml_mul_mat_id_sorted(ctx, moe.up, moe.x, moe.ids);
+    ggml_tensor * par_sorted     = ggml_moe_up_gate_sorted(ctx, moe.up, moe.gate, moe.x, moe.ids, GGML_UNARY_OP_SILU);
+    ggml_tensor * experts_sorted = ggml_mul_mat_id_sorted(ctx, moe.down, par_sorted, moe.ids);
+    ggml_tensor * out_sorted     = ggml_multi_add_weighted(ctx, experts_sorted, moe.weights, moe.ids, n_expert);
+    ggml_tensor * out_weighted   = ggml_multi_add_weighted(ctx, experts, moe.weights, nullptr, n_expert);
+    ggml_tensor * out_down       = ggml_moe_down(ctx, moe.down, par, moe.ids, moe.weights);
+
+    for (ggml_tensor * t : { up, par, experts, out, up_sorted, par_sorted, experts_sorted, out_sorted, out_weighted, out_down }) {
+        compute(ctx, t);
+    }
+
+    struct {
+        const char * what;
+        double err;
+    } checks[] = {
+        { "mul_mat_id_sorted",                  nmse_sorted(moe, up_sorted, up)                                             },
+        { "moe_up_gate_sorted",                 nmse_sorted(moe, par_sorted, par)                                           },
+        { "mul_mat_id_sorted of sorted rows",   nmse_sorted(moe, experts_sorted, experts)                                   },
+        { "multi_add_weighted of sorted rows",  nmse((const float *) out->data, (const float *) out_sorted->data,   ggml_nelements(out)) },
+        { "multi_add_weighted",                 nmse((const float *) out->data, (const float *) out_weighted->data, ggml_nelements(out)) },
+        { "moe_down",                           nmse((const float *) out->data, (const float *) out_down->data,     ggml_nelements(out)) },
+    };
+
+    bool ok = true;
+    for (const auto & c : checks) {
+        char what[128];
+        snprintf(what, sizeof(what), "%s %s n_embd %d%s: nmse = %.2e", c.what, ggml_type_name(type), (int) n_embd, drop ? " dropped" : "", c.err);
+        ok = report(what, c.err < 1e-10) && ok;
+    }
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(int /*argc*/, char ** /*argv*/) {
+    std::mt19937 rng(1234);
+
+    int n_fail = 0;
+
+    n_fail += !test_set_rows(GGML_TYPE_F32,  1e-12, rng);
+    n_fail += !test_set_rows(GGML_TYPE_F16,  1e-6,  rng);
+    n_fail += !test_set_rows(GGML_TYPE_BF16, 1e-4,  rng);
+    n_fail += !test_set_rows(GGML_TYPE_Q8_0, 1e-4,  rng);
+    n_fail += !test_set_rows(GGML_TYPE_Q4_0, 1e-2,  rng);
+
+    for (ggml_type type_k : { GGML_TYPE_F16, GGML_TYPE_Q8_0 }) {
+        n_fail += !test_flash_attn_skip_masked(type_k, rng);
+    }
+    for (ggml_type type_k : { GGML_TYPE_F16, GGML_TYPE_BF16, GGML_TYPE_Q8_0 }) {
+        n_fail += !test_flash_attn_alibi(type_k, rng);
+    }
+
+    const test_route_params route_params[] = {
+        { "softmax",                          GGML_MOE_GATING_SOFTMAX, false, true,  1.0f, 1, 0 },
+        { "softmax, 3 of 8 groups",           GGML_MOE_GATING_SOFTMAX, false, false, 1.0f, 8, 3 },
+        { "sigmoid, bias, 4 of 8 groups",     GGML_MOE_GATING_SIGMOID, true,  true,  2.5f, 8, 4 },
+        { "sigmoid, bias, 2 of 4 groups",     GGML_MOE_GATING_SIGMOID, true,  false, 1.5f, 4, 2 },
+    };
+    for (const auto & tp : route_params) {
+        n_fail += !test_moe_route(tp, rng);
+    }
+
+    for (ggml_type type : { GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0 }) {
+        n_fail += !test_moe_ffn(type, 256, false, rng);
+    }
+    n_fail += !test_moe_ffn(GGML_TYPE_Q8_0, 256, true, rng);
+    // the last tile of rows of ggml_moe_down is shorter
+    n_fail += !test_moe_ffn(GGML_TYPE_F32, 200, false, rng);
+    n_fail += !test_moe_ffn(GGML_TYPE_F16, 200, true,  rng);
+
+    if (n_fail > 0) {
+        printf("%d tests failed\n", n_fail);
+        return 1;
+    }
+
+    printf("All tests passed.\n");
+    return 0;
+}
@@ -0,0 +1,201 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#define LLAMA_API_INTERNAL
+
+#include "ggml.h"
+#include "llama.h"
+#include "common.h"
+#include "grammar-parser.h"
+#include "json-schema-to-grammar.h"
+
+#include <cassert>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+static llama_grammar * build_grammar(const std::string & grammar_str) {
+    auto parsed_grammar = grammar_parser::parse(grammar_str.c_str());
+
+    // Ensure we parsed correctly
+    assert(!parsed_grammar.rules.empty());
+
+    // Ensure we have a root node
+    assert(!(parsed_grammar.symbol_ids.find("root") == parsed_grammar.symbol_ids.end()));
+
+    std::vector<const llama_grammar_element*> grammar_rules(parsed_grammar.c_rules());
+    llama_grammar * grammar = llama_grammar_init(
+        grammar_rules.data(), grammar_rules.size(), parsed_grammar.symbol_ids.at("root"));
+
+    assert(grammar != nullptr);
+
+    return grammar;
+}
+
+// Generates n_tokens with random logits under the grammar, and checks that llama_grammar_sample allows exactly the
+// same tokens as matching the pieces of all the candidates.
+static void test_grammar_vocab(llama_context * ctx, const std::string & test_desc, const std::string & grammar_str, int n_tokens) {
+    fprintf(stderr, "⚫ Testing %s\n", test_desc.c_str());
+    fflush(stderr);
+
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    llama_grammar * grammar = build_grammar(grammar_str);
+
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+
+    std::vector<llama_token_data> cur_ref(n_vocab);
+    std::vector<llama_token_data> cur(n_vocab);
+
+    int64_t t_ref_us  = 0;
+    int64_t t_mask_us = 0;
+
+    std::string output;
+
+    int n_sampled = 0;
+    for (; n_sampled < n_tokens; ++n_sampled) {
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            cur_ref[id] = cur[id] = llama_token_data{ id, dist(rng), 0.0f };
+        }
+
+        llama_token_data_array cur_ref_p = { cur_ref.data(), cur_ref.size(), false };
+        llama_token_data_array cur_p     = { cur.data(),     cur.size(),     false };
+
+        const int64_t t_start_us = ggml_time_us();
+        llama_grammar_sample_candidates(grammar, ctx, &cur_ref_p);
+        const int64_t t_mid_us = ggml_time_us();
+        llama_grammar_sample(grammar, ctx, &cur_p);
+        const int64_t t_end_us = ggml_time_us();
+
+        t_ref_us  += t_mid_us - t_start_us;
+        t_mask_us += t_end_us - t_mid_us;
+
+        // both allow the same tokens, and the most likely one is the next token
+        llama_token id_next = -1;
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            GGML_ASSERT(std::isinf(cur_ref[id].logit) == std::isinf(cur[id].logit));
+            if (!std::isinf(cur[id].logit) && (id_next < 0 || cur[id].logit > cur[id_next].logit)) {
+                id_next = id;
+            }
+        }
+        GGML_ASSERT(id_next >= 0);
+
+        if (llama_token_is_eog(llama_get_model(ctx), id_next)) {
+            break;
+        }
+
+        // also check the single token path that is used to validate a sampled token
+        {
+            llama_token_data single = { id_next, 0.0f, 0.0f };
+            llama_token_data_array single_p = { &single, 1, false };
+            llama_grammar_sample(grammar, ctx, &single_p);
+            GGML_ASSERT(!std::isinf(single.logit));
+        }
+
+        llama_grammar_accept_token(grammar, ctx, id_next);
+        output += llama_token_to_piece(ctx, id_next, true);
+    }
+
+    fprintf(stderr, "  output: %s\n", output.c_str());
+    fprintf(stdout, "  ✅︎ %d tokens, %8.1f tokens/s with the vocabulary masks vs. %8.1f tokens/s matching all the candidates\n",
+            n_sampled, n_sampled*1e6/t_mask_us, n_sampled*1e6/t_ref_us);
+
+    llama_grammar_free(grammar);
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    fprintf(stderr, "%s : reading vocab from: '%s'\n", __func__, fname.c_str());
+
+    llama_model * model;
+    llama_context * ctx;
+
+    llama_backend_init();
+
+    // load the vocab
+    {
+        auto mparams = llama_model_default_params();
+
+        mparams.vocab_only = true;
+
+        model = llama_load_model_from_file(fname.c_str(), mparams);
+
+        if (model == NULL) {
+            fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+
+        auto cparams = llama_context_default_params();
+
+        ctx = llama_new_context_with_model(model, cparams);
+
+        if (ctx == NULL) {
+            fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+            llama_free_model(model);
+            return 1;
+        }
+    }
+
+    test_grammar_vocab(ctx, "JSON schema", json_schema_to_grammar(json::parse(R"""({
+        "type": "object",
+        "properties": {
+            "name":    { "type": "string" },
+            "age":     { "type": "integer", "minimum": 0 },
+            "email":   { "type": "string", "format": "email" },
+            "country": { "enum": ["France", "Germany", "Italy", "Spain"] },
+            "tags":    { "type": "array", "items": { "type": "string" }, "maxItems": 3 }
+        },
+        "required": ["name", "age", "country"],
+        "additionalProperties": false
+    })""")), 64);
+
+    test_grammar_vocab(ctx, "JSON", R"""(
+        root   ::= object
+        value  ::= object | array | string | number | ("true" | "false" | "null") ws
+
+        object ::=
+          "{" ws (
+                    string ":" ws value
+            ("," ws string ":" ws value)*
+          )? "}" ws
+
+        array  ::=
+          "[" ws (
+                    value
+            ("," ws value)*
+          )? "]" ws
+
+        string ::=
+          "\"" (
+            [^"\\\x7F\x00-\x1F] |
+            "\\" (["\\bfnrt] | "u" [0-9a-fA-F]{4})
+          )* "\"" ws
+
+        number ::= ("-"? ([0-9] | [1-9] [0-9]{0,15})) ("." [0-9]+)? ([eE] [-+]? [0-9] [1-9]{0,15})? ws
+
+        ws ::= | " " | "\n" [ \t]{0,20}
+    )""", 64);
+
+    test_grammar_vocab(ctx, "non-ASCII", R"""(
+        root ::= "「" [一-鿿ぁ-ゟ゠-ヿ]+ "」" ([ \n] [^\x00-\x7F]+)*
+    )""", 32);
+
+    llama_free(ctx);
+    llama_free_model(model);
+
+    llama_backend_free();
+
+    fprintf(stdout, "All tests passed.\n");
+    return 0;
+}
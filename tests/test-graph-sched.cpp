@@ -0,0 +1,242 @@
+// Checks that computing a graph with the dependency-aware schedule gives the same result as computing it in
+// lockstep, for a transformer-like graph with independent branches and buffers re-used by the graph allocator,
+// and for an op that reads beyond the view it gets (MULTI_ADD) next to a node that writes into the viewed tensor.
+
+#include <ggml.h>
+#include <ggml-alloc.h>
+#include <ggml-backend.h>
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+struct test_layer {
+    ggml_tensor * attn_norm;
+    ggml_tensor * wq;
+    ggml_tensor * wk;
+    ggml_tensor * wv;
+    ggml_tensor * wo;
+    ggml_tensor * ffn_norm;
+    ggml_tensor * ffn_up;
+    ggml_tensor * ffn_gate;
+    ggml_tensor * ffn_down;
+};
+
+static const int n_embd  = 256;
+static const int n_ff    = 512;
+static const int n_layer = 4;
+
+static std::vector<float> random_data(const ggml_tensor * tensor, std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> data(ggml_nelements(tensor));
+    for (auto & x : data) {
+        x = dist(rng)/sqrtf((float)tensor->ne[0]);
+    }
+    return data;
+}
+
+static void init_tensor(ggml_tensor * tensor, std::mt19937 & rng) {
+    const std::vector<float> data = random_data(tensor, rng);
+    if (tensor->type == GGML_TYPE_F32) {
+        ggml_backend_tensor_set(tensor, data.data(), 0, ggml_nbytes(tensor));
+    } else {
+        std::vector<uint8_t> qdata(ggml_nbytes(tensor));
+        ggml_quantize_chunk(tensor->type, data.data(), qdata.data(), 0, ggml_nrows(tensor), tensor->ne[0], nullptr);
+        ggml_backend_tensor_set(tensor, qdata.data(), 0, qdata.size());
+    }
+}
+
+static ggml_cgraph * build_graph(ggml_context * ctx, const std::vector<test_layer> & layers, ggml_tensor * inp) {
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+
+    ggml_tensor * x = inp;
+    for (const auto & layer : layers) {
+        ggml_tensor * cur = ggml_mul(ctx, ggml_rms_norm(ctx, x, 1e-5f), layer.attn_norm);
+
+        ggml_tensor * q = ggml_mul_mat(ctx, layer.wq, cur);
+        ggml_tensor * k = ggml_mul_mat(ctx, layer.wk, cur);
+        ggml_tensor * v = ggml_mul_mat(ctx, layer.wv, cur);
+
+        ggml_tensor * kq = ggml_soft_max_ext(ctx, ggml_mul_mat(ctx, k, q), nullptr, 1.0f/sqrtf((float)n_embd), 0.0f);
+        ggml_tensor * kqv = ggml_mul_mat(ctx, ggml_cont(ctx, ggml_transpose(ctx, v)), kq);
+
+        x = ggml_add(ctx, x, ggml_mul_mat(ctx, layer.wo, kqv));
+
+        cur = ggml_mul(ctx, ggml_rms_norm(ctx, x, 1e-5f), layer.ffn_norm);
+
+        ggml_tensor * up   = ggml_mul_mat(ctx, layer.ffn_up,   cur);
+        ggml_tensor * gate = ggml_mul_mat(ctx, layer.ffn_gate, cur);
+
+        x = ggml_add(ctx, x, ggml_mul_mat(ctx, layer.ffn_down, ggml_mul(ctx, ggml_silu(ctx, gate), up)));
+    }
+    ggml_set_output(x);
+
+    ggml_build_forward_expand(gf, x);
+
+    return gf;
+}
+
+static std::vector<float> compute(ggml_backend_t backend, ggml_cgraph * gf, ggml_tensor * inp, const std::vector<float> & inp_data,
+        ggml_tensor * out, int n_threads, bool lockstep) {
+    ggml_backend_cpu_set_n_threads(backend, n_threads);
+    ggml_backend_cpu_set_lockstep(backend, lockstep);
+
+    // the graph allocator may re-use the memory of the input
+    ggml_backend_tensor_set(inp, inp_data.data(), 0, ggml_nbytes(inp));
+
+    GGML_ASSERT(ggml_backend_graph_compute(backend, gf) == GGML_STATUS_SUCCESS);
+
+    std::vector<float> result(ggml_nelements(out));
+    ggml_backend_tensor_get(out, result.data(), 0, ggml_nbytes(out));
+    return result;
+}
+
+static double nmse(const std::vector<float> & a, const std::vector<float> & b) {
+    double sum_a2 = 0;
+    double sum_d2 = 0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (!std::isfinite(a[i]) || !std::isfinite(b[i])) {
+            return INFINITY;
+        }
+        sum_a2 += (double)a[i]*a[i];
+        sum_d2 += ((double)a[i] - b[i])*((double)a[i] - b[i]);
+    }
+    return sum_d2/sum_a2;
+}
+
+// the sum of the experts of each token, followed by an independent node that overwrites the last expert of the last
+// token in place - MULTI_ADD only gets the view of the first expert, but reads the others too
+static int test_multi_add_view(ggml_backend_t backend, std::mt19937 & rng) {
+    const int n_expert = 8;
+    const int n_tokens = 4;
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ 16*ggml_tensor_overhead() + ggml_graph_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * inp = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_ff, n_expert, n_tokens);
+    ggml_tensor * experts = ggml_scale(ctx, inp, 1.0f);
+    ggml_tensor * first = ggml_view_2d(ctx, experts, n_ff, n_tokens, experts->nb[2], 0);
+    ggml_tensor * sum = ggml_multi_add(ctx, first, n_expert);
+    ggml_tensor * last = ggml_view_1d(ctx, experts, n_ff, (n_tokens - 1)*experts->nb[2] + (n_expert - 1)*experts->nb[1]);
+    ggml_tensor * over = ggml_scale_inplace(ctx, last, -1.0f);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, sum);
+    ggml_build_forward_expand(gf, over);
+
+    ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors(ctx, backend);
+    const std::vector<float> inp_data = random_data(inp, rng);
+
+    int n_fail = 0;
+
+    const std::vector<float> ref = compute(backend, gf, inp, inp_data, sum, 1, true);
+    for (int n_threads : { 2, 4, 8 }) {
+        const std::vector<float> sched = compute(backend, gf, inp, inp_data, sum, n_threads, false);
+
+        const double err = nmse(ref, sched);
+        const bool ok = err < 1e-10;
+
+        printf("  multi_add of a view n_threads = %d: nmse scheduled = %.2e %s\n", n_threads, err, ok ? "OK" : "FAIL");
+        if (!ok) {
+            ++n_fail;
+        }
+    }
+
+    ggml_backend_buffer_free(buf);
+    ggml_free(ctx);
+
+    return n_fail;
+}
+
+int main(void) {
+    ggml_backend_t backend = ggml_backend_cpu_init();
+
+    std::mt19937 rng(42);
+
+    int n_fail = 0;
+
+    for (ggml_type wtype : { GGML_TYPE_F32, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0 }) {
+        ggml_init_params wparams = {
+            /*.mem_size   =*/ ggml_tensor_overhead()*9*n_layer,
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+        ggml_context * ctx_w = ggml_init(wparams);
+
+        std::vector<test_layer> layers(n_layer);
+        for (auto & layer : layers) {
+            layer.attn_norm = ggml_new_tensor_1d(ctx_w, GGML_TYPE_F32, n_embd);
+            layer.wq        = ggml_new_tensor_2d(ctx_w, wtype, n_embd, n_embd);
+            layer.wk        = ggml_new_tensor_2d(ctx_w, wtype, n_embd, n_embd);
+            layer.wv        = ggml_new_tensor_2d(ctx_w, wtype, n_embd, n_embd);
+            layer.wo        = ggml_new_tensor_2d(ctx_w, wtype, n_embd, n_embd);
+            layer.ffn_norm  = ggml_new_tensor_1d(ctx_w, GGML_TYPE_F32, n_embd);
+            layer.ffn_up    = ggml_new_tensor_2d(ctx_w, wtype, n_embd, n_ff);
+            layer.ffn_gate  = ggml_new_tensor_2d(ctx_w, wtype, n_embd, n_ff);
+            layer.ffn_down  = ggml_new_tensor_2d(ctx_w, wtype, n_ff, n_embd);
+        }
+        ggml_backend_buffer_t buf_w = ggml_backend_alloc_ctx_tensors(ctx_w, backend);
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx_w); t; t = ggml_get_next_tensor(ctx_w, t)) {
+            init_tensor(t, rng);
+        }
+
+        for (int n_tokens : { 1, 7, 32 }) {
+            ggml_init_params params = {
+                /*.mem_size   =*/ ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead(),
+                /*.mem_buffer =*/ nullptr,
+                /*.no_alloc   =*/ true,
+            };
+            ggml_context * ctx = ggml_init(params);
+
+            ggml_tensor * inp = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_tokens);
+            ggml_set_input(inp);
+
+            ggml_cgraph * gf = build_graph(ctx, layers, inp);
+            ggml_tensor * out = gf->nodes[gf->n_nodes - 1];
+
+            ggml_gallocr_t galloc = ggml_gallocr_new(ggml_backend_get_default_buffer_type(backend));
+            GGML_ASSERT(ggml_gallocr_alloc_graph(galloc, gf));
+            const std::vector<float> inp_data = random_data(inp, rng);
+
+            const std::vector<float> ref = compute(backend, gf, inp, inp_data, out, 1, true);
+
+            for (int n_threads : { 2, 3, 4, 8 }) {
+                const std::vector<float> lockstep = compute(backend, gf, inp, inp_data, out, n_threads, true);
+                const std::vector<float> sched    = compute(backend, gf, inp, inp_data, out, n_threads, false);
+
+                const double err_lockstep = nmse(ref, lockstep);
+                const double err_sched    = nmse(lockstep, sched);
+                const bool ok = err_lockstep < 1e-10 && err_sched < 1e-10;
+
+                printf("  %-5s n_tokens = %2d n_threads = %d: nmse lockstep = %.2e, scheduled = %.2e %s\n",
+                        ggml_type_name(wtype), n_tokens, n_threads, err_lockstep, err_sched, ok ? "OK" : "FAIL");
+                if (!ok) {
+                    ++n_fail;
+                }
+            }
+
+            ggml_gallocr_free(galloc);
+            ggml_free(ctx);
+        }
+
+        ggml_backend_buffer_free(buf_w);
+        ggml_free(ctx_w);
+    }
+
+    n_fail += test_multi_add_view(backend, rng);
+
+    ggml_backend_free(backend);
+
+    if (n_fail > 0) {
+        printf("%d tests failed\n", n_fail);
+        return 1;
+    }
+
+    printf("All tests passed.\n");
+    return 0;
+}
@@ -0,0 +1,265 @@
+// Checks that a context with the sliding window KV cache (swa_kv_cache) gives the same logits as a context with the
+// full KV cache when the window cache prunes the cells the sequences no longer attend, when a batch split into several
+// ubatches is truncated again (rejected draft tokens), across idle sequences, defragmentation and a state round trip,
+// and that llama_kv_cache_seq_rm refuses to truncate a sequence into a window that was already dropped.
+//
+// The model is a tiny Gemma 3 with random weights that is written next to the test, the vocab comes from the given
+// vocab-only model.
+
+#include "llama.h"
+#include "ggml.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+static const int n_embd  = 64;
+static const int n_head  = 4;
+static const int n_ff    = 128;
+static const int n_layer = 6;
+static const int n_swa   = 16;
+
+static const char * fname_model = "test-kv-swa.gguf";
+
+static bool write_model(const char * fname_vocab, int & n_vocab) {
+    gguf_init_params params_vocab = {
+        /*.no_alloc =*/ true,
+        /*.ctx      =*/ nullptr,
+    };
+    gguf_context * ctx_vocab = gguf_init_from_file(fname_vocab, params_vocab);
+    if (ctx_vocab == nullptr) {
+        fprintf(stderr, "%s: failed to read the vocab from '%s'\n", __func__, fname_vocab);
+        return false;
+    }
+    n_vocab = gguf_get_arr_n(ctx_vocab, gguf_find_key(ctx_vocab, "tokenizer.ggml.tokens"));
+
+    gguf_context * ctx_gguf = gguf_init_empty();
+    gguf_set_kv(ctx_gguf, ctx_vocab);
+    gguf_set_val_str(ctx_gguf, "general.architecture", "gemma3");
+    gguf_set_val_u32(ctx_gguf, "gemma3.context_length", 4096);
+    gguf_set_val_u32(ctx_gguf, "gemma3.embedding_length", n_embd);
+    gguf_set_val_u32(ctx_gguf, "gemma3.block_count", n_layer);
+    gguf_set_val_u32(ctx_gguf, "gemma3.feed_forward_length", n_ff);
+    gguf_set_val_u32(ctx_gguf, "gemma3.attention.head_count", n_head);
+    gguf_set_val_u32(ctx_gguf, "gemma3.attention.head_count_kv", n_head/2);
+    gguf_set_val_u32(ctx_gguf, "gemma3.attention.sliding_window", n_swa);
+    gguf_set_val_f32(ctx_gguf, "gemma3.attention.layer_norm_rms_epsilon", 1e-6f);
+
+    const int n_tensors = 2 + 13*n_layer;
+    ggml_init_params params = {
+        /*.mem_size   =*/ ggml_tensor_overhead()*n_tensors + sizeof(float)*((size_t) n_vocab*n_embd + n_layer*(4*n_embd*n_embd + 3*n_embd*n_ff + 8*n_embd)),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(1234);
+    auto add = [&](const std::string & name, int64_t ne0, int64_t ne1, bool norm) {
+        ggml_tensor * t = ne1 > 1 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name.c_str());
+        std::normal_distribution<float> dist(0.0f, norm ? 0.1f : 1.0f/sqrtf((float) ne0));
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            data[i] = dist(rng);
+        }
+        gguf_add_tensor(ctx_gguf, t);
+    };
+
+    const int n_embd_head = n_embd/n_head;
+
+    add("token_embd.weight", n_embd, n_vocab, false);
+    add("output_norm.weight", n_embd, 1, true);
+    for (int il = 0; il < n_layer; ++il) {
+        const std::string blk = "blk." + std::to_string(il) + ".";
+        add(blk + "attn_norm.weight",           n_embd, 1, true);
+        add(blk + "attn_q.weight",              n_embd, n_embd, false);
+        add(blk + "attn_q_norm.weight",         n_embd_head, 1, true);
+        add(blk + "attn_k.weight",              n_embd, n_embd/2, false);
+        add(blk + "attn_k_norm.weight",         n_embd_head, 1, true);
+        add(blk + "attn_v.weight",              n_embd, n_embd/2, false);
+        add(blk + "attn_output.weight",         n_embd, n_embd, false);
+        add(blk + "post_attention_norm.weight", n_embd, 1, true);
+        add(blk + "ffn_norm.weight",            n_embd, 1, true);
+        add(blk + "ffn_gate.weight",            n_embd, n_ff, false);
+        add(blk + "ffn_up.weight",              n_embd, n_ff, false);
+        add(blk + "ffn_down.weight",            n_ff, n_embd, false);
+        add(blk + "post_ffw_norm.weight",       n_embd, 1, true);
+    }
+
+    gguf_write_to_file(ctx_gguf, fname_model, false);
+
+    ggml_free(ctx);
+    gguf_free(ctx_gguf);
+    gguf_free(ctx_vocab);
+
+    return true;
+}
+
+// a full KV cache context and a sliding window KV cache context that get the same batches
+struct test_ctx_pair {
+    llama_context * ref;
+    llama_context * swa;
+    int n_vocab;
+    int n_fail = 0;
+};
+
+static llama_context * new_context(llama_model * model, bool swa_kv_cache) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx        = 512;
+    cparams.n_batch      = 64;
+    cparams.n_ubatch     = 16;
+    cparams.n_seq_max    = 2;
+    cparams.n_threads    = 4;
+    cparams.swa_kv_cache = swa_kv_cache;
+    return llama_new_context_with_model(model, cparams);
+}
+
+static double nmse(const float * a, const float * b, int n) {
+    double sum_a2 = 0;
+    double sum_d2 = 0;
+    for (int i = 0; i < n; ++i) {
+        if (!std::isfinite(a[i]) || !std::isfinite(b[i])) {
+            return INFINITY;
+        }
+        sum_a2 += (double)a[i]*a[i];
+        sum_d2 += ((double)a[i] - b[i])*((double)a[i] - b[i]);
+    }
+    return sum_d2/sum_a2;
+}
+
+// decode the tokens of one sequence at the positions pos0... in both contexts and compare the logits of all tokens
+static void decode(test_ctx_pair & p, const char * what, llama_seq_id seq_id, llama_pos pos0, const std::vector<llama_token> & tokens) {
+    llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        batch.token   [i]    = tokens[i];
+        batch.pos     [i]    = pos0 + i;
+        batch.n_seq_id[i]    = 1;
+        batch.seq_id  [i][0] = seq_id;
+        batch.logits  [i]    = true;
+    }
+    batch.n_tokens = tokens.size();
+
+    bool ok = llama_decode(p.ref, batch) == 0 && llama_decode(p.swa, batch) == 0;
+
+    double err = 0;
+    for (size_t i = 0; ok && i < tokens.size(); ++i) {
+        err = std::max(err, nmse(llama_get_logits_ith(p.ref, i), llama_get_logits_ith(p.swa, i), p.n_vocab));
+    }
+    ok = ok && err < 1e-8;
+
+    printf("  %-40s seq %d pos %3d..%3d: nmse = %.2e %s\n", what, seq_id, pos0, pos0 + (int) tokens.size() - 1, err, ok ? "OK" : "FAIL");
+    if (!ok) {
+        ++p.n_fail;
+    }
+
+    llama_batch_free(batch);
+}
+
+static void check(test_ctx_pair & p, const char * what, bool ok) {
+    printf("  %-40s %s\n", what, ok ? "OK" : "FAIL");
+    if (!ok) {
+        ++p.n_fail;
+    }
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    int n_vocab = 0;
+    if (!write_model(argv[1], n_vocab)) {
+        return 1;
+    }
+
+    llama_backend_init();
+
+    llama_model_params mparams = llama_model_default_params();
+    llama_model * model = llama_load_model_from_file(fname_model, mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname_model);
+        return 1;
+    }
+
+    test_ctx_pair p = { new_context(model, false), new_context(model, true), n_vocab };
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<llama_token> dist_token(3, n_vocab - 1);
+    auto tokens = [&](int n) {
+        std::vector<llama_token> result(n);
+        for (auto & t : result) {
+            t = dist_token(rng);
+        }
+        return result;
+    };
+
+    // a prompt for sequence 1 that then stays idle while sequence 0 moves far past the window
+    decode(p, "prompt of the idle sequence", 1, 0, tokens(20));
+
+    // a prompt that fills several ubatches and two batches, then generation that prunes the window cache
+    decode(p, "prompt", 0, 0, tokens(64));
+    decode(p, "prompt", 0, 64, tokens(36));
+    llama_pos pos = 100;
+    for (int i = 0; i < 2*n_swa; ++i, ++pos) {
+        decode(p, "generation", 0, pos, tokens(1));
+    }
+
+    // a batch of draft tokens over three ubatches, most of them rejected: the window before the first rejected
+    // token has to survive the pruning of the later ubatches
+    decode(p, "draft over several ubatches", 0, pos, tokens(40));
+    check(p, "truncate the rejected draft tokens", llama_kv_cache_seq_rm(p.swa, 0, pos + 3, -1) && llama_kv_cache_seq_rm(p.ref, 0, pos + 3, -1));
+    pos += 3;
+    decode(p, "token after the accepted drafts", 0, pos, tokens(1));
+    pos += 1;
+
+    // the window of position 50 is gone, the sequence cannot be truncated there - and nothing may be removed
+    check(p, "refuse to truncate before the window", !llama_kv_cache_seq_rm(p.swa, 0, 50, -1));
+    decode(p, "generation after the refusal", 0, pos, tokens(4));
+    pos += 4;
+
+    // the idle sequence kept its window
+    decode(p, "idle sequence resumes", 1, 20, tokens(5));
+
+    llama_kv_cache_defrag(p.ref);
+    llama_kv_cache_update(p.ref);
+    llama_kv_cache_defrag(p.swa);
+    llama_kv_cache_update(p.swa);
+    decode(p, "generation after defrag", 0, pos, tokens(8));
+    pos += 8;
+
+    // the state of both caches survives a round trip through a new context
+    {
+        std::vector<uint8_t> state(llama_state_get_size(p.swa));
+        const size_t n_written = llama_state_get_data(p.swa, state.data(), state.size());
+
+        llama_context * ctx = new_context(model, true);
+        const size_t n_read = llama_state_set_data(ctx, state.data(), n_written);
+        check(p, "state round trip", n_written > 0 && n_read == n_written);
+
+        llama_free(p.swa);
+        p.swa = ctx;
+    }
+    decode(p, "generation after the state round trip", 0, pos, tokens(2*n_swa));
+    decode(p, "idle sequence after the state round trip", 1, 25, tokens(3));
+
+    const int n_fail = p.n_fail;
+
+    llama_free(p.ref);
+    llama_free(p.swa);
+    llama_free_model(model);
+    llama_backend_free();
+
+    remove(fname_model);
+
+    if (n_fail > 0) {
+        printf("%d tests failed\n", n_fail);
+        return 1;
+    }
+
+    printf("All tests passed.\n");
+    return 0;
+}
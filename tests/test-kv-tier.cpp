@@ -0,0 +1,180 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "kv_tier.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// fake sequence state - the tokens followed by padding up to size bytes
+static std::vector<uint8_t> snapshot(const std::vector<llama_token> & tokens, size_t size) {
+    std::vector<uint8_t> data(size, 0xab);
+    for (size_t i = 0; i < tokens.size() && i < size; ++i) {
+        data[i] = (uint8_t) tokens[i];
+    }
+    return data;
+}
+
+static std::vector<llama_token> seq(llama_token t0, int n) {
+    std::vector<llama_token> res;
+    for (int i = 0; i < n; ++i) {
+        res.push_back(t0 + i);
+    }
+    return res;
+}
+
+// the prefix found must come with the data saved for it
+static int32_t find_checked(server_kv_tier & tier, const std::vector<llama_token> & tokens, int32_t n_min = 1) {
+    uint64_t key = 0;
+    int32_t  n   = 0;
+    if (!tier.find(tokens, n_min, key, n)) {
+        return 0;
+    }
+
+    const server_kv_tier::entry & e = tier.entries.at(key);
+    assert((int32_t) e.tokens.size() >= n);
+
+    std::vector<uint8_t> buf;
+    const uint8_t * data = tier.load(key, buf);
+    assert(data != nullptr);
+
+    const std::vector<uint8_t> expected = snapshot(e.tokens, e.size);
+    for (size_t i = 0; i < e.size; ++i) {
+        assert(data[i] == expected[i]);
+    }
+
+    return n;
+}
+
+int main() {
+    {
+        // disabled tier
+        server_kv_tier tier;
+        assert(!tier.enabled());
+        assert(!tier.save(seq(1, 4), snapshot(seq(1, 4), 100)));
+        assert(find_checked(tier, seq(1, 4)) == 0);
+    }
+
+    {
+        // RAM only
+        server_kv_tier tier;
+        tier.init(1000, 0, "");
+        assert(tier.enabled());
+
+        const std::vector<llama_token> a = seq(1, 8);
+        const std::vector<llama_token> b = seq(20, 8);
+
+        assert(tier.save(a, snapshot(a, 400)));
+        assert(tier.save(b, snapshot(b, 400)));
+        assert(tier.ram_used == 800);
+
+        std::vector<llama_token> a2 = seq(1, 5); a2.push_back(99);
+        assert(find_checked(tier, a2) == 5);
+        assert(find_checked(tier, a2, 6) == 0);
+        assert(find_checked(tier, seq(50, 4)) == 0);
+        assert(tier.n_lookup == 3);
+
+        // a shorter prefix of a saved sequence is redundant
+        assert(tier.save(seq(1, 4), snapshot(seq(1, 4), 100)));
+        assert(tier.entries.size() == 2);
+
+        // a longer one replaces it
+        const std::vector<llama_token> a3 = seq(1, 12);
+        assert(tier.save(a3, snapshot(a3, 450)));
+        assert(tier.entries.size() == 2);
+        assert(tier.ram_used == 850);
+        assert(find_checked(tier, a3) == 12);
+
+        // b is the least recently used one and is dropped to make room
+        const std::vector<llama_token> c = seq(40, 8);
+        assert(tier.save(c, snapshot(c, 400)));
+        assert(tier.entries.size() == 2);
+        assert(tier.n_evicted == 1);
+        assert(tier.ram_used == 850);
+        assert(find_checked(tier, b) == 0);
+        assert(find_checked(tier, c) == 8);
+
+        // larger than the pool
+        assert(!tier.save(seq(60, 4), snapshot(seq(60, 4), 2000)));
+
+        tier.clear();
+        assert(tier.entries.empty());
+        assert(tier.ram_used == 0);
+    }
+
+    {
+        // RAM + disk
+        const std::filesystem::path dir = std::filesystem::temp_directory_path() / "test-kv-tier";
+        std::filesystem::remove_all(dir);
+        std::filesystem::create_directories(dir);
+
+        const std::string path = dir.string() + "/";
+
+        const auto n_files = [&]() {
+            size_t n = 0;
+            for (const auto & it : std::filesystem::directory_iterator(dir)) {
+                (void) it;
+                n++;
+            }
+            return n;
+        };
+
+        {
+            server_kv_tier tier;
+            tier.init(500, 1000, path);
+
+            const std::vector<llama_token> a = seq(1, 8);
+            const std::vector<llama_token> b = seq(20, 8);
+            const std::vector<llama_token> c = seq(40, 8);
+            const std::vector<llama_token> d = seq(60, 8);
+
+            assert(tier.save(a, snapshot(a, 300)));
+            assert(tier.save(b, snapshot(b, 300))); // a is spilled to disk
+            assert(tier.n_spilled == 1);
+            assert(tier.n_ram() == 1 && tier.n_disk() == 1);
+            assert(tier.ram_used == 300 && tier.disk_used == 300);
+            assert(n_files() == 1);
+
+            // restoring from disk
+            assert(find_checked(tier, a) == 8);
+
+            // too large for RAM - goes straight to disk
+            assert(tier.save(c, snapshot(c, 600)));
+            assert(tier.n_disk() == 2);
+            assert(tier.disk_used == 900);
+            assert(n_files() == 2);
+
+            // spilling b to make room for d drops the least recently used file (a)
+            assert(tier.save(d, snapshot(d, 300)));
+            assert(tier.n_spilled == 3);
+            assert(tier.n_evicted == 1);
+            assert(tier.disk_used <= 1000);
+            assert(find_checked(tier, a) == 0);
+            assert(find_checked(tier, b) == 8);
+            assert(find_checked(tier, c) == 8);
+            assert(find_checked(tier, d) == 8);
+
+            // a missing file is a miss and the entry is dropped
+            const uint64_t key_b = server_kv_tier::hash(b);
+            assert(tier.entries.at(key_b).on_disk);
+            std::filesystem::remove_all(dir);
+            std::filesystem::create_directories(dir);
+            std::vector<uint8_t> buf;
+            assert(tier.load(key_b, buf) == nullptr);
+            assert(tier.entries.find(key_b) == tier.entries.end());
+        }
+
+        // the files are removed with the tier
+        assert(n_files() == 0);
+
+        std::filesystem::remove_all(dir);
+    }
+
+    fprintf(stderr, "All tests passed.\n");
+
+    return 0;
+}
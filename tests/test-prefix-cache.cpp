@@ -0,0 +1,163 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "prefix_cache.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <map>
+#include <vector>
+
+// fake KV cache: the tokens each sequence holds, -1 = no cell at that position
+static std::map<llama_seq_id, std::vector<llama_token>> kv;
+
+static void init_cache(server_prefix_cache & pc, int n_seq) {
+    kv.clear();
+
+    pc.kv_copy = [](llama_seq_id src, llama_seq_id dst, int32_t i0, int32_t i1) {
+        auto & s = kv[src];
+        auto & d = kv[dst];
+        if ((int32_t) d.size() < i1) {
+            d.resize(i1, -1);
+        }
+        for (int32_t i = i0; i < i1; ++i) {
+            assert(i < (int32_t) s.size() && s[i] != -1);
+            d[i] = s[i];
+        }
+    };
+    pc.kv_drop = [](llama_seq_id seq_id) {
+        kv.erase(seq_id);
+    };
+    pc.init(100, n_seq);
+}
+
+// a slot decoded tokens into its own sequence
+static void decode(llama_seq_id seq_id, const std::vector<llama_token> & tokens) {
+    kv[seq_id] = tokens;
+}
+
+// the prefix found in the cache must be fully backed by the cells of the returned sequence
+static int32_t find_checked(server_prefix_cache & pc, const std::vector<llama_token> & tokens) {
+    llama_seq_id seq_id = -1;
+    const int32_t n = pc.find(tokens, seq_id);
+    if (n > 0) {
+        assert(seq_id >= 100);
+        const auto & cells = kv.at(seq_id);
+        assert((int32_t) cells.size() >= n);
+        for (int32_t i = 0; i < n; ++i) {
+            assert(cells[i] == tokens[i]);
+        }
+    }
+    return n;
+}
+
+int main() {
+    {
+        // disabled cache
+        server_prefix_cache pc;
+        assert(!pc.enabled());
+        pc.insert({ 1, 2, 3 }, 3, 1);
+        llama_seq_id seq_id;
+        assert(pc.find({ 1, 2, 3 }, seq_id) == 0);
+        assert(!pc.evict_lru());
+    }
+
+    {
+        server_prefix_cache pc;
+        init_cache(pc, 4);
+
+        const std::vector<llama_token> sys = { 1, 2, 3, 4, 5, 6 };
+
+        std::vector<llama_token> a = sys; a.insert(a.end(), { 10, 11, 12 });
+        std::vector<llama_token> b = sys; b.insert(b.end(), { 20, 21 });
+
+        assert(find_checked(pc, a) == 0);
+
+        decode(1, a);
+        pc.insert(a, a.size(), 1);
+        assert(pc.n_prefixes() == 1);
+
+        // a different slot with the same system prompt reuses it
+        assert(find_checked(pc, b) == (int32_t) sys.size());
+        assert(find_checked(pc, a) == (int32_t) a.size());
+
+        // diverging prefix - the edge is split and shares the system prompt cells
+        decode(2, b);
+        pc.insert(b, b.size(), 2);
+        assert(pc.n_prefixes() == 2);
+        assert(find_checked(pc, b) == (int32_t) b.size());
+        assert(find_checked(pc, a) == (int32_t) a.size());
+
+        // extending a leaf (next chat turn) does not take a new sequence
+        std::vector<llama_token> a2 = a; a2.insert(a2.end(), { 13, 14 });
+        decode(1, a2);
+        pc.insert(a2, a2.size(), 1);
+        assert(pc.n_prefixes() == 2);
+        assert(find_checked(pc, a2) == (int32_t) a2.size());
+
+        // inserting a cached prefix is a no-op
+        pc.insert(a, 4, 1);
+        assert(pc.n_prefixes() == 2);
+
+        // the slot sequences may be overwritten - the cache keeps its own references
+        kv.erase(1);
+        kv.erase(2);
+        assert(find_checked(pc, a2) == (int32_t) a2.size());
+        assert(find_checked(pc, b)  == (int32_t) b.size());
+
+        // touch b, then fill up the cache: a2 is the least recently used one
+        assert(find_checked(pc, b) == (int32_t) b.size());
+        for (llama_token t = 30; t < 33; ++t) {
+            std::vector<llama_token> c = { t, t + 1 };
+            decode(3, c);
+            pc.insert(c, c.size(), 3);
+        }
+        assert(pc.n_prefixes() == 4);
+        assert(pc.n_evicted == 1);
+        assert(find_checked(pc, a2) == (int32_t) sys.size());
+        assert(find_checked(pc, b)  == (int32_t) b.size());
+
+        // evicting everything returns all sequences
+        while (pc.evict_lru()) {}
+        assert(pc.n_prefixes() == 0);
+        assert(pc.seq_free.size() == 4);
+        assert(kv.size() == 1); // only the slot sequence is left
+        assert(find_checked(pc, b) == 0);
+    }
+
+    {
+        // evicting a leaf merges its parent and hands its sequence over
+        server_prefix_cache pc;
+        init_cache(pc, 3);
+
+        const std::vector<llama_token> a = { 1, 2, 3, 4 };
+        const std::vector<llama_token> b = { 1, 2, 5, 6 };
+        const std::vector<llama_token> c = { 1, 7 };
+
+        decode(1, a); pc.insert(a, a.size(), 1);
+        decode(1, b); pc.insert(b, b.size(), 1);
+        decode(1, c); pc.insert(c, c.size(), 1);
+        assert(pc.n_prefixes() == 3);
+        assert(find_checked(pc, b) == 4);
+        assert(find_checked(pc, c) == 2);
+
+        assert(pc.evict_lru()); // a
+        assert(pc.n_prefixes() == 2);
+        assert(find_checked(pc, a) == 2);
+        assert(find_checked(pc, b) == 4);
+
+        assert(pc.evict_lru()); // c
+        assert(pc.root.children.size() == 1);
+        assert(pc.root.children.begin()->second->tokens.size() == 4);
+        assert(find_checked(pc, c) == 1);
+
+        pc.clear();
+        assert(pc.n_prefixes() == 0);
+        assert(pc.seq_free.size() == 3);
+    }
+
+    fprintf(stderr, "All tests passed.\n");
+
+    return 0;
+}
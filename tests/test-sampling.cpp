@@ -7,6 +7,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -230,6 +231,68 @@ static void test_sampler_queue(
            samplers_sequence.c_str(), n_vocab, top_k, top_p, min_p);
 }
 
+// the samplers on the raw logits must keep the same tokens as temperature + sampler on the full candidates array
+static void test_sampler_logits(const size_t n_vocab, const char sampler, const float temp, const int top_k, const float p, const size_t min_keep) {
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 4.0f);
+
+    std::vector<float> logits(n_vocab);
+    for (auto & logit : logits) {
+        logit = dist(rng);
+    }
+    logits[n_vocab/2] = -INFINITY;
+
+    std::vector<llama_token_data> candidates;
+    candidates.reserve(n_vocab);
+    for (llama_token token_id = 0; token_id < (llama_token)n_vocab; token_id++) {
+        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    }
+
+    llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
+
+    std::vector<llama_token_data> pruned(n_vocab);
+    llama_token_data_array pruned_p = { pruned.data(), pruned.size(), false };
+
+    const int64_t t_start_us = ggml_time_us();
+    llama_sample_temp(nullptr, &candidates_p, temp);
+    switch (sampler) {
+        case 'k': llama_sample_top_k(nullptr, &candidates_p, top_k, min_keep); break;
+        case 'p': llama_sample_top_p(nullptr, &candidates_p, p,     min_keep); break;
+        case 'm': llama_sample_min_p(nullptr, &candidates_p, p,     min_keep); break;
+        default : GGML_ABORT("Unknown sampler");                               break;
+    }
+
+    const int64_t t_mid_us = ggml_time_us();
+    switch (sampler) {
+        case 'k': llama_sample_top_k_logits(nullptr, &pruned_p, logits.data(), n_vocab, temp, top_k, min_keep); break;
+        case 'p': llama_sample_top_p_logits(nullptr, &pruned_p, logits.data(), n_vocab, temp, p,     min_keep); break;
+        case 'm': llama_sample_min_p_logits(nullptr, &pruned_p, logits.data(), n_vocab, temp, p,     min_keep); break;
+    }
+    const int64_t t_end_us = ggml_time_us();
+
+    // top-p sums the probabilities in a different order, the nucleus may end a few tokens apart
+    if (sampler == 'p') {
+        const size_t n_diff = std::max(pruned_p.size, candidates_p.size) - std::min(pruned_p.size, candidates_p.size);
+        GGML_ASSERT(n_diff <= 2 + candidates_p.size/100);
+    } else {
+        GGML_ASSERT(pruned_p.size == candidates_p.size);
+    }
+    GGML_ASSERT(pruned_p.sorted == candidates_p.sorted);
+
+    // both keep the tokens in the same order, unsorted results are in vocabulary order
+    // (the random logits have a few exact ties, the sort may order those differently)
+    const size_t n_common = std::min(pruned_p.size, candidates_p.size);
+    for (size_t i = 0; i < n_common; i++) {
+        GGML_ASSERT(pruned_p.data[i].logit == candidates_p.data[i].logit);
+        const bool tied = (i > 0 && pruned_p.data[i].logit == pruned_p.data[i - 1].logit) ||
+                          (i + 1 < n_common && pruned_p.data[i].logit == pruned_p.data[i + 1].logit);
+        GGML_ASSERT(tied || pruned_p.data[i].id == candidates_p.data[i].id);
+    }
+
+    printf("Sampler on logits %c OK with n_vocab=%06ld temp=%f top_k=%05d p=%f min_keep=%zu: %zu kept, %6.1f us vs. %6.1f us\n",
+           sampler, n_vocab, temp, top_k, p, min_keep, pruned_p.size, (double) (t_end_us - t_mid_us), (double) (t_mid_us - t_start_us));
+}
+
 int main(void) {
     ggml_time_init();
 
@@ -295,6 +358,19 @@ int main(void) {
     test_sampler_queue(10000, "mkp", 100, 0.8f, 0.1f);
     test_sampler_queue(10000, "mpk", 100, 0.8f, 0.1f);
 
+    for (const float temp : { 1.0f, 0.7f, 3.0f }) {
+        test_sampler_logits(152064, 'k', temp,      1, 0.0f,     1);
+        test_sampler_logits(152064, 'k', temp,     40, 0.0f,     1);
+        test_sampler_logits(152064, 'k', temp,   1000, 0.0f,     1);
+        test_sampler_logits(152064, 'k', temp,     10, 0.0f,    50);
+        test_sampler_logits(152064, 'p', temp,      0, 0.5f,     1);
+        test_sampler_logits(152064, 'p', temp,      0, 0.95f,    1);
+        test_sampler_logits(152064, 'p', temp,      0, 0.0f,    10);
+        test_sampler_logits(152064, 'm', temp,      0, 0.05f,    1);
+        test_sampler_logits(152064, 'm', temp,      0, 0.5f,     1);
+        test_sampler_logits(152064, 'm', temp,      0, 0.99f,  100);
+    }
+
     printf("OK\n");
 
     return 0;